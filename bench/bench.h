@@ -0,0 +1,31 @@
+#ifndef _BENCH_H
+#define _BENCH_H
+#include <time.h>
+#include "../dhcprelya.h"
+#include "../metrics.h"
+
+/* DHCP message types */
+#define DHCPDISCOVER	1
+#define DHCPOFFER	2
+#define DHCPREQUEST	3
+#define DHCPACK		5
+
+#define BENCH_FRAME_LEN	(ETHER_HDR_LEN + DHCP_UDP_OVERHEAD + DHCP_MIN_SIZE)
+
+static inline uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return timespec_ns(&ts);
+}
+
+/* packet.c */
+int build_request(uint8_t *frame, const uint8_t *mac, uint32_t xid, int type,
+	struct in_addr req_ip, struct in_addr server_id);
+int dhcp_message_type(struct dhcp_packet *dhcp);
+void print_latency_header(FILE *f);
+void print_latency(FILE *f, const char *name, const struct metrics_hist *h);
+
+#endif
@@ -0,0 +1,240 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+#include <sysexits.h>
+#include <pthread.h>
+#include <pcap.h>
+
+#include "bench.h"
+
+/* DHCP clients load generator.
+ *
+ * Sends DISCOVERs from -c different MACs at -r packets per second to an
+ * interface (BPF) and waits for OFFERs. With -m dora it answers every
+ * OFFER with a REQUEST and waits for ACK. Time to an answer is kept in
+ * histograms. A transaction is found by its XID, so answers for others
+ * and duplicates are not counted. */
+
+unsigned debug = 0, max_packet_size = DHCP_MTU_MAX;
+
+static pcap_t *cap;
+static uint32_t xid_key, count;
+static int dora = 0;
+static volatile int stop = 0;
+
+/* Per transaction. Written by the receiver thread only except sent_ns. */
+static uint64_t *sent_ns, *req_ns;
+static uint8_t *state;
+#define ST_SENT		0
+#define ST_OFFERED	1
+#define ST_ACKED	2
+
+static struct metrics_hist offer_h, ack_h;
+static uint64_t offers, acks, requests, unknown;
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Usage: dhcpgen -i interface [-r rate] [-n count] [-c clients] "
+		"[-m discover|dora] [-w wait]\n");
+	fprintf(stderr, "\t-r\tDISCOVERs per second, 0 - as fast as possible (default 1000)\n");
+	fprintf(stderr, "\t-n\tDISCOVERs to send (default 10000)\n");
+	fprintf(stderr, "\t-c\tclients (MAC addresses) number (default 1000)\n");
+	fprintf(stderr, "\t-m\tdiscover - wait for OFFER only, dora - full exchange\n");
+	fprintf(stderr, "\t-w\tseconds to wait for answers at the end (default 2)\n");
+	exit(EX_USAGE);
+}
+
+static void
+client_mac(uint32_t client, uint8_t *mac)
+{
+	mac[0] = 0x02;		/* locally administered */
+	mac[1] = 0xbe;
+	mac[2] = client >> 24;
+	mac[3] = client >> 16;
+	mac[4] = client >> 8;
+	mac[5] = client;
+}
+
+static void
+receive(u_char *user, const struct pcap_pkthdr *h, const u_char *packet)
+{
+	struct dhcp_packet dhcp;
+	struct in_addr server_id = {0};
+	uint8_t frame[BENCH_FRAME_LEN], *opt;
+	uint64_t now;
+	uint32_t idx;
+
+	if (h->caplen < sizeof(struct packet_headers) + DHCP_FIXED_NON_UDP)
+		return;
+	now = bench_now_ns();
+	bzero(&dhcp, sizeof(dhcp));
+	memcpy(&dhcp, packet + sizeof(struct packet_headers),
+		MIN(h->caplen - sizeof(struct packet_headers), sizeof(dhcp)));
+	idx = ntohl(dhcp.xid) ^ xid_key;
+	if (dhcp.op != BOOTREPLY || idx >= count) {
+		unknown++;
+		return;
+	}
+
+	switch (dhcp_message_type(&dhcp)) {
+	case DHCPOFFER:
+		if (state[idx] != ST_SENT)
+			return;
+		state[idx] = ST_OFFERED;
+		offers++;
+		hist_add(&offer_h, now - sent_ns[idx]);
+		if (!dora)
+			break;
+		opt = find_option(&dhcp, 54);
+		if (opt != NULL && *opt == 54 && opt[1] == 4)
+			memcpy(&server_id, opt + 2, 4);
+		build_request(frame, dhcp.chaddr, dhcp.xid, DHCPREQUEST, dhcp.yiaddr,
+			server_id);
+		req_ns[idx] = bench_now_ns();
+		if (pcap_inject(cap, frame, BENCH_FRAME_LEN) == -1)
+			warnx("pcap_inject: %s", pcap_geterr(cap));
+		else
+			requests++;
+		break;
+	case DHCPACK:
+		if (state[idx] != ST_OFFERED)
+			return;
+		state[idx] = ST_ACKED;
+		acks++;
+		hist_add(&ack_h, now - req_ns[idx]);
+		break;
+	default:
+		unknown++;
+	}
+}
+
+static void *
+receiver(void *param)
+{
+	while (!stop)
+		if (pcap_dispatch(cap, -1, receive, NULL) == -1)
+			warnx("pcap_dispatch: %s", pcap_geterr(cap));
+	return NULL;
+}
+
+int
+main(int argc, char *argv[])
+{
+	char errbuf[PCAP_ERRBUF_SIZE], *iname = NULL;
+	struct bpf_program fp;
+	struct in_addr none = {0};
+	uint8_t frame[BENCH_FRAME_LEN], mac[ETH_ADDR_LEN];
+	uint64_t start, next, now, elapsed, sent_time, errors = 0;
+	unsigned rate = 1000, clients = 1000, wait = 2;
+	struct timespec ts;
+	pthread_t tid;
+	uint32_t i;
+	int c;
+
+	count = 10000;
+	while ((c = getopt(argc, argv, "c:hi:m:n:r:w:")) != -1) {
+		switch (c) {
+		case 'c':
+			clients = strtoul(optarg, NULL, 10);
+			break;
+		case 'i':
+			iname = optarg;
+			break;
+		case 'm':
+			if (strcmp(optarg, "dora") == 0)
+				dora = 1;
+			else if (strcmp(optarg, "discover") != 0)
+				usage();
+			break;
+		case 'n':
+			count = strtoul(optarg, NULL, 10);
+			break;
+		case 'r':
+			rate = strtoul(optarg, NULL, 10);
+			break;
+		case 'w':
+			wait = strtoul(optarg, NULL, 10);
+			break;
+		case 'h':
+		default:
+			usage();
+		}
+	}
+	if (iname == NULL || count == 0 || clients == 0)
+		usage();
+
+	sent_ns = calloc(count, sizeof(uint64_t));
+	req_ns = calloc(count, sizeof(uint64_t));
+	state = calloc(count, sizeof(uint8_t));
+	if (sent_ns == NULL || req_ns == NULL || state == NULL)
+		errx(EX_OSERR, "can't allocate %u transactions", count);
+
+	if ((cap = pcap_create(iname, errbuf)) == NULL)
+		errx(EX_NOINPUT, "pcap_create: %s", errbuf);
+	pcap_set_snaplen(cap, DHCP_MTU_MAX + ETHER_HDR_LEN);
+	pcap_set_timeout(cap, 100);
+	pcap_set_immediate_mode(cap, 1);
+	pcap_set_buffer_size(cap, 16 * 1024 * 1024);
+	if (pcap_activate(cap) < 0)
+		errx(EX_NOINPUT, "pcap_activate: %s", pcap_geterr(cap));
+	if (pcap_setdirection(cap, PCAP_D_IN) == -1)
+		warnx("pcap_setdirection: %s", pcap_geterr(cap));
+	if (pcap_compile(cap, &fp, "udp and dst port 68", 1, 0) == -1 ||
+	    pcap_setfilter(cap, &fp) == -1)
+		errx(EX_SOFTWARE, "pcap filter: %s", pcap_geterr(cap));
+
+	arc4random_buf(&xid_key, sizeof(xid_key));
+	if (pthread_create(&tid, NULL, receiver, NULL) != 0)
+		errx(EX_OSERR, "can't create receiver thread");
+
+	start = next = bench_now_ns();
+	for (i = 0; i < count; i++) {
+		if (rate) {
+			next = start + (uint64_t)i * 1000000000 / rate;
+			now = bench_now_ns();
+			if (next > now + 100000) {
+				ts.tv_sec = (next - now) / 1000000000;
+				ts.tv_nsec = (next - now) % 1000000000;
+				nanosleep(&ts, NULL);
+			}
+		}
+		client_mac(i % clients, mac);
+		build_request(frame, mac, htonl(i ^ xid_key), DHCPDISCOVER, none, none);
+		sent_ns[i] = bench_now_ns();
+		if (pcap_inject(cap, frame, BENCH_FRAME_LEN) == -1)
+			errors++;
+	}
+	sent_time = bench_now_ns() - start;
+
+	/* Wait for late answers */
+	for (c = 0; c < wait * 10; c++) {
+		if ((dora ? acks : offers) + errors >= count)
+			break;
+		usleep(100000);
+	}
+	stop = 1;
+	pthread_join(tid, NULL);
+	elapsed = bench_now_ns() - start;
+
+	printf("Sent:     %u DISCOVER in %.3f s (%.0f pps), %ju send errors\n",
+		count, sent_time / 1e9, count / (sent_time / 1e9), (uintmax_t)errors);
+	printf("Offers:   %ju (loss %.3f%%)\n", (uintmax_t)offers,
+		100.0 * (count - offers) / count);
+	if (dora)
+		printf("Acks:     %ju for %ju REQUEST (loss %.3f%%)\n", (uintmax_t)acks,
+			(uintmax_t)requests,
+			requests ? 100.0 * (requests - acks) / requests : 0.0);
+	printf("Answers:  %.0f pps\n", (offers + acks) / (elapsed / 1e9));
+	if (unknown)
+		printf("Unknown:  %ju\n", (uintmax_t)unknown);
+	print_latency_header(stdout);
+	print_latency(stdout, "DISCOVER-OFFER", &offer_h);
+	if (dora)
+		print_latency(stdout, "REQUEST-ACK", &ack_h);
+
+	pcap_close(cap);
+	return offers == 0 ? 1 : 0;
+}
@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <err.h>
+#include <errno.h>
+#include <sysexits.h>
+
+#include "bench.h"
+
+/* A stand-in DHCP server for dhcprelya benchmarks.
+ *
+ * Answers relayed DISCOVERs with OFFERs and REQUESTs with ACKs at once.
+ * An address is derived from the client MAC, no leases are kept. Option 82
+ * is echoed back like a real server does. -d adds a processing delay and
+ * -l drops a given percent of requests to test timeouts and fan-out. */
+
+unsigned debug = 0, max_packet_size = DHCP_MTU_MAX;
+
+static volatile int stop = 0;
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Usage: dhcpstub [-a address] [-p port] [-d delay_us] "
+		"[-l loss_percent] [-n network]\n");
+	exit(EX_USAGE);
+}
+
+static void
+on_signal(int sig)
+{
+	stop = 1;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct sockaddr_in addr, from;
+	struct dhcp_packet req, ans;
+	struct in_addr network, server_id;
+	socklen_t from_len;
+	struct timeval tv = {1, 0};
+	uint64_t received = 0, answered = 0, dropped = 0, bad = 0;
+	uint32_t h, lease = htonl(3600), mask = htonl(0xffff0000);
+	unsigned delay = 0, loss = 0;
+	uint8_t *opt, opt82[256], type;
+	ssize_t n;
+	int c, i, fd, len, port = 67;
+
+	bzero(&addr, sizeof(addr));
+	addr.sin_family = AF_INET;
+	inet_aton("10.1.0.0", &network);
+	while ((c = getopt(argc, argv, "a:d:hl:n:p:")) != -1) {
+		switch (c) {
+		case 'a':
+			if (inet_aton(optarg, &addr.sin_addr) == 0)
+				usage();
+			break;
+		case 'd':
+			delay = strtoul(optarg, NULL, 10);
+			break;
+		case 'l':
+			loss = strtoul(optarg, NULL, 10);
+			break;
+		case 'n':
+			if (inet_aton(optarg, &network) == 0)
+				usage();
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'h':
+		default:
+			usage();
+		}
+	}
+	addr.sin_port = htons(port);
+	server_id = addr.sin_addr;
+
+	if ((fd = socket(PF_INET, SOCK_DGRAM, 0)) == -1)
+		err(EX_OSERR, "socket");
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+		err(EX_OSERR, "bind");
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	c = 4 * 1024 * 1024;
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &c, sizeof(c));
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	while (!stop) {
+		from_len = sizeof(from);
+		n = recvfrom(fd, &req, sizeof(req), 0, (struct sockaddr *)&from, &from_len);
+		if (n == -1) {
+			if (errno != EAGAIN && errno != EINTR)
+				warn("recvfrom");
+			continue;
+		}
+		received++;
+		if (n < DHCP_FIXED_NON_UDP + DHCP_COOKIE_LEN || req.op != BOOTREQUEST ||
+		    req.giaddr.s_addr == 0) {
+			bad++;
+			continue;
+		}
+		if (n < sizeof(req))
+			bzero((char *)&req + n, sizeof(req) - n);
+		switch (dhcp_message_type(&req)) {
+		case DHCPDISCOVER:
+			type = DHCPOFFER;
+			break;
+		case DHCPREQUEST:
+			type = DHCPACK;
+			break;
+		default:
+			bad++;
+			continue;
+		}
+		if (loss && arc4random_uniform(100) < loss) {
+			dropped++;
+			continue;
+		}
+		if (delay)
+			usleep(delay);
+
+		/* Keep option 82 to echo it */
+		opt82[0] = 0;
+		opt = find_option(&req, 82);
+		if (opt != NULL && *opt == 82)
+			memcpy(opt82, opt + 1, opt[1] + 1);
+
+		bzero(&ans, sizeof(ans));
+		memcpy(&ans, &req, DHCP_FIXED_NON_UDP);
+		ans.op = BOOTREPLY;
+		ans.secs = 0;
+		for (h = 2166136261U, i = 0; i < ETH_ADDR_LEN; i++)
+			h = (h ^ req.chaddr[i]) * 16777619U;
+		ans.yiaddr.s_addr = htonl(ntohl(network.s_addr) + 2 + h % 65533);
+		memcpy(ans.options, req.options, DHCP_COOKIE_LEN);
+		ans.options[DHCP_COOKIE_LEN] = 255;
+		insert_option(&ans, 53, 1, &type, INSERT_OPTION_NORMAL);
+		insert_option(&ans, 54, 4, (uint8_t *)&server_id, INSERT_OPTION_NORMAL);
+		insert_option(&ans, 51, 4, (uint8_t *)&lease, INSERT_OPTION_NORMAL);
+		insert_option(&ans, 1, 4, (uint8_t *)&mask, INSERT_OPTION_NORMAL);
+		insert_option(&ans, 3, 4, (uint8_t *)&req.giaddr, INSERT_OPTION_NORMAL);
+		if (opt82[0] != 0)
+			insert_option(&ans, 82, opt82[0], opt82 + 1, INSERT_OPTION_NORMAL);
+		len = MAX(get_dhcp_len(&ans), DHCP_MIN_SIZE);
+
+		/* To the relay */
+		from.sin_addr = req.giaddr;
+		from.sin_port = htons(67);
+		if (sendto(fd, &ans, len, 0, (struct sockaddr *)&from, sizeof(from)) == -1)
+			warn("sendto");
+		else
+			answered++;
+	}
+
+	printf("Received: %ju, answered: %ju, dropped: %ju, bad: %ju\n",
+		(uintmax_t)received, (uintmax_t)answered, (uintmax_t)dropped,
+		(uintmax_t)bad);
+	return 0;
+}
@@ -0,0 +1,523 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+#include <time.h>
+#include <sysexits.h>
+#if defined(__amd64__) || defined(__i386__)
+#include <machine/cpufunc.h>
+#endif
+
+#include "bench.h"
+
+/* Microbenchmarks of per-packet functions over a corpus of packets.
+ *
+ * Every function is run over every corpus packet and ns/op and cycles/op
+ * (TSC ticks, x86 only) are printed. Functions changing a packet are run
+ * on BATCH fresh copies prepared before a timed run. */
+
+unsigned debug = 0, max_packet_size = 1400;
+
+/* For option82_plugin */
+struct interface *ifs[IF_MAX];
+int if_num;
+
+struct interface *
+get_interface_by_name(char *iname)
+{
+	return NULL;
+}
+
+extern struct plugin_data option82_plugin;
+
+#define FRAME_MAX	(ETHER_HDR_LEN + DHCP_UDP_OVERHEAD + sizeof(struct dhcp_packet))
+#define BATCH		256
+
+struct corpus {
+	const char *name;
+	uint8_t frame[FRAME_MAX];
+	unsigned len;
+};
+
+#define DHCP(c)	((struct dhcp_packet *)((c)->frame + sizeof(struct packet_headers)))
+
+static struct corpus corpus[4];
+static int corpus_num;
+static struct dhcp_packet work[BATCH];
+static volatile uintptr_t sink;
+
+/* option82_plugin agent information */
+static struct interface o82_intf = { .idx = 0, .name = "vlan42" };
+static const char o82_rid[] = "relay1";
+
+/* Relay agent information: circuit-id and remote-id */
+static uint8_t agent_info[] = {
+	1, 16, 'g', 'e', '-', '0', '/', '0', '/', '1', '2', ':', 'v', 'l', 'a', 'n', '4', '2',
+	2, 6, 0x00, 0x1b, 0x21, 0x3c, 0x4d, 0x5e,
+};
+
+static inline uint64_t
+cycles(void)
+{
+#if defined(__amd64__) || defined(__i386__)
+	return rdtsc();
+#else
+	return 0;
+#endif
+}
+
+/* Set lengths and checksums as dhcprelya does */
+static void
+finish_frame(struct corpus *c)
+{
+	struct packet_headers *h = (struct packet_headers *)c->frame;
+	int len;
+
+	len = MAX(get_dhcp_len(DHCP(c)), DHCP_MIN_SIZE);
+	c->len = sizeof(struct packet_headers) + len;
+	h->ip.ip_len = htons(DHCP_UDP_OVERHEAD + len);
+	h->ip.ip_sum = 0;
+	h->ip.ip_sum = htons(ip_checksum((const char *)&h->ip, sizeof(struct ip)));
+	h->udp.uh_ulen = htons(sizeof(struct udphdr) + len);
+	h->udp.uh_sum = 0;
+	h->udp.uh_sum = htons(udp_checksum((const char *)c->frame));
+	if (c->len > max_packet_size || !sanity_check((const char *)c->frame, c->len))
+		errx(EX_SOFTWARE, "corpus packet %s is broken", c->name);
+}
+
+static struct corpus *
+new_packet(const char *name, int type)
+{
+	struct corpus *c = &corpus[corpus_num++];
+	struct in_addr none = {0};
+	uint8_t mac[ETH_ADDR_LEN] = {0x00, 0x1e, 0x67, 0x12, 0x34, 0x56};
+
+	c->name = name;
+	build_request(c->frame, mac, 0x12345678, type, none, none);
+	return c;
+}
+
+static void
+add_option(struct corpus *c, uint8_t id, uint8_t len, const void *data)
+{
+	if (!insert_option(DHCP(c), id, len, (uint8_t *)data, INSERT_OPTION_OVERRIDE))
+		errx(EX_SOFTWARE, "can't add option %d to %s", id, c->name);
+}
+
+static void
+make_corpus(void)
+{
+	static const uint8_t pxe_params[] = {
+		1, 2, 3, 4, 5, 6, 11, 12, 13, 15, 16, 17, 18, 22, 23, 28, 40, 41,
+		42, 43, 50, 51, 54, 58, 59, 60, 66, 67, 97, 128, 129, 130, 131,
+		132, 133, 134, 135, 175, 203,
+	};
+	static const uint8_t arch[] = {0, 0}, ndi[] = {1, 2, 1}, max_size[] = {5, 0xc0};
+	static const uint8_t ipxe[] = {177, 5, 1, 0x80, 0x86, 0x10, 0x0e};
+	uint8_t guid[17], ip[4] = {10, 1, 2, 3}, srv[4] = {10, 2, 0, 2}, *p;
+	struct corpus *c;
+	int i, len, room;
+
+	c = new_packet("discover", DHCPDISCOVER);
+	finish_frame(c);
+
+	c = new_packet("pxe", DHCPDISCOVER);
+	add_option(c, 55, sizeof(pxe_params), pxe_params);
+	add_option(c, 57, sizeof(max_size), max_size);
+	add_option(c, 60, 32, "PXEClient:Arch:00000:UNDI:002001");
+	add_option(c, 77, 4, "iPXE");
+	add_option(c, 93, sizeof(arch), arch);
+	add_option(c, 94, sizeof(ndi), ndi);
+	for (i = 0; i < sizeof(guid); i++)
+		guid[i] = i * 7;
+	guid[0] = 0;
+	add_option(c, 97, sizeof(guid), guid);
+	add_option(c, 175, sizeof(ipxe), ipxe);
+	finish_frame(c);
+
+	c = new_packet("option82", DHCPREQUEST);
+	DHCP(c)->hops = 1;
+	DHCP(c)->giaddr.s_addr = htonl(0x0a010001);
+	add_option(c, 50, 4, ip);
+	add_option(c, 54, 4, srv);
+	add_option(c, 12, 13, "host-0012-abc");
+	add_option(c, 82, sizeof(agent_info), agent_info);
+	finish_frame(c);
+
+	/* Fill options up to max_packet_size with options of different
+	 * sizes. The parser walks all of them. */
+	c = new_packet("max_size", DHCPREQUEST);
+	p = DHCP(c)->options + (get_dhcp_len(DHCP(c)) - DHCP_FIXED_NON_UDP) - 1;
+	room = max_packet_size - sizeof(struct packet_headers) -
+		(p - (uint8_t *)DHCP(c)) - 1;
+	for (i = 0; room > 2; i++) {
+		len = MIN((i % 5) * 16 + 4, room - 2);
+		*p++ = 224 + i % 30;
+		*p++ = len;
+		memset(p, i, len);
+		p += len;
+		room -= len + 2;
+	}
+	*p = 255;
+	finish_frame(c);
+}
+
+/* Functions under test. n operations on a corpus packet. */
+static void
+b_sanity_check(struct corpus *c, unsigned n)
+{
+	while (n--)
+		sink += sanity_check((const char *)c->frame, c->len);
+}
+
+static void
+b_get_dhcp_len(struct corpus *c, unsigned n)
+{
+	while (n--)
+		sink += get_dhcp_len(DHCP(c));
+}
+
+static void
+b_find_option_53(struct corpus *c, unsigned n)
+{
+	while (n--)
+		sink += (uintptr_t)find_option(DHCP(c), 53);
+}
+
+static void
+b_find_option_82(struct corpus *c, unsigned n)
+{
+	while (n--)
+		sink += (uintptr_t)find_option(DHCP(c), 82);
+}
+
+static void
+b_find_suboption(struct corpus *c, unsigned n)
+{
+	while (n--)
+		sink += (uintptr_t)find_suboption(DHCP(c), 82, 2);
+}
+
+static void
+b_insert_option(struct corpus *c, unsigned n)
+{
+	unsigned i;
+
+	for (i = 0; i < n; i++)
+		sink += insert_option(&work[i], 82, sizeof(agent_info), agent_info,
+			INSERT_OPTION_OVERRIDE);
+}
+
+/* Option 82 as option82_plugin built it for every request before */
+static void
+b_option82_build(struct corpus *c, unsigned n)
+{
+	uint8_t buf[255], *p;
+	unsigned i;
+	int len;
+
+	for (i = 0; i < n; i++) {
+		p = buf;
+		len = strlen(o82_intf.name);
+		*p++ = 1;
+		*p++ = len;
+		memcpy(p, o82_intf.name, len);
+		p += len;
+		*p++ = 2;
+		*p++ = sizeof(o82_rid) - 1;
+		memcpy(p, o82_rid, sizeof(o82_rid) - 1);
+		p += sizeof(o82_rid) - 1;
+		sink += insert_option(&work[i], 82, p - buf, buf, INSERT_OPTION_NORMAL);
+	}
+}
+
+/* The same option appended by option82_plugin from a built one */
+static void
+b_option82_plugin(struct corpus *c, unsigned n)
+{
+	unsigned i;
+
+	for (i = 0; i < n; i++)
+		sink += option82_plugin.client_request(&o82_intf, &work[i], NULL);
+}
+
+static void
+b_remove_option(struct corpus *c, unsigned n)
+{
+	unsigned i;
+
+	for (i = 0; i < n; i++)
+		sink += remove_option(&work[i], 82);
+}
+
+static void
+b_ip_checksum(struct corpus *c, unsigned n)
+{
+	while (n--)
+		sink += ip_checksum((const char *)c->frame + ETHER_HDR_LEN, sizeof(struct ip));
+}
+
+static void
+b_udp_checksum(struct corpus *c, unsigned n)
+{
+	while (n--)
+		sink += udp_checksum((const char *)c->frame);
+}
+
+/* A log_plugin request line as it was made before event_fmt.c */
+static void
+b_log_sprintf(struct corpus *c, unsigned n)
+{
+	struct packet_headers *h = (struct packet_headers *)c->frame;
+	char buf[18 * 2 + 11], timebuf[16], logbuf[256];
+	struct timeval tv;
+	struct tm tm;
+
+	while (n--) {
+		gettimeofday(&tv, NULL);
+		localtime_r(&tv.tv_sec, &tm);
+		sprintf(timebuf, "%02d:%02d:%02d.%06lu", tm.tm_hour, tm.tm_min,
+			tm.tm_sec, (unsigned long)tv.tv_usec);
+		sink += sprintf(logbuf, "%s request on %s XID: %s %s -> %s (%d bytes)",
+			timebuf, "vlan1234", print_xid(DHCP(c)->xid, buf),
+			ether_ntoa_r((struct ether_addr *)h->eh.ether_shost, buf + 11),
+			ether_ntoa_r((struct ether_addr *)h->eh.ether_dhost, buf + 29),
+			get_dhcp_len(DHCP(c)));
+	}
+}
+
+/* The same fields and an option 53 lookup as log_plugin does */
+static void
+event_fill(struct corpus *c, struct log_event *ev)
+{
+	uint8_t *opt;
+
+	gettimeofday(&ev->tv, NULL);
+	ev->hook = "client_request";
+	ev->ifname = "vlan1234";
+	ev->xid = DHCP(c)->xid;
+	ev->chaddr = DHCP(c)->chaddr;
+	opt = find_option(DHCP(c), 53);
+	ev->msg_type = opt != NULL && *opt == 53 ? opt[2] : 0;
+	ev->giaddr = DHCP(c)->giaddr;
+	ev->server.s_addr = 0;
+	ev->len = get_dhcp_len(DHCP(c));
+	ev->verdict = "pass";
+	ev->dhcp = NULL;
+}
+
+static void
+b_event_json(struct corpus *c, unsigned n)
+{
+	struct log_event ev;
+	char buf[EVENT_MAX];
+
+	while (n--) {
+		event_fill(c, &ev);
+		sink += event_json(&ev, buf, sizeof(buf));
+	}
+}
+
+static void
+b_event_logfmt(struct corpus *c, unsigned n)
+{
+	struct log_event ev;
+	char buf[EVENT_MAX];
+
+	while (n--) {
+		event_fill(c, &ev);
+		sink += event_logfmt(&ev, buf, sizeof(buf));
+	}
+}
+
+static void
+b_event_json_options(struct corpus *c, unsigned n)
+{
+	struct log_event ev;
+	char buf[EVENT_DETAILED_MAX];
+
+	while (n--) {
+		event_fill(c, &ev);
+		ev.dhcp = DHCP(c);
+		sink += event_json(&ev, buf, sizeof(buf));
+	}
+}
+
+static void
+b_decode_packet(struct corpus *c, unsigned n)
+{
+	static char buf[DECODE_PACKET_MAX];
+
+	while (n--)
+		sink += dhcp_decode_packet(DHCP(c), get_dhcp_len(DHCP(c)), buf,
+			sizeof(buf));
+}
+
+/* Fresh copies of a packet for functions changing it */
+static int
+setup_copies(struct corpus *c)
+{
+	int i;
+
+	for (i = 0; i < BATCH; i++)
+		memcpy(&work[i], DHCP(c), sizeof(struct dhcp_packet));
+	return 1;
+}
+
+/* Skip packets option 82 does not fit in (insert_option() logs errors) */
+static int
+setup_insert(struct corpus *c)
+{
+	setup_copies(c);
+	if (!insert_option(&work[0], 82, sizeof(agent_info), agent_info,
+		INSERT_OPTION_OVERRIDE))
+		return 0;
+	memcpy(&work[0], DHCP(c), sizeof(struct dhcp_packet));
+	return 1;
+}
+
+/* Option 82 must fit and be present for remove_option */
+static int
+setup_with_82(struct corpus *c)
+{
+	int i;
+
+	setup_copies(c);
+	for (i = 0; i < BATCH; i++)
+		if (!insert_option(&work[i], 82, sizeof(agent_info), agent_info,
+			INSERT_OPTION_OVERRIDE))
+			return 0;
+	return 1;
+}
+
+/* Option 82 must fit and be absent for option82_plugin to add it */
+static int
+setup_without_82(struct corpus *c)
+{
+	int i;
+
+	if (!setup_insert(c))
+		return 0;
+	for (i = 0; i < BATCH; i++)
+		remove_option(&work[i], 82);
+	return 1;
+}
+
+static void
+option82_init(void)
+{
+	plugin_options_head_t head;
+	struct plugin_options *opts;
+	char line[64];
+
+	SLIST_INIT(&head);
+	snprintf(line, sizeof(line), "remote_id=\"%s\"", o82_rid);
+	if ((opts = malloc(sizeof(*opts))) == NULL ||
+	    (opts->option_line = strdup(line)) == NULL)
+		err(EX_OSERR, "malloc");
+	SLIST_INSERT_HEAD(&head, opts, next);
+	if (!option82_plugin.init(&head))
+		errx(EX_SOFTWARE, "option82_plugin init failed");
+}
+
+static struct {
+	const char *name;
+	void (*run)(struct corpus *c, unsigned n);
+	int (*setup)(struct corpus *c);
+} benches[] = {
+	{ "sanity_check", b_sanity_check, NULL },
+	{ "get_dhcp_len", b_get_dhcp_len, NULL },
+	{ "find_option(53)", b_find_option_53, NULL },
+	{ "find_option(82)", b_find_option_82, NULL },
+	{ "find_suboption(82,2)", b_find_suboption, NULL },
+	{ "insert_option(82)", b_insert_option, setup_insert },
+	{ "remove_option(82)", b_remove_option, setup_with_82 },
+	{ "option82 build+insert", b_option82_build, setup_without_82 },
+	{ "option82_plugin", b_option82_plugin, setup_without_82 },
+	{ "ip_checksum", b_ip_checksum, NULL },
+	{ "udp_checksum", b_udp_checksum, NULL },
+	{ "log_sprintf", b_log_sprintf, NULL },
+	{ "event_json", b_event_json, NULL },
+	{ "event_logfmt", b_event_logfmt, NULL },
+	{ "event_json+options", b_event_json_options, NULL },
+	{ "dhcp_decode_packet", b_decode_packet, NULL },
+};
+#define BENCHES_NUM	(sizeof(benches) / sizeof(benches[0]))
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Usage: microbench [-n iterations] [-b function] [-p packet]\n");
+	exit(EX_USAGE);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *only_bench = NULL, *only_packet = NULL;
+	unsigned iterations = 1000000, done, n, b;
+	uint64_t ns, cyc, t0, c0;
+	struct corpus *c;
+	int ch, i, ok;
+
+	while ((ch = getopt(argc, argv, "b:hn:p:")) != -1) {
+		switch (ch) {
+		case 'b':
+			only_bench = optarg;
+			break;
+		case 'n':
+			iterations = strtoul(optarg, NULL, 10);
+			break;
+		case 'p':
+			only_packet = optarg;
+			break;
+		case 'h':
+		default:
+			usage();
+		}
+	}
+	if (iterations == 0)
+		usage();
+
+	make_corpus();
+	option82_init();
+	printf("Corpus (max_packet_size %u):", max_packet_size);
+	for (i = 0; i < corpus_num; i++)
+		printf(" %s=%u", corpus[i].name, corpus[i].len);
+	printf(" bytes\n\n%-22s %-10s %10s %10s\n", "Function", "Packet", "ns/op",
+		"cycles/op");
+
+	for (b = 0; b < BENCHES_NUM; b++) {
+		if (only_bench != NULL && strcmp(only_bench, benches[b].name) != 0)
+			continue;
+		for (i = 0; i < corpus_num; i++) {
+			c = &corpus[i];
+			if (only_packet != NULL && strcmp(only_packet, c->name) != 0)
+				continue;
+			/* Warm up */
+			ok = benches[b].setup == NULL || benches[b].setup(c);
+			if (!ok) {
+				printf("%-22s %-10s %10s %10s\n", benches[b].name, c->name,
+					"n/a", "n/a");
+				continue;
+			}
+			benches[b].run(c, benches[b].setup ? BATCH : 1000);
+
+			ns = cyc = 0;
+			for (done = 0; done < iterations; done += n) {
+				n = MIN(iterations - done, benches[b].setup ? BATCH : iterations);
+				if (benches[b].setup)
+					benches[b].setup(c);
+				t0 = bench_now_ns();
+				c0 = cycles();
+				benches[b].run(c, n);
+				cyc += cycles() - c0;
+				ns += bench_now_ns() - t0;
+			}
+			printf("%-22s %-10s %10.1f %10.1f\n", benches[b].name, c->name,
+				(double)ns / iterations, (double)cyc / iterations);
+		}
+	}
+	return 0;
+}
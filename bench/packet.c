@@ -0,0 +1,89 @@
+#include <string.h>
+
+#include "bench.h"
+
+/* Build a client broadcast frame (Ethernet, IP, UDP, DHCP) in frame.
+ * req_ip and server_id are added if not zero. Returns the frame length. */
+int
+build_request(uint8_t *frame, const uint8_t *mac, uint32_t xid, int type,
+	struct in_addr req_ip, struct in_addr server_id)
+{
+	struct packet_headers *h = (struct packet_headers *)frame;
+	struct dhcp_packet *dhcp;
+	uint8_t *p;
+
+	bzero(frame, BENCH_FRAME_LEN);
+	memset(h->eh.ether_dhost, 0xff, ETHER_ADDR_LEN);
+	memcpy(h->eh.ether_shost, mac, ETHER_ADDR_LEN);
+	h->eh.ether_type = htons(ETHERTYPE_IP);
+
+	h->ip.ip_v = IPVERSION;
+	h->ip.ip_hl = 5;
+	h->ip.ip_len = htons(DHCP_UDP_OVERHEAD + DHCP_MIN_SIZE);
+	h->ip.ip_ttl = 64;
+	h->ip.ip_p = IPPROTO_UDP;
+	h->ip.ip_dst.s_addr = INADDR_BROADCAST;
+	h->ip.ip_sum = htons(ip_checksum((const char *)&h->ip, sizeof(struct ip)));
+
+	h->udp.uh_sport = htons(68);
+	h->udp.uh_dport = htons(67);
+	h->udp.uh_ulen = htons(sizeof(struct udphdr) + DHCP_MIN_SIZE);
+
+	dhcp = (struct dhcp_packet *)(frame + sizeof(struct packet_headers));
+	dhcp->op = BOOTREQUEST;
+	dhcp->htype = 1;
+	dhcp->hlen = ETH_ADDR_LEN;
+	dhcp->xid = xid;
+	dhcp->flags = htons(0x8000);	/* broadcast answer */
+	memcpy(dhcp->chaddr, mac, ETH_ADDR_LEN);
+
+	p = dhcp->options;
+	*p++ = 99; *p++ = 130; *p++ = 83; *p++ = 99;
+	*p++ = 53; *p++ = 1; *p++ = type;
+	*p++ = 61; *p++ = 7; *p++ = 1;
+	memcpy(p, mac, ETH_ADDR_LEN);
+	p += ETH_ADDR_LEN;
+	if (req_ip.s_addr != 0) {
+		*p++ = 50; *p++ = 4;
+		memcpy(p, &req_ip, 4);
+		p += 4;
+	}
+	if (server_id.s_addr != 0) {
+		*p++ = 54; *p++ = 4;
+		memcpy(p, &server_id, 4);
+		p += 4;
+	}
+	*p++ = 55; *p++ = 3; *p++ = 1; *p++ = 3; *p++ = 6;
+	*p = 255;
+
+	return BENCH_FRAME_LEN;
+}
+
+/* Option 53 value or 0 */
+int
+dhcp_message_type(struct dhcp_packet *dhcp)
+{
+	uint8_t *opt;
+
+	opt = find_option(dhcp, 53);
+	if (opt == NULL || *opt != 53 || opt[1] != 1)
+		return 0;
+	return opt[2];
+}
+
+void
+print_latency_header(FILE *f)
+{
+	fprintf(f, "Latency (us): %-16s %10s %10s %10s %10s %10s %10s\n", "",
+		"Count", "p50", "p90", "p99", "p99.9", "Max");
+}
+
+void
+print_latency(FILE *f, const char *name, const struct metrics_hist *h)
+{
+	fprintf(f, "              %-16s %10ju %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+		name, (uintmax_t)h->count,
+		hist_quantile(h, 0.5) / 1e3, hist_quantile(h, 0.9) / 1e3,
+		hist_quantile(h, 0.99) / 1e3, hist_quantile(h, 0.999) / 1e3,
+		h->max / 1e3);
+}
@@ -0,0 +1,208 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <err.h>
+#include <errno.h>
+#include <md5.h>
+#include <sysexits.h>
+
+#include "bench.h"
+
+/* A stand-in RADIUS server for radius_plugin tests.
+ *
+ * Checks a Request Authenticator of every Accounting-Request with a
+ * shared secret and answers with an Accounting-Response at once. -d adds
+ * a processing delay and -l drops a given percent of requests to test
+ * retries and timeouts. Requests are counted by Acct-Status-Type.
+ * Access-Requests are answered with Access-Accept, or Access-Reject for
+ * -r percent of User-Names (the same names every time). */
+
+#define RAD_HDR_LEN	20
+#define RAD_AUTH_LEN	16
+#define RAD_MAX_LEN	4096
+
+#define ACCESS_REQUEST	1
+#define ACCESS_ACCEPT	2
+#define ACCESS_REJECT	3
+#define ACCT_REQUEST	4
+#define ACCT_RESPONSE	5
+#define ATTR_USER_NAME	1
+#define ATTR_STATUS_TYPE	40
+
+unsigned debug = 0, max_packet_size = DHCP_MTU_MAX;
+
+static volatile int stop = 0;
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Usage: radstub [-a address] [-p port] [-s secret] "
+		"[-d delay_us] [-l loss_percent] [-r reject_percent]\n");
+	exit(EX_USAGE);
+}
+
+static void
+on_signal(int sig)
+{
+	stop = 1;
+}
+
+/* MD5(packet with auth replaced by a given one, secret) */
+static void
+authenticator(const uint8_t *pkt, int len, const uint8_t *auth, const char *secret,
+	uint8_t *digest)
+{
+	MD5_CTX ctx;
+
+	MD5Init(&ctx);
+	MD5Update(&ctx, pkt, 4);
+	MD5Update(&ctx, auth, RAD_AUTH_LEN);
+	MD5Update(&ctx, pkt + RAD_HDR_LEN, len - RAD_HDR_LEN);
+	MD5Update(&ctx, secret, strlen(secret));
+	MD5Final(digest, &ctx);
+}
+
+static int
+status_type(const uint8_t *pkt, int len)
+{
+	int i;
+
+	for (i = RAD_HDR_LEN; i + 2 <= len && pkt[i + 1] >= 2; i += pkt[i + 1])
+		if (pkt[i] == ATTR_STATUS_TYPE && pkt[i + 1] == 6 && i + 6 <= len)
+			return pkt[i + 5];
+	return 0;
+}
+
+/* A percent bucket of User-Name */
+static unsigned
+user_bucket(const uint8_t *pkt, int len)
+{
+	uint32_t h = 2166136261U;
+	int i, j;
+
+	for (i = RAD_HDR_LEN; i + 2 <= len && pkt[i + 1] >= 2; i += pkt[i + 1])
+		if (pkt[i] == ATTR_USER_NAME && i + pkt[i + 1] <= len) {
+			for (j = 2; j < pkt[i + 1]; j++)
+				h = (h ^ pkt[i + j]) * 16777619U;
+			break;
+		}
+	return h % 100;
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const uint8_t zero[RAD_AUTH_LEN];
+	struct sockaddr_in addr, from;
+	socklen_t from_len;
+	struct timeval tv = {1, 0};
+	uint64_t received = 0, answered = 0, dropped = 0, bad = 0, types[4];
+	uint64_t accepted = 0, rejected = 0;
+	uint8_t req[RAD_MAX_LEN], ans[RAD_HDR_LEN], digest[RAD_AUTH_LEN];
+	const char *secret = "bench";
+	unsigned delay = 0, loss = 0, reject = 0;
+	ssize_t n;
+	int c, fd, len, port = 1813;
+
+	bzero(&addr, sizeof(addr));
+	bzero(types, sizeof(types));
+	addr.sin_family = AF_INET;
+	while ((c = getopt(argc, argv, "a:d:hl:p:r:s:")) != -1) {
+		switch (c) {
+		case 'a':
+			if (inet_aton(optarg, &addr.sin_addr) == 0)
+				usage();
+			break;
+		case 'd':
+			delay = strtoul(optarg, NULL, 10);
+			break;
+		case 'l':
+			loss = strtoul(optarg, NULL, 10);
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'r':
+			reject = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			secret = optarg;
+			break;
+		case 'h':
+		default:
+			usage();
+		}
+	}
+	addr.sin_port = htons(port);
+
+	if ((fd = socket(PF_INET, SOCK_DGRAM, 0)) == -1)
+		err(EX_OSERR, "socket");
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+		err(EX_OSERR, "bind");
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	c = 4 * 1024 * 1024;
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &c, sizeof(c));
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	while (!stop) {
+		from_len = sizeof(from);
+		n = recvfrom(fd, req, sizeof(req), 0, (struct sockaddr *)&from, &from_len);
+		if (n == -1) {
+			if (errno != EAGAIN && errno != EINTR)
+				warn("recvfrom");
+			continue;
+		}
+		received++;
+		len = n >= RAD_HDR_LEN ? (req[2] << 8) + req[3] : 0;
+		if (len < RAD_HDR_LEN || len > n ||
+		    (req[0] != ACCT_REQUEST && req[0] != ACCESS_REQUEST)) {
+			bad++;
+			continue;
+		}
+		/* An Access-Request has a random authenticator */
+		authenticator(req, len, zero, secret, digest);
+		if (req[0] == ACCT_REQUEST && memcmp(digest, req + 4, RAD_AUTH_LEN) != 0) {
+			bad++;
+			continue;
+		}
+		if (loss && arc4random_uniform(100) < loss) {
+			dropped++;
+			continue;
+		}
+		if (delay)
+			usleep(delay);
+		if (req[0] == ACCESS_REQUEST) {
+			if (user_bucket(req, len) < reject) {
+				ans[0] = ACCESS_REJECT;
+				rejected++;
+			} else {
+				ans[0] = ACCESS_ACCEPT;
+				accepted++;
+			}
+		} else {
+			c = status_type(req, len);
+			types[c < 4 ? c : 0]++;
+			ans[0] = ACCT_RESPONSE;
+		}
+		ans[1] = req[1];
+		ans[2] = 0;
+		ans[3] = RAD_HDR_LEN;
+		authenticator(ans, RAD_HDR_LEN, req + 4, secret, ans + 4);
+		if (sendto(fd, ans, RAD_HDR_LEN, 0, (struct sockaddr *)&from, from_len) == -1)
+			warn("sendto");
+		else
+			answered++;
+	}
+
+	printf("Received: %ju, answered: %ju, dropped: %ju, bad: %ju\n"
+		"Start: %ju, stop: %ju, interim: %ju, other: %ju\n"
+		"Accept: %ju, reject: %ju\n",
+		(uintmax_t)received, (uintmax_t)answered, (uintmax_t)dropped,
+		(uintmax_t)bad, (uintmax_t)types[1], (uintmax_t)types[2],
+		(uintmax_t)types[3], (uintmax_t)types[0], (uintmax_t)accepted,
+		(uintmax_t)rejected);
+	return 0;
+}
@@ -0,0 +1,93 @@
+#!/bin/sh
+# Run dhcprelya between a load generator and a stand-in DHCP server.
+# Everything lives in vnet jails connected by epair(4) interfaces, so no
+# real network is needed:
+#
+#   client jail         relay jail                     server jail
+#   [epairXa] <----> [epairXb 10.1.0.1/16]
+#                    [epairYa 10.2.0.1/24] <----> [epairYb 10.2.0.2/24]
+#
+# Must be run as root on FreeBSD with VIMAGE (GENERIC has it). Parameters
+# are taken from the environment:
+#   RATE	DISCOVERs per second (0 - as fast as possible)
+#   COUNT	DISCOVERs to send
+#   CLIENTS	different client MACs
+#   MODE	discover or dora
+#   OPTIONS	extra lines for [options] section of dhcprelya.conf
+#   STUB_ARGS	extra dhcpstub arguments (-d delay, -l loss)
+#   RADIUS	yes to load radius_plugin with radstub as a server
+#   RADIUS_OPTIONS	extra radius_plugin options (auth=yes, ...)
+#   RADSTUB_ARGS	extra radstub arguments (-d delay, -l loss, -r reject)
+
+RATE=${RATE:-10000}
+COUNT=${COUNT:-100000}
+CLIENTS=${CLIENTS:-1000}
+MODE=${MODE:-dora}
+
+BENCH=$(cd $(dirname $0) && pwd)
+TOP=$(dirname ${BENCH})
+TMP=$(mktemp -d /tmp/dhcprelya-bench.XXXXXX)
+J=drbench$$
+
+cleanup()
+{
+	[ -f ${TMP}/relay.pid ] && kill $(cat ${TMP}/relay.pid) 2>/dev/null
+	[ -n "${STUB_PID}" ] && kill ${STUB_PID} 2>/dev/null && wait ${STUB_PID}
+	[ -n "${RADSTUB_PID}" ] && kill ${RADSTUB_PID} 2>/dev/null && wait ${RADSTUB_PID}
+	for j in client relay server; do
+		jail -r ${J}_${j} 2>/dev/null
+	done
+	[ -n "${C}" ] && ifconfig ${C}a destroy 2>/dev/null
+	[ -n "${S}" ] && ifconfig ${S}a destroy 2>/dev/null
+	rm -rf ${TMP}
+}
+trap cleanup EXIT INT TERM
+
+set -e
+kldload -n if_epair
+C=$(ifconfig epair create); C=${C%a}
+S=$(ifconfig epair create); S=${S%a}
+
+jail -c name=${J}_client path=/ vnet persist vnet.interface=${C}a
+jail -c name=${J}_relay path=/ vnet persist vnet.interface=${C}b vnet.interface=${S}a
+jail -c name=${J}_server path=/ vnet persist vnet.interface=${S}b
+
+jexec ${J}_client ifconfig ${C}a up
+jexec ${J}_relay ifconfig ${C}b inet 10.1.0.1/16 up
+jexec ${J}_relay ifconfig ${S}a inet 10.2.0.1/24 up
+jexec ${J}_server ifconfig ${S}b inet 10.2.0.2/24 up
+jexec ${J}_server route -q add -net 10.1.0.0/16 10.2.0.1
+
+cat > ${TMP}/dhcprelya.conf <<CONF
+[servers]
+10.2.0.2 ${C}b
+[options]
+track_transactions=yes
+metrics_file=${TMP}/metrics
+${OPTIONS}
+CONF
+if [ "${RADIUS}" = yes ]; then
+	cat >> ${TMP}/dhcprelya.conf <<CONF
+plugin_path=${TOP}
+[radius-plugin]
+servers=10.2.0.2:1813
+secret=bench
+${RADIUS_OPTIONS}
+CONF
+	jexec ${J}_server ${BENCH}/radstub -a 10.2.0.2 ${RADSTUB_ARGS} &
+	RADSTUB_PID=$!
+fi
+
+jexec ${J}_server ${BENCH}/dhcpstub -a 10.2.0.2 ${STUB_ARGS} &
+STUB_PID=$!
+jexec ${J}_relay ${TOP}/dhcprelya -p ${TMP}/relay.pid -f ${TMP}/dhcprelya.conf
+sleep 1
+
+set +e
+echo "=== dhcpgen: rate ${RATE}, count ${COUNT}, clients ${CLIENTS}, mode ${MODE}"
+jexec ${J}_client ${BENCH}/dhcpgen -i ${C}a -r ${RATE} -n ${COUNT} -c ${CLIENTS} -m ${MODE}
+rc=$?
+echo "=== dhcprelya"
+${TOP}/dhcprelyactl -f ${TMP}/metrics
+echo "=== dhcpstub"
+exit ${rc}
@@ -0,0 +1,356 @@
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/param.h>
+#include <sys/sysctl.h>
+#include <net/bpf.h>
+
+#include "dhcprelya.h"
+
+/* Capture (BPF) buffers of interfaces within a memory budget.
+ *
+ * libpcap gives every interface a buffer of megabytes. It's a lot of idle
+ * memory for thousands of VLANs. With capture_budget set every interface
+ * starts with capture_buffer_min. Its listener checks pcap_stats() once a
+ * second: a buffer is doubled after drops if the budget has room, and it's
+ * halved after CAPTURE_QUIET seconds without drops if the peak rate of the
+ * period fits into a half. A BPF buffer can't be resized, so a new handle
+ * is opened and the old one is read to the end by the listener before it's
+ * closed. A packet coming while both are open is seen twice, like a client
+ * retransmission. Counters of closed handles are kept, so pcap counters are
+ * still totals.
+ *
+ * The capture filter is a generated BPF program. Besides "udp and dst port
+ * bootps and not ether src <our MAC>" it checks in the kernel what
+ * sanity_check() and the main thread would drop anyway: a not IPv4 frame,
+ * a fragment, a short UDP length, a BOOTREPLY, too many hops and, with
+ * check_chaddr, a client MAC not equal to the frame source (for requests
+ * not relayed by another agent). Such floods don't wake listeners up. The
+ * program is the same for all interfaces but our MAC. A user filter
+ * (pcapfilter) is compiled and appended to run after the checks. */
+
+#define CAPTURE_QUIET	60	/* seconds without drops to shrink */
+#define CAPTURE_TIMEOUT	100	/* pcap read timeout, ms */
+
+/* Jump targets resolved by capture_filter() */
+#define JUMP_REJECT	255
+#define JUMP_ACCEPT	254
+
+/* Loads relative to X, an IP header length */
+#define UDP_OFF(off)	(ETHER_HDR_LEN + (off))
+#define BOOTP_OFF(off)	(ETHER_HDR_LEN + sizeof(struct udphdr) + (off))
+#define LDX_IP_HLEN	BPF_STMT(BPF_LDX + BPF_B + BPF_MSH, ETHER_HDR_LEN)
+
+extern int bootps_port;
+extern char pcapfilter[];
+
+int check_chaddr = 0;
+unsigned long capture_budget = 0;
+unsigned capture_buffer_min = 32 * 1024, capture_buffer_max = 4 * 1024 * 1024;
+
+struct capture {
+	unsigned size;		/* 0 - libpcap default */
+	uint64_t base_recv, base_drop, base_ifdrop;	/* of closed handles */
+	struct pcap_stat last;	/* of the handle a second ago */
+	unsigned peak;		/* packets a second, max since a resize */
+	unsigned quiet;		/* seconds without drops */
+	uint64_t resizes;
+	int denied;		/* the budget is exhausted, logged */
+};
+
+static struct capture caps[IF_MAX];
+static unsigned long capture_used;
+static pthread_mutex_t budget_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Set a client requests filter for an interface on a live or a file handle */
+int
+capture_filter(pcap_t *cap, const struct interface *intf)
+{
+	const uint8_t *mac = intf->mac;
+	struct bpf_insn checks[] = {
+		BPF_STMT(BPF_LD + BPF_H + BPF_ABS, offsetof(struct ether_header, ether_type)),
+		BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, ETHERTYPE_IP, 0, JUMP_REJECT),
+		BPF_STMT(BPF_LD + BPF_B + BPF_ABS, ETHER_HDR_LEN + offsetof(struct ip, ip_p)),
+		BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, IPPROTO_UDP, 0, JUMP_REJECT),
+		/* Fragment offset */
+		BPF_STMT(BPF_LD + BPF_H + BPF_ABS, ETHER_HDR_LEN + offsetof(struct ip, ip_off)),
+		BPF_JUMP(BPF_JMP + BPF_JSET + BPF_K, IP_OFFMASK, JUMP_REJECT, 0),
+		LDX_IP_HLEN,
+		BPF_STMT(BPF_LD + BPF_H + BPF_IND, UDP_OFF(offsetof(struct udphdr, uh_dport))),
+		BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, ntohs(bootps_port), 0, JUMP_REJECT),
+		BPF_STMT(BPF_LD + BPF_H + BPF_IND, UDP_OFF(offsetof(struct udphdr, uh_ulen))),
+		BPF_JUMP(BPF_JMP + BPF_JGE + BPF_K, DHCP_FIXED_NON_UDP + DHCP_COOKIE_LEN + 1,
+			0, JUMP_REJECT),
+		BPF_STMT(BPF_LD + BPF_B + BPF_IND, BOOTP_OFF(offsetof(struct dhcp_packet, op))),
+		BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, BOOTREQUEST, 0, JUMP_REJECT),
+		BPF_STMT(BPF_LD + BPF_B + BPF_IND, BOOTP_OFF(offsetof(struct dhcp_packet, hops))),
+		BPF_JUMP(BPF_JMP + BPF_JGE + BPF_K, max_hops, JUMP_REJECT, 0),
+		/* Not our own frame */
+		BPF_STMT(BPF_LD + BPF_W + BPF_ABS, offsetof(struct ether_header, ether_shost)),
+		BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K,
+			(uint32_t)mac[0] << 24 | mac[1] << 16 | mac[2] << 8 | mac[3], 0, 2),
+		BPF_STMT(BPF_LD + BPF_H + BPF_ABS, offsetof(struct ether_header, ether_shost) + 4),
+		BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, mac[4] << 8 | mac[5], JUMP_REJECT, 0),
+	};
+	struct bpf_insn chaddr[] = {
+		/* Relayed requests come from another agent MAC */
+		BPF_STMT(BPF_LD + BPF_W + BPF_IND, BOOTP_OFF(offsetof(struct dhcp_packet, giaddr))),
+		BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, 0, 0, JUMP_ACCEPT),
+		BPF_STMT(BPF_LD + BPF_W + BPF_IND, BOOTP_OFF(offsetof(struct dhcp_packet, chaddr))),
+		BPF_STMT(BPF_MISC + BPF_TAX, 0),
+		BPF_STMT(BPF_LD + BPF_W + BPF_ABS, offsetof(struct ether_header, ether_shost)),
+		BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_X, 0, 0, JUMP_REJECT),
+		LDX_IP_HLEN,
+		BPF_STMT(BPF_LD + BPF_H + BPF_IND, BOOTP_OFF(offsetof(struct dhcp_packet, chaddr) + 4)),
+		BPF_STMT(BPF_MISC + BPF_TAX, 0),
+		BPF_STMT(BPF_LD + BPF_H + BPF_ABS, offsetof(struct ether_header, ether_shost) + 4),
+		BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_X, 0, 0, JUMP_REJECT),
+	};
+	struct bpf_insn tail[] = {
+		BPF_STMT(BPF_JMP + BPF_JA, JUMP_ACCEPT),
+		BPF_STMT(BPF_RET + BPF_K, 0),		/* rejected */
+	};
+	/* Accepted without a user filter: the whole packet, snaplen cuts it */
+	struct bpf_insn whole = BPF_STMT(BPF_RET + BPF_K, (u_int)-1);
+	struct bpf_program user, fp;
+	struct bpf_insn *insn;
+	unsigned i, reject, accept;
+	int rc;
+
+	user.bf_len = 0;
+	if (pcapfilter[0] != '\0' && pcap_compile(cap, &user, pcapfilter, 1, 0) < 0) {
+		logd(LOG_ERR, "pcap filter on %s: %s", intf->name, pcap_geterr(cap));
+		return 0;
+	}
+	accept = nitems(checks) + (check_chaddr ? nitems(chaddr) : 0) + nitems(tail);
+	reject = accept - 1;
+	fp.bf_len = accept + (user.bf_len ? user.bf_len : 1);
+	if ((fp.bf_insns = calloc(fp.bf_len, sizeof(struct bpf_insn))) == NULL) {
+		logd(LOG_ERR, "capture_filter: malloc error");
+		if (user.bf_len)
+			pcap_freecode(&user);
+		return 0;
+	}
+	insn = fp.bf_insns;
+	memcpy(insn, checks, sizeof(checks));
+	insn += nitems(checks);
+	if (check_chaddr) {
+		memcpy(insn, chaddr, sizeof(chaddr));
+		insn += nitems(chaddr);
+	}
+	memcpy(insn, tail, sizeof(tail));
+	insn += nitems(tail);
+	if (user.bf_len) {
+		memcpy(insn, user.bf_insns, user.bf_len * sizeof(struct bpf_insn));
+		pcap_freecode(&user);
+	} else
+		*insn = whole;
+
+	/* Resolve jumps to the end */
+	for (i = 0; i < accept; i++) {
+		insn = &fp.bf_insns[i];
+		if (BPF_CLASS(insn->code) != BPF_JMP)
+			continue;
+		if (BPF_OP(insn->code) == BPF_JA) {
+			insn->k = accept - i - 1;
+			continue;
+		}
+		if (insn->jt == JUMP_REJECT || insn->jt == JUMP_ACCEPT)
+			insn->jt = (insn->jt == JUMP_REJECT ? reject : accept) - i - 1;
+		if (insn->jf == JUMP_REJECT || insn->jf == JUMP_ACCEPT)
+			insn->jf = (insn->jf == JUMP_REJECT ? reject : accept) - i - 1;
+	}
+
+	if ((rc = pcap_setfilter(cap, &fp)) < 0)
+		logd(LOG_ERR, "pcap filter on %s: %s", intf->name, pcap_geterr(cap));
+	free(fp.bf_insns);
+	return rc == 0;
+}
+
+/* Open a handle with a client requests filter. size 0 is libpcap default. */
+pcap_t *
+capture_open(const struct interface *intf, unsigned size)
+{
+	char errbuf[PCAP_ERRBUF_SIZE];
+	pcap_t *cap;
+
+	if ((cap = pcap_create(intf->name, errbuf)) == NULL) {
+		logd(LOG_ERR, "pcap_create(%s): %s", intf->name, errbuf);
+		return NULL;
+	}
+	pcap_set_snaplen(cap, max_packet_size);
+	pcap_set_promisc(cap, 0);
+	pcap_set_timeout(cap, CAPTURE_TIMEOUT);
+	if (size != 0)
+		pcap_set_buffer_size(cap, size);
+	if (pcap_activate(cap) < 0) {
+		logd(LOG_ERR, "pcap_activate(%s): %s", intf->name, pcap_geterr(cap));
+		pcap_close(cap);
+		return NULL;
+	}
+
+	if (!capture_filter(cap, intf)) {
+		pcap_close(cap);
+		return NULL;
+	}
+	return cap;
+}
+
+/* Set filters and start all interfaces with a minimal buffer within the
+ * budget. Called when the config is read, before listeners start. */
+int
+capture_init(void)
+{
+	u_int maxbuf;
+	size_t len = sizeof(maxbuf);
+	pcap_t *cap;
+	int i;
+
+	/* Options are known now */
+	if (capture_budget == 0) {
+		for (i = 0; i < if_num; i++)
+			if (!capture_filter(ifs[i]->cap, ifs[i]))
+				return 0;
+		return 1;
+	}
+	/* The kernel silently cuts larger buffers */
+	if (sysctlbyname("net.bpf.maxbufsize", &maxbuf, &len, NULL, 0) == 0 &&
+	    maxbuf < capture_buffer_max) {
+		logd(LOG_NOTICE, "capture_buffer_max is cut to net.bpf.maxbufsize %u", maxbuf);
+		capture_buffer_max = maxbuf;
+	}
+	if (capture_buffer_min > capture_buffer_max)
+		capture_buffer_min = capture_buffer_max;
+	if ((unsigned long)capture_buffer_min * if_num > capture_budget) {
+		logd(LOG_ERR, "capture_budget is less than capture_buffer_min for %d interfaces",
+			if_num);
+		return 0;
+	}
+
+	for (i = 0; i < if_num; i++) {
+		if ((cap = capture_open(ifs[i], capture_buffer_min)) == NULL)
+			return 0;
+		pcap_close(ifs[i]->cap);
+		ifs[i]->cap = cap;
+		caps[i].size = capture_buffer_min;
+	}
+	capture_used = (unsigned long)capture_buffer_min * if_num;
+	return 1;
+}
+
+/* Counters of an interface from its start */
+void
+capture_stats(const struct interface *intf, uint64_t *recv, uint64_t *drop,
+	uint64_t *ifdrop)
+{
+	const struct capture *c = &caps[intf->idx];
+	struct pcap_stat ps;
+
+	if (pcap_stats(intf->cap, &ps) == -1)
+		bzero(&ps, sizeof(ps));
+	*recv = c->base_recv + ps.ps_recv;
+	*drop = c->base_drop + ps.ps_drop;
+	*ifdrop = c->base_ifdrop + ps.ps_ifdrop;
+}
+
+unsigned
+capture_buffer(const struct interface *intf, uint64_t *resizes)
+{
+	*resizes = caps[intf->idx].resizes;
+	return caps[intf->idx].size;
+}
+
+unsigned long
+capture_budget_used(void)
+{
+	return capture_used;
+}
+
+/* Take bytes from the budget (or return them if negative) */
+static int
+budget_take(long bytes)
+{
+	int ok = 1;
+
+	pthread_mutex_lock(&budget_lock);
+	if (bytes > 0 && capture_used + bytes > capture_budget)
+		ok = 0;
+	else
+		capture_used += bytes;
+	pthread_mutex_unlock(&budget_lock);
+	return ok;
+}
+
+/* Called by a listener once a second. Returns a replaced handle to be read
+ * to the end and closed or NULL. */
+pcap_t *
+capture_tune(struct interface *intf)
+{
+	struct capture *c = &caps[intf->idx];
+	char errbuf[PCAP_ERRBUF_SIZE];
+	struct pcap_stat ps;
+	unsigned drops, rate, size;
+	pcap_t *cap, *old;
+
+	if (capture_budget == 0 || pcap_stats(intf->cap, &ps) == -1)
+		return NULL;
+	drops = ps.ps_drop - c->last.ps_drop;
+	rate = ps.ps_recv - c->last.ps_recv;
+	c->last = ps;
+	c->peak = MAX(c->peak, rate);
+
+	size = c->size;
+	if (drops > 0) {
+		c->quiet = 0;
+		if (c->size >= capture_buffer_max)
+			return NULL;
+		size = MIN(c->size * 2, capture_buffer_max);
+		if (!budget_take(size - c->size)) {
+			if (!c->denied)
+				logd(LOG_WARNING, "Drops on %s, but capture_budget is exhausted",
+					intf->name);
+			c->denied = 1;
+			return NULL;
+		}
+	} else if (++c->quiet >= CAPTURE_QUIET) {
+		c->quiet = 0;
+		/* A buffer is read every CAPTURE_TIMEOUT ms at least, leave
+		 * it four times more room */
+		if (c->size > capture_buffer_min &&
+		    (uint64_t)c->peak * max_packet_size * CAPTURE_TIMEOUT / 1000 * 4 <= c->size / 2)
+			size = MAX(c->size / 2, capture_buffer_min);
+		c->peak = 0;
+		if (size == c->size)
+			return NULL;
+	} else
+		return NULL;
+
+	if ((cap = capture_open(intf, size)) == NULL) {
+		if (size > c->size)
+			budget_take(-(long)(size - c->size));
+		return NULL;
+	}
+	if (size < c->size)
+		budget_take(-(long)(c->size - size));
+	logd(LOG_NOTICE, "Capture buffer of %s: %u -> %u KB", intf->name,
+		c->size / 1024, size / 1024);
+
+	c->base_recv += ps.ps_recv;
+	c->base_drop += ps.ps_drop;
+	c->base_ifdrop += ps.ps_ifdrop;
+	bzero(&c->last, sizeof(c->last));
+	c->size = size;
+	c->peak = 0;
+	c->denied = 0;
+	c->resizes++;
+
+	old = intf->cap;
+	if (pcap_setnonblock(old, 1, errbuf) == -1) {
+		/* Can't read it without blocking, lose what's there */
+		pcap_close(old);
+		old = NULL;
+	}
+	intf->cap = cap;
+	return old;
+}
@@ -0,0 +1,335 @@
+#include <string.h>
+#include <ctype.h>
+#include <sys/param.h>
+
+#include "dhcprelya.h"
+#include "dhcp_options.h"
+
+/* DHCP packets and options decoder.
+ *
+ * How an option is shown is defined by its entry in dhcp_options[] (see
+ * dhcp_options.h): a type and an element size. One loop renders values
+ * into a caller's buffer for log_plugin text, JSON and logfmt outputs.
+ * No stdio, no allocation. A value of a wrong length is shown as hex.
+ * Output is truncated to the buffer and always NUL terminated. */
+
+struct out {
+	char *p;
+	char *end;		/* a place for NUL */
+};
+
+static const char hex[] = "0123456789abcdef";
+
+static inline void
+out_c(struct out *o, char c)
+{
+	if (o->p < o->end)
+		*o->p++ = c;
+}
+
+static void
+out_s(struct out *o, const char *s)
+{
+	while (*s != '\0' && o->p < o->end)
+		*o->p++ = *s++;
+}
+
+/* %-*s */
+static void
+out_pad(struct out *o, const char *s, int width)
+{
+	for (; *s != '\0'; s++, width--)
+		out_c(o, *s);
+	while (width-- > 0)
+		out_c(o, ' ');
+}
+
+/* %*u */
+static void
+out_u(struct out *o, uint32_t v, int width)
+{
+	char tmp[10];
+	int n = 0;
+
+	do {
+		tmp[n++] = '0' + v % 10;
+		v /= 10;
+	} while (v != 0);
+	while (width-- > n)
+		out_c(o, ' ');
+	while (n > 0)
+		out_c(o, tmp[--n]);
+}
+
+static void
+out_hex(struct out *o, const uint8_t *data, int len, char sep)
+{
+	int i;
+
+	for (i = 0; i < len; i++) {
+		if (sep && i != 0)
+			out_c(o, sep);
+		out_c(o, hex[data[i] >> 4]);
+		out_c(o, hex[data[i] & 0xf]);
+	}
+}
+
+/* Up to NUL, non-printable as '.' */
+static void
+out_ascii(struct out *o, const uint8_t *data, int len, int stop_at_nul)
+{
+	int i;
+
+	for (i = 0; i < len; i++) {
+		if (stop_at_nul && data[i] == '\0')
+			break;
+		out_c(o, isprint(data[i]) ? data[i] : '.');
+	}
+}
+
+static void
+out_ip(struct out *o, const uint8_t *data)
+{
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		if (i != 0)
+			out_c(o, '.');
+		out_u(o, data[i], 0);
+	}
+}
+
+static void
+out_time(struct out *o, uint32_t t)
+{
+	static const struct {
+		uint32_t secs;
+		char unit;
+	} units[] = {
+		{ 7 * 24 * 3600, 'w' }, { 24 * 3600, 'd' }, { 3600, 'h' }, { 60, 'm' },
+		{ 1, 's' }
+	};
+	int i;
+
+	out_u(o, t, 0);
+	out_s(o, " (");
+	for (i = 0; i < nitems(units); i++)
+		if (t >= units[i].secs) {
+			out_u(o, t / units[i].secs, 0);
+			out_c(o, units[i].unit);
+			t %= units[i].secs;
+		}
+	out_c(o, ')');
+}
+
+static const char *
+tok_name(const struct tok *t, uint8_t v)
+{
+	for (; t->s != NULL; t++)
+		if (t->v == v)
+			return t->s;
+	return "unknown";
+}
+
+static void
+decode_value(struct out *o, uint8_t code, const uint8_t *data, int len)
+{
+	const struct dhcp_option_info *info = &dhcp_options[code];
+	int type = info->type, i;
+
+	if (info->size > 1 && (len == 0 || len % info->size != 0))
+		type = OT_HEX;
+	switch (type) {
+	case OT_PAD:
+	case OT_END:
+		break;
+	case OT_HEX:
+		out_hex(o, data, len, 0);
+		out_c(o, ' ');
+		out_ascii(o, data, len, 0);
+		break;
+	case OT_HEX_ONLY:
+		out_hex(o, data, len, 0);
+		break;
+	case OT_IP:
+	case OT_IP_MASK:
+	case OT_ROUTE:
+		for (i = 0; i < len; i += 4) {
+			if (i != 0)
+				out_c(o, type == OT_IP || i % 8 == 0 ? ',' :
+					(type == OT_IP_MASK ? '/' : ' '));
+			out_ip(o, data + i);
+		}
+		break;
+	case OT_STRING:
+		out_ascii(o, data, len, 1);
+		break;
+	case OT_WORD:
+		for (i = 0; i < len; i += 2) {
+			if (i != 0)
+				out_c(o, ',');
+			out_u(o, (data[i] << 8) + data[i + 1], 0);
+		}
+		break;
+	case OT_BYTE:
+		if (len > 0)
+			out_u(o, data[0], 0);
+		break;
+	case OT_TIME:
+		out_time(o, ((uint32_t)data[0] << 24) + (data[1] << 16) + (data[2] << 8) + data[3]);
+		break;
+	case OT_ENUM:
+		if (len < 1)
+			break;
+		out_u(o, data[0], 0);
+		out_s(o, " (");
+		out_s(o, data[0] < info->values_num ? info->values[data[0]] :
+			"*wrong value*");
+		out_c(o, ')');
+		break;
+	case OT_PARAMS:
+		for (i = 0; i < len; i++) {
+			if (i != 0)
+				out_s(o, ", ");
+			out_u(o, data[i], 0);
+			out_s(o, " (");
+			out_s(o, dhcp_options[data[i]].name);
+			out_c(o, ')');
+		}
+		break;
+	case OT_CLIENT_ID:
+		if (len < 1)
+			break;
+		if (data[0] != 0) {
+			out_s(o, tok_name(arp2str, data[0]));
+			out_c(o, ' ');
+			out_hex(o, data + 1, len - 1, ':');
+		} else
+			out_ascii(o, data + 1, len - 1, 1);
+		break;
+	case OT_FQDN:
+		if (len < 3) {
+			out_hex(o, data, len, 0);
+			break;
+		}
+		for (i = 0; i < 3; i++) {
+			out_u(o, data[i], 0);
+			out_c(o, i < 2 ? '-' : ' ');
+		}
+		out_ascii(o, data + 3, len - 3, 1);
+		break;
+	case OT_AGENT_INFO:
+		for (i = 0; i + 1 < len; i += data[i + 1] + 2) {
+			if (i != 0)
+				out_s(o, "; ");
+			out_s(o, data[i] < nitems(relayagent_suboptions) ?
+				relayagent_suboptions[data[i]] : "subopt");
+			out_c(o, '(');
+			out_u(o, data[i], 0);
+			out_s(o, "): ");
+			if (i + 2 + data[i + 1] > len) {
+				out_s(o, "*MALFORMED -- TOO LARGE*");
+				break;
+			}
+			out_hex(o, data + i + 2, data[i + 1], 0);
+			out_c(o, ' ');
+			out_ascii(o, data + i + 2, data[i + 1], 0);
+		}
+		break;
+	}
+}
+
+const char *
+dhcp_option_name(uint8_t code)
+{
+	return dhcp_options[code].name;
+}
+
+/* A value of an option at opt (code, length, data) */
+size_t
+dhcp_decode_value(const uint8_t *opt, char *buf, size_t size)
+{
+	struct out o = {buf, buf + size - 1};
+
+	if (opt[0] == 0 || opt[0] == 255)
+		o.p = buf;
+	else
+		decode_value(&o, opt[0], opt + 2, opt[1]);
+	*o.p = '\0';
+	return o.p - buf;
+}
+
+static void
+out_field(struct out *o, const char *name, const uint8_t *addr)
+{
+	out_s(o, name);
+	out_ip(o, addr);
+	out_c(o, '\n');
+}
+
+/* A multiline text dump of a packet of len bytes as log_plugin prints it
+ * with detailed=yes */
+size_t
+dhcp_decode_packet(const struct dhcp_packet *dhcp, size_t len, char *buf, size_t size)
+{
+	static const char line[] =
+	    "---------------------------------------------------------------------------\n";
+	struct out o = {buf, buf + size - 1};
+	const uint8_t *data = (const uint8_t *)dhcp;
+	size_t j;
+
+	out_s(&o, line);
+	out_s(&o, "op: ");
+	out_u(&o, dhcp->op, 0);
+	out_s(&o, dhcp->op == 1 ? " (BOOTREQUEST)\n" :
+		(dhcp->op == 2 ? " (BOOTREPLY)\n" : " (illegal)\n"));
+	out_s(&o, "htype: ");
+	out_u(&o, dhcp->htype, 0);
+	out_s(&o, dhcp->htype == 1 ? " (Ethernet)\nhlen: " : " ()\nhlen: ");
+	out_u(&o, dhcp->hlen, 0);
+	out_s(&o, "\nhops: ");
+	out_u(&o, dhcp->hops, 0);
+	out_s(&o, "\nxid: 0x");
+	out_hex(&o, (const uint8_t *)&dhcp->xid, 4, 0);
+	out_s(&o, "\nsecs: ");
+	out_u(&o, ntohs(dhcp->secs), 0);
+	out_s(&o, "\nflags: 0x");
+	out_hex(&o, (const uint8_t *)&dhcp->flags, 2, 0);
+	out_c(&o, '\n');
+	out_field(&o, "ciaddr: ", (const uint8_t *)&dhcp->ciaddr);
+	out_field(&o, "yiaddr: ", (const uint8_t *)&dhcp->yiaddr);
+	out_field(&o, "siaddr: ", (const uint8_t *)&dhcp->siaddr);
+	out_field(&o, "giaddr: ", (const uint8_t *)&dhcp->giaddr);
+	out_s(&o, "chaddr: ");
+	out_hex(&o, dhcp->chaddr, ETHER_ADDR_LEN, ':');
+	out_s(&o, "\nsname: ");
+	out_ascii(&o, (const uint8_t *)dhcp->sname, sizeof(dhcp->sname), 1);
+	out_s(&o, ".\nfile: ");
+	out_ascii(&o, (const uint8_t *)dhcp->file, sizeof(dhcp->file), 1);
+	out_s(&o, ".\n");
+
+	len = MIN(len, sizeof(struct dhcp_packet));
+	for (j = DHCP_FIXED_NON_UDP + DHCP_COOKIE_LEN; j < len && data[j] != 255;) {
+		if (data[j] == 0) {	/* padding */
+			j++;
+			continue;
+		}
+		out_s(&o, "OPTION: ");
+		out_u(&o, data[j], 3);
+		if (j + 1 >= len || j + 2 + data[j + 1] > len) {
+			out_s(&o, " *TRUNCATED*\n");
+			break;
+		}
+		out_s(&o, " (");
+		out_u(&o, data[j + 1], 3);
+		out_s(&o, ") ");
+		out_pad(&o, dhcp_options[data[j]].name, 26);
+		decode_value(&o, data[j], data + j + 2, data[j + 1]);
+		out_c(&o, '\n');
+		j += data[j + 1] + 2;
+	}
+	out_s(&o, line);
+	out_c(&o, '\n');
+	*o.p = '\0';
+	return o.p - buf;
+}
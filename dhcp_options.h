@@ -1,264 +1,29 @@
-/* this list was stolen from The DHCP Handbook by Droms and Lemon, Appendix D */
+#define OT_HEX		0	/* hex and ASCII */
+#define OT_PAD		1
+#define OT_END		2
+#define OT_IP		3	/* a list of addresses */
+#define OT_IP_MASK	4	/* address/mask pairs */
+#define OT_ROUTE	5	/* destination and router pairs */
+#define OT_STRING	6
+#define OT_WORD		7	/* a list of 16 bits numbers */
+#define OT_BYTE		8
+#define OT_TIME		9	/* 32 bits seconds */
+#define OT_ENUM		10	/* a byte with a name */
+#define OT_PARAMS	11	/* a list of option codes */
+#define OT_HEX_ONLY	12
+#define OT_CLIENT_ID	13
+#define OT_FQDN		14
+#define OT_AGENT_INFO	15
 
-/* The first comment is the number, the last parameter is if it's verbosed */
-const char *dhcp_options[] = {
-	 /* 0 */ "pad",
-	 /* 1 */ "Subnet mask",	/**/
-	 /* 2 */ "Time offset",	/**/
-	 /* 3 */ "Routers",	/**/
-	 /* 4 */ "Time server",	/**/
-	 /* 5 */ "Name server",	/**/
-	 /* 6 */ "DNS server",	/**/
-	 /* 7 */ "Log server",	/**/
-	 /* 8 */ "Cookie server",	/**/
-	 /* 9 */ "LPR server",	/**/
-	 /* 10 */ "Impress server",	/**/
-	 /* 11 */ "Resource location server",	/**/
-	 /* 12 */ "Host name",	/**/
-	 /* 13 */ "Boot file size",	/**/
-	 /* 14 */ "Merit dump file",	/**/
-	 /* 15 */ "Domainname",	/**/
-	 /* 16 */ "Swap server",/**/
-	 /* 17 */ "Root path",	/**/
-	 /* 18 */ "Extensions path",	/**/
-	 /* 19 */ "IP forwarding",	/**/
-	 /* 20 */ "Non-local source routing",	/**/
-	 /* 21 */ "Policy filter",	/**/
-	 /* 22 */ "Maximum datagram reassembly size",	/**/
-	 /* 23 */ "Default IP TTL",	/**/
-	 /* 24 */ "Path MTU aging timeout",	/**/
-	 /* 25 */ "Path MTU plateau table",	/**/
-	 /* 26 */ "Interface MTU",	/**/
-	 /* 27 */ "All subnets local",	/**/
-	 /* 28 */ "Broadcast address",	/**/
-	 /* 29 */ "Perform mask discovery",	/**/
-	 /* 30 */ "Mask supplier",	/**/
-	 /* 31 */ "Perform router discovery",	/**/
-	 /* 32 */ "Router solicitation",	/**/
-	 /* 33 */ "Static route",	/**/
-	 /* 34 */ "Trailer encapsulation",	/**/
-	 /* 35 */ "ARP cache timeout",	/**/
-	 /* 36 */ "Ethernet encapsulation",	/**/
-	 /* 37 */ "TCP default TTL",	/**/
-	 /* 38 */ "TCP keepalive interval",	/**/
-	 /* 39 */ "TCP keepalive garbage",	/**/
-	 /* 40 */ "NIS domain",	/**/
-	 /* 41 */ "NIS servers",/**/
-	 /* 42 */ "NTP servers",/**/
-	 /* 43 */ "Vendor specific info",	/**/
-	 /* 44 */ "NetBIOS name server",	/**/
-	 /* 45 */ "NetBIOS datagram distribution server",	/**/
-	 /* 46 */ "NetBIOS node type",	/**/
-	 /* 47 */ "NetBIOS scope",	/**/
-	 /* 48 */ "X Window System font server",	/**/
-	 /* 49 */ "X Window System display server",	/**/
-	 /* 50 */ "Request IP address",	/**/
-	 /* 51 */ "IP address leasetime",	/**/
-	 /* 52 */ "Option overload",	/**/
-	 /* 53 */ "DHCP message type",	/**/
-	 /* 54 */ "Server identifier",	/**/
-	 /* 55 */ "Parameter Request List",	/**/
-	 /* 56 */ "Message",	/**/
-	 /* 57 */ "Maximum DHCP message size",	/**/
-	 /* 58 */ "T1",		/**/
-	 /* 59 */ "T2",		/**/
-	 /* 60 */ "Vendor class identifier",	/**/
-	 /* 61 */ "Client-identifier",	/**/
-	 /* 62 */ "Netware/IP domain name",	/**/
-	 /* 63 */ "Netware/IP domain information",	/**/
-	 /* 64 */ "NIS+ domain",/**/
-	 /* 65 */ "NIS+ servers",	/**/
-	 /* 66 */ "TFTP server name",	/**/
-	 /* 67 */ "Bootfile name",	/**/
-	 /* 68 */ "Mobile IP home agent",	/**/
-	 /* 69 */ "SMTP server",/**/
-	 /* 70 */ "POP3 server",/**/
-	 /* 71 */ "NNTP server",/**/
-	 /* 72 */ "WWW server",	/**/
-	 /* 73 */ "Finger server",	/**/
-	 /* 74 */ "IRC server",	/**/
-	 /* 75 */ "StreetTalk server",	/**/
-	 /* 76 */ "StreetTalk directory assistance server",	/**/
-	 /* 77 */ "User-class Identification",
-	 /* 78 */ "SLP-directory-agent",
-	 /* 79 */ "SLP-service-scope",
-	 /* 80 */ "Naming Authority",
-	 /* 81 */ "Client FQDN",/**/
-	 /* 82 */ "Relay Agent Information",
-	 /* 83 */ "Agent Remote ID",
-	 /* 84 */ "Agent Subnet Mask",
-	 /* 85 */ "NDS server",	/**/
-	 /* 86 */ "NDS tree name",	/**/
-	 /* 87 */ "NDS context",/**/
-	 /* 88 */ "IEEE 1003.1 POSIX",
-	 /* 89 */ "FQDN",
-	 /* 90 */ "Authentication",
-	 /* 91 */ "Vines TCP/IP",
-	 /* 92 */ "Server Selection",
-	 /* 93 */ "Client System",
-	 /* 94 */ "Client NDI",
-	 /* 95 */ "LDAP",
-	 /* 96 */ "IPv6 Transitions",
-	 /* 97 */ "UUID/GUID",
-	 /* 98 */ "UPA servers",
-	 /* 99 */ "???",
-	 /* 100 */ "Printer Name",
-	 /* 101 */ "MDHCP",
-	 /* 102 */ "???",
-	 /* 103 */ "???",
-	 /* 104 */ "???",
-	 /* 105 */ "???",
-	 /* 106 */ "???",
-	 /* 107 */ "???",
-	 /* 108 */ "Swap Path",
-	 /* 109 */ "???",
-	 /* 110 */ "IPX Compatability",
-	 /* 111 */ "???",
-	 /* 112 */ "Netinfo Address",
-	 /* 113 */ "Netinfo Tag",
-	 /* 114 */ "URL",
-	 /* 115 */ "DHCP Failover",
-	 /* 116 */ "DHCP Autoconfiguration",
-	 /* 117 */ "Name Service Search",
-	 /* 118 */ "Subnet selection",
-	 /* 119 */ "Domain Search",
-	 /* 120 */ "SIP Servers DHCP Option",
-	 /* 121 */ "Classless Static Route",
-	 /* 122 */ "???",
-	 /* 123 */ "???",
-	 /* 124 */ "???",
-	 /* 125 */ "???",
-	 /* 126 */ "Extension",
-	 /* 127 */ "Extension",
-	 /* 128 */ "???",
-	 /* 129 */ "???",
-	 /* 130 */ "???",
-	 /* 131 */ "???",
-	 /* 132 */ "???",
-	 /* 133 */ "???",
-	 /* 134 */ "???",
-	 /* 135 */ "???",
-	 /* 136 */ "???",
-	 /* 137 */ "???",
-	 /* 138 */ "???",
-	 /* 139 */ "???",
-	 /* 140 */ "???",
-	 /* 141 */ "???",
-	 /* 142 */ "???",
-	 /* 143 */ "???",
-	 /* 144 */ "HP - TFTP file",
-	 /* 145 */ "???",
-	 /* 146 */ "???",
-	 /* 147 */ "???",
-	 /* 148 */ "???",
-	 /* 149 */ "???",
-	 /* 150 */ "CiscoCallManagerTFTP",
-	 /* 151 */ "???",
-	 /* 152 */ "???",
-	 /* 153 */ "???",
-	 /* 154 */ "???",
-	 /* 155 */ "???",
-	 /* 156 */ "???",
-	 /* 157 */ "???",
-	 /* 158 */ "???",
-	 /* 159 */ "???",
-	 /* 160 */ "???",
-	 /* 161 */ "???",
-	 /* 162 */ "???",
-	 /* 163 */ "???",
-	 /* 164 */ "???",
-	 /* 165 */ "???",
-	 /* 166 */ "???",
-	 /* 167 */ "???",
-	 /* 168 */ "???",
-	 /* 169 */ "???",
-	 /* 170 */ "???",
-	 /* 171 */ "???",
-	 /* 172 */ "???",
-	 /* 173 */ "???",
-	 /* 174 */ "???",
-	 /* 175 */ "???",
-	 /* 176 */ "???",
-	 /* 177 */ "???",
-	 /* 178 */ "???",
-	 /* 179 */ "???",
-	 /* 180 */ "???",
-	 /* 181 */ "???",
-	 /* 182 */ "???",
-	 /* 183 */ "???",
-	 /* 184 */ "???",
-	 /* 185 */ "???",
-	 /* 186 */ "???",
-	 /* 187 */ "???",
-	 /* 188 */ "???",
-	 /* 189 */ "???",
-	 /* 190 */ "???",
-	 /* 191 */ "???",
-	 /* 192 */ "???",
-	 /* 193 */ "???",
-	 /* 194 */ "???",
-	 /* 195 */ "???",
-	 /* 196 */ "???",
-	 /* 197 */ "???",
-	 /* 198 */ "???",
-	 /* 199 */ "???",
-	 /* 200 */ "???",
-	 /* 201 */ "???",
-	 /* 202 */ "???",
-	 /* 203 */ "???",
-	 /* 204 */ "???",
-	 /* 205 */ "???",
-	 /* 206 */ "???",
-	 /* 207 */ "???",
-	 /* 208 */ "???",
-	 /* 209 */ "???",
-	 /* 210 */ "Authenticate",
-	 /* 211 */ "???",
-	 /* 212 */ "???",
-	 /* 213 */ "???",
-	 /* 214 */ "???",
-	 /* 215 */ "???",
-	 /* 216 */ "???",
-	 /* 217 */ "???",
-	 /* 218 */ "???",
-	 /* 219 */ "???",
-	 /* 220 */ "???",
-	 /* 221 */ "???",
-	 /* 222 */ "???",
-	 /* 223 */ "???",
-	 /* 224 */ "???",
-	 /* 225 */ "???",
-	 /* 226 */ "???",
-	 /* 227 */ "???",
-	 /* 228 */ "???",
-	 /* 229 */ "???",
-	 /* 230 */ "???",
-	 /* 231 */ "???",
-	 /* 232 */ "???",
-	 /* 233 */ "???",
-	 /* 234 */ "???",
-	 /* 235 */ "???",
-	 /* 236 */ "???",
-	 /* 237 */ "???",
-	 /* 238 */ "???",
-	 /* 239 */ "???",
-	 /* 240 */ "???",
-	 /* 241 */ "???",
-	 /* 242 */ "???",
-	 /* 243 */ "???",
-	 /* 244 */ "???",
-	 /* 245 */ "???",
-	 /* 246 */ "???",
-	 /* 247 */ "???",
-	 /* 248 */ "???",
-	 /* 249 */ "MSFT - Classless route",
-	 /* 250 */ "???",
-	 /* 251 */ "???",
-	 /* 252 */ "MSFT - WinSock Proxy Auto Detect",
-	 /* 253 */ "???",
-	 /* 254 */ "???",
- /* 255 */ "End"};
+struct dhcp_option_info {
+	const char *name;
+	uint8_t type;
+	uint8_t size;
+	uint8_t values_num;
+	const char **values;
+};
 
+#define ENUM(name, values)	{ name, OT_ENUM, 1, nitems(values), values }
 
 const char *dhcp_message_types[] = {
 	"wrong specified",
@@ -314,6 +79,272 @@ const char *relayagent_suboptions[] = {
 	 /* 2 */ "Remote-ID"
 };
 
+/* this list was stolen from The DHCP Handbook by Droms and Lemon, Appendix D */
+
+/* The first comment is the number. A type is how a value is decoded by
+ * dhcp_decode.c, a size is an element size, a value length must be a
+ * multiple of it. Enumerated values have a names table. */
+const struct dhcp_option_info dhcp_options[] = {
+	/* 0 */ { "pad", OT_PAD, 0 },
+	/* 1 */ { "Subnet mask", OT_IP, 4 },
+	/* 2 */ { "Time offset", OT_TIME, 4 },
+	/* 3 */ { "Routers", OT_IP, 4 },
+	/* 4 */ { "Time server", OT_IP, 4 },
+	/* 5 */ { "Name server", OT_IP, 4 },
+	/* 6 */ { "DNS server", OT_IP, 4 },
+	/* 7 */ { "Log server", OT_IP, 4 },
+	/* 8 */ { "Cookie server", OT_IP, 4 },
+	/* 9 */ { "LPR server", OT_IP, 4 },
+	/* 10 */ { "Impress server", OT_IP, 4 },
+	/* 11 */ { "Resource location server", OT_IP, 4 },
+	/* 12 */ { "Host name", OT_STRING, 1 },
+	/* 13 */ { "Boot file size", OT_WORD, 2 },
+	/* 14 */ { "Merit dump file", OT_STRING, 1 },
+	/* 15 */ { "Domainname", OT_STRING, 1 },
+	/* 16 */ { "Swap server", OT_IP, 4 },
+	/* 17 */ { "Root path", OT_STRING, 1 },
+	/* 18 */ { "Extensions path", OT_STRING, 1 },
+	/* 19 */ ENUM("IP forwarding", enabledisable),
+	/* 20 */ ENUM("Non-local source routing", enabledisable),
+	/* 21 */ { "Policy filter", OT_IP_MASK, 8 },
+	/* 22 */ { "Maximum datagram reassembly size", OT_WORD, 2 },
+	/* 23 */ { "Default IP TTL", OT_BYTE, 1 },
+	/* 24 */ { "Path MTU aging timeout", OT_TIME, 4 },
+	/* 25 */ { "Path MTU plateau table", OT_WORD, 2 },
+	/* 26 */ { "Interface MTU", OT_WORD, 2 },
+	/* 27 */ ENUM("All subnets local", enabledisable),
+	/* 28 */ { "Broadcast address", OT_IP, 4 },
+	/* 29 */ ENUM("Perform mask discovery", enabledisable),
+	/* 30 */ ENUM("Mask supplier", enabledisable),
+	/* 31 */ ENUM("Perform router discovery", enabledisable),
+	/* 32 */ { "Router solicitation", OT_IP, 4 },
+	/* 33 */ { "Static route", OT_ROUTE, 8 },
+	/* 34 */ ENUM("Trailer encapsulation", enabledisable),
+	/* 35 */ { "ARP cache timeout", OT_TIME, 4 },
+	/* 36 */ ENUM("Ethernet encapsulation", ethernet_encapsulation),
+	/* 37 */ { "TCP default TTL", OT_BYTE, 1 },
+	/* 38 */ { "TCP keepalive interval", OT_TIME, 4 },
+	/* 39 */ ENUM("TCP keepalive garbage", enabledisable),
+	/* 40 */ { "NIS domain", OT_STRING, 1 },
+	/* 41 */ { "NIS servers", OT_IP, 4 },
+	/* 42 */ { "NTP servers", OT_IP, 4 },
+	/* 43 */ { "Vendor specific info", OT_HEX, 1 },
+	/* 44 */ { "NetBIOS name server", OT_IP, 4 },
+	/* 45 */ { "NetBIOS datagram distribution server", OT_IP, 4 },
+	/* 46 */ ENUM("NetBIOS node type", netbios_node_type),
+	/* 47 */ { "NetBIOS scope", OT_HEX, 1 },
+	/* 48 */ { "X Window System font server", OT_IP, 4 },
+	/* 49 */ { "X Window System display server", OT_IP, 4 },
+	/* 50 */ { "Request IP address", OT_IP, 4 },
+	/* 51 */ { "IP address leasetime", OT_TIME, 4 },
+	/* 52 */ ENUM("Option overload", option_overload),
+	/* 53 */ ENUM("DHCP message type", dhcp_message_types),
+	/* 54 */ { "Server identifier", OT_IP, 4 },
+	/* 55 */ { "Parameter Request List", OT_PARAMS, 1 },
+	/* 56 */ { "Message", OT_STRING, 1 },
+	/* 57 */ { "Maximum DHCP message size", OT_WORD, 2 },
+	/* 58 */ { "T1", OT_TIME, 4 },
+	/* 59 */ { "T2", OT_TIME, 4 },
+	/* 60 */ { "Vendor class identifier", OT_STRING, 1 },
+	/* 61 */ { "Client-identifier", OT_CLIENT_ID, 1 },
+	/* 62 */ { "Netware/IP domain name", OT_STRING, 1 },
+	/* 63 */ { "Netware/IP domain information", OT_HEX_ONLY, 1 },
+	/* 64 */ { "NIS+ domain", OT_STRING, 1 },
+	/* 65 */ { "NIS+ servers", OT_IP, 4 },
+	/* 66 */ { "TFTP server name", OT_STRING, 1 },
+	/* 67 */ { "Bootfile name", OT_STRING, 1 },
+	/* 68 */ { "Mobile IP home agent", OT_IP, 4 },
+	/* 69 */ { "SMTP server", OT_IP, 4 },
+	/* 70 */ { "POP3 server", OT_IP, 4 },
+	/* 71 */ { "NNTP server", OT_IP, 4 },
+	/* 72 */ { "WWW server", OT_IP, 4 },
+	/* 73 */ { "Finger server", OT_IP, 4 },
+	/* 74 */ { "IRC server", OT_IP, 4 },
+	/* 75 */ { "StreetTalk server", OT_IP, 4 },
+	/* 76 */ { "StreetTalk directory assistance server", OT_IP, 4 },
+	/* 77 */ { "User-class Identification", OT_HEX, 1 },
+	/* 78 */ { "SLP-directory-agent", OT_HEX, 1 },
+	/* 79 */ { "SLP-service-scope", OT_HEX, 1 },
+	/* 80 */ { "Naming Authority", OT_HEX, 1 },
+	/* 81 */ { "Client FQDN", OT_FQDN, 1 },
+	/* 82 */ { "Relay Agent Information", OT_AGENT_INFO, 1 },
+	/* 83 */ { "Agent Remote ID", OT_HEX, 1 },
+	/* 84 */ { "Agent Subnet Mask", OT_HEX, 1 },
+	/* 85 */ { "NDS server", OT_IP, 4 },
+	/* 86 */ { "NDS tree name", OT_STRING, 1 },
+	/* 87 */ { "NDS context", OT_STRING, 1 },
+	/* 88 */ { "IEEE 1003.1 POSIX", OT_HEX, 1 },
+	/* 89 */ { "FQDN", OT_HEX, 1 },
+	/* 90 */ { "Authentication", OT_HEX, 1 },
+	/* 91 */ { "Vines TCP/IP", OT_HEX, 1 },
+	/* 92 */ { "Server Selection", OT_HEX, 1 },
+	/* 93 */ { "Client System", OT_HEX, 1 },
+	/* 94 */ { "Client NDI", OT_HEX, 1 },
+	/* 95 */ { "LDAP", OT_HEX, 1 },
+	/* 96 */ { "IPv6 Transitions", OT_HEX, 1 },
+	/* 97 */ { "UUID/GUID", OT_HEX, 1 },
+	/* 98 */ { "UPA servers", OT_HEX, 1 },
+	/* 99 */ { "???", OT_HEX, 1 },
+	/* 100 */ { "Printer Name", OT_HEX, 1 },
+	/* 101 */ { "MDHCP", OT_HEX, 1 },
+	/* 102 */ { "???", OT_HEX, 1 },
+	/* 103 */ { "???", OT_HEX, 1 },
+	/* 104 */ { "???", OT_HEX, 1 },
+	/* 105 */ { "???", OT_HEX, 1 },
+	/* 106 */ { "???", OT_HEX, 1 },
+	/* 107 */ { "???", OT_HEX, 1 },
+	/* 108 */ { "Swap Path", OT_HEX, 1 },
+	/* 109 */ { "???", OT_HEX, 1 },
+	/* 110 */ { "IPX Compatability", OT_HEX, 1 },
+	/* 111 */ { "???", OT_HEX, 1 },
+	/* 112 */ { "Netinfo Address", OT_HEX, 1 },
+	/* 113 */ { "Netinfo Tag", OT_HEX, 1 },
+	/* 114 */ { "URL", OT_HEX, 1 },
+	/* 115 */ { "DHCP Failover", OT_HEX, 1 },
+	/* 116 */ { "DHCP Autoconfiguration", OT_HEX, 1 },
+	/* 117 */ { "Name Service Search", OT_HEX, 1 },
+	/* 118 */ { "Subnet selection", OT_HEX, 1 },
+	/* 119 */ { "Domain Search", OT_HEX, 1 },
+	/* 120 */ { "SIP Servers DHCP Option", OT_HEX, 1 },
+	/* 121 */ { "Classless Static Route", OT_HEX, 1 },
+	/* 122 */ { "???", OT_HEX, 1 },
+	/* 123 */ { "???", OT_HEX, 1 },
+	/* 124 */ { "???", OT_HEX, 1 },
+	/* 125 */ { "???", OT_HEX, 1 },
+	/* 126 */ { "Extension", OT_HEX, 1 },
+	/* 127 */ { "Extension", OT_HEX, 1 },
+	/* 128 */ { "???", OT_HEX, 1 },
+	/* 129 */ { "???", OT_HEX, 1 },
+	/* 130 */ { "???", OT_HEX, 1 },
+	/* 131 */ { "???", OT_HEX, 1 },
+	/* 132 */ { "???", OT_HEX, 1 },
+	/* 133 */ { "???", OT_HEX, 1 },
+	/* 134 */ { "???", OT_HEX, 1 },
+	/* 135 */ { "???", OT_HEX, 1 },
+	/* 136 */ { "???", OT_HEX, 1 },
+	/* 137 */ { "???", OT_HEX, 1 },
+	/* 138 */ { "???", OT_HEX, 1 },
+	/* 139 */ { "???", OT_HEX, 1 },
+	/* 140 */ { "???", OT_HEX, 1 },
+	/* 141 */ { "???", OT_HEX, 1 },
+	/* 142 */ { "???", OT_HEX, 1 },
+	/* 143 */ { "???", OT_HEX, 1 },
+	/* 144 */ { "HP - TFTP file", OT_HEX, 1 },
+	/* 145 */ { "???", OT_HEX, 1 },
+	/* 146 */ { "???", OT_HEX, 1 },
+	/* 147 */ { "???", OT_HEX, 1 },
+	/* 148 */ { "???", OT_HEX, 1 },
+	/* 149 */ { "???", OT_HEX, 1 },
+	/* 150 */ { "CiscoCallManagerTFTP", OT_IP, 4 },
+	/* 151 */ { "???", OT_HEX, 1 },
+	/* 152 */ { "???", OT_HEX, 1 },
+	/* 153 */ { "???", OT_HEX, 1 },
+	/* 154 */ { "???", OT_HEX, 1 },
+	/* 155 */ { "???", OT_HEX, 1 },
+	/* 156 */ { "???", OT_HEX, 1 },
+	/* 157 */ { "???", OT_HEX, 1 },
+	/* 158 */ { "???", OT_HEX, 1 },
+	/* 159 */ { "???", OT_HEX, 1 },
+	/* 160 */ { "???", OT_HEX, 1 },
+	/* 161 */ { "???", OT_HEX, 1 },
+	/* 162 */ { "???", OT_HEX, 1 },
+	/* 163 */ { "???", OT_HEX, 1 },
+	/* 164 */ { "???", OT_HEX, 1 },
+	/* 165 */ { "???", OT_HEX, 1 },
+	/* 166 */ { "???", OT_HEX, 1 },
+	/* 167 */ { "???", OT_HEX, 1 },
+	/* 168 */ { "???", OT_HEX, 1 },
+	/* 169 */ { "???", OT_HEX, 1 },
+	/* 170 */ { "???", OT_HEX, 1 },
+	/* 171 */ { "???", OT_HEX, 1 },
+	/* 172 */ { "???", OT_HEX, 1 },
+	/* 173 */ { "???", OT_HEX, 1 },
+	/* 174 */ { "???", OT_HEX, 1 },
+	/* 175 */ { "???", OT_HEX, 1 },
+	/* 176 */ { "???", OT_HEX, 1 },
+	/* 177 */ { "???", OT_HEX, 1 },
+	/* 178 */ { "???", OT_HEX, 1 },
+	/* 179 */ { "???", OT_HEX, 1 },
+	/* 180 */ { "???", OT_HEX, 1 },
+	/* 181 */ { "???", OT_HEX, 1 },
+	/* 182 */ { "???", OT_HEX, 1 },
+	/* 183 */ { "???", OT_HEX, 1 },
+	/* 184 */ { "???", OT_HEX, 1 },
+	/* 185 */ { "???", OT_HEX, 1 },
+	/* 186 */ { "???", OT_HEX, 1 },
+	/* 187 */ { "???", OT_HEX, 1 },
+	/* 188 */ { "???", OT_HEX, 1 },
+	/* 189 */ { "???", OT_HEX, 1 },
+	/* 190 */ { "???", OT_HEX, 1 },
+	/* 191 */ { "???", OT_HEX, 1 },
+	/* 192 */ { "???", OT_HEX, 1 },
+	/* 193 */ { "???", OT_HEX, 1 },
+	/* 194 */ { "???", OT_HEX, 1 },
+	/* 195 */ { "???", OT_HEX, 1 },
+	/* 196 */ { "???", OT_HEX, 1 },
+	/* 197 */ { "???", OT_HEX, 1 },
+	/* 198 */ { "???", OT_HEX, 1 },
+	/* 199 */ { "???", OT_HEX, 1 },
+	/* 200 */ { "???", OT_HEX, 1 },
+	/* 201 */ { "???", OT_HEX, 1 },
+	/* 202 */ { "???", OT_HEX, 1 },
+	/* 203 */ { "???", OT_HEX, 1 },
+	/* 204 */ { "???", OT_HEX, 1 },
+	/* 205 */ { "???", OT_HEX, 1 },
+	/* 206 */ { "???", OT_HEX, 1 },
+	/* 207 */ { "???", OT_HEX, 1 },
+	/* 208 */ { "???", OT_HEX, 1 },
+	/* 209 */ { "???", OT_HEX, 1 },
+	/* 210 */ { "Authenticate", OT_HEX, 1 },
+	/* 211 */ { "???", OT_HEX, 1 },
+	/* 212 */ { "???", OT_HEX, 1 },
+	/* 213 */ { "???", OT_HEX, 1 },
+	/* 214 */ { "???", OT_HEX, 1 },
+	/* 215 */ { "???", OT_HEX, 1 },
+	/* 216 */ { "???", OT_HEX, 1 },
+	/* 217 */ { "???", OT_HEX, 1 },
+	/* 218 */ { "???", OT_HEX, 1 },
+	/* 219 */ { "???", OT_HEX, 1 },
+	/* 220 */ { "???", OT_HEX, 1 },
+	/* 221 */ { "???", OT_HEX, 1 },
+	/* 222 */ { "???", OT_HEX, 1 },
+	/* 223 */ { "???", OT_HEX, 1 },
+	/* 224 */ { "???", OT_HEX, 1 },
+	/* 225 */ { "???", OT_HEX, 1 },
+	/* 226 */ { "???", OT_HEX, 1 },
+	/* 227 */ { "???", OT_HEX, 1 },
+	/* 228 */ { "???", OT_HEX, 1 },
+	/* 229 */ { "???", OT_HEX, 1 },
+	/* 230 */ { "???", OT_HEX, 1 },
+	/* 231 */ { "???", OT_HEX, 1 },
+	/* 232 */ { "???", OT_HEX, 1 },
+	/* 233 */ { "???", OT_HEX, 1 },
+	/* 234 */ { "???", OT_HEX, 1 },
+	/* 235 */ { "???", OT_HEX, 1 },
+	/* 236 */ { "???", OT_HEX, 1 },
+	/* 237 */ { "???", OT_HEX, 1 },
+	/* 238 */ { "???", OT_HEX, 1 },
+	/* 239 */ { "???", OT_HEX, 1 },
+	/* 240 */ { "???", OT_HEX, 1 },
+	/* 241 */ { "???", OT_HEX, 1 },
+	/* 242 */ { "???", OT_HEX, 1 },
+	/* 243 */ { "???", OT_HEX, 1 },
+	/* 244 */ { "???", OT_HEX, 1 },
+	/* 245 */ { "???", OT_HEX, 1 },
+	/* 246 */ { "???", OT_HEX, 1 },
+	/* 247 */ { "???", OT_HEX, 1 },
+	/* 248 */ { "???", OT_HEX, 1 },
+	/* 249 */ { "MSFT - Classless route", OT_HEX, 1 },
+	/* 250 */ { "???", OT_HEX, 1 },
+	/* 251 */ { "???", OT_HEX, 1 },
+	/* 252 */ { "MSFT - WinSock Proxy Auto Detect", OT_STRING, 1 },
+	/* 253 */ { "???", OT_HEX, 1 },
+	/* 254 */ { "???", OT_HEX, 1 },
+	/* 255 */ { "End", OT_END, 0 }
+};
+_Static_assert(sizeof(dhcp_options) / sizeof(dhcp_options[0]) == 256,
+	"dhcp_options[] must have all 256 codes");
+
 /* Copied from RFC1700 */
 const char *htypes[] = {
 	 /* 0 */ "wrong specified",
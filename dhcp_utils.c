@@ -3,9 +3,10 @@
 
 #include "dhcprelya.h"
 
-/* returns offset of option start or -1 if malformed packet detected or -2 if nothing found */
-int
-find_opt_offset(uint8_t *start, uint8_t option_id, int max_len, int is_subopt)
+/* returns offset of option_id or End-Of-Options mark (255), whichever is
+   first, or -1 if malformed packet detected */
+static int
+opt_walk(uint8_t *start, uint8_t option_id, int max_len, int is_subopt)
 {
 	uint8_t *p;
 	int passed = 0;
@@ -21,10 +22,22 @@ find_opt_offset(uint8_t *start, uint8_t option_id, int max_len, int is_subopt)
 
 	if (passed > max_len ||
 		(passed == max_len && *p != 255) ||
-		(!is_subopt && passed + 2 + p[1] >= max_len))
+		(!is_subopt && *p != 255 && passed + 2 + p[1] >= max_len))
+		return -1;		// Malformed packet
+
+	return passed;
+}
+
+/* returns offset of option start or -1 if malformed packet detected or -2 if nothing found */
+int
+find_opt_offset(uint8_t *start, uint8_t option_id, int max_len, int is_subopt)
+{
+	int passed;
+
+	if ((passed = opt_walk(start, option_id, max_len, is_subopt)) < 0)
 		return -1;		// Malformed packet
 
-	if (*p == option_id)
+	if (start[passed] == option_id)
 		return passed;
 
 	return -2;			// Nothing found
@@ -49,6 +62,25 @@ find_option(struct dhcp_packet *dhcp, uint8_t option_id)
 	return dhcp->options + DHCP_COOKIE_LEN + passed;
 }
 
+/* returns: NULL if malformed packet detected. Otherwise a pointer to option_id
+   option or to End-Of-Options mark (255) if there is no such option. It's one
+   pass to check an option is there and to find where to append it. */
+uint8_t *
+find_option_or_end(struct dhcp_packet *dhcp, uint8_t option_id)
+{
+	int passed, max_len;
+
+	if (dhcp == NULL)
+		return NULL;
+	max_len = max_packet_size - ETHER_HDR_LEN - DHCP_FIXED_LEN - DHCP_COOKIE_LEN;
+	passed = opt_walk(dhcp->options + DHCP_COOKIE_LEN, option_id, max_len, 0);
+
+	if (passed < 0)
+		return NULL;
+
+	return dhcp->options + DHCP_COOKIE_LEN + passed;
+}
+
 uint8_t *
 find_suboption(struct dhcp_packet *dhcp, uint8_t option_id, uint8_t suboption_id)
 {
@@ -155,3 +187,52 @@ get_dhcp_len(struct dhcp_packet *dhcp)
 
 	return p - ((uint8_t *)dhcp) + 1;
 }
+
+/* Check a captured client frame (Ethernet, IP, UDP, DHCP) is sane */
+int
+sanity_check(const char *packet, const unsigned len)
+{
+	struct ether_header *eh;
+	struct ip *ip;
+	struct udphdr *udp;
+	uint8_t *p;
+	int passed;
+
+	eh = (struct ether_header *)packet;
+	ip = (struct ip *)(packet + ETHER_HDR_LEN);
+	udp = (struct udphdr *)(packet + ETHER_HDR_LEN + sizeof(struct ip));
+
+	if (len > max_packet_size) {
+		logd(LOG_ERR, "length too big -- packet discarded");
+		return 0;
+	}
+	if (len < ETHER_HDR_LEN + DHCP_FIXED_LEN) {
+		logd(LOG_ERR, "length too little -- packet discarded");
+		return 0;
+	}
+	if (ntohs(eh->ether_type) != ETHERTYPE_IP) {
+		logd(LOG_ERR, "wrong ether type -- packet discarded");
+		return 0;
+	}
+	if (ntohs(udp->uh_ulen) < DHCP_FIXED_NON_UDP + DHCP_COOKIE_LEN + 1) {
+		logd(LOG_ERR, "not enough DHCP data -- packet ignore");
+		return 0;
+	}
+
+	p = ((struct dhcp_packet *)(packet + ETHER_HDR_LEN + DHCP_UDP_OVERHEAD))->options + DHCP_COOKIE_LEN;
+	passed = p - (uint8_t *)packet;
+	while (passed < len && *p != 255) {
+		if (*p == 0)
+			p++;
+		else
+			p += p[1] + 2;
+		passed = p - (uint8_t *)packet;
+	}
+	if ((passed == len && *p != 255) ||
+		(passed > len)) {
+		logd(LOG_ERR, "malformed dhcp packet (can't find option 255) -- packet ignore");
+		return 0;
+	}
+
+	return 1;
+}
@@ -48,17 +48,24 @@
 #include <sys/queue.h>
 
 #include "dhcprelya.h"
+#include "metrics.h"
 
 #define VERSION "6.1"
+#define OPTSTRING "A:c:df:hi:L:p:r:R:w:x:"
 
 /* options */
 /* globals (can check in modules) */
 unsigned debug = 0, max_packet_size = 1400;;
 /* local */
-static unsigned max_hops = 4;
+unsigned max_hops = 4;
 static char plugin_base[80];
+static int track_transactions = 0, drop_unsolicited = 1;
+static unsigned transaction_timeout = 10, transaction_table_size = 16384;
+static char metrics_file[MAXPATHLEN], metrics_listen[64];
+static char log_file[MAXPATHLEN];
+static unsigned servers_weight = 1;	/* for interfaces of next servers lines */
+static unsigned log_rate = LOG_RATE_DEFAULT, log_queue_size = LOG_QUEUE_DEFAULT;
 
-STAILQ_HEAD(queue_head, queue) q_head;
 STAILQ_HEAD(bindmap, ip_binding_map) ip_binding_map_head;
 
 uint8_t plugins_number = 0;
@@ -70,9 +77,7 @@ struct interface *ifs[IF_MAX];
 struct dhcp_server *servers[SERVERS_MAX];
 int if_num = 0;			/* interfaces number */
 int srv_num = 0;		/* servers number */
-unsigned int queue_size = 0, rps_limit = 0;
-pthread_mutex_t queue_lock;
-pthread_cond_t queue_cond;
+unsigned int rps_limit = 0;
 plugin_options_head_t *options_heads[MAX_PLUGINS];
 
 char pcapfilter[4096] = "\0";
@@ -87,6 +92,8 @@ usage(char *prgname)
 	fprintf(stderr, "Version %s.\n", VERSION);
 	fprintf(stderr, "Usage:\n%s [-d] [-p<pidfile>] -f <config_file>\n", prgname);
 	fprintf(stderr, "or ISC compatible mode:\n%s [-d] [-x \"<pcap filter>\"] [-p<pidfile>] -A <packet_size> -c <max_hops> -i <ifname>... <dhcp_server>...\n", prgname);
+	fprintf(stderr, "Replay pcap files instead of interfaces (add to the above):\n"
+		"\t-r <ifname>:<file.pcap>... [-R <servers.pcap>] [-w <output_prefix>] [-L <passes>]\n");
 	exit(EX_OK);
 }
 
@@ -109,6 +116,45 @@ process_error(int ret_code, char *fmt,...)
 	va_end(ap);
 }
 
+int
+find_server(const struct sockaddr_in *addr)
+{
+	int i;
+
+	for (i = 0; i < srv_num; i++) {
+		/* Servers on one address with different ports are different
+		 * servers, as in add_server() */
+		if (addr->sin_addr.s_addr == servers[i]->sockaddr.sin_addr.s_addr &&
+		    addr->sin_port == servers[i]->sockaddr.sin_port)
+			break;
+	}
+
+	return i;
+}
+
+/* Count a round-trip time of a server answer */
+void
+update_server_rtt(int srv_idx, const struct timespec *sent,
+	const struct timespec *now)
+{
+	struct dhcp_server *srv;
+	long rtt;
+
+	if (srv_idx == srv_num)
+		return;
+	srv = servers[srv_idx];
+	rtt = (now->tv_sec - sent->tv_sec) * 1000000 +
+		(now->tv_nsec - sent->tv_nsec) / 1000;
+	srv->replies++;
+	srv->rtt_last = rtt;
+	if (srv->rtt_avg == 0)
+		srv->rtt_avg = rtt;
+	else
+		srv->rtt_avg = (srv->rtt_avg * 7 + rtt) / 8;
+	if (srv->rtt_max < rtt)
+		srv->rtt_max = rtt;
+}
+
 int
 find_interface(const ip_addr_t addr)
 {
@@ -156,9 +202,8 @@ open_interface(const char *iname)
 {
 	int i, j, x = 1;
 	struct ifreq ifr;
-	struct bpf_program fp;
 	struct sockaddr_in baddr;
-	char errbuf[PCAP_ERRBUF_SIZE], file[32], buf[256], filtstr[256];
+	char file[32], buf[256];
 
 	if (if_num >= IF_MAX - 1)
 		process_error(EX_RES, "too many interfaces");
@@ -186,16 +231,33 @@ open_interface(const char *iname)
 	ifs[if_num]->idx = if_num;
 	strlcpy(ifs[if_num]->name, iname, INTF_NAME_LEN);
 
-	if (!get_mac(iname, (char *)ifs[if_num]->mac) || 
+	if (replay_mode) {
+		/* Not a real interface. Take an address from bind_ip. */
+		if (get_bound_ip(iname) == NULL) {
+			logd(LOG_ERR, "Set an address for %s with bind_ip to replay", iname);
+			free(ifs[if_num]);
+			return 0;
+		}
+		ifs[if_num]->ip = *get_bound_ip(iname);
+		memcpy(ifs[if_num]->mac, "\x02\0\0\0\0", 5);
+		ifs[if_num]->mac[5] = if_num;
+		ifs[if_num]->fd = ifs[if_num]->bpf = -1;
+		ifs[if_num]->cap = NULL;
+	} else if (!get_mac(iname, (char *)ifs[if_num]->mac) || 
 		!get_ip(iname, &ifs[if_num]->ip, get_bound_ip(iname))) {
 		free(ifs[if_num]);
 		return 0;
 	}
+	ifs[i]->weight = 1;
 	ifs[i]->srv_num = 1;
 	ifs[i]->srvrs = malloc(ifs[i]->srv_num * sizeof(int));
 	if (ifs[i]->srvrs == NULL)
 		process_error(EX_MEM, "malloc");
 	ifs[i]->srvrs[0] = srv_num - 1;
+	if (replay_mode) {
+		if_num++;
+		return 1;
+	}
 
 	/* Looking for a free BPF device and open it */
 	for (j = 0; j < 255; j++) {
@@ -210,25 +272,9 @@ open_interface(const char *iname)
 	if (ioctl(ifs[if_num]->bpf, BIOCSETIF, (char *)&ifr) < 0)
 		process_error(EX_RES, "Can't BIOCSETIF");
 
-	if ((ifs[if_num]->cap = pcap_open_live(iname, max_packet_size, 0, 100, errbuf)) == NULL)
-		process_error(EX_RES, "pcap_open_live(%s): %s", iname, errbuf);
-	
-	if( strlen(pcapfilter) > 0 ){
-		sprintf(filtstr, "udp and dst port bootps and not ether src %s and %s",
-				ether_ntoa_r((struct ether_addr*)ifs[if_num]->mac, buf),
-				pcapfilter
-			);
-	}
-	else {
-		sprintf(filtstr, "udp and dst port bootps and not ether src %s",
-			ether_ntoa_r((struct ether_addr*)ifs[if_num]->mac, buf));
-	}
-	
-	
-	if (pcap_compile(ifs[if_num]->cap, &fp, filtstr, 0, 0) < 0)
-		process_error(EX_RES, "pcap_compile");
-	if (pcap_setfilter(ifs[if_num]->cap, &fp) < 0)
-		process_error(EX_RES, "pcap_setfilter");
+	/* A buffer size and a filter are set by capture_init() when the config is read */
+	if ((ifs[if_num]->cap = capture_open(ifs[if_num], 0)) == NULL)
+		process_error(EX_RES, "Can't capture on %s", iname);
 
 	if ((ifs[if_num]->fd = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0)
 		process_error(EX_RES, "socket for listener at %s: %s", iname, strerror(errno));
@@ -310,52 +356,103 @@ open_server(const char *server_spec)
 	return 1;
 }
 
+/* Open a server if it's not opened yet. Returns its index or -1. */
 int
-sanity_check(const char *packet, const unsigned len)
+add_server(const char *server_spec)
 {
-	struct ether_header *eh;
-	struct ip *ip;
-	struct udphdr *udp;
-	uint8_t *p;
-	int passed;
-
-	eh = (struct ether_header *)packet;
-	ip = (struct ip *)(packet + ETHER_HDR_LEN);
-	udp = (struct udphdr *)(packet + ETHER_HDR_LEN + sizeof(struct ip));
-
-	if (len > max_packet_size) {
-		logd(LOG_ERR, "length too big -- packet discarded");
-		return 0;
+	int i;
+
+	if (!open_server(server_spec))
+		return -1;
+	for (i = 0; i < srv_num - 1; i++) {
+		if (servers[i]->sockaddr.sin_addr.s_addr == servers[srv_num - 1]->sockaddr.sin_addr.s_addr &&
+		    servers[i]->sockaddr.sin_port == servers[srv_num - 1]->sockaddr.sin_port) {
+			srv_num--;
+			free(servers[srv_num]->name);
+			free(servers[srv_num]);
+			return i;
+		}
 	}
-	if (len < ETHER_HDR_LEN + DHCP_FIXED_LEN) {
-		logd(LOG_ERR, "length too little -- packet discarded");
-		return 0;
+	return srv_num - 1;
+}
+
+/* Check a client frame and run client_request plugins. Returns a queue
+ * entry or NULL if the packet is dropped. */
+struct queue *
+client_packet(struct interface *intf, const struct pcap_pkthdr *pcap_header,
+	const u_char *packet)
+{
+	int i, rc, ignore;
+	struct queue *q;
+	struct timespec hs, rt;
+	struct packet_headers headers;
+	size_t len;
+
+	if (!sanity_check((char *)packet, pcap_header->caplen)) {
+		METRIC_DROP(DROP_SANITY);
+		return NULL;
 	}
-	if (ntohs(eh->ether_type) != ETHERTYPE_IP) {
-		logd(LOG_ERR, "wrong ether type -- packet discarded");
-		return 0;
+
+	/* Discard BOOTREPLY from client */
+	if (((struct dhcp_packet *)(packet + ETHER_HDR_LEN + DHCP_UDP_OVERHEAD))->op == BOOTREPLY) {
+		METRIC_DROP(DROP_BOOTREPLY);
+		return NULL;
 	}
-	if (ntohs(udp->uh_ulen) < DHCP_FIXED_NON_UDP + DHCP_COOKIE_LEN + 1) {
-		logd(LOG_ERR, "not enough DHCP data -- packet ignore");
-		return 0;
+
+	/* A full queue drops a request before plugins see it */
+	if ((q = queue_alloc(intf)) == NULL) {
+		METRIC_INC(queue_drops[intf->idx]);
+		METRIC_DROP(DROP_QUEUE_FULL);
+		return NULL;
+	}
+	len = pcap_header->caplen - sizeof(struct packet_headers);
+	memcpy(&headers, packet, sizeof(struct packet_headers));
+	memcpy(&q->dhcp, packet + sizeof(struct packet_headers), len);
+	bzero((char *)&q->dhcp + len, sizeof(struct dhcp_packet) - len);
+	q->qclass = queue_class(&q->dhcp);
+	if (shed_enabled && !shed_admit(intf, &q->dhcp, q->qclass)) {
+		queue_cancel(q);
+		return NULL;
 	}
 
-	p = ((struct dhcp_packet *)(packet + ETHER_HDR_LEN + DHCP_UDP_OVERHEAD))->options + DHCP_COOKIE_LEN;
-	passed = p - (uint8_t *)packet;
-	while (passed < len && *p != 255) {
-		if (*p == 0)
-			p++;
-		else
-			p += p[1] + 2;
-		passed = p - (uint8_t *)packet;
+	/* If a plugin returns 0, ignore the packet */
+	ignore = 0;
+	for (i = 0; i < plugins_number; i++) {
+		if (plugins[i]->client_request) {
+			latency_start(&hs);
+			rc = plugins[i]->client_request(intf, &q->dhcp, &headers);
+			latency_end(METRIC_HOOK(i, HOOK_CLIENT_REQUEST), &hs);
+			if (rc == 0) {
+				logd(LOG_WARNING, "The packet rejected by %s plugin", plugins[i]->name);
+				METRIC_INC(plugin_rejects[i]);
+				ignore = 1;
+				break;
+			}
+		}
 	}
-	if ((passed == len && *p != 255) ||
-		(passed > len)) {
-		logd(LOG_ERR, "malformed dhcp packet (can't find option 255) -- packet ignore");
-		return 0;
+	if (ignore) {
+		queue_cancel(q);
+		METRIC_DROP(DROP_PLUGIN);
+		return NULL;
 	}
 
-	return 1;
+	q->ip_dst = headers.ip.ip_dst.s_addr;
+	if (latency_stats) {
+		clock_gettime(CLOCK_MONOTONIC, &q->ts_enqueue);
+		/* pcap timestamp is a wall clock time. A replayed one is
+		 * meaningless. */
+		q->capture_ns = 0;
+		if (!replay_mode) {
+			clock_gettime(CLOCK_REALTIME, &rt);
+			q->capture_ns = timespec_ns(&rt) -
+				((int64_t)pcap_header->ts.tv_sec * 1000000000 +
+				pcap_header->ts.tv_usec * 1000);
+			if (q->capture_ns < 0)
+				q->capture_ns = 0;
+		}
+		hist_add(METRIC_STAGE(STAGE_CAPTURE), q->capture_ns);
+	}
+	return q;
 }
 
 /* Listen an interface for a DHCP packet (from client) and store it in a
@@ -363,23 +460,40 @@ sanity_check(const char *packet, const unsigned len)
 void *
 listener(void *param)
 {
-	int i, n, ignore = 0, packet_count = 0;
+	int n, packet_count = 0;
 	struct interface *intf = param;
 	struct pcap_pkthdr *pcap_header;
 	const u_char *packet;
 	struct queue *q;
-	struct timespec tv, last_count_reset_tv = {0, 0};
-	struct packet_headers headers;
-	struct dhcp_packet dhcp;
+	struct timespec tv, last_count_reset_tv = {0, 0}, stats_tv = {0, 0};
+	pcap_t *draining = NULL;
 
+	metrics_thread_register(intf->idx);
 	while (1) {
-		if ((n = pcap_next_ex(intf->cap, &pcap_header, &packet)) > 0) {
+		/* Packets left in a handle replaced by capture_tune() go first */
+		if (draining != NULL &&
+		    (n = pcap_next_ex(draining, &pcap_header, &packet)) <= 0) {
+			pcap_close(draining);
+			draining = NULL;
+		}
+		if (draining == NULL)
+			n = pcap_next_ex(intf->cap, &pcap_header, &packet);
+		/* Export pcap drop counters and tune a buffer once a second */
+		clock_gettime(CLOCK_MONOTONIC_FAST, &tv);
+		if (tv.tv_sec != stats_tv.tv_sec) {
+			metrics_pcap_update(intf);
+			if (draining == NULL)
+				draining = capture_tune(intf);
+			stats_tv = tv;
+		}
+		if (n > 0) {
+			METRIC_INC(if_in[intf->idx]);
 			/* Drop a packet we got too quickly if we have a RPS
 			 * limit */
 			if (rps_limit && packet_count++ > rps_limit) {
-				clock_gettime(CLOCK_MONOTONIC_FAST, &tv);
 				if (DeltaUSec(tv, last_count_reset_tv) < 1000000) {
 					logd(LOG_WARNING, "The packet on interface %s droped due to RPS limit", intf->name);
+					METRIC_DROP(DROP_RPS_LIMIT);
 					continue;
 				} else {
 					memcpy(&last_count_reset_tv, &tv, sizeof(struct timeval));
@@ -387,44 +501,10 @@ listener(void *param)
 				}
 			}
 
-			if (!sanity_check((char *)packet, pcap_header->caplen))
-				continue;
-
-			/* Discard BOOTREPLY from client */
-			if (((struct dhcp_packet *)(packet + ETHER_HDR_LEN + DHCP_UDP_OVERHEAD))->op == BOOTREPLY)
-				continue;
-
-			memcpy(&headers, packet, sizeof(struct packet_headers));
-			bzero(&dhcp, sizeof(struct dhcp_packet));
-			memcpy(&dhcp, packet + sizeof(struct packet_headers), pcap_header->caplen - sizeof(struct packet_headers));
-
-			/* If a plugin returns 0, ignore the packet */
-			for (i = 0; i < plugins_number; i++) {
-				if (plugins[i]->client_request)
-					if (plugins[i]->client_request(intf, &dhcp, &headers) == 0) {
-						logd(LOG_WARNING, "The packet rejected by %s plugin", plugins[i]->name);
-						ignore = 1;
-						break;
-					}
-			}
-			if (ignore)
-				continue;
-
-			q = malloc(sizeof(struct queue));
-			if (q == NULL) {
-				logd(LOG_ERR, "malloc error");
+			if ((q = client_packet(intf, pcap_header, packet)) == NULL)
 				continue;
-			}
 
-			memcpy(&q->dhcp, &dhcp, sizeof(struct dhcp_packet));
-			q->if_idx = intf->idx;
-			q->ip_dst = headers.ip.ip_dst.s_addr;
-
-			pthread_mutex_lock(&queue_lock);
-			STAILQ_INSERT_TAIL(&q_head, q, entries);
-			queue_size++;
-			pthread_cond_signal(&queue_cond);
-			pthread_mutex_unlock(&queue_lock);
+			queue_put(q);
 		} else {
 			/* Sleep if an error. It prevent us from 100% CPU
 			 * load if there is an interface problem. */
@@ -433,151 +513,209 @@ listener(void *param)
 	}
 }
 
-/* Only one packet from server is processed at once
- * 
- */
-void *
-process_server_answer(void *param)
+/* Process a packet from a server: check it, run plugins, build headers and
+ * send it to a client. dhcp is a buffer of struct dhcp_packet size. */
+void
+server_packet(struct sockaddr_in *from_addr, struct dhcp_packet *dhcp, size_t psize)
 {
-	struct sockaddr_in from_addr;
-	struct dhcp_packet dhcp;
 	struct packet_headers headers;
 	uint8_t *packet = NULL;
 	char pbuf[11 + 16 + 19];
-	socklen_t from_len = sizeof(from_addr);
-	int i, j, fdmax = 0, ignore, if_idx;
-	size_t len, psize = 0;
-	fd_set fds;
+	int j, ignore, rc, if_idx, srv_idx;
+	ssize_t n;
+	size_t len;
+	struct xid_entry xe;
+	struct timespec now, received, hs;
 
-	while (1) {
-		FD_ZERO(&fds);
-		for (i = 0; i < if_num; i++) {
-			FD_SET(ifs[i]->fd, &fds);
-			if (fdmax < ifs[i]->fd)
-				fdmax = ifs[i]->fd;
+	if (psize < DHCP_MIN_SIZE) {
+		logd(LOG_WARNING, "A little data from server: %zu < %d", psize, DHCP_MIN_SIZE);
+		METRIC_DROP(DROP_SHORT_ANSWER);
+		return;
+	}
+	latency_start(&received);
+	/* Is it an answer for our request? Check it before plugins, it's
+	 * cheap. */
+	srv_idx = find_server(from_addr);
+	if (srv_idx < srv_num)
+		METRIC_INC(srv_in[srv_idx]);
+	xe.if_idx = -1;
+	if (track_transactions) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (xid_table_lookup(dhcp, &xe, &now)) {
+			update_server_rtt(srv_idx, &xe.sent, &now);
+			if (latency_stats)
+				latency_add(METRIC_STAGE(STAGE_SERVER), &xe.sent, &now);
+			fanout_server_answered(srv_idx, dhcp, &now);
+		} else {
+			xe.if_idx = -1;
+			if (drop_unsolicited) {
+				logd(LOG_DEBUG, "Unsolicited answer from %s XID %s. Dropped.",
+					inet_ntop(AF_INET, &from_addr->sin_addr, pbuf, sizeof(pbuf)),
+					print_xid(dhcp->xid, pbuf + 16));
+				METRIC_DROP(DROP_UNSOLICITED);
+				return;
+			}
 		}
+	}
+	/* If a plugin returns 0, stop processing and do not send the packet */
+	for (j = 0; j < plugins_number; j++) {
+		if (plugins[j]->server_answer) {
+			latency_start(&hs);
+			rc = plugins[j]->server_answer(from_addr, dhcp);
+			latency_end(METRIC_HOOK(j, HOOK_SERVER_ANSWER), &hs);
+			if (rc == 0) {
+				logd(LOG_WARNING, "The packet rejected by %s plugin",
+					plugins[j]->name);
+				METRIC_INC(plugin_rejects[j]);
+				METRIC_DROP(DROP_PLUGIN);
+				return;
+			}
+		}
+	}
 
-		if (select(fdmax + 1, &fds, NULL, NULL, NULL)) {
-			for (i = 0; i < if_num; i++)
-				if (FD_ISSET(ifs[i]->fd, &fds)) {
-					bzero(&from_addr, sizeof(from_addr));
-					/* from_addr.sin_family=AF_INET;
-					 * from_addr.sin_port = bootps_port; */
-					from_len = sizeof(from_addr);
-
-					psize = recvfrom(ifs[i]->fd, (void *)&dhcp,
-								max_packet_size - ETHER_HDR_LEN - DHCP_UDP_OVERHEAD, 0,
-								(struct sockaddr *)&from_addr, &from_len);
-					if (psize < DHCP_MIN_SIZE) {
-						logd(LOG_WARNING, "A little data from server: %zu < %d", psize, DHCP_MIN_SIZE);
-						continue;
-					}
-					/* If a plugin returns 0, stop processing and
-					 * do not send the packet */
-					ignore = 0;
-					for (j = 0; j < plugins_number; j++) {
-						if (plugins[j]->server_answer)
-							if (plugins[j]->server_answer(&from_addr, &dhcp) == 0) {
-								logd(LOG_WARNING, "The packet rejected by %s plugin",
-									plugins[j]->name);
-								ignore = 1;
-								break;
-							}
-					}
+	psize = get_dhcp_len(dhcp);
+	if (!psize) {
+		logd(LOG_ERR, "server_answer: plugins generated wrong packet. Dropped.");
+		METRIC_DROP(DROP_PLUGIN);
+		return;
+	}
 
-					psize = get_dhcp_len(&dhcp);
-					if (!psize) {
-						logd(LOG_ERR, "server_answer: plugins generated wrong packet. Dropped.");
-						ignore = 1;
-					}
+	bzero(&headers, sizeof(struct packet_headers));
+	/* Prefer the interface the request came from if a few interfaces
+	 * have the same address */
+	if (xe.if_idx != -1 && ifs[xe.if_idx]->ip == *((ip_addr_t *)&dhcp->giaddr))
+		if_idx = xe.if_idx;
+	else
+		if_idx = find_interface(*((ip_addr_t *)&dhcp->giaddr));
+	if (if_idx == if_num) {
+		logd(LOG_ERR, "Destination interface not found for: %s",
+			inet_ntop(AF_INET, &dhcp->giaddr, pbuf,
+			sizeof(pbuf)));
+		METRIC_DROP(DROP_NO_INTERFACE);
+		return;
+	}
 
-					if (ignore)
-						continue;
+	memcpy(headers.eh.ether_shost, ifs[if_idx]->mac, ETHER_ADDR_LEN);
+	headers.eh.ether_type = htons(ETHERTYPE_IP);
+	headers.ip.ip_v = IPVERSION;
+	headers.ip.ip_hl = 5;		/* IP header length is 5 word (no options) */
+	headers.ip.ip_tos = IPTOS_LOWDELAY;
+	headers.ip.ip_len = htons(sizeof(struct ip) + sizeof(struct udphdr) + psize);
+	headers.ip.ip_id = 0;
+	headers.ip.ip_off = 0;
+	headers.ip.ip_ttl = 16;
+	headers.ip.ip_p = IPPROTO_UDP;
+	headers.ip.ip_sum = 0;
+	memcpy(&headers.ip.ip_src, &ifs[if_idx]->ip, sizeof(ip_addr_t));
+	/* Broadcast flag */
+	if (dhcp->op == BOOTREPLY && dhcp->flags & 0x80) {
+		headers.ip.ip_dst.s_addr = INADDR_BROADCAST;
+		memset(headers.eh.ether_dhost, 0xff, ETHER_ADDR_LEN);
+	} else {
+		memcpy(&headers.ip.ip_dst, &dhcp->yiaddr, sizeof(ip_addr_t));
+		memcpy(headers.eh.ether_dhost, dhcp->chaddr, ETHER_ADDR_LEN);
+	}
 
-					/* Only one packet! */
-					break;
-				}
-		} else {
-			/* No packets from servers */
-			continue;
+	headers.udp.uh_sport = bootps_port;
+	headers.udp.uh_dport = bootpc_port;
+	headers.udp.uh_ulen = htons(sizeof(struct udphdr) + psize);
+	headers.udp.uh_sum = 0;
+
+	ignore = 0;
+	for (j = 0; j < plugins_number; j++) {
+		if (plugins[j]->send_to_client) {
+			latency_start(&hs);
+			rc = plugins[j]->send_to_client(from_addr, ifs[if_idx],
+							dhcp, &headers);
+			latency_end(METRIC_HOOK(j, HOOK_SEND_TO_CLIENT), &hs);
+			if (rc == 0) {
+				logd(LOG_WARNING, "The packet rejected by %s plugin", plugins[j]->name);
+				METRIC_INC(plugin_rejects[j]);
+				ignore = 1;
+				break;
+			}
 		}
+	}
 
-		bzero(&headers, sizeof(struct packet_headers));
-		if_idx = find_interface(*((ip_addr_t *)&dhcp.giaddr));
-		if (if_idx == if_num) {
-			logd(LOG_ERR, "Destination interface not found for: %s",
-				inet_ntop(AF_INET, &dhcp.giaddr, pbuf,
-				sizeof(pbuf)));
-			continue;
-		}
+	if (ignore) {
+		METRIC_DROP(DROP_PLUGIN);
+		return;
+	}
 
-		memcpy(headers.eh.ether_shost, ifs[if_idx]->mac, ETHER_ADDR_LEN);
-		headers.eh.ether_type = htons(ETHERTYPE_IP);
-		headers.ip.ip_v = IPVERSION;
-		headers.ip.ip_hl = 5;		/* IP header length is 5 word (no options) */
-		headers.ip.ip_tos = IPTOS_LOWDELAY;
-		headers.ip.ip_len = htons(sizeof(struct ip) + sizeof(struct udphdr) + psize);
-		headers.ip.ip_id = 0;
-		headers.ip.ip_off = 0;
-		headers.ip.ip_ttl = 16;
-		headers.ip.ip_p = IPPROTO_UDP;
-		headers.ip.ip_sum = 0;
-		memcpy(&headers.ip.ip_src, &ifs[if_idx]->ip, sizeof(ip_addr_t));
-		/* Broadcast flag */
-		if (dhcp.op == BOOTREPLY && dhcp.flags & 0x80) {
-			headers.ip.ip_dst.s_addr = INADDR_BROADCAST;
-			memset(headers.eh.ether_dhost, 0xff, ETHER_ADDR_LEN);
-		} else {
-			memcpy(&headers.ip.ip_dst, &dhcp.yiaddr, sizeof(ip_addr_t));
-			memcpy(headers.eh.ether_dhost, dhcp.chaddr, ETHER_ADDR_LEN);
-		}
+	psize = get_dhcp_len(dhcp);
+	if (!psize) {
+		logd(LOG_ERR, "send_to_client: plugins generated wrong packet. Dropped.");
+		METRIC_DROP(DROP_PLUGIN);
+		return;
+	}
 
-		headers.udp.uh_sport = bootps_port;
-		headers.udp.uh_dport = bootpc_port;
-		headers.udp.uh_ulen = htons(sizeof(struct udphdr) + psize);
-		headers.udp.uh_sum = 0;
+	len = ETHER_HDR_LEN + DHCP_UDP_OVERHEAD + psize;
+	packet = malloc(len);
+	if (packet == NULL) {
+		logd(LOG_ERR, "malloc error");
+		METRIC_DROP(DROP_NOMEM);
+		return;
+	}
 
-		ignore = 0;
-		for (j = 0; j < plugins_number; j++) {
-			if (plugins[j]->send_to_client)
-				if (plugins[j]->send_to_client(&from_addr, ifs[if_idx],
-								&dhcp, &headers) == 0) {
-					logd(LOG_WARNING, "The packet rejected by %s plugin", plugins[j]->name);
-					ignore = 1;
-					break;
-				}
-		}
+	headers.ip.ip_len = htons(sizeof(struct ip) + sizeof(struct udphdr) + psize);
+	headers.udp.uh_ulen = htons(sizeof(struct udphdr) + psize);
+	headers.ip.ip_sum = 0;
+	headers.ip.ip_sum = htons(ip_checksum((const char *)&headers.ip, sizeof(struct ip)));
+	bzero(packet, len);
+	memcpy(packet, &headers, sizeof(struct packet_headers));
+	memcpy(packet + sizeof(struct packet_headers), dhcp, psize);
 
-		if (ignore)
-			continue;
+	headers.udp.uh_sum = htons(udp_checksum((const char *)packet));
 
-		psize = get_dhcp_len(&dhcp);
-		if (!psize) {
-			logd(LOG_ERR, "send_to_client: plugins generated wrong packet. Dropped.");
-			continue;
-		}
+	if (replay_mode)
+		n = replay_to_client(ifs[if_idx], packet, len);
+	else
+		n = write(ifs[if_idx]->bpf, packet, len);
+	if (n != len) {
+		logd(LOG_ERR, "bpf write failed for %s while trying to write %zu bytes (%zd bytes wrote): %s", ifs[if_idx]->name, len, n, strerror(errno));
+		METRIC_DROP(DROP_BPF_WRITE);
+	} else {
+		METRIC_INC(if_out[if_idx]);
+		latency_end(METRIC_STAGE(STAGE_ANSWER), &received);
+	}
 
-		len = ETHER_HDR_LEN + DHCP_UDP_OVERHEAD + psize;
-		packet = malloc(len);
-		if (packet == NULL) {
-			logd(LOG_ERR, "malloc error");
-			continue;
-		}
+	free(packet);
+}
 
-		headers.ip.ip_len = htons(sizeof(struct ip) + sizeof(struct udphdr) + psize);
-		headers.udp.uh_ulen = htons(sizeof(struct udphdr) + psize);
-		headers.ip.ip_sum = 0;
-		headers.ip.ip_sum = htons(ip_checksum((const char *)&headers.ip, sizeof(struct ip)));
-		bzero(packet, len);
-		memcpy(packet, &headers, sizeof(struct packet_headers));
-		memcpy(packet + sizeof(struct packet_headers), &dhcp, psize);
-		
-		headers.udp.uh_sum = htons(udp_checksum((const char *)packet));
+/* Read answers from servers */
+void *
+process_server_answer(void *param)
+{
+	struct sockaddr_in from_addr;
+	struct dhcp_packet dhcp;
+	socklen_t from_len;
+	int i, fdmax = 0;
+	ssize_t psize;
+	fd_set fds;
 
-		if ((i = write(ifs[if_idx]->bpf, packet, len)) != len)
-			logd(LOG_ERR, "bpf write failed for %s while trying to write %d bytes (%d bytes wrote): %s", ifs[if_idx]->name, len, i, strerror(errno));
+	metrics_thread_register(METRICS_ANSWER_THREAD);
+	while (1) {
+		FD_ZERO(&fds);
+		for (i = 0; i < if_num; i++) {
+			FD_SET(ifs[i]->fd, &fds);
+			if (fdmax < ifs[i]->fd)
+				fdmax = ifs[i]->fd;
+		}
 
-		free(packet);
+		if (select(fdmax + 1, &fds, NULL, NULL, NULL) <= 0)
+			continue;
+		for (i = 0; i < if_num; i++) {
+			if (!FD_ISSET(ifs[i]->fd, &fds))
+				continue;
+			bzero(&from_addr, sizeof(from_addr));
+			from_len = sizeof(from_addr);
+			psize = recvfrom(ifs[i]->fd, (void *)&dhcp,
+						max_packet_size - ETHER_HDR_LEN - DHCP_UDP_OVERHEAD, 0,
+						(struct sockaddr *)&from_addr, &from_len);
+			if (psize == -1)
+				continue;
+			server_packet(&from_addr, &dhcp, psize);
+		}
 	}
 }
 
@@ -585,28 +723,60 @@ process_server_answer(void *param)
 void
 process_queue(struct queue *q)
 {
-	int i, j, ignore;
+	int i, j, n, ignore, rc, srv_cnt;
+	int targets[SERVERS_MAX];
+	const int *srvrs;
+	struct dhcp_server *srv;
 	size_t len;
+	uint64_t srv_mask = 0;
+	struct timespec now, start, hs;
 
+	if (latency_stats) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		latency_add(METRIC_STAGE(STAGE_QUEUE), &q->ts_enqueue, &start);
+		latency_add(&metrics_self->queue_wait[q->qclass], &q->ts_enqueue, &start);
+	}
 	/* Check the packet pass too many hops */
 	if (q->dhcp.hops >= max_hops) {
-		free(q);
+		METRIC_DROP(DROP_HOPS);
+		queue_free(q);
 		return;
 	}
 	q->dhcp.hops++;
 	if (q->dhcp.giaddr.s_addr == 0)
 		memcpy(&q->dhcp.giaddr, &ifs[q->if_idx]->ip, sizeof(ip_addr_t));
-	for (i = 0; i < ifs[q->if_idx]->srv_num; i++) {
+
+	srvrs = ifs[q->if_idx]->srvrs;
+	srv_cnt = ifs[q->if_idx]->srv_num;
+	if (policy_lookup(&q->dhcp, q->if_idx, &srvrs, &srv_cnt) == POLICY_DROP) {
+		logd(LOG_DEBUG, "The packet on interface %s dropped by policy", ifs[q->if_idx]->name);
+		METRIC_DROP(DROP_POLICY);
+		queue_free(q);
+		return;
+	}
+
+	if (track_transactions)
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	if (shed_enabled)
+		shed_tick(&now);
+	n = fanout_select(&q->dhcp, srvrs, srv_cnt, targets, &now);
+	for (i = 0; i < n; i++) {
+		srv = servers[targets[i]];
 		ignore = 0;
 		for (j = 0; j < plugins_number; j++) {
-			if (plugins[j]->send_to_server)
-				if (plugins[j]->send_to_server(&(servers[ifs[q->if_idx]->srvrs[i]]->sockaddr),
-						ifs[q->if_idx], &q->dhcp) == 0) {
+			if (plugins[j]->send_to_server) {
+				latency_start(&hs);
+				rc = plugins[j]->send_to_server(&srv->sockaddr,
+						ifs[q->if_idx], &q->dhcp);
+				latency_end(METRIC_HOOK(j, HOOK_SEND_TO_SERVER), &hs);
+				if (rc == 0) {
 					logd(LOG_WARNING, "The packet rejected by %s plugin",
 						plugins[j]->name);
+					METRIC_INC(plugin_rejects[j]);
 					ignore = 1;
 					break;
 				}
+			}
 		}
 		len = get_dhcp_len(&q->dhcp);
 		if (!len) {
@@ -614,22 +784,47 @@ process_queue(struct queue *q)
 			ignore = 1;
 		}
 
-		if (!ignore)
-			sendto(ifs[q->if_idx]->fd, &q->dhcp,
-				len, 0,
-				(struct sockaddr *)&servers[ifs[q->if_idx]->srvrs[i]]->sockaddr,
+		if (ignore) {
+			METRIC_DROP(DROP_PLUGIN);
+			continue;
+		}
+		if (replay_mode)
+			rc = replay_to_server(ifs[q->if_idx], &srv->sockaddr, &q->dhcp, len);
+		else
+			rc = sendto(ifs[q->if_idx]->fd, &q->dhcp, len, 0,
+				(struct sockaddr *)&srv->sockaddr,
 				sizeof(struct sockaddr_in));
+		if (rc != -1) {
+			srv_mask |= 1ULL << targets[i];
+			METRIC_INC(srv_out[targets[i]]);
+		} else {
+			METRIC_DROP(DROP_SEND_ERROR);
+			fanout_send_error(targets[i], errno);
+		}
+	}
+
+	if (track_transactions && srv_mask != 0)
+		xid_table_insert(&q->dhcp, q->if_idx, srv_mask, &now);
+
+	if (latency_stats && srv_mask != 0) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		latency_add(METRIC_STAGE(STAGE_FORWARD), &start, &now);
+		hist_add(METRIC_STAGE(STAGE_REQUEST), q->capture_ns +
+			timespec_ns(&now) - timespec_ns(&q->ts_enqueue));
 	}
 
-	free(q);
+	queue_free(q);
 }
 
-/* Parse a servers part of config */
+/* Parse a servers part of config. An interface may have a queue weight
+ * after a colon, otherwise it's queue_weight set above the line. */
 void
 parse_servers_line(char *buf)
 {
-	char *p, *n;
+	char *p, *n, *w;
 	int inum;
+	unsigned weight;
+	struct interface *intf;
 
 	p = buf;
 	strsep(&p, " \t");
@@ -640,9 +835,21 @@ parse_servers_line(char *buf)
 	inum = 0;
 	while ((n = strsep(&p, " \t")) != NULL) {
 		if (*n != '\0') {
-			if (open_interface(n))
+			weight = servers_weight;
+			if ((w = strchr(n, ':')) != NULL) {
+				*w++ = '\0';
+				weight = strtol(w, NULL, 10);
+				if (weight < 1 || weight > QUEUE_WEIGHT_MAX) {
+					logd(LOG_WARNING, "Wrong queue weight %s of %s. Ignored.", w, n);
+					weight = servers_weight;
+				}
+			}
+			if (open_interface(n)) {
 				inum++;
-			else {
+				intf = get_interface_by_name(n);
+				if (intf->weight < weight)
+					intf->weight = weight;
+			} else {
 				logd(LOG_WARNING, "Interface %s does not exist. Ignored.", n);
 			}
 		}
@@ -667,7 +874,7 @@ read_config(const char *filename)
 	void *handle;
 
 	enum sections {
-		Servers, Options, Plugin
+		Servers, Options, Policy, Plugin
 	} section = Servers;
 
 	struct plugins_data *plugins_data;
@@ -700,6 +907,10 @@ read_config(const char *filename)
 				section = Options;
 				continue;
 			}
+			if (strcasecmp(buf + 1, "policy") == 0) {
+				section = Policy;
+				continue;
+			}
 			if ((p = strcasestr(buf, "-plugin")) != NULL) {
 				if (plugins_number > MAX_PLUGINS - 1)
 					errx(1, "Too many plugins. Line: %d", line);
@@ -775,6 +986,13 @@ read_config(const char *filename)
 						logd(LOG_DEBUG, "interface %s binded to address %s", p1, p);
 					continue;
 				}
+				if (strcasecmp(buf, "queue_weight") == 0) {
+					servers_weight = strtol(p, NULL, 10);
+					if (servers_weight < 1 || servers_weight > QUEUE_WEIGHT_MAX)
+						errx(1, "Wrong queue_weight value. Line: %d", line);
+					logd(LOG_DEBUG, "queue_weight set to: %u", servers_weight);
+					continue;
+				}
 				if (strcasecmp(buf, "file") != 0)
 					errx(1, "Unknown option in [Servers] section. Line: %d", line);
 				if ((fs = fopen(p, "r")) == NULL)
@@ -822,6 +1040,167 @@ read_config(const char *filename)
 				logd(LOG_DEBUG, "Option rps_limit set to: %d", rps_limit);
 				continue;
 			}
+			if (strcasecmp(buf, "queue_aging") == 0) {
+				queue_aging = strtol(p, NULL, 10);
+				if (queue_aging > 65535)
+					errx(1, "Wrong queue_aging value. Line: %d", line);
+				logd(LOG_DEBUG, "Option queue_aging set to: %u", queue_aging);
+				continue;
+			}
+			if (strcasecmp(buf, "queue_limit") == 0) {
+				queue_limit = strtol(p, NULL, 10);
+				if (queue_limit < 16 || queue_limit > 65536)
+					errx(1, "Wrong queue_limit value. Line: %d", line);
+				logd(LOG_DEBUG, "Option queue_limit set to: %u", queue_limit);
+				continue;
+			}
+			if (strcasecmp(buf, "shed") == 0) {
+				if ((shed_enabled = get_bool_value(p)) == -1)
+					errx(1, "shed value error. Line: %d", line);
+				logd(LOG_DEBUG, "Option shed set to: %d", shed_enabled);
+				continue;
+			}
+			if (strcasecmp(buf, "shed_latency") == 0) {
+				shed_latency = strtol(p, NULL, 10);
+				if (shed_latency < 1 || shed_latency > 60000)
+					errx(1, "Wrong shed_latency value. Line: %d", line);
+				logd(LOG_DEBUG, "Option shed_latency set to: %u", shed_latency);
+				continue;
+			}
+			if (strcasecmp(buf, "shed_outstanding") == 0) {
+				shed_outstanding = strtol(p, NULL, 10);
+				if (shed_outstanding < 1)
+					errx(1, "Wrong shed_outstanding value. Line: %d", line);
+				logd(LOG_DEBUG, "Option shed_outstanding set to: %u", shed_outstanding);
+				continue;
+			}
+			if (strcasecmp(buf, "track_transactions") == 0) {
+				if ((track_transactions = get_bool_value(p)) == -1)
+					errx(1, "track_transactions value error. Line: %d", line);
+				logd(LOG_DEBUG, "Option track_transactions set to: %d", track_transactions);
+				continue;
+			}
+			if (strcasecmp(buf, "transaction_timeout") == 0) {
+				transaction_timeout = strtol(p, NULL, 10);
+				if (transaction_timeout < 1 || transaction_timeout > 3600)
+					errx(1, "Wrong transaction timeout. Line: %d", line);
+				logd(LOG_DEBUG, "Option transaction_timeout set to: %d", transaction_timeout);
+				continue;
+			}
+			if (strcasecmp(buf, "transaction_table_size") == 0) {
+				transaction_table_size = strtol(p, NULL, 10);
+				if (transaction_table_size < 16)
+					errx(1, "Wrong transaction table size. Line: %d", line);
+				logd(LOG_DEBUG, "Option transaction_table_size set to: %d", transaction_table_size);
+				continue;
+			}
+			if (strcasecmp(buf, "drop_unsolicited") == 0) {
+				if ((drop_unsolicited = get_bool_value(p)) == -1)
+					errx(1, "drop_unsolicited value error. Line: %d", line);
+				logd(LOG_DEBUG, "Option drop_unsolicited set to: %d", drop_unsolicited);
+				continue;
+			}
+			if (strcasecmp(buf, "fanout") == 0) {
+				if (strcasecmp(p, "all") == 0)
+					fanout_mode = FANOUT_ALL;
+				else if (strcasecmp(p, "affinity") == 0)
+					fanout_mode = FANOUT_AFFINITY;
+				else if (strcasecmp(p, "hash") == 0)
+					fanout_mode = FANOUT_HASH;
+				else
+					errx(1, "Unknown fanout mode. Line: %d", line);
+				logd(LOG_DEBUG, "Option fanout set to: %s", p);
+				continue;
+			}
+			if (strcasecmp(buf, "fanout_timeout") == 0) {
+				fanout_timeout = strtol(p, NULL, 10);
+				logd(LOG_DEBUG, "Option fanout_timeout set to: %d", fanout_timeout);
+				continue;
+			}
+			if (strcasecmp(buf, "server_down_after") == 0) {
+				server_down_after = strtol(p, NULL, 10);
+				if (server_down_after < 1)
+					errx(1, "Wrong server_down_after value. Line: %d", line);
+				logd(LOG_DEBUG, "Option server_down_after set to: %d", server_down_after);
+				continue;
+			}
+			if (strcasecmp(buf, "server_retry") == 0) {
+				server_retry = strtol(p, NULL, 10);
+				logd(LOG_DEBUG, "Option server_retry set to: %d", server_retry);
+				continue;
+			}
+			if (strcasecmp(buf, "affinity_timeout") == 0) {
+				affinity_timeout = strtol(p, NULL, 10);
+				if (affinity_timeout < 1 || affinity_timeout > 0xffffff)
+					errx(1, "Wrong affinity timeout. Line: %d", line);
+				logd(LOG_DEBUG, "Option affinity_timeout set to: %d", affinity_timeout);
+				continue;
+			}
+			if (strcasecmp(buf, "affinity_table_size") == 0) {
+				affinity_table_size = strtol(p, NULL, 10);
+				if (affinity_table_size < 16)
+					errx(1, "Wrong affinity table size. Line: %d", line);
+				logd(LOG_DEBUG, "Option affinity_table_size set to: %d", affinity_table_size);
+				continue;
+			}
+			if (strcasecmp(buf, "metrics_file") == 0) {
+				strlcpy(metrics_file, p, sizeof(metrics_file));
+				logd(LOG_DEBUG, "Option metrics_file set to: %s", metrics_file);
+				continue;
+			}
+			if (strcasecmp(buf, "latency_stats") == 0) {
+				if ((latency_stats = get_bool_value(p)) == -1)
+					errx(1, "latency_stats value error. Line: %d", line);
+				logd(LOG_DEBUG, "Option latency_stats set to: %d", latency_stats);
+				continue;
+			}
+			if (strcasecmp(buf, "metrics_listen") == 0) {
+				strlcpy(metrics_listen, p, sizeof(metrics_listen));
+				logd(LOG_DEBUG, "Option metrics_listen set to: %s", metrics_listen);
+				continue;
+			}
+			if (strcasecmp(buf, "log_file") == 0) {
+				strlcpy(log_file, p, sizeof(log_file));
+				logd(LOG_DEBUG, "Option log_file set to: %s", log_file);
+				continue;
+			}
+			if (strcasecmp(buf, "log_rate") == 0) {
+				log_rate = strtol(p, NULL, 10);
+				logd(LOG_DEBUG, "Option log_rate set to: %u", log_rate);
+				continue;
+			}
+			if (strcasecmp(buf, "log_queue_size") == 0) {
+				log_queue_size = strtol(p, NULL, 10);
+				if (log_queue_size < 16)
+					errx(1, "Wrong log queue size. Line: %d", line);
+				logd(LOG_DEBUG, "Option log_queue_size set to: %u", log_queue_size);
+				continue;
+			}
+			if (strcasecmp(buf, "check_chaddr") == 0) {
+				if ((check_chaddr = get_bool_value(p)) == -1)
+					errx(1, "check_chaddr value error. Line: %d", line);
+				logd(LOG_DEBUG, "Option check_chaddr set to: %d", check_chaddr);
+				continue;
+			}
+			if (strcasecmp(buf, "capture_budget") == 0) {
+				capture_budget = strtoul(p, NULL, 10) * 1024 * 1024;
+				logd(LOG_DEBUG, "Option capture_budget set to: %lu", capture_budget);
+				continue;
+			}
+			if (strcasecmp(buf, "capture_buffer_min") == 0) {
+				capture_buffer_min = strtoul(p, NULL, 10) * 1024;
+				if (capture_buffer_min < 4096)
+					errx(1, "Wrong capture buffer size. Line: %d", line);
+				logd(LOG_DEBUG, "Option capture_buffer_min set to: %u", capture_buffer_min);
+				continue;
+			}
+			if (strcasecmp(buf, "capture_buffer_max") == 0) {
+				capture_buffer_max = strtoul(p, NULL, 10) * 1024;
+				if (capture_buffer_max < 4096)
+					errx(1, "Wrong capture buffer size. Line: %d", line);
+				logd(LOG_DEBUG, "Option capture_buffer_max set to: %u", capture_buffer_max);
+				continue;
+			}
 			if (strcasecmp(buf, "plugin_path") == 0) {
 				strlcpy(plugin_base, p, sizeof(plugin_base));
 				if (plugin_base[strlen(plugin_base) - 1] != '/')
@@ -831,6 +1210,10 @@ read_config(const char *filename)
 			}
 			errx(1, "Unknown option in [Options] section. Line: %d", line);
 		}
+		if (section == Policy) {
+			if (!policy_parse_line(buf, line))
+				errx(1, "Policy error. Line: %d", line);
+		}
 		if (section == Plugin) {
 			popt = malloc(sizeof(struct plugin_options));
 			if (popt == NULL)
@@ -878,7 +1261,31 @@ main(int argc, char *argv[])
 	strlcpy(prgname, argv[0], sizeof(prgname));
 	filename[0] = '\0';
 	STAILQ_INIT(&ip_binding_map_head);
-	while ((c = getopt(argc, argv, "A:c:df:hi:p:x:")) != -1) {
+	/* Replay options change how interfaces are opened, so get them
+	 * first */
+	while ((c = getopt(argc, argv, OPTSTRING)) != -1) {
+		switch (c) {
+		case 'L':
+			if ((replay_passes = strtol(optarg, NULL, 10)) < 1)
+				errx(1, "Wrong replay passes number");
+			break;
+		case 'r':
+			if (!replay_add_input(optarg))
+				errx(1, "Wrong replay input: %s", optarg);
+			replay_mode = 1;
+			break;
+		case 'R':
+			replay_server_file = optarg;
+			replay_mode = 1;
+			break;
+		case 'w':
+			replay_output = optarg;
+			break;
+		}
+	}
+	optreset = 1;
+	optind = 1;
+	while ((c = getopt(argc, argv, OPTSTRING)) != -1) {
 		switch (c) {
 		case 'A':
 			if (configured == 2)
@@ -918,6 +1325,11 @@ main(int argc, char *argv[])
 		case 'x':
 			strlcpy(pcapfilter, optarg, sizeof(pcapfilter));
 			break;
+		case 'L':
+		case 'r':
+		case 'R':
+		case 'w':
+			break;
 		case 'h':
 		default:
 			usage(prgname);
@@ -954,6 +1366,11 @@ main(int argc, char *argv[])
 	if (if_num == 0)
 		errx(1, "No interfaces found to listen. Exiting.");
 
+	if (!policy_compile())
+		errx(1, "Can't compile policy rules");
+	if (!replay_mode && !capture_init())
+		errx(1, "Can't set capture filters and buffers");
+
 	logd(LOG_WARNING, "Total interfaces: %d", if_num);
 
 	/* Make a PID filename */
@@ -968,14 +1385,15 @@ main(int argc, char *argv[])
 		strlcat(filename, ".pid", sizeof(filename));
 	}
 	/* Create a PID file and daemonize if no debug flag */
-	if (!debug && (pfh = pidfile_open(filename, 0644, &opid)) == NULL) {
+	if (!debug && !replay_mode &&
+	    (pfh = pidfile_open(filename, 0644, &opid)) == NULL) {
 		if (errno == EEXIST)
 			errx(1, "Already run with PID %lu. Exiting.", (unsigned long)opid);
 		errx(1, "Can't create PID file");
 	}
 	signal(SIGHUP, SIG_IGN);
 
-	if (!debug) {
+	if (!debug && !replay_mode) {
 		if (daemon(0, 0) == -1)
 			process_error(1, "Can't daemonize. Exiting.");
 		else
@@ -983,11 +1401,31 @@ main(int argc, char *argv[])
 	}
 	if (pfh)
 		pidfile_write(pfh);
-
-	STAILQ_INIT(&q_head);
-
-	pthread_mutex_init(&queue_lock, NULL);
-	pthread_cond_init(&queue_cond, NULL);
+	/* Packet threads only queue messages from now */
+	if (!debug && !replay_mode &&
+	    !logd_start(log_file[0] != '\0' ? log_file : NULL, log_rate, log_queue_size))
+		process_error(EX_RES, "can't start logging");
+
+	if (!queue_init())
+		process_error(EX_MEM, "can't allocate requests queues");
+
+	/* We need to know who answered to choose servers and to see how
+	 * many requests servers have not answered yet */
+	if (fanout_mode != FANOUT_ALL || shed_enabled)
+		track_transactions = 1;
+	if (track_transactions &&
+	    !xid_table_init(transaction_table_size, transaction_timeout))
+		process_error(EX_MEM, "can't allocate transactions table");
+	if (!fanout_init())
+		process_error(EX_MEM, "can't allocate client affinity table");
+
+	if (!metrics_init(metrics_file[0] != '\0' ? metrics_file : NULL))
+		process_error(EX_RES, "can't create metrics");
+	metrics_thread_register(METRICS_MAIN_THREAD);
+	if (replay_mode)
+		exit(replay_run());
+	if (!metrics_start(metrics_listen[0] != '\0' ? metrics_listen : NULL))
+		process_error(EX_RES, "can't start metrics thread");
 
 	/* Create listeners for every interface */
 	for (i = 0; i < if_num; i++) {
@@ -1001,15 +1439,7 @@ main(int argc, char *argv[])
 
 	/* Main loop */
 	while (1) {
-		pthread_mutex_lock(&queue_lock);
-		while (queue_size == 0)
-			pthread_cond_wait(&queue_cond, &queue_lock);
-
-		q = STAILQ_FIRST(&q_head);
-		STAILQ_REMOVE_HEAD(&q_head, entries);
-		queue_size--;
-
-		pthread_mutex_unlock(&queue_lock);
+		q = queue_get();
 		process_queue(q);
 	}
 
@@ -1018,6 +1448,4 @@ main(int argc, char *argv[])
 		if (plugins[i]->destroy)
 			(plugins[i]->destroy) ();
 	}
-	pthread_cond_destroy(&queue_cond);
-	pthread_mutex_destroy(&queue_lock);
 }
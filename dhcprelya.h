@@ -110,17 +110,35 @@ struct interface {
 	pcap_t *cap;
 	int srv_num;
 	int *srvrs;
+	unsigned weight;	/* of its requests queue */
 };
 
 struct dhcp_server {
 	char *name;
 	struct sockaddr_in sockaddr;
+	/* Round-trip statistics (in microseconds). Updated by the server
+	 * answers thread only. */
+	uint64_t replies;
+	long rtt_last, rtt_avg, rtt_max;
+	/* Health. timeouts is a number of unanswered requests in a row,
+	 * it's changed by both the main and the server answers threads.
+	 * Other counters are changed by the main thread only. */
+	volatile uint32_t timeouts;
+	uint64_t lost, errors;
+	/* Requests waiting for an answer, kept by xid_table.c */
+	volatile uint32_t outstanding;
+	time_t last_probe;	/* the last request sent while it was down */
+	uint64_t hash_seed;	/* a weight base for consistent hashing */
 };
 
 struct queue {
 	struct dhcp_packet dhcp;
 	int if_idx;
+	int qclass;
 	ip_addr_t ip_dst;
+	/* for latency_stats */
+	int64_t capture_ns;		/* pcap timestamp -> queued */
+	struct timespec ts_enqueue;
 
 	STAILQ_ENTRY(queue) entries;
 };
@@ -131,11 +149,54 @@ struct ip_binding_map {
 	STAILQ_ENTRY(ip_binding_map) next;
 };
 
+/* Timer wheel */
+struct tw_timer {
+	time_t expires;
+	int armed;
+	TAILQ_ENTRY(tw_timer) entries;
+};
+TAILQ_HEAD(tw_bucket, tw_timer);
+
+struct timer_wheel {
+	struct tw_bucket *buckets;
+	unsigned size;
+	unsigned count;
+	time_t now;
+};
+
+/* Forwarded request (transaction) */
+struct xid_entry {
+	volatile uint32_t gen;	/* odd while the entry is being changed */
+	int used;
+	uint32_t xid;
+	uint8_t chaddr[ETH_ADDR_LEN];
+	int if_idx;		/* interface the request came from */
+	uint64_t srv_mask;	/* bit per server the request sent to */
+	volatile uint64_t replied;	/* bit per server answered */
+	struct timespec sent;
+	struct tw_timer timer;
+};
+
+/* Fan-out modes */
+#define FANOUT_ALL	0	/* send to all servers of an interface */
+#define FANOUT_AFFINITY	1	/* last answered or a first healthy server */
+#define FANOUT_HASH	2	/* consistent hashing of clients over servers */
+
 /* Global options */
-extern unsigned debug, max_packet_size;
+extern unsigned debug, max_packet_size, max_hops;
+
+extern struct interface *ifs[];
+extern struct dhcp_server *servers[];
+extern int if_num, srv_num;
 
 struct interface *get_interface_by_idx(int idx);
 struct interface *get_interface_by_name(char *iname);
+int add_server(const char *server_spec);
+void process_error(int ret_code, char *fmt,...);
+struct queue *client_packet(struct interface *intf, const struct pcap_pkthdr *pcap_header,
+	const u_char *packet);
+void process_queue(struct queue *q);
+void server_packet(struct sockaddr_in *from_addr, struct dhcp_packet *dhcp, size_t psize);
 
 /* ip_checksum.c */
 short ip_checksum(const char *packet, int count);
@@ -143,23 +204,222 @@ short udp_checksum(const char *packet);
 
 /* utils.c */
 char *print_xid(uint32_t ip, char *buf);
-void logd(int log_level, char *fmt,...);
 int get_bool_value(const char *str);
 
+/* logd.c */
+struct log_site {
+	const char *fmt;
+	int level;
+	struct log_site *next;
+	uint32_t second;
+	volatile uint32_t count;	/* messages in the second */
+	volatile uint32_t suppressed;
+	volatile int listed;
+};
+
+/* A level is checked before arguments are evaluated. Every call site
+ * is rate limited on its own. */
+#define logd(log_level, ...) do {					\
+	static struct log_site log_site_;				\
+	if ((log_level) != LOG_DEBUG || debug)				\
+		logd_site(&log_site_, (log_level), __VA_ARGS__);	\
+} while (0)
+
+#define LOG_RATE_DEFAULT	10
+#define LOG_QUEUE_DEFAULT	256
+
+void logd_site(struct log_site *site, int level, const char *fmt,...) __printflike(3, 4);
+int logd_start(const char *file, unsigned max_rate, unsigned size);
+void logd_stop(void);
+
 /* net_utils.c */
 int get_mac(const char *if_name, char *if_mac);
 int get_ip(const char *iname, ip_addr_t *ip, const ip_addr_t *preferable);
 
+/* timer_wheel.c */
+int tw_init(struct timer_wheel *tw, unsigned size, time_t now);
+void tw_destroy(struct timer_wheel *tw);
+void tw_add(struct timer_wheel *tw, struct tw_timer *t, time_t expires);
+void tw_del(struct timer_wheel *tw, struct tw_timer *t);
+int tw_advance(struct timer_wheel *tw, time_t now,
+	void (*fn)(struct tw_timer *t, void *arg), void *arg);
+
+/* spool.c */
+struct spool;
+
+struct spool *spool_open(const char *path, unsigned rec_size, uint64_t slots);
+int spool_append(struct spool *sp, const void *rec);
+int spool_peek(struct spool *sp, void *rec);
+void spool_consume(struct spool *sp);
+uint64_t spool_depth(struct spool *sp);
+void spool_sync(struct spool *sp);
+void spool_close(struct spool *sp);
+
+/* idset.c */
+struct idset;
+
+struct idset *idset_new(unsigned hint, int bloom);
+int idset_add(struct idset *s, const uint8_t *data, unsigned len);
+int idset_contains(const struct idset *s, const uint8_t *data, unsigned len);
+unsigned idset_count(const struct idset *s);
+void idset_free(struct idset *s);
+
+/* capture.c */
+extern int check_chaddr;
+extern unsigned long capture_budget;
+extern unsigned capture_buffer_min, capture_buffer_max;
+
+int capture_filter(pcap_t *cap, const struct interface *intf);
+pcap_t *capture_open(const struct interface *intf, unsigned size);
+int capture_init(void);
+void capture_stats(const struct interface *intf, uint64_t *recv, uint64_t *drop,
+	uint64_t *ifdrop);
+unsigned capture_buffer(const struct interface *intf, uint64_t *resizes);
+unsigned long capture_budget_used(void);
+pcap_t *capture_tune(struct interface *intf);
+
+/* queue.c */
+#define QCLASS_BOUND	0	/* renewals, releases, declines, informs */
+#define QCLASS_REQUEST	1	/* REQUESTs for an offer or a known lease */
+#define QCLASS_DISCOVER	2	/* DISCOVERs and everything else */
+#define QCLASS_MAX	3
+#define QUEUE_WEIGHT_MAX	1000
+
+extern unsigned queue_aging, queue_limit;
+
+int queue_init(void);
+struct queue *queue_alloc(const struct interface *intf);
+void queue_cancel(struct queue *q);
+void queue_free(struct queue *q);
+int queue_class(struct dhcp_packet *dhcp);
+void queue_put(struct queue *q);
+struct queue *queue_get(void);
+unsigned queue_depth(int qclass);
+
+/* shed.c */
+extern int shed_enabled;
+extern unsigned shed_latency, shed_outstanding;
+
+void shed_tick(const struct timespec *now);
+int shed_admit(const struct interface *intf, struct dhcp_packet *dhcp, int qclass);
+unsigned shed_admitted(int if_idx);
+int shed_server_overloaded(int srv_idx);
+
+/* xid_table.c */
+int xid_table_init(unsigned size, unsigned entry_timeout);
+void xid_table_set_expire_cb(void (*cb) (const struct xid_entry *entry));
+void xid_table_tick(const struct timespec *now);
+void xid_table_insert(const struct dhcp_packet *dhcp, int if_idx,
+	uint64_t srv_mask, const struct timespec *now);
+int xid_table_lookup(const struct dhcp_packet *dhcp, struct xid_entry *found,
+	const struct timespec *now);
+void xid_table_answered(const struct dhcp_packet *dhcp, int srv_idx);
+unsigned server_outstanding(int srv_idx);
+
+/* fanout.c */
+extern int fanout_mode;
+extern unsigned fanout_timeout, server_down_after, server_retry;
+extern unsigned affinity_timeout, affinity_table_size;
+
+int fanout_init(void);
+void fanout_server_answered(int srv_idx, const struct dhcp_packet *dhcp,
+	const struct timespec *now);
+void fanout_send_error(int srv_idx, int error);
+int fanout_select(const struct dhcp_packet *dhcp, const int *srvrs, int srv_cnt,
+	int *targets, const struct timespec *now);
+
+/* policy.c */
+#define POLICY_PASS	0	/* to the interface servers */
+#define POLICY_DROP	1
+#define POLICY_GROUP	2	/* to servers of a group */
+
+int policy_parse_line(char *buf, int line);
+int policy_compile(void);
+int policy_lookup(struct dhcp_packet *dhcp, int if_idx, const int **srvrs, int *srv_cnt);
+
+/* replay.c */
+extern int replay_mode;
+extern unsigned replay_passes;
+extern char *replay_server_file, *replay_output;
+
+int replay_add_input(const char *spec);
+int replay_run(void);
+ssize_t replay_to_server(const struct interface *intf, const struct sockaddr_in *server,
+	const struct dhcp_packet *dhcp, size_t len);
+ssize_t replay_to_client(const struct interface *intf, const uint8_t *packet, size_t len);
+
+/* pcapng.c */
+#define PCAPNG_IN	1	/* epb_flags direction */
+#define PCAPNG_OUT	2
+
+int pcapng_open(const char *file_prefix, off_t max_size, time_t max_age);
+void pcapng_write(const char *ifname, int flags, const struct timeval *tv,
+	const uint8_t *frame, size_t frame_len, const char *comment);
+void pcapng_flush(void);
+void pcapng_close(void);
+
+/* dhcp_decode.c */
+#define DECODE_VALUE_MAX	2048	/* any option value fits */
+#define DECODE_PACKET_MAX	32768
+
+const char *dhcp_option_name(uint8_t code);
+size_t dhcp_decode_value(const uint8_t *opt, char *buf, size_t size);
+size_t dhcp_decode_packet(const struct dhcp_packet *dhcp, size_t len, char *buf, size_t size);
+
+/* event_fmt.c */
+#define EVENT_MAX	512	/* a formatted event without options fits always */
+#define EVENT_DETAILED_MAX	(EVENT_MAX + 16384)
+
+struct log_event {
+	struct timeval tv;
+	const char *hook;
+	const char *ifname;	/* NULL - not known */
+	uint32_t xid;
+	const uint8_t *chaddr;
+	int msg_type;		/* 0 - no option 53 */
+	struct in_addr giaddr;
+	struct in_addr server;	/* 0 - none */
+	size_t len;
+	const char *verdict;
+	const struct dhcp_packet *dhcp;	/* options are added if not NULL */
+};
+
+size_t event_json(const struct log_event *ev, char *buf, size_t size);
+size_t event_logfmt(const struct log_event *ev, char *buf, size_t size);
+
 /* dhcp_utils.c */
 #define INSERT_OPTION_NORMAL 0		// No replace, no stack
 #define INSERT_OPTION_OVERRIDE 1	// If duplicate found - override
 #define INSERT_OPTION_STACK 2		// No search for duplicate, just insert
 
 uint8_t *find_option(struct dhcp_packet *dhcp, uint8_t option_id);
+uint8_t *find_option_or_end(struct dhcp_packet *dhcp, uint8_t option_id);
 uint8_t *find_suboption(struct dhcp_packet *dhcp, uint8_t option_id, uint8_t suboption_id);
 int insert_option(struct dhcp_packet *dhcp, uint8_t option_id, uint8_t len, uint8_t *option, int flags);
 int remove_option(struct dhcp_packet *dhcp, uint8_t option_id);
 int get_dhcp_len(struct dhcp_packet *dhcp);
+int sanity_check(const char *packet, const unsigned len);
+
+/* FNV-1a of len bytes, h is FNV1A_BASIS or a hash to go on with */
+#define FNV1A_BASIS	2166136261U
+#define FNV1A_PRIME	16777619U
+
+static inline uint32_t
+fnv1a(uint32_t h, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	while (len-- > 0)
+		h = (h ^ *p++) * FNV1A_PRIME;
+	return h;
+}
+
+/* A hash of a client for tables by chaddr */
+static inline uint32_t
+chaddr_hash(const uint8_t *chaddr)
+{
+	return fnv1a(FNV1A_BASIS, chaddr, ETH_ADDR_LEN);
+}
 
 /* Plugins support */
 #define MAX_PLUGINS 20
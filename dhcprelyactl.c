@@ -0,0 +1,67 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+#include <sysexits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "metrics.h"
+
+/* Print dhcprelya counters from its metrics file (metrics_file option) */
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Usage: dhcprelyactl [-p] [-f metrics_file]\n");
+	fprintf(stderr, "\t-p\tPrometheus text format\n");
+	exit(EX_USAGE);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const struct metrics_shm *m;
+	const char *filename = METRICS_FILE;
+	struct stat st;
+	int c, fd, prometheus = 0;
+
+	while ((c = getopt(argc, argv, "f:ph")) != -1) {
+		switch (c) {
+		case 'f':
+			filename = optarg;
+			break;
+		case 'p':
+			prometheus = 1;
+			break;
+		case 'h':
+		default:
+			usage();
+		}
+	}
+
+	if ((fd = open(filename, O_RDONLY)) == -1)
+		err(EX_NOINPUT, "%s", filename);
+	if (fstat(fd, &st) == -1)
+		err(EX_IOERR, "%s", filename);
+	if (st.st_size < (off_t)sizeof(struct metrics_shm))
+		errx(EX_DATAERR, "%s: too short", filename);
+	m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (m == MAP_FAILED)
+		err(EX_OSERR, "mmap");
+	close(fd);
+
+	if (m->magic != METRICS_MAGIC)
+		errx(EX_DATAERR, "%s: not a dhcprelya metrics file", filename);
+	if (m->version != METRICS_VERSION)
+		errx(EX_DATAERR, "%s: version %u, expected %u", filename, m->version,
+			METRICS_VERSION);
+	if (m->size > st.st_size || m->thread_size < sizeof(struct metrics_thread) +
+	    m->plugins_num * HOOK_MAX * sizeof(struct metrics_hist))
+		errx(EX_DATAERR, "%s: bad layout", filename);
+
+	metrics_print(m, stdout, prometheus);
+	return 0;
+}
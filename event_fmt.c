@@ -0,0 +1,253 @@
+#include <string.h>
+#include <sys/param.h>
+
+#include "dhcprelya.h"
+
+/* JSON lines and logfmt events for log_plugin.
+ *
+ * Hand-written formatters: no stdio, no locale, no allocation. All fields
+ * are bounded (interface names are escaped), so a buffer of EVENT_MAX bytes
+ * is always enough and there are no checks on the way. A line ends with
+ * '\n'. Fields not known for a hook (interface, server, message type) are
+ * omitted. Decoded options (detailed=yes) go last while they fit into a
+ * buffer. */
+
+static const char hex[] = "0123456789abcdef";
+
+static const char *types[] = {
+	NULL, "discover", "offer", "request", "decline", "ack", "nak",
+	"release", "inform"
+};
+
+static char *
+put_str(char *p, const char *s)
+{
+	while (*s != '\0')
+		*p++ = *s++;
+	return p;
+}
+
+/* JSON string escaping. logfmt values are quoted the same way. */
+static char *
+put_escaped(char *p, const char *s, size_t max)
+{
+	unsigned char c;
+
+	*p++ = '"';
+	for (; max-- > 0 && (c = *s) != '\0'; s++) {
+		if (c == '"' || c == '\\') {
+			*p++ = '\\';
+			*p++ = c;
+		} else if (c < 0x20 || c >= 0x7f) {
+			p = put_str(p, "\\u00");
+			*p++ = hex[c >> 4];
+			*p++ = hex[c & 0xf];
+		} else
+			*p++ = c;
+	}
+	*p++ = '"';
+	return p;
+}
+
+static char *
+put_u64(char *p, uint64_t v)
+{
+	char tmp[20];
+	int n = 0;
+
+	do {
+		tmp[n++] = '0' + v % 10;
+		v /= 10;
+	} while (v != 0);
+	while (n > 0)
+		*p++ = tmp[--n];
+	return p;
+}
+
+static char *
+put_time(char *p, const struct timeval *tv)
+{
+	uint32_t usec = tv->tv_usec;
+	int i;
+
+	p = put_u64(p, tv->tv_sec);
+	*p++ = '.';
+	for (i = 5; i >= 0; i--) {
+		p[i] = '0' + usec % 10;
+		usec /= 10;
+	}
+	return p + 6;
+}
+
+/* As print_xid() does: bytes in a network order */
+static char *
+put_xid(char *p, uint32_t xid)
+{
+	const uint8_t *b = (const uint8_t *)&xid;
+	int i;
+
+	*p++ = '0';
+	*p++ = 'x';
+	for (i = 0; i < 4; i++) {
+		*p++ = hex[b[i] >> 4];
+		*p++ = hex[b[i] & 0xf];
+	}
+	return p;
+}
+
+static char *
+put_ip(char *p, struct in_addr addr)
+{
+	const uint8_t *b = (const uint8_t *)&addr.s_addr;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		if (i != 0)
+			*p++ = '.';
+		if (b[i] >= 100)
+			*p++ = '0' + b[i] / 100;
+		if (b[i] >= 10)
+			*p++ = '0' + b[i] / 10 % 10;
+		*p++ = '0' + b[i] % 10;
+	}
+	return p;
+}
+
+static char *
+put_mac(char *p, const uint8_t *mac)
+{
+	int i;
+
+	for (i = 0; i < ETHER_ADDR_LEN; i++) {
+		if (i != 0)
+			*p++ = ':';
+		*p++ = hex[mac[i] >> 4];
+		*p++ = hex[mac[i] & 0xf];
+	}
+	return p;
+}
+
+static char *
+put_type(char *p, int type)
+{
+	if (type > 0 && type < sizeof(types) / sizeof(types[0]))
+		return put_str(p, types[type]);
+	return put_u64(p, type);
+}
+
+/* Walk options of a packet, values are decoded by dhcp_decode.c. Stops
+ * when a next one could not fit before end. */
+static char *
+put_options(char *p, char *end, const struct log_event *ev, int json)
+{
+	const uint8_t *data = (const uint8_t *)ev->dhcp;
+	char value[DECODE_VALUE_MAX];
+	size_t j, len = MIN(ev->len, sizeof(struct dhcp_packet)), n;
+	int first = 1;
+
+	for (j = DHCP_FIXED_NON_UDP + DHCP_COOKIE_LEN; j + 1 < len && data[j] != 255;) {
+		if (data[j] == 0) {
+			j++;
+			continue;
+		}
+		if (j + 2 + data[j + 1] > len)
+			break;
+		n = dhcp_decode_value(data + j, value, sizeof(value));
+		/* Escaping makes 6 bytes of a byte at most */
+		if (end - p < 32 + 6 * n)
+			break;
+		if (json) {
+			p = put_str(p, first ? "{\"code\":" : ",{\"code\":");
+			p = put_u64(p, data[j]);
+			p = put_str(p, ",\"value\":");
+			p = put_escaped(p, value, n);
+			*p++ = '}';
+		} else {
+			p = put_str(p, " opt");
+			p = put_u64(p, data[j]);
+			*p++ = '=';
+			p = put_escaped(p, value, n);
+		}
+		first = 0;
+		j += data[j + 1] + 2;
+	}
+	return p;
+}
+
+size_t
+event_json(const struct log_event *ev, char *buf, size_t size)
+{
+	char *p = buf;
+
+	p = put_str(p, "{\"ts\":");
+	p = put_time(p, &ev->tv);
+	p = put_str(p, ",\"hook\":\"");
+	p = put_str(p, ev->hook);
+	if (ev->ifname != NULL) {
+		p = put_str(p, "\",\"if\":");
+		p = put_escaped(p, ev->ifname, INTF_NAME_LEN);
+		p = put_str(p, ",\"xid\":\"");
+	} else
+		p = put_str(p, "\",\"xid\":\"");
+	p = put_xid(p, ev->xid);
+	p = put_str(p, "\",\"chaddr\":\"");
+	p = put_mac(p, ev->chaddr);
+	if (ev->msg_type != 0) {
+		p = put_str(p, "\",\"type\":\"");
+		p = put_type(p, ev->msg_type);
+	}
+	p = put_str(p, "\",\"giaddr\":\"");
+	p = put_ip(p, ev->giaddr);
+	if (ev->server.s_addr != 0) {
+		p = put_str(p, "\",\"server\":\"");
+		p = put_ip(p, ev->server);
+	}
+	p = put_str(p, "\",\"len\":");
+	p = put_u64(p, ev->len);
+	p = put_str(p, ",\"verdict\":\"");
+	p = put_str(p, ev->verdict);
+	if (ev->dhcp != NULL) {
+		p = put_str(p, "\",\"options\":[");
+		p = put_options(p, buf + size - 4, ev, 1);
+		p = put_str(p, "]}\n");
+	} else
+		p = put_str(p, "\"}\n");
+	return p - buf;
+}
+
+size_t
+event_logfmt(const struct log_event *ev, char *buf, size_t size)
+{
+	char *p = buf;
+
+	p = put_str(p, "ts=");
+	p = put_time(p, &ev->tv);
+	p = put_str(p, " hook=");
+	p = put_str(p, ev->hook);
+	if (ev->ifname != NULL) {
+		p = put_str(p, " if=");
+		p = put_escaped(p, ev->ifname, INTF_NAME_LEN);
+	}
+	p = put_str(p, " xid=");
+	p = put_xid(p, ev->xid);
+	p = put_str(p, " chaddr=");
+	p = put_mac(p, ev->chaddr);
+	if (ev->msg_type != 0) {
+		p = put_str(p, " type=");
+		p = put_type(p, ev->msg_type);
+	}
+	p = put_str(p, " giaddr=");
+	p = put_ip(p, ev->giaddr);
+	if (ev->server.s_addr != 0) {
+		p = put_str(p, " server=");
+		p = put_ip(p, ev->server);
+	}
+	p = put_str(p, " len=");
+	p = put_u64(p, ev->len);
+	p = put_str(p, " verdict=");
+	p = put_str(p, ev->verdict);
+	if (ev->dhcp != NULL)
+		p = put_options(p, buf + size - 1, ev, 0);
+	*p++ = '\n';
+	return p - buf;
+}
@@ -0,0 +1,261 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <machine/atomic.h>
+
+#include "dhcprelya.h"
+
+/* Choose servers a request will be sent to.
+ *
+ * FANOUT_ALL: every server for the interface gets a copy (classic mode).
+ * FANOUT_AFFINITY: a server answered the client last time or the first
+ * healthy server for the interface. If the client is not answered in
+ * fanout_timeout seconds, the request goes to all servers.
+ * FANOUT_HASH: servers of the interface are a pool. A client always goes to
+ * the same healthy server chosen by a rendezvous (highest random weight)
+ * hash of its Client-ID (option 61) or MAC. A server weight depends on its
+ * address and port only, so adding or removing a server moves only clients
+ * of that server (RFC 3074 has the same idea).
+ *
+ * A server health is learned from answers, transactions timeouts and send
+ * errors. A server is down after server_down_after unanswered requests in
+ * a row and it's up again after any answer. Down servers still get
+ * requests in a fan-out and one request in server_retry seconds when they
+ * would be chosen, so they will be noticed when they return.
+ *
+ * A client affinity is a table of 64 bit words written by the server
+ * answers thread and read by the main thread. A word keeps a hash tag of
+ * the client MAC, a server index and a time of the answer, so it's always
+ * read and written at once. */
+
+int fanout_mode = FANOUT_ALL;
+unsigned fanout_timeout = 3, server_down_after = 3, server_retry = 30;
+unsigned affinity_timeout = 3600, affinity_table_size = 65536;
+
+static uint64_t *affinity;
+static unsigned affinity_mask;
+
+#define AFF_TAG(w)	((uint32_t)((w) >> 32))
+#define AFF_SRV(w)	((int)(((w) >> 24) & 0xff))
+#define AFF_TIME(w)	((uint32_t)((w) & 0xffffff))
+#define AFF_MAKE(tag, srv, t)	((uint64_t)(tag) << 32 | (uint64_t)((srv) & 0xff) << 24 | ((t) & 0xffffff))
+
+static inline uint32_t
+chaddr_tag(const uint8_t *chaddr)
+{
+	uint32_t h = chaddr_hash(chaddr);
+
+	/* Zero tag means an empty slot */
+	return h ? h : 1;
+}
+
+static inline uint64_t
+mix64(uint64_t x)
+{
+	/* splitmix64 finalizer */
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return x;
+}
+
+static inline uint64_t
+hash64(const uint8_t *data, int len)
+{
+	uint64_t h = 14695981039346656037ULL;
+	int i;
+
+	/* FNV-1a */
+	for (i = 0; i < len; i++) {
+		h ^= data[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+static inline int
+server_is_up(int srv_idx)
+{
+	return atomic_load_acq_32(&servers[srv_idx]->timeouts) < server_down_after;
+}
+
+/* A down server gets a request once in server_retry seconds to find out
+ * it's alive again. The main thread. */
+static inline int
+server_usable(int srv_idx, const struct timespec *now)
+{
+	if (server_is_up(srv_idx))
+		return 1;
+	if (now->tv_sec - servers[srv_idx]->last_probe >= server_retry) {
+		servers[srv_idx]->last_probe = now->tv_sec;
+		return 1;
+	}
+	return 0;
+}
+
+/* Count unanswered servers of an expired transaction. The main thread. */
+static void
+fanout_expired(const struct xid_entry *e)
+{
+	uint64_t lost;
+	int i;
+
+	lost = e->srv_mask & ~e->replied;
+	for (i = 0; lost != 0 && i < srv_num; i++, lost >>= 1) {
+		if ((lost & 1) == 0)
+			continue;
+		servers[i]->lost++;
+		if (atomic_fetchadd_32(&servers[i]->timeouts, 1) + 1 == server_down_after)
+			logd(LOG_WARNING, "DHCP server %s does not answer. Marked as down.",
+				servers[i]->name);
+	}
+}
+
+int
+fanout_init(void)
+{
+	unsigned n;
+	int i;
+
+	xid_table_set_expire_cb(fanout_expired);
+	for (i = 0; i < srv_num; i++)
+		servers[i]->hash_seed = mix64(hash64((uint8_t *)&servers[i]->sockaddr.sin_addr,
+			sizeof(struct in_addr)) ^ servers[i]->sockaddr.sin_port);
+	if (fanout_mode != FANOUT_AFFINITY)
+		return 1;
+
+	for (n = 1; n < affinity_table_size; n <<= 1)
+		;
+	affinity = calloc(n, sizeof(uint64_t));
+	if (affinity == NULL)
+		return 0;
+	affinity_mask = n - 1;
+	return 1;
+}
+
+/* A server answered a request. The server answers thread. */
+void
+fanout_server_answered(int srv_idx, const struct dhcp_packet *dhcp,
+	const struct timespec *now)
+{
+	uint32_t tag;
+
+	if (srv_idx < 0 || srv_idx >= srv_num)
+		return;
+	if (atomic_load_acq_32(&servers[srv_idx]->timeouts) >= server_down_after)
+		logd(LOG_WARNING, "DHCP server %s is up again", servers[srv_idx]->name);
+	atomic_store_rel_32(&servers[srv_idx]->timeouts, 0);
+	xid_table_answered(dhcp, srv_idx);
+
+	if (affinity == NULL)
+		return;
+	tag = chaddr_tag(dhcp->chaddr);
+	atomic_store_rel_64(&affinity[tag & affinity_mask],
+		AFF_MAKE(tag, srv_idx, now->tv_sec));
+}
+
+/* sendto() failed. The main thread. */
+void
+fanout_send_error(int srv_idx, int error)
+{
+	servers[srv_idx]->errors++;
+	/* The host is not reachable at all. Don't wait for timeouts. */
+	if (error == EHOSTUNREACH || error == EHOSTDOWN || error == ENETUNREACH ||
+	    error == ECONNREFUSED) {
+		if (atomic_load_acq_32(&servers[srv_idx]->timeouts) < server_down_after)
+			logd(LOG_WARNING, "DHCP server %s is unreachable: %s. Marked as down.",
+				servers[srv_idx]->name, strerror(error));
+		atomic_store_rel_32(&servers[srv_idx]->timeouts, server_down_after);
+	}
+}
+
+/* Rendezvous hashing. Every server gets a score for the client, the
+ * highest one wins. If it's down, the best healthy one is used. */
+static int
+hash_select(const struct dhcp_packet *dhcp, const int *srvrs, int srv_cnt,
+	const struct timespec *now)
+{
+	uint64_t key, score, top_score = 0, up_score = 0;
+	uint8_t *opt;
+	int i, srv, top = -1, best_up = -1;
+
+	opt = find_option((struct dhcp_packet *)dhcp, 61);
+	if (opt != NULL && opt[1] > 0)
+		key = hash64(opt + 2, opt[1]);
+	else
+		key = hash64(dhcp->chaddr, ETH_ADDR_LEN);
+
+	for (i = 0; i < srv_cnt; i++) {
+		srv = srvrs[i];
+		score = mix64(key ^ servers[srv]->hash_seed);
+		if (top == -1 || score > top_score) {
+			top = srv;
+			top_score = score;
+		}
+		if (server_is_up(srv) && (best_up == -1 || score > up_score)) {
+			best_up = srv;
+			up_score = score;
+		}
+	}
+	if (best_up == top || best_up == -1 || server_usable(top, now))
+		return top;
+	return best_up;
+}
+
+/* Fill targets[] with indexes of servers for the request from srvrs[]
+ * (servers of an interface or a policy group). Returns a number of servers.
+ * The main thread. */
+int
+fanout_select(const struct dhcp_packet *dhcp, const int *srvrs, int srv_cnt,
+	int *targets, const struct timespec *now)
+{
+	struct xid_entry xe;
+	uint64_t w;
+	uint32_t tag;
+	int i, srv;
+
+	if (fanout_mode == FANOUT_ALL || srv_cnt == 1)
+		goto all;
+
+	if (fanout_mode == FANOUT_HASH) {
+		targets[0] = hash_select(dhcp, srvrs, srv_cnt, now);
+		return 1;
+	}
+
+	/* The client waits too long. Ask everybody. */
+	if (ntohs(dhcp->secs) >= fanout_timeout)
+		goto all;
+	if (xid_table_lookup(dhcp, &xe, now) && xe.replied == 0 &&
+	    now->tv_sec - xe.sent.tv_sec >= fanout_timeout)
+		goto all;
+
+	/* A server answered the client before */
+	tag = chaddr_tag(dhcp->chaddr);
+	w = atomic_load_acq_64(&affinity[tag & affinity_mask]);
+	if (AFF_TAG(w) == tag &&
+	    ((now->tv_sec - AFF_TIME(w)) & 0xffffff) < affinity_timeout) {
+		srv = AFF_SRV(w);
+		for (i = 0; i < srv_cnt; i++)
+			if (srvrs[i] == srv)
+				break;
+		if (i < srv_cnt && server_is_up(srv)) {
+			targets[0] = srv;
+			return 1;
+		}
+	}
+
+	/* The first healthy server is a primary */
+	for (i = 0; i < srv_cnt; i++)
+		if (server_usable(srvrs[i], now)) {
+			targets[0] = srvrs[i];
+			return 1;
+		}
+
+	/* Everybody is down. Try all of them. */
+all:
+	for (i = 0; i < srv_cnt; i++)
+		targets[i] = srvrs[i];
+	return srv_cnt;
+}
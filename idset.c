@@ -0,0 +1,229 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "dhcprelya.h"
+
+/* A set of short byte strings (option 82 sub-option values).
+ *
+ * Keys are kept one after another in an arena as a length byte and data.
+ * The table is open addressing with linear probing of 64 bit slots: a
+ * 32 bit tag of the key hash and an offset of the key in the arena. A zero
+ * tag is an empty slot. A key is compared only if its tag matches, so a
+ * lookup is a hash and about one cache line. The table doubles when it's
+ * half full. An optional Bloom filter of 8 bits per slot (3 probes) answers
+ * most misses without touching the table.
+ *
+ * A set is not changed after it's built, so any number of threads may look
+ * it up. A new set is built for a new list. */
+
+#define IDSET_MIN	64
+#define BLOOM_K		3
+
+struct idset {
+	uint64_t *slots;
+	uint32_t mask, count;
+	uint8_t *keys;
+	size_t keys_len, keys_size;
+	uint64_t *bloom;	/* NULL if disabled */
+	uint32_t bloom_mask;	/* bits - 1 */
+};
+
+static inline uint64_t
+id_hash(const uint8_t *data, unsigned len)
+{
+	uint64_t h = 14695981039346656037ULL;
+	unsigned i;
+
+	/* FNV-1a, then splitmix64 finalizer for high bits to be random too */
+	for (i = 0; i < len; i++)
+		h = (h ^ data[i]) * 1099511628211ULL;
+	h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+	return h ^ (h >> 31);
+}
+
+static inline uint32_t
+id_tag(uint64_t h)
+{
+	/* Zero tag means an empty slot */
+	return (h >> 32) ? (uint32_t)(h >> 32) : 1;
+}
+
+static inline void
+bloom_add(struct idset *s, uint64_t h)
+{
+	uint32_t a = h >> 32, b = (uint32_t)h | 1, bit;
+	int i;
+
+	for (i = 0; i < BLOOM_K; i++, a += b) {
+		bit = a & s->bloom_mask;
+		s->bloom[bit >> 6] |= 1ULL << (bit & 63);
+	}
+}
+
+static inline int
+bloom_test(const struct idset *s, uint64_t h)
+{
+	uint32_t a = h >> 32, b = (uint32_t)h | 1, bit;
+	int i;
+
+	for (i = 0; i < BLOOM_K; i++, a += b) {
+		bit = a & s->bloom_mask;
+		if ((s->bloom[bit >> 6] & (1ULL << (bit & 63))) == 0)
+			return 0;
+	}
+	return 1;
+}
+
+static void
+slot_insert(struct idset *s, uint64_t h, uint32_t off)
+{
+	uint32_t i = h & s->mask;
+
+	while (s->slots[i] != 0)
+		i = (i + 1) & s->mask;
+	s->slots[i] = (uint64_t)id_tag(h) << 32 | off;
+}
+
+/* Rebuild the table (and the filter) of size slots from the arena */
+static int
+rehash(struct idset *s, uint32_t size)
+{
+	uint64_t *slots, *bloom = NULL;
+	size_t off;
+	uint64_t h;
+
+	if ((slots = calloc(size, sizeof(uint64_t))) == NULL)
+		return 0;
+	if (s->bloom != NULL &&
+	    (bloom = calloc(MAX(size / 8, 1), sizeof(uint64_t))) == NULL) {
+		free(slots);
+		return 0;
+	}
+	free(s->slots);
+	s->slots = slots;
+	s->mask = size - 1;
+	if (s->bloom != NULL) {
+		free(s->bloom);
+		s->bloom = bloom;
+		s->bloom_mask = size * 8 - 1;
+	}
+	for (off = 0; off < s->keys_len; off += 1 + s->keys[off]) {
+		h = id_hash(s->keys + off + 1, s->keys[off]);
+		slot_insert(s, h, off);
+		if (s->bloom != NULL)
+			bloom_add(s, h);
+	}
+	return 1;
+}
+
+/* A set for about hint keys */
+struct idset *
+idset_new(unsigned hint, int bloom)
+{
+	struct idset *s;
+	uint32_t size = IDSET_MIN;
+
+	while (size < 0x80000000U && size < 2 * (uint64_t)hint)
+		size <<= 1;
+	if ((s = calloc(1, sizeof(struct idset))) == NULL)
+		return NULL;
+	/* rehash() replaces it */
+	if (bloom && (s->bloom = calloc(1, sizeof(uint64_t))) == NULL) {
+		free(s);
+		return NULL;
+	}
+	if (!rehash(s, size)) {
+		idset_free(s);
+		return NULL;
+	}
+	return s;
+}
+
+static int
+find(const struct idset *s, const uint8_t *data, unsigned len, uint64_t h)
+{
+	uint32_t i, tag = id_tag(h);
+	const uint8_t *key;
+
+	for (i = h & s->mask; s->slots[i] != 0; i = (i + 1) & s->mask) {
+		if ((uint32_t)(s->slots[i] >> 32) != tag)
+			continue;
+		key = s->keys + (uint32_t)s->slots[i];
+		if (key[0] == len && memcmp(key + 1, data, len) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+/* Returns 1 if a key is added, 0 if it's there already, -1 on error */
+int
+idset_add(struct idset *s, const uint8_t *data, unsigned len)
+{
+	uint64_t h;
+	size_t size;
+	uint8_t *p;
+
+	if (len > 255)
+		return -1;
+	h = id_hash(data, len);
+	if (find(s, data, len, h))
+		return 0;
+	if (s->keys_len + 1 + len > UINT32_MAX)
+		return -1;
+	if (s->keys_len + 1 + len > s->keys_size) {
+		size = MAX(s->keys_size * 2, 4096);
+		if ((p = realloc(s->keys, size)) == NULL)
+			return -1;
+		s->keys = p;
+		s->keys_size = size;
+	}
+	s->keys[s->keys_len] = len;
+	memcpy(s->keys + s->keys_len + 1, data, len);
+	if (2 * (s->count + 1) > s->mask + 1) {
+		/* The key is in the arena, rehash() adds it */
+		s->keys_len += 1 + len;
+		if (!rehash(s, 2 * (s->mask + 1))) {
+			s->keys_len -= 1 + len;
+			return -1;
+		}
+	} else {
+		slot_insert(s, h, s->keys_len);
+		if (s->bloom != NULL)
+			bloom_add(s, h);
+		s->keys_len += 1 + len;
+	}
+	s->count++;
+	return 1;
+}
+
+int
+idset_contains(const struct idset *s, const uint8_t *data, unsigned len)
+{
+	uint64_t h;
+
+	if (s == NULL || s->count == 0)
+		return 0;
+	h = id_hash(data, len);
+	if (s->bloom != NULL && !bloom_test(s, h))
+		return 0;
+	return find(s, data, len, h);
+}
+
+unsigned
+idset_count(const struct idset *s)
+{
+	return s != NULL ? s->count : 0;
+}
+
+void
+idset_free(struct idset *s)
+{
+	if (s == NULL)
+		return;
+	free(s->slots);
+	free(s->bloom);
+	free(s->keys);
+	free(s);
+}
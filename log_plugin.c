@@ -26,24 +26,132 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
 #include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/param.h>
 #include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
+#include <machine/atomic.h>
 
 #include "dhcprelya.h"
-#include "dhcp_options.h"
 
-#define BITS8	0
-#define BITS32	1
+/* Hooks do not print. They copy a record (time, hook, interface, XID,
+ * MACs, length and the packet for detailed=yes) into a ring of their
+ * thread. A writer thread formats records with a buffered stdout. Every
+ * ring has one producer and one consumer, so head and tail are only
+ * loaded and stored. When a ring is full a record is counted as lost, a
+ * packet is never delayed. async=no prints in hooks as before.
+ *
+ * With trace_file the writer also saves packets of all hooks into pcapng
+ * files (see pcapng.c). Client side packets are on their interfaces, server
+ * side ones on "servers". A hook name is a packet comment. It works
+ * without debug and costs a copy of a packet in a hook.
+ *
+ * format=json or logfmt writes events (see event_fmt.c) instead of text
+ * lines, with debug or not. They are batched into large write(2) to a file
+ * or stdout, or sent one per datagram to a local socket (unix:/path). */
+
+#define LOG_REQUEST	0
+#define LOG_SEND	1
+#define LOG_ANSWER	2
+#define LOG_REPLY	3
+
+#define LOG_RINGS	(IF_MAX + 2)	/* listeners, main and answer threads */
+#define LOG_BUFSIZE	(256 * 1024)
+
+#define FORMAT_TEXT	0
+#define FORMAT_JSON	1
+#define FORMAT_LOGFMT	2
+
+struct log_record {
+	struct timeval tv;
+	int hook;
+	char ifname[INTF_NAME_LEN];
+	ip_addr_t ifaddr;
+	struct sockaddr_in server;
+	struct packet_headers headers;	/* client side hooks */
+	uint8_t chaddr[ETHER_ADDR_LEN];
+	uint8_t msg_type;
+	struct in_addr giaddr;
+	uint32_t xid;
+	size_t len;
+	uint8_t data[];		/* the packet if detailed or traced */
+};
+
+struct log_ring {
+	uint32_t head;		/* written by the producer */
+	uint32_t lost;
+	uint32_t tail __aligned(CACHE_LINE_SIZE);	/* by the writer */
+	uint8_t *records;
+} __aligned(CACHE_LINE_SIZE);
+
+static unsigned detailed = 0, print_only_incoming = 0, async = 1;
+static unsigned ring_size = 4096, record_size;
+static char *trace_file = NULL;
+static unsigned trace_rotate_size = 0, trace_rotate_time = 0;
+static int tracing = 0;
+static int format = FORMAT_TEXT, out_fd = STDOUT_FILENO, out_dgram = 0;
+static volatile uint32_t send_errors = 0;
+static char out_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static char events[LOG_BUFSIZE];	/* the writer batch */
+static size_t events_len;
+
+static const char *hook_names[] = {
+	"client_request", "send_to_server", "server_answer", "send_to_client"
+};
+
+extern int bootps_port;
+
+static struct log_ring rings[LOG_RINGS];
+static volatile uint32_t rings_num = 0, writer_stop = 0;
+static __thread struct log_ring *ring;
+static __thread int no_ring;
+static pthread_once_t writer_once = PTHREAD_ONCE_INIT;
+static pthread_t writer_tid;
+static int writer_running = 0;
 
-#define SPERW	(7 * 24 * 3600)
-#define SPERD	(24 * 3600)
-#define SPERH	(3600)
-#define SPERM	(60)
+static void *writer(void *arg);
+void log_plugin_destroy(void);
 
-static unsigned detailed = 0, print_only_incoming = 0;
+/* A file or unix:/path for a datagram socket */
+static int
+open_output(const char *path)
+{
+	struct sockaddr_un sun;
+
+	if (strncmp(path, "unix:", 5) != 0) {
+		if ((out_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644)) == -1) {
+			logd(LOG_ERR, "log_plugin: Can't open %s: %s", path, strerror(errno));
+			return 0;
+		}
+		return 1;
+	}
+	path += 5;
+	bzero(&sun, sizeof(sun));
+	sun.sun_family = AF_LOCAL;
+	if (strlcpy(sun.sun_path, path, sizeof(sun.sun_path)) >= sizeof(sun.sun_path)) {
+		logd(LOG_ERR, "log_plugin: Too long socket path: %s", path);
+		return 0;
+	}
+	if ((out_fd = socket(PF_LOCAL, SOCK_DGRAM, 0)) == -1) {
+		logd(LOG_ERR, "log_plugin: socket: %s", strerror(errno));
+		return 0;
+	}
+	/* A reader may start later. Events are counted as lost until then. */
+	if (connect(out_fd, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+		logd(LOG_WARNING, "log_plugin: connect to %s: %s", path, strerror(errno));
+	strlcpy(out_path, path, sizeof(out_path));
+	out_dgram = 1;
+	return 1;
+}
 
 int
 log_plugin_init(plugin_options_head_t *options_head)
@@ -72,6 +180,50 @@ log_plugin_init(plugin_options_head_t *options_head)
 			}
 			if (print_only_incoming)
 				logd(LOG_DEBUG, "log_plugin: Print only incoming: on");
+		} else if (strcasecmp(opts->option_line, "async") == 0) {
+			if ((async = get_bool_value(p)) == -1) {
+				logd(LOG_ERR, "log_plugin: Syntax error at line: %s", opts->option_line);
+				return 0;
+			}
+			logd(LOG_DEBUG, "log_plugin: Async: %s", async ? "on" : "off");
+		} else if (strcasecmp(opts->option_line, "ring_size") == 0) {
+			ring_size = strtoul(p, NULL, 10);
+			if (ring_size < 16 || ring_size > 1024 * 1024) {
+				logd(LOG_ERR, "log_plugin: Wrong ring_size: %s", p);
+				return 0;
+			}
+			/* A power of two for masking */
+			while (ring_size & (ring_size - 1))
+				ring_size &= ring_size - 1;
+			logd(LOG_DEBUG, "log_plugin: Ring size: %u", ring_size);
+		} else if (strcasecmp(opts->option_line, "format") == 0) {
+			if (strcasecmp(p, "text") == 0)
+				format = FORMAT_TEXT;
+			else if (strcasecmp(p, "json") == 0)
+				format = FORMAT_JSON;
+			else if (strcasecmp(p, "logfmt") == 0)
+				format = FORMAT_LOGFMT;
+			else {
+				logd(LOG_ERR, "log_plugin: Unknown format: %s", p);
+				return 0;
+			}
+			logd(LOG_DEBUG, "log_plugin: Format: %s", p);
+		} else if (strcasecmp(opts->option_line, "output") == 0) {
+			if (!open_output(p))
+				return 0;
+			logd(LOG_DEBUG, "log_plugin: Output: %s", p);
+		} else if (strcasecmp(opts->option_line, "trace_file") == 0) {
+			if ((trace_file = strdup(p)) == NULL) {
+				logd(LOG_ERR, "log_plugin: malloc");
+				return 0;
+			}
+			logd(LOG_DEBUG, "log_plugin: Trace file: %s", trace_file);
+		} else if (strcasecmp(opts->option_line, "trace_rotate_size") == 0) {
+			trace_rotate_size = strtoul(p, NULL, 10);
+			logd(LOG_DEBUG, "log_plugin: Trace rotate size: %u MB", trace_rotate_size);
+		} else if (strcasecmp(opts->option_line, "trace_rotate_time") == 0) {
+			trace_rotate_time = strtoul(p, NULL, 10);
+			logd(LOG_DEBUG, "log_plugin: Trace rotate time: %u s", trace_rotate_time);
 		} else {
 			logd(LOG_ERR, "log_plugin: Unknown option at line: %s", opts->option_line);
 			return 0;
@@ -80,436 +232,398 @@ log_plugin_init(plugin_options_head_t *options_head)
 		SLIST_REMOVE(options_head, opts, plugin_options, next);
 		free(opts);
 	}
+	if (trace_file != NULL && !async) {
+		logd(LOG_ERR, "log_plugin: trace_file needs async=yes");
+		return 0;
+	}
+	tracing = trace_file != NULL;
+	record_size = roundup(offsetof(struct log_record, data) +
+		(detailed || tracing ? sizeof(struct dhcp_packet) : 0), sizeof(uint64_t));
 	return 1;
 }
 
-void
-log_plugin_get_time(char *buf)
+/* localtime_r() once a second */
+static void
+format_time(const struct timeval *tv, char *buf)
 {
-	struct timeval tv;
-	struct timezone tz;
-	struct tm tm;
+	static __thread time_t last = -1;
+	static __thread struct tm tm;
 
-	gettimeofday(&tv, &tz);
-	localtime_r((const time_t *)&tv.tv_sec, &tm);
+	if (tv->tv_sec != last) {
+		localtime_r(&tv->tv_sec, &tm);
+		last = tv->tv_sec;
+	}
 	sprintf(buf, "%02d:%02d:%02d.%06lu",
-		tm.tm_hour, tm.tm_min, tm.tm_sec, tv.tv_usec);
+		tm.tm_hour, tm.tm_min, tm.tm_sec, (unsigned long)tv->tv_usec);
 }
 
-/* print the data as a hex-list, with the translation into ascii behind it */
-void
-printHexString(uint8_t *data, int len)
+static void
+print_record(struct log_record *rec)
 {
-	int i, j, k;
-	char c;
-
-	for (i = 0; i <= len / 8; i++) {
-		for (j = 0; j < 8; j++) {
-			if (i * 8 + j >= len)
-				break;
-			printf("%02x", data[i * 8 + j]);
-		}
-		for (k = j; k < 8; k++)
-			printf("  ");
-		printf(" ");
-		for (j = 0; j < 8; j++) {
-			c = data[i * 8 + j];
-			if (i * 8 + j >= len)
-				break;
-			printf("%c", isprint(c) ? c : '.');
-		}
-		if (i * 8 + j < len)
-			printf("\n\t\t\t\t\t    ");
+	char buf[16 + 11 + 18 * 2], timebuf[16], decoded[DECODE_PACKET_MAX];
+	size_t n;
+
+	format_time(&rec->tv, timebuf);
+	switch (rec->hook) {
+	case LOG_REQUEST:
+		printf("%s request on %s XID: %s %s -> %s (%zu bytes)\n", timebuf,
+			rec->ifname, print_xid(rec->xid, buf),
+			ether_ntoa_r((struct ether_addr *)rec->headers.eh.ether_shost, buf + 11),
+			ether_ntoa_r((struct ether_addr *)rec->headers.eh.ether_dhost, buf + 29),
+			rec->len);
+		break;
+	case LOG_SEND:
+		printf("%s send XID: %s to server %s (%zu bytes)\n", timebuf,
+			print_xid(rec->xid, buf),
+			inet_ntop(AF_INET, &rec->server.sin_addr, buf + 11, sizeof(buf) - 11),
+			rec->len);
+		break;
+	case LOG_ANSWER:
+		printf("%s reply from server (%s) XID: %s (%zu bytes)\n", timebuf,
+			inet_ntop(AF_INET, &rec->server.sin_addr, buf, 16),
+			print_xid(rec->xid, buf + 16), rec->len);
+		break;
+	case LOG_REPLY:
+		printf("%s (from %s) send XID: %s for %s via %s (%zu bytes)\n", timebuf,
+			inet_ntop(AF_INET, &rec->server.sin_addr, buf, 16),
+			print_xid(rec->xid, buf + 16),
+			ether_ntoa_r((struct ether_addr *)rec->chaddr, buf + 27),
+			rec->ifname, rec->len);
+		break;
+	}
+	if (detailed) {
+		n = dhcp_decode_packet((struct dhcp_packet *)rec->data, rec->len,
+			decoded, sizeof(decoded));
+		fwrite(decoded, n, 1, stdout);
 	}
 }
 
-/* print the data as a hex-list, without the translation into ascii behind it */
-void
-printHex(uint8_t *data, int len)
+/* Rebuild a frame. Server side hooks have no headers, so they are made
+ * up from addresses. Lengths are set as plugins could change a packet. */
+static void
+trace_record(struct log_record *rec)
 {
-	int i, j;
-
-	for (i = 0; i <= len / 8; i++) {
-		for (j = 0; j < 8; j++) {
-			if (i * 8 + j >= len)
-				break;
-			printf("%02x", data[i * 8 + j]);
+	uint8_t frame[sizeof(struct packet_headers) + sizeof(struct dhcp_packet)];
+	struct packet_headers *h = (struct packet_headers *)frame;
+	struct dhcp_packet *dhcp = (struct dhcp_packet *)rec->data;
+	char comment[32 + INTF_NAME_LEN];
+	size_t len = MIN(rec->len, sizeof(struct dhcp_packet));
+	int in = rec->hook == LOG_REQUEST || rec->hook == LOG_ANSWER;
+
+	if (rec->hook == LOG_REQUEST || rec->hook == LOG_REPLY) {
+		memcpy(h, &rec->headers, sizeof(struct packet_headers));
+	} else {
+		bzero(h, sizeof(struct packet_headers));
+		h->eh.ether_type = htons(ETHERTYPE_IP);
+		h->ip.ip_v = IPVERSION;
+		h->ip.ip_hl = 5;
+		h->ip.ip_ttl = 64;
+		h->ip.ip_p = IPPROTO_UDP;
+		if (in) {
+			h->ip.ip_src = rec->server.sin_addr;
+			h->ip.ip_dst = dhcp->giaddr;
+			h->udp.uh_sport = rec->server.sin_port;
+			h->udp.uh_dport = bootps_port;
+		} else {
+			h->ip.ip_src.s_addr = rec->ifaddr;
+			h->ip.ip_dst = rec->server.sin_addr;
+			h->udp.uh_sport = bootps_port;
+			h->udp.uh_dport = rec->server.sin_port;
 		}
-		if (i * 8 + j < len)
-			printf("\n\t\t\t\t\t    ");
 	}
+	h->ip.ip_len = htons(DHCP_UDP_OVERHEAD + len);
+	h->ip.ip_sum = 0;
+	h->ip.ip_sum = htons(ip_checksum((const char *)&h->ip, sizeof(struct ip)));
+	h->udp.uh_ulen = htons(sizeof(struct udphdr) + len);
+	h->udp.uh_sum = 0;	/* no checksum */
+	memcpy(frame + sizeof(struct packet_headers), dhcp, len);
+
+	if (rec->hook == LOG_SEND)
+		snprintf(comment, sizeof(comment), "%s from %s", hook_names[rec->hook],
+			rec->ifname);
+	else
+		strlcpy(comment, hook_names[rec->hook], sizeof(comment));
+	pcapng_write(rec->hook == LOG_REQUEST || rec->hook == LOG_REPLY ?
+		rec->ifname : "servers", in ? PCAPNG_IN : PCAPNG_OUT, &rec->tv,
+		frame, sizeof(struct packet_headers) + len, comment);
 }
 
-/* print the data as a hex-list seperated by colons */
-void
-printHexColon(uint8_t *data, int len)
+/* Packets are seen by log_plugin only if preceding plugins passed them */
+static size_t
+format_event(const struct log_record *rec, char *buf, size_t size)
 {
-	int i;
+	struct log_event ev;
+
+	ev.tv = rec->tv;
+	ev.hook = hook_names[rec->hook];
+	ev.ifname = rec->hook != LOG_ANSWER ? rec->ifname : NULL;
+	ev.xid = rec->xid;
+	ev.chaddr = rec->chaddr;
+	ev.msg_type = rec->msg_type;
+	ev.giaddr = rec->giaddr;
+	ev.server.s_addr = rec->hook != LOG_REQUEST ? rec->server.sin_addr.s_addr : 0;
+	ev.len = rec->len;
+	ev.verdict = "pass";
+	ev.dhcp = detailed ? (const struct dhcp_packet *)rec->data : NULL;
+	if (format == FORMAT_JSON)
+		return event_json(&ev, buf, size);
+	return event_logfmt(&ev, buf, size);
+}
 
-	for (i = 0; i < len; i++) {
-		if (i != 0)
-			printf(":");
-		printf("%02x", data[i]);
+static void
+send_event(const char *buf, size_t len)
+{
+	struct sockaddr_un sun;
+
+	if (send(out_fd, buf, len, MSG_DONTWAIT) != -1)
+		return;
+	atomic_add_32(&send_errors, 1);
+	/* Reconnect if a reader was restarted */
+	if (errno == ENOTCONN || errno == ECONNREFUSED || errno == ENOENT) {
+		bzero(&sun, sizeof(sun));
+		sun.sun_family = AF_LOCAL;
+		strlcpy(sun.sun_path, out_path, sizeof(sun.sun_path));
+		connect(out_fd, (struct sockaddr *)&sun, sizeof(sun));
 	}
 }
 
-const char*
-print_tok(const struct tok *t, uint8_t v)
+static void
+flush_events(void)
+{
+	if (events_len > 0 && write(out_fd, events, events_len) == -1)
+		atomic_add_32(&send_errors, 1);
+	events_len = 0;
+}
+
+/* Datagrams are sent at once, a file gets batches */
+static void
+write_event(const struct log_record *rec)
 {
-	while (t->s != NULL) {
-		if (t->v == v)
-			return t->s;
-		t++;
+	char buf[EVENT_DETAILED_MAX];
+
+	if (out_dgram) {
+		send_event(buf, format_event(rec, buf, sizeof(buf)));
+		return;
 	}
-	return "unknown";
+	if (events_len + EVENT_DETAILED_MAX > sizeof(events))
+		flush_events();
+	events_len += format_event(rec, events + events_len, EVENT_DETAILED_MAX);
 }
 
-void
-print_word(uint8_t *data)
+static int
+shown(int hook)
 {
-	printf("%d", (data[0] << 8) + data[1]);
+	return !print_only_incoming || hook == LOG_REQUEST || hook == LOG_ANSWER;
 }
 
-/* print the data as a 8 and 32 bits time-value */
-void
-print_time(uint8_t *data, int bits)
+/* Does a hook need a record? Text is printed with debug only. */
+static int
+wanted(int hook)
 {
-	int t;
+	return tracing ||
+		((format != FORMAT_TEXT || debug) && shown(hook));
+}
 
-	if (bits == BITS8)
-		t = data[0];
-	else
-		t = (data[0] << 24) + (data[1] << 16) + (data[2] << 8) + data[3];
+static void
+start_writer(void)
+{
+	if (tracing && !pcapng_open(trace_file, (off_t)trace_rotate_size * 1024 * 1024,
+	    trace_rotate_time))
+		tracing = 0;
+	fflush(stdout);
+	setvbuf(stdout, NULL, _IOFBF, LOG_BUFSIZE);
+	if (pthread_create(&writer_tid, NULL, writer, NULL) != 0) {
+		logd(LOG_ERR, "log_plugin: Can't create a writer thread");
+		return;
+	}
+	writer_running = 1;
+	/* dhcprelya -r exits without plugins destroy() */
+	atexit(log_plugin_destroy);
+}
 
-	printf("%d (", t);
-	if (t > SPERW) {
-		printf("%dw", t / (SPERW));
-		t %= SPERW;
+/* A ring of the calling thread. Allocated on a first packet. */
+static struct log_ring *
+ring_self(void)
+{
+	struct log_ring *r;
+	uint8_t *records;
+	uint32_t n;
+
+	if (ring != NULL || no_ring)
+		return ring;
+	pthread_once(&writer_once, start_writer);
+	no_ring = 1;
+	if (!writer_running)
+		return NULL;
+	n = atomic_fetchadd_32(&rings_num, 1);
+	if (n >= LOG_RINGS) {
+		logd(LOG_ERR, "log_plugin: Too many threads");
+		return NULL;
 	}
-	if (t > SPERD) {
-		printf("%dd", t / (SPERD));
-		t %= SPERD;
+	r = &rings[n];
+	if ((records = calloc(ring_size, record_size)) == NULL) {
+		logd(LOG_ERR, "log_plugin: Can't allocate a ring");
+		return NULL;
 	}
-	if (t > SPERH) {
-		printf("%dh", t / (SPERH));
-		t %= SPERH;
+	atomic_store_rel_ptr((volatile uintptr_t *)&r->records, (uintptr_t)records);
+	ring = r;
+	return r;
+}
+
+/* A free record or NULL if the ring is full */
+static struct log_record *
+ring_reserve(struct log_ring *r)
+{
+	if (r->head - atomic_load_acq_32(&r->tail) >= ring_size) {
+		r->lost++;
+		return NULL;
 	}
-	if (t > SPERM) {
-		printf("%dm", t / (SPERM));
-		t %= SPERM;
+	return (struct log_record *)(r->records +
+		(size_t)(r->head & (ring_size - 1)) * record_size);
+}
+
+static void *
+writer(void *arg)
+{
+	struct timespec ts = {0, 1000000};	/* 1ms */
+	struct log_ring *r;
+	struct log_record *rec;
+	uint64_t lost, reported = 0;
+	uint32_t head, tail;
+	u_int i, n, written;
+	time_t last_report = 0;
+
+	for (;;) {
+		written = 0;
+		n = MIN(atomic_load_acq_32(&rings_num), LOG_RINGS);
+		lost = 0;
+		for (i = 0; i < n; i++) {
+			r = &rings[i];
+			/* A ring is being allocated */
+			if (atomic_load_acq_ptr((volatile uintptr_t *)&r->records) == 0)
+				continue;
+			head = atomic_load_acq_32(&r->head);
+			for (tail = r->tail; tail != head; tail++) {
+				rec = (struct log_record *)(r->records +
+					(size_t)(tail & (ring_size - 1)) * record_size);
+				if (shown(rec->hook)) {
+					if (format != FORMAT_TEXT)
+						write_event(rec);
+					else if (debug)
+						print_record(rec);
+				}
+				if (tracing)
+					trace_record(rec);
+				written++;
+			}
+			atomic_store_rel_32(&r->tail, tail);
+			lost += atomic_load_acq_32(&r->lost);
+		}
+		lost += atomic_load_acq_32(&send_errors);
+		if (lost != reported &&
+		    (time(NULL) != last_report || atomic_load_acq_32(&writer_stop))) {
+			/* Not into a stream of events */
+			if (format != FORMAT_TEXT)
+				logd(LOG_WARNING, "log_plugin: %ju records lost",
+					(uintmax_t)(lost - reported));
+			else
+				printf("log_plugin: %ju records lost\n", (uintmax_t)(lost - reported));
+			reported = lost;
+			last_report = time(NULL);
+		}
+		if (written == 0) {
+			flush_events();
+			fflush(stdout);
+			if (tracing)
+				pcapng_flush();
+			if (atomic_load_acq_32(&writer_stop))
+				break;
+			nanosleep(&ts, NULL);
+		}
 	}
-	if (t > 0)
-		printf("%ds", t);
-	printf(")");
+	return NULL;
 }
 
-void
-printReqParmList(uint8_t *data, int len)
+/* Fill a record for a hook. The packet is copied only if it's needed. */
+static void
+fill_record(struct log_record *rec, int hook, const struct interface *intf,
+	const struct sockaddr_in *server, const struct packet_headers *headers,
+	struct dhcp_packet *dhcp)
 {
-	int i;
+	uint8_t *opt;
 
-	for (i = 0; i < len; i++) {
-		printf("%3d (%s)\n", data[i], dhcp_options[data[i]]);
-		printf("\t\t\t\t\t    ");
+	gettimeofday(&rec->tv, NULL);
+	rec->hook = hook;
+	if (intf != NULL) {
+		strlcpy(rec->ifname, intf->name, sizeof(rec->ifname));
+		rec->ifaddr = intf->ip;
 	}
+	if (server != NULL)
+		rec->server = *server;
+	if (headers != NULL)
+		memcpy(&rec->headers, headers, sizeof(struct packet_headers));
+	memcpy(rec->chaddr, dhcp->chaddr, ETHER_ADDR_LEN);
+	rec->giaddr = dhcp->giaddr;
+	rec->msg_type = 0;
+	if (format != FORMAT_TEXT && (opt = find_option(dhcp, 53)) != NULL &&
+	    *opt == 53 && opt[1] == 1)
+		rec->msg_type = opt[2];
+	rec->xid = dhcp->xid;
+	rec->len = get_dhcp_len(dhcp);
+	if (detailed || tracing)
+		memcpy(rec->data, dhcp, MIN(rec->len, sizeof(struct dhcp_packet)));
 }
 
-void
-print_dhcp_packet(struct dhcp_packet *dhcp, int data_len)
+/* async=no: print or send in a hook */
+static void
+log_now(int hook, const struct interface *intf, const struct sockaddr_in *server,
+	const struct packet_headers *headers, struct dhcp_packet *dhcp)
 {
-	char buf[1024];
-	uint8_t *data;
-	int i, j;
-
-	puts("---------------------------------------------------------------------------");
-	printf("op: %d (%s)\n", dhcp->op,
-		dhcp->op == 1 ? "BOOTREQUEST" :
-				(dhcp->op == 2 ? "BOOTREPLY" : "illegal"));
-	printf("htype: %d (%s)\n", dhcp->htype, dhcp->htype == 1 ? "Ethernet" :
-									"");
-	printf("hlen: %d\n", dhcp->hlen);
-	printf("hops: %d\n", dhcp->hops);
-	printf("xid: %s\n", print_xid(dhcp->xid, buf));
-	printf("secs: %d\n", dhcp->secs);
-	printf("flags: 0x%X\n", dhcp->flags);
-	printf("ciaddr: %s\n", inet_ntop(AF_INET, &dhcp->ciaddr.s_addr,
-					buf, sizeof(buf)));
-	printf("yiaddr: %s\n", inet_ntop(AF_INET, &dhcp->yiaddr.s_addr,
-					buf, sizeof(buf)));
-	printf("siaddr: %s\n", inet_ntop(AF_INET, &dhcp->siaddr.s_addr,
-					buf, sizeof(buf)));
-	printf("giaddr: %s\n", inet_ntop(AF_INET, &dhcp->giaddr.s_addr,
-					buf, sizeof(buf)));
-	printf("chaddr: %s\n", ether_ntoa_r((struct ether_addr*)dhcp->chaddr,
-						buf));
-	printf("sname: %s.\n", dhcp->sname);
-	printf("file: %s.\n", dhcp->file);
-
-	data = (uint8_t *)dhcp;
-	/* print options */
-	j = DHCP_FIXED_NON_UDP;
-	/* XXX print cookie */
-	j += DHCP_COOKIE_LEN;
-	while (j < data_len && data[j] != 255) {
-		printf("OPTION: %3d (%3d) %-26s", data[j], data[j + 1],
-			dhcp_options[data[j]]);
-		switch (data[j]) {
-		default:
-			printHexString(data + j + 2, data[j + 1]);
-			break;
-		case 0:	/* padding */
-			break;
-		case 1:	/* Subnetmask */
-		case 3:	/* Routers */
-		case 16:	/* Swap server */
-		case 28:	/* Broadcast address */
-		case 32:	/* Router solicitation */
-		case 50:	/* Requested IP address */
-		case 54:	/* Server identifier */
-			printf("%s", inet_ntop(AF_INET, data + j + 2,
-						buf, sizeof(buf)));
-			break;
-
-		case 12:	/* Hostname */
-		case 14:	/* Merit dump file */
-		case 15:	/* Domain name */
-		case 17:	/* Root Path */
-		case 18:	/* Extensions path */
-		case 40:	/* NIS domain */
-		case 56:	/* Message */
-		case 62:	/* Netware/IP domain name */
-		case 64:	/* NIS+ domain */
-		case 66:	/* TFTP server name */
-		case 67:	/* bootfile name */
-		case 60:	/* Vendor class identifier */
-		case 86:	/* NDS Tree name */
-		case 87:	/* NDS context */
-		case 252:	/* MSFT - WinSock Proxy Auto Detect */
-			strlcpy(buf, (char *)&data[j + 2], data[j + 1]+1);
-			buf[data[j + 1]] = 0;
-			printf("%s", buf);
-			break;
-
-		case 4:	/* Time servers */
-		case 5:	/* Name servers */
-		case 6:	/* DNS server */
-		case 7:	/* Log server */
-		case 8:	/* Cookie server */
-		case 9:	/* LPR server */
-		case 10:	/* Impress server */
-		case 11:	/* Resource location server */
-		case 41:	/* NIS servers */
-		case 42:	/* NTP servers */
-		case 44:	/* NetBIOS name server */
-		case 45:	/* NetBIOS datagram distribution server */
-		case 48:	/* X Window System font server */
-		case 49:	/* X Window System display server */
-		case 65:	/* NIS+ servers */
-		case 68:	/* Mobile IP home agent */
-		case 69:	/* SMTP server */
-		case 70:	/* POP3 server */
-		case 71:	/* NNTP server */
-		case 72:	/* WWW server */
-		case 73:	/* Finger server */
-		case 74:	/* IRC server */
-		case 75:	/* StreetTalk server */
-		case 76:	/* StreetTalk directory assistance server */
-		case 85:	/* NDS server */
-		case 150:	/* CiscoCallManagerTFTP */
-			for (i = 0; i < data[j + 1] / 4; i++) {
-				if (i != 0)
-					printf(",");
-				printf("%s", inet_ntop(AF_INET,
-						data + j + 2 + i * 4,
-						buf, sizeof(buf)));
-			}
-			break;
-
-		case 21:	/* Policy filter */
-			for (i = 0; i < data[j + 1] / 8; i++) {
-				if (i != 0)
-					printf(",");
-				printf("%s/%s",
-					inet_ntop(AF_INET,
-						data + j + 2 + i * 8,
-						buf, sizeof(buf)),
-					inet_ntop(AF_INET,
-						(data + j + 2 + i * 8) + 4,
-						buf+16, sizeof(buf)-16)
-				);
-			}
-			break;
-
-		case 33:	/* Static route */
-			for (i = 0; i < data[j + 1] / 8; i++) {
-				if (i != 0)
-					printf(",");
-				printf("%s %s",
-					inet_ntop(AF_INET,
-						data + j + 2 + i * 8,
-						buf, sizeof(buf)),
-					inet_ntop(AF_INET,
-						(data + j + 2 + i * 8) + 4,
-						buf+16, sizeof(buf)-16)
-				);
-			}
-			break;
+	union {
+		struct log_record rec;
+		uint8_t buf[offsetof(struct log_record, data) + sizeof(struct dhcp_packet)];
+	} local;
+	char buf[EVENT_DETAILED_MAX];
+	size_t n;
+
+	fill_record(&local.rec, hook, intf, server, headers, dhcp);
+	if (format == FORMAT_TEXT) {
+		print_record(&local.rec);
+		fflush(stdout);
+		return;
+	}
+	n = format_event(&local.rec, buf, sizeof(buf));
+	if (out_dgram)
+		send_event(buf, n);
+	else if (write(out_fd, buf, n) == -1)
+		atomic_add_32(&send_errors, 1);
+}
 
-		case 25:	/* Path MTU plateau table */
-			for (i = 0; i < data[j + 1] / 2; i++) {
-				if (i != 0)
-					printf(",");
-				print_word(data + j + 2 + i * 2);
-			}
-			break;
-
-		case 13:	/* bootfile size */
-		case 22:	/* Maximum datagram reassembly size */
-		case 26:	/* Interface MTU */
-		case 57:	/* Maximum DHCP message size */
-			print_word(data + j + 2);
-			break;
-
-		case 19:	/* IP forwarding enabled/disable */
-		case 20:	/* Non-local source routing */
-		case 27:	/* All subnets local */
-		case 29:	/* Perform mask discovery */
-		case 30:	/* Mask supplier */
-		case 31:	/* Perform router discovery */
-		case 34:	/* Trailer encapsulation */
-		case 39:	/* TCP keepalive garbage */
-			printf("%d (%s)", data[j + 2], enabledisable[data[j + 2]]);
-			break;
-
-		case 23:	/* Default IP TTL */
-			print_time(data + j + 2, BITS8);
-			break;
-
-		case 37:	/* TCP default TTL */
-			printf("%d", data[j + 2]);
-			break;
-
-		case 43:	/* Vendor specific info */
-		case 47:	/* NetBIOS scope (no idea how it looks like) */
-			printHexString(data + j + 2, data[j + 1]);
-			break;
-
-		case 46:	/* NetBIOS over TCP/IP node type */
-			printf("%d (%s)",
-				data[j + 2], netbios_node_type[data[j + 2]]);
-			break;
-
-		case 2:	/* Time offset */
-		case 24:	/* Path MTU aging timeout */
-		case 35:	/* ARP cache timeout */
-		case 38:	/* TCP keepalive interval */
-		case 51:	/* IP address leasetime */
-		case 58:	/* T1 */
-		case 59:	/* T2 */
-			print_time(data + j + 2, BITS32);
-			break;
-
-		case 36:	/* Ethernet encapsulation */
-			printf("%d (%s)",
-				data[j + 2],
-				data[j + 2] > sizeof(ethernet_encapsulation) ?
-				"*wrong value*" :
-				ethernet_encapsulation[data[j + 2]]);
-			break;
-
-		case 52:	/* Option overload */
-			printf("%d (%s)",
-				data[j + 2],
-				data[j + 2] > sizeof(option_overload) ?
-				"*wrong value*" :
-				option_overload[data[j + 2]]);
-			break;
-
-		case 53:	/* DHCP message type */
-			printf("%d (%s)",
-				data[j + 2],
-				data[j + 2] > sizeof(dhcp_message_types) ?
-				"*wrong value*" :
-				dhcp_message_types[data[j + 2]]);
-			break;
-
-		case 55:	/* Parameter Request List */
-			printReqParmList(data + j + 2, data[j + 1]);
-			break;
-
-		case 63:	/* Netware/IP domain information */
-			printHex(data + j + 2, data[j + 1]);
-			break;
-
-		case 61:	/* Client identifier */
-			if (data[j + 2] != 0) {
-				printf("%s ", print_tok(arp2str, data[j + 2]));
-				printHexColon(data + j + 3, data[j + 1] - 1);
-			} else {
-				strlcpy(buf, (char *)&data[j + 3], data[j + 1]-1);
-				buf[data[j + 1] - 1] = 0;
-				printf("%s", buf);
-			}
-			break;
-
-		case 81:	/* Client FQDN */
-			printf("%d", data[j + 2]);
-			printf("-");
-			printf("%d", data[j + 3]);
-			printf("-");
-			printf("%d", data[j + 4]);
-			printf(" ");
-			strlcpy(buf, (char *)&data[j + 5], data[j + 1] - 2);
-			buf[data[j + 1] - 3] = 0;
-			printf("%s", buf);
-			break;
-
-		case 82:	/* Relay Agent Information */
-			for (i = j + 2; i < j + data[j + 1];) {
-				printf("\n%-5s subopt: %3d (%3d) %-19s ", " ",
-					data[i], data[i + 1],
-					data[i] > sizeof(relayagent_suboptions) ?
-					"*wrong value*" :
-					relayagent_suboptions[data[i]]);
-				if (i + data[i + 1] > j + data[j + 1]) {
-					printf("*MALFORMED -- TOO LARGE*\n");
-					break;
-				}
-				printHexString(data + i + 2, data[i + 1]);
-				i += data[i + 1] + 2;
-			}
-			break;
-		}
-		printf("\n");
-		if (data[j] == 0)	/* padding */
-			j++;
-		else
-			j += data[j + 1] + 2;
+static void
+log_packet(int hook, const struct interface *intf, const struct sockaddr_in *server,
+	const struct packet_headers *headers, struct dhcp_packet *dhcp)
+{
+	struct log_record *rec;
+	struct log_ring *r;
+
+	if (!async) {
+		log_now(hook, intf, server, headers, dhcp);
+		return;
 	}
-	puts("---------------------------------------------------------------------------\n");
+	if ((r = ring_self()) == NULL)
+		return;
+	if ((rec = ring_reserve(r)) == NULL)
+		return;
+	fill_record(rec, hook, intf, server, headers, dhcp);
+	atomic_store_rel_32(&r->head, r->head + 1);
 }
 
 int
 log_plugin_client_request(const struct interface *intf,
 				struct dhcp_packet *dhcp, struct packet_headers *headers)
 {
-	char buf[18 * 2 + 11], timebuf[16], logbuf[256];
-	size_t dhcp_len;
-
-	if (debug) {
-		dhcp_len = get_dhcp_len(dhcp);
-		log_plugin_get_time(timebuf);
-		sprintf(logbuf, "%s request on %s XID: %s %s -> %s (%zu bytes)", timebuf,
-			intf->name,
-			print_xid(dhcp->xid, buf),
-			ether_ntoa_r((struct ether_addr*)headers->eh.ether_shost, buf+11),
-			ether_ntoa_r((struct ether_addr*)headers->eh.ether_dhost, buf+29),
-			dhcp_len
-		);
-		puts(logbuf);
-		if (detailed)
-			print_dhcp_packet(dhcp, dhcp_len);
-	}
+	if (wanted(LOG_REQUEST))
+		log_packet(LOG_REQUEST, intf, NULL, headers, dhcp);
 	return 1;
 }
 
@@ -517,22 +631,8 @@ int
 log_plugin_send_to_server(const struct sockaddr_in *server,
 				const struct interface *input_intf, struct dhcp_packet *dhcp)
 {
-	char buf[16 + 11], timebuf[16], logbuf[256];
-	size_t dhcp_len;
-
-	if (debug && !print_only_incoming) {
-		dhcp_len = get_dhcp_len(dhcp);
-		log_plugin_get_time(timebuf);
-		sprintf(logbuf, "%s send XID: %s to server %s (%zu bytes)", timebuf,
-			print_xid(dhcp->xid, buf),
-			inet_ntop(AF_INET, &server->sin_addr.s_addr,
-					buf+11, sizeof(buf)-11),
-			dhcp_len
-		);
-		puts(logbuf);
-		if (detailed)
-			print_dhcp_packet(dhcp, dhcp_len);
-	}
+	if (wanted(LOG_SEND))
+		log_packet(LOG_SEND, input_intf, server, NULL, dhcp);
 	return 1;
 }
 
@@ -540,22 +640,8 @@ int
 log_plugin_server_answer(const struct sockaddr_in *server,
 				struct dhcp_packet *dhcp)
 {
-	char buf[16 + 11], timebuf[16], logbuf[256];
-	size_t dhcp_len;
-
-	if (debug) {
-		dhcp_len = get_dhcp_len(dhcp);
-		log_plugin_get_time(timebuf);
-		sprintf(logbuf, "%s reply from server (%s) XID: %s (%zu bytes)", timebuf,
-			inet_ntop(AF_INET, &server->sin_addr.s_addr,
-				buf, sizeof(buf)),
-			print_xid(dhcp->xid, buf + 16),
-			dhcp_len
-		);
-		puts(logbuf);
-		if (detailed)
-			print_dhcp_packet(dhcp, dhcp_len);
-	}
+	if (wanted(LOG_ANSWER))
+		log_packet(LOG_ANSWER, NULL, server, NULL, dhcp);
 	return 1;
 }
 
@@ -564,31 +650,29 @@ log_plugin_send_to_client(const struct sockaddr_in *server,
 			const struct interface *intf,
 			struct dhcp_packet *dhcp, struct packet_headers *headers)
 {
-	char buf[11 + 16 + 18], timebuf[16], logbuf[256];
-	size_t dhcp_len;
-
-	if (debug && !print_only_incoming) {
-		dhcp_len = get_dhcp_len(dhcp);
-
-		log_plugin_get_time(timebuf);
-		sprintf(logbuf, "%s (from %s) send XID: %s for %s via %s (%zu bytes)", timebuf,
-			inet_ntop(AF_INET, &server->sin_addr.s_addr,
-					buf, sizeof(buf)),
-			print_xid(dhcp->xid, buf + 16),
-			ether_ntoa_r((struct ether_addr*)dhcp->chaddr, buf+27),
-			intf->name, dhcp_len
-		);
-		puts(logbuf);
-		if (detailed)
-			print_dhcp_packet(dhcp, dhcp_len);
-	}
+	if (wanted(LOG_REPLY))
+		log_packet(LOG_REPLY, intf, server, headers, dhcp);
 	return 1;
 }
 
+/* Stop the writer when all records are written */
+void
+log_plugin_destroy(void)
+{
+	if (!writer_running)
+		return;
+	writer_running = 0;
+	atomic_store_rel_32(&writer_stop, 1);
+	pthread_join(writer_tid, NULL);
+	fflush(stdout);
+	if (tracing)
+		pcapng_close();
+}
+
 struct plugin_data log_plugin = {
 	"log",
 	log_plugin_init,
-	NULL,			/* no destroy() function */
+	log_plugin_destroy,
 	log_plugin_client_request,
 	log_plugin_send_to_server,
 	log_plugin_server_answer,
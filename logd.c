@@ -0,0 +1,217 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <machine/atomic.h>
+
+#include "dhcprelya.h"
+
+/* Log messages.
+ *
+ * logd() is a macro (see dhcprelya.h): LOG_DEBUG without -d costs a
+ * compare, arguments are not even evaluated. Every call site has a
+ * static struct log_site with a per second counter. Messages over
+ * log_rate a second are only counted, not formatted, and a writer thread
+ * reports them as "repeated N times" once a second.
+ *
+ * Packet threads format a message on a stack and copy it into a bounded
+ * queue under a mutex held for a memcpy. syslog(3) or a log file are
+ * written by the writer thread only. If the queue is full a message is
+ * counted as lost. Before logd_start() (config parsing, -d, replay) and in
+ * plugins not sharing the main program symbols messages are written at
+ * once as before. */
+
+#define LOG_MSG_MAX	1024
+
+struct log_msg {
+	int level;
+	char text[LOG_MSG_MAX];
+};
+
+static struct log_msg *queue;
+static unsigned queue_size, head, tail;
+static unsigned rate;
+static uint32_t lost;
+static int started = 0, stop = 0;
+static FILE *log_file = NULL;
+static struct log_site *sites;		/* ever suppressed, under lock */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static pthread_t writer_tid;
+
+static void
+output(int level, const char *text)
+{
+	char stamp[32];
+	struct tm tm;
+	time_t now;
+
+	if (debug)
+		printf("%s\n", text);
+	else if (log_file != NULL) {
+		now = time(NULL);
+		localtime_r(&now, &tm);
+		strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+		fprintf(log_file, "%s %s\n", stamp, text);
+	} else
+		syslog(level, "%s", text);
+}
+
+/* Summaries of suppressed messages and of lost ones */
+static void
+report(void)
+{
+	struct log_site *site;
+	char text[LOG_MSG_MAX];
+	uint32_t n;
+
+	pthread_mutex_lock(&lock);
+	for (site = sites; site != NULL; site = site->next) {
+		if ((n = atomic_readandclear_32(&site->suppressed)) == 0)
+			continue;
+		snprintf(text, sizeof(text), "last message repeated %u times: %s",
+			n, site->fmt);
+		pthread_mutex_unlock(&lock);
+		output(site->level, text);
+		pthread_mutex_lock(&lock);
+	}
+	n = lost;
+	lost = 0;
+	pthread_mutex_unlock(&lock);
+	if (n != 0) {
+		snprintf(text, sizeof(text), "logd: %u messages lost", n);
+		output(LOG_WARNING, text);
+	}
+}
+
+static void *
+writer(void *arg)
+{
+	struct log_msg msg;
+	struct timespec ts;
+	time_t reported = time(NULL);
+
+	pthread_mutex_lock(&lock);
+	for (;;) {
+		while (head == tail && !stop) {
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec++;
+			pthread_cond_timedwait(&cond, &lock, &ts);
+			if (time(NULL) != reported)
+				break;
+		}
+		while (head != tail) {
+			memcpy(&msg, &queue[tail], sizeof(msg));
+			tail = (tail + 1) % queue_size;
+			pthread_mutex_unlock(&lock);
+			output(msg.level, msg.text);
+			pthread_mutex_lock(&lock);
+		}
+		if (time(NULL) != reported || stop) {
+			reported = time(NULL);
+			pthread_mutex_unlock(&lock);
+			report();
+			if (log_file != NULL)
+				fflush(log_file);
+			pthread_mutex_lock(&lock);
+		}
+		if (stop && head == tail)
+			break;
+	}
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+void
+logd_site(struct log_site *site, int level, const char *fmt,...)
+{
+	va_list ap;
+	char text[LOG_MSG_MAX];
+	uint32_t second;
+
+	if (started && level != LOG_DEBUG && rate != 0) {
+		second = time(NULL);
+		/* Races only let a few more messages through */
+		if (site->second != second) {
+			site->second = second;
+			site->count = 0;
+		}
+		if (atomic_fetchadd_32(&site->count, 1) >= rate) {
+			if (atomic_fetchadd_32(&site->suppressed, 1) == 0 &&
+			    !site->listed) {
+				pthread_mutex_lock(&lock);
+				if (!site->listed) {
+					site->fmt = fmt;
+					site->level = level;
+					site->next = sites;
+					sites = site;
+					site->listed = 1;
+				}
+				pthread_mutex_unlock(&lock);
+			}
+			return;
+		}
+	}
+
+	va_start(ap, fmt);
+	vsnprintf(text, sizeof(text), fmt, ap);
+	va_end(ap);
+	if (!started || level == LOG_DEBUG) {
+		output(level, text);
+		return;
+	}
+
+	pthread_mutex_lock(&lock);
+	if ((head + 1) % queue_size == tail)
+		lost++;
+	else {
+		queue[head].level = level;
+		strlcpy(queue[head].text, text, LOG_MSG_MAX);
+		head = (head + 1) % queue_size;
+		pthread_cond_signal(&cond);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+/* Must be called after daemon(3). file is NULL for syslog. A rate is
+ * messages a second a call site may log, 0 - no limit. */
+int
+logd_start(const char *file, unsigned max_rate, unsigned size)
+{
+	if (file != NULL && (log_file = fopen(file, "a")) == NULL) {
+		logd(LOG_ERR, "Can't open log file %s: %s", file, strerror(errno));
+		return 0;
+	}
+	if ((queue = calloc(size, sizeof(struct log_msg))) == NULL) {
+		logd(LOG_ERR, "logd: malloc");
+		return 0;
+	}
+	queue_size = size;
+	rate = max_rate;
+	if (pthread_create(&writer_tid, NULL, writer, NULL) != 0) {
+		logd(LOG_ERR, "logd: can't create a writer thread");
+		return 0;
+	}
+	started = 1;
+	atexit(logd_stop);
+	return 1;
+}
+
+/* Write all queued messages and summaries */
+void
+logd_stop(void)
+{
+	if (!started)
+		return;
+	pthread_mutex_lock(&lock);
+	stop = 1;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+	pthread_join(writer_tid, NULL);
+	started = 0;
+	if (log_file != NULL)
+		fflush(log_file);
+}
@@ -0,0 +1,252 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+
+#include "metrics.h"
+
+/* Counters are always collected. They are kept in an anonymous memory or
+ * in a file if metrics_file is set, so dhcprelyactl can read them.
+ * A metrics thread updates gauges once a second and serves HTTP /metrics
+ * requests (Prometheus text format) if metrics_listen is set. */
+
+extern unsigned int queue_size;
+extern int bootps_port;
+extern uint8_t plugins_number;
+extern struct plugin_data *plugins[];
+
+__thread struct metrics_thread *metrics_self;
+struct metrics_shm *metrics;
+int latency_stats = 1;
+
+#define HTTP_DEADLINE	3
+
+static int http_fd = -1;
+
+int
+metrics_init(const char *filename)
+{
+	struct metrics_shm *m;
+	size_t size, offset, thread_size;
+	int fd, i, threads = if_num + 2;
+
+	offset = roundup(sizeof(struct metrics_shm), CACHE_LINE_SIZE);
+	thread_size = roundup(sizeof(struct metrics_thread) +
+		plugins_number * HOOK_MAX * sizeof(struct metrics_hist), CACHE_LINE_SIZE);
+	size = offset + threads * thread_size;
+
+	if (filename != NULL) {
+		if ((fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1) {
+			logd(LOG_ERR, "metrics: can't open %s: %s", filename, strerror(errno));
+			return 0;
+		}
+		if (ftruncate(fd, size) == -1) {
+			logd(LOG_ERR, "metrics: can't resize %s: %s", filename, strerror(errno));
+			close(fd);
+			return 0;
+		}
+		m = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+	} else
+		m = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+	if (m == MAP_FAILED) {
+		logd(LOG_ERR, "metrics: mmap: %s", strerror(errno));
+		return 0;
+	}
+
+	m->version = METRICS_VERSION;
+	m->size = size;
+	m->if_num = if_num;
+	m->srv_num = srv_num;
+	m->plugins_num = plugins_number;
+	m->threads_num = threads;
+	m->thread_size = thread_size;
+	m->threads_offset = offset;
+	m->start_time = time(NULL);
+	for (i = 0; i < if_num; i++)
+		strlcpy(m->if_names[i], ifs[i]->name, INTF_NAME_LEN);
+	for (i = 0; i < srv_num; i++)
+		if (inet_ntop(AF_INET, &servers[i]->sockaddr.sin_addr, m->srv_names[i],
+			METRICS_NAME_LEN) != NULL &&
+		    servers[i]->sockaddr.sin_port != bootps_port)
+			snprintf(m->srv_names[i] + strlen(m->srv_names[i]),
+				METRICS_NAME_LEN - strlen(m->srv_names[i]), ":%d",
+				ntohs(servers[i]->sockaddr.sin_port));
+	for (i = 0; i < plugins_number; i++)
+		strlcpy(m->plugin_names[i], plugins[i]->name, METRICS_NAME_LEN);
+	/* A reader checks magic, so set it the last */
+	__sync_synchronize();
+	m->magic = METRICS_MAGIC;
+
+	metrics = m;
+	return 1;
+}
+
+/* Bind the calling thread to its counters block */
+void
+metrics_thread_register(int thread_idx)
+{
+	metrics_self = METRICS_THREAD(metrics, thread_idx);
+}
+
+/* Called by a listener for its own interface */
+void
+metrics_pcap_update(struct interface *intf)
+{
+	struct metrics_pcap *mp = &metrics->pcap[intf->idx];
+
+	capture_stats(intf, &mp->recv, &mp->drop, &mp->ifdrop);
+	mp->buffer = capture_buffer(intf, &mp->resizes);
+}
+
+void
+metrics_update(void)
+{
+	struct metrics_server *ms;
+	int i;
+
+	metrics->queue_depth = queue_size;
+	if (metrics->queue_depth_max < metrics->queue_depth)
+		metrics->queue_depth_max = metrics->queue_depth;
+	for (i = 0; i < QCLASS_MAX; i++) {
+		metrics->class_depth[i] = queue_depth(i);
+		if (metrics->class_depth_max[i] < metrics->class_depth[i])
+			metrics->class_depth_max[i] = metrics->class_depth[i];
+	}
+	metrics->capture_budget = capture_budget;
+	metrics->capture_used = capture_budget_used();
+	metrics->shed_enabled = shed_enabled;
+	for (i = 0; i < if_num; i++)
+		metrics->shed_admitted[i] = shed_admitted(i);
+	for (i = 0; i < srv_num; i++) {
+		ms = &metrics->srv[i];
+		ms->replies = servers[i]->replies;
+		ms->lost = servers[i]->lost;
+		ms->errors = servers[i]->errors;
+		ms->rtt_last = servers[i]->rtt_last;
+		ms->rtt_avg = servers[i]->rtt_avg;
+		ms->rtt_max = servers[i]->rtt_max;
+		ms->up = servers[i]->timeouts < server_down_after;
+		ms->outstanding = server_outstanding(i);
+		ms->overloaded = shed_server_overloaded(i);
+	}
+	metrics->updated = time(NULL);
+}
+
+/* A scraper has a second to send a request and HTTP_DEADLINE seconds to
+ * read an answer, it must not stop the metrics thread. */
+static void
+http_serve(int fd)
+{
+	struct timeval tv = {1, 0};
+	char buf[1024], *body = NULL;
+	size_t len = 0, off;
+	ssize_t n;
+	time_t deadline;
+	FILE *f;
+	int x = 1;
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &x, sizeof(x));
+	if ((n = read(fd, buf, sizeof(buf) - 1)) <= 0) {
+		close(fd);
+		return;
+	}
+	buf[n] = '\0';
+	if ((f = open_memstream(&body, &len)) == NULL) {
+		close(fd);
+		return;
+	}
+	if (strncmp(buf, "GET /metrics ", 13) == 0 || strncmp(buf, "GET / ", 6) == 0) {
+		fputs("HTTP/1.0 200 OK\r\n"
+			"Content-Type: text/plain; version=0.0.4\r\n"
+			"Connection: close\r\n\r\n", f);
+		metrics_print(metrics, f, 1);
+	} else
+		fputs("HTTP/1.0 404 Not Found\r\nConnection: close\r\n\r\n", f);
+	fclose(f);
+
+	deadline = time(NULL) + HTTP_DEADLINE;
+	for (off = 0; off < len && time(NULL) < deadline; off += n)
+		if ((n = write(fd, body + off, len - off)) <= 0)
+			break;
+	free(body);
+	close(fd);
+}
+
+static void *
+metrics_loop(void *param)
+{
+	struct timeval tv;
+	fd_set fds;
+	int fd;
+
+	while (1) {
+		metrics_update();
+		if (http_fd == -1) {
+			sleep(1);
+			continue;
+		}
+		FD_ZERO(&fds);
+		FD_SET(http_fd, &fds);
+		tv.tv_sec = 1;
+		tv.tv_usec = 0;
+		if (select(http_fd + 1, &fds, NULL, NULL, &tv) > 0 &&
+		    (fd = accept(http_fd, NULL, NULL)) != -1) {
+			metrics_update();
+			http_serve(fd);
+		}
+	}
+	return NULL;
+}
+
+/* Start the metrics thread. listen_spec is [address:]port or NULL. */
+int
+metrics_start(const char *listen_spec)
+{
+	struct sockaddr_in addr;
+	pthread_t tid;
+	char buf[64], *p;
+	int x = 1;
+
+	if (listen_spec != NULL) {
+		bzero(&addr, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		strlcpy(buf, listen_spec, sizeof(buf));
+		if ((p = strchr(buf, ':')) != NULL) {
+			*p++ = '\0';
+			if (inet_pton(AF_INET, buf, &addr.sin_addr) != 1) {
+				logd(LOG_ERR, "metrics: bad address %s", buf);
+				return 0;
+			}
+		} else
+			p = buf;
+		addr.sin_port = htons(atoi(p));
+		if (addr.sin_port == 0) {
+			logd(LOG_ERR, "metrics: bad port %s", p);
+			return 0;
+		}
+		if ((http_fd = socket(PF_INET, SOCK_STREAM, 0)) == -1 ||
+		    setsockopt(http_fd, SOL_SOCKET, SO_REUSEADDR, &x, sizeof(x)) == -1 ||
+		    bind(http_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+		    listen(http_fd, 8) == -1) {
+			logd(LOG_ERR, "metrics: can't listen at %s: %s", listen_spec, strerror(errno));
+			return 0;
+		}
+		logd(LOG_WARNING, "Metrics at http://%s/metrics", listen_spec);
+	}
+
+	if (pthread_create(&tid, NULL, metrics_loop, NULL) != 0)
+		return 0;
+	pthread_detach(tid);
+	return 1;
+}
@@ -0,0 +1,244 @@
+#ifndef _METRICS_H
+#define _METRICS_H
+#include <sys/param.h>
+#include <stdio.h>
+#include <time.h>
+#include "dhcprelya.h"
+
+/* Counters layout shared by dhcprelya and dhcprelyactl (via mmap'd file).
+ *
+ * Every packet thread has its own cache line aligned block of counters and
+ * it's the only writer of the block, so counters are plain increments
+ * without atomics or locks. A reader sums all blocks. Gauges are written
+ * by a single owner too (listeners for pcap stats, metrics thread for
+ * others). */
+
+#define METRICS_MAGIC	0x4452454c	/* "DREL" */
+#define METRICS_VERSION	10
+#define METRICS_NAME_LEN	64
+#define METRICS_FILE	"/var/run/dhcprelya.metrics"
+
+/* Drop reasons */
+#define DROP_RPS_LIMIT		0
+#define DROP_SANITY		1
+#define DROP_BOOTREPLY		2
+#define DROP_PLUGIN		3
+#define DROP_NOMEM		4
+#define DROP_HOPS		5
+#define DROP_POLICY		6
+#define DROP_SEND_ERROR		7
+#define DROP_SHORT_ANSWER	8
+#define DROP_UNSOLICITED	9
+#define DROP_NO_INTERFACE	10
+#define DROP_BPF_WRITE		11
+#define DROP_QUEUE_FULL		12
+#define DROP_SHED_RETRANSMIT	13
+#define DROP_SHED_DISCOVER	14
+#define DROP_MAX		15
+
+extern const char *metrics_drop_names[DROP_MAX];
+
+/* Latency stages */
+#define STAGE_CAPTURE	0	/* pcap timestamp -> queued (listener, client_request hooks) */
+#define STAGE_QUEUE	1	/* queued -> taken by the main thread */
+#define STAGE_FORWARD	2	/* taken -> sent to the last server (send_to_server hooks) */
+#define STAGE_REQUEST	3	/* pcap timestamp -> sent to the last server */
+#define STAGE_SERVER	4	/* sent -> answered by a server (with transactions) */
+#define STAGE_ANSWER	5	/* answer received -> written to BPF */
+#define STAGE_MAX	6
+
+/* Plugin hooks */
+#define HOOK_CLIENT_REQUEST	0
+#define HOOK_SEND_TO_SERVER	1
+#define HOOK_SERVER_ANSWER	2
+#define HOOK_SEND_TO_CLIENT	3
+#define HOOK_MAX		4
+
+extern const char *metrics_stage_names[STAGE_MAX];
+extern const char *metrics_hook_names[HOOK_MAX];
+extern const char *metrics_class_names[QCLASS_MAX];
+
+/* A log-linear (HDR style) histogram of nanoseconds. Values below
+ * 2^HIST_SUB_BITS have own buckets, every next power of 2 is split into
+ * 2^HIST_SUB_BITS buckets, so an error is below 12.5%. 256 buckets cover
+ * up to 2^34 ns (17 s), bigger values go to the last one. */
+#define HIST_SUB_BITS	3
+#define HIST_SUB	(1 << HIST_SUB_BITS)
+#define HIST_BUCKETS	256
+
+struct metrics_hist {
+	uint64_t count, sum, max;
+	uint64_t buckets[HIST_BUCKETS];
+};
+
+static inline unsigned
+hist_bucket(uint64_t v)
+{
+	unsigned e, idx;
+
+	if (v < HIST_SUB)
+		return v;
+	e = 63 - __builtin_clzll(v);
+	idx = (e - HIST_SUB_BITS + 1) * HIST_SUB + ((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+	return idx < HIST_BUCKETS ? idx : HIST_BUCKETS - 1;
+}
+
+/* The lowest value of a bucket */
+static inline uint64_t
+hist_bucket_value(unsigned idx)
+{
+	if (idx < HIST_SUB)
+		return idx;
+	return (uint64_t)(HIST_SUB + idx % HIST_SUB) << (idx / HIST_SUB - 1);
+}
+
+static inline void
+hist_add(struct metrics_hist *h, uint64_t v)
+{
+	h->buckets[hist_bucket(v)]++;
+	h->count++;
+	h->sum += v;
+	if (h->max < v)
+		h->max = v;
+}
+
+static inline int64_t
+timespec_ns(const struct timespec *ts)
+{
+	return (int64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+struct metrics_thread {
+	uint64_t if_in[IF_MAX];		/* requests from clients */
+	uint64_t if_out[IF_MAX];	/* answers to clients */
+	uint64_t queue_drops[IF_MAX];	/* requests queue of the interface is full */
+	uint64_t srv_out[SERVERS_MAX];	/* requests to servers */
+	uint64_t srv_in[SERVERS_MAX];	/* answers from servers */
+	uint64_t drops[DROP_MAX];
+	uint64_t plugin_rejects[MAX_PLUGINS];
+	uint64_t queue_in[QCLASS_MAX];	/* requests queued by a class */
+	uint64_t queue_aged;		/* moved a class up by queue_aging */
+	struct metrics_hist latency[STAGE_MAX];
+	struct metrics_hist queue_wait[QCLASS_MAX];	/* queued -> taken */
+	/* plugins_num * HOOK_MAX histograms of plugin calls */
+	struct metrics_hist hooks[];
+} __aligned(CACHE_LINE_SIZE);
+
+struct metrics_server {
+	uint64_t replies, lost, errors;
+	int64_t rtt_last, rtt_avg, rtt_max;	/* microseconds */
+	uint32_t up;
+	uint32_t overloaded;		/* with shed */
+	uint64_t outstanding;		/* with transactions */
+};
+
+struct metrics_pcap {
+	uint64_t recv, drop, ifdrop;
+	uint64_t buffer, resizes;	/* capture buffer, 0 - libpcap default */
+} __aligned(CACHE_LINE_SIZE);
+
+/* radius_plugin accounting. Written under a plugin queue lock, lease
+ * counters under a lease cache lock. */
+struct metrics_radius {
+	uint32_t enabled;
+	uint64_t queued, dropped, answered, failed;
+	uint64_t starts, interims, stops;
+	uint64_t renewals, untracked, leases;	/* lease cache */
+	uint64_t spooled, spool_dropped, replayed;
+	uint64_t spool_depth, replay_rate;	/* records, records a second */
+	uint64_t queue_depth, queue_depth_max, in_flight;
+	struct metrics_hist latency;	/* queued -> answered */
+	/* Authorization. Cache lookups are counted by listeners atomically. */
+	uint32_t auth_enabled;
+	uint64_t auth_hits, auth_misses, auth_coalesced, auth_dropped;
+	uint64_t auth_accepted, auth_rejected, auth_failed;
+	struct metrics_hist auth_latency;	/* a miss -> answered */
+};
+
+struct metrics_shm {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;			/* of the whole segment */
+	uint32_t if_num, srv_num, plugins_num, threads_num;
+	uint32_t thread_size;		/* with hooks histograms */
+	uint64_t threads_offset;
+	int64_t start_time;
+	uint64_t updated;		/* gauges update time */
+	char if_names[IF_MAX][INTF_NAME_LEN];
+	char srv_names[SERVERS_MAX][METRICS_NAME_LEN];
+	char plugin_names[MAX_PLUGINS][METRICS_NAME_LEN];
+	/* Gauges */
+	uint64_t queue_depth, queue_depth_max;
+	uint64_t class_depth[QCLASS_MAX], class_depth_max[QCLASS_MAX];
+	uint64_t capture_budget, capture_used;	/* bytes */
+	uint32_t shed_enabled;
+	uint32_t shed_admitted[IF_MAX];	/* per-mille of new DISCOVERs */
+	struct metrics_server srv[SERVERS_MAX];
+	struct metrics_pcap pcap[IF_MAX];
+	struct metrics_radius radius;
+};
+
+#define METRICS_THREAD(m, i) \
+	((struct metrics_thread *)((char *)(m) + (m)->threads_offset + (i) * (m)->thread_size))
+
+/* Threads blocks: listeners are [0, if_num), then the main thread and the
+ * server answers thread */
+#define METRICS_MAIN_THREAD	(if_num)
+#define METRICS_ANSWER_THREAD	(if_num + 1)
+
+/* The calling thread counters block */
+extern __thread struct metrics_thread *metrics_self;
+
+#define METRIC_INC(field)	(metrics_self->field++)
+#define METRIC_DROP(reason)	(metrics_self->drops[reason]++)
+
+/* Latency measurement. Clocks are read only if latency_stats is on.
+ * Monotonic clock is cheap on FreeBSD (vDSO, TSC based). */
+extern int latency_stats;
+
+static inline void
+latency_start(struct timespec *ts)
+{
+	if (latency_stats)
+		clock_gettime(CLOCK_MONOTONIC, ts);
+}
+
+static inline void
+latency_add(struct metrics_hist *h, const struct timespec *start,
+	const struct timespec *end)
+{
+	int64_t d;
+
+	d = timespec_ns(end) - timespec_ns(start);
+	hist_add(h, d > 0 ? d : 0);
+}
+
+/* Add a time since start into a histogram */
+static inline void
+latency_end(struct metrics_hist *h, const struct timespec *start)
+{
+	struct timespec now;
+
+	if (!latency_stats)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	latency_add(h, start, &now);
+}
+
+#define METRIC_STAGE(stage)	(&metrics_self->latency[stage])
+#define METRIC_HOOK(plugin, hook)	(&metrics_self->hooks[(plugin) * HOOK_MAX + (hook)])
+
+/* metrics.c */
+extern struct metrics_shm *metrics;
+
+int metrics_init(const char *filename);
+void metrics_thread_register(int thread_idx);
+int metrics_start(const char *listen_spec);
+void metrics_pcap_update(struct interface *intf);
+void metrics_update(void);
+
+/* metrics_print.c */
+void metrics_print(const struct metrics_shm *m, FILE *f, int prometheus);
+uint64_t hist_quantile(const struct metrics_hist *h, double q);
+
+#endif
@@ -0,0 +1,485 @@
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include "metrics.h"
+
+/* Print counters in a human readable or Prometheus text format.
+ * Used by dhcprelya (HTTP) and dhcprelyactl, so it uses only the segment. */
+
+const char *metrics_drop_names[DROP_MAX] = {
+	"rps_limit",
+	"sanity_check",
+	"bootreply_from_client",
+	"plugin",
+	"no_memory",
+	"max_hops",
+	"policy",
+	"send_error",
+	"short_answer",
+	"unsolicited_answer",
+	"no_interface",
+	"bpf_write",
+	"queue_full",
+	"shed_retransmit",
+	"shed_discover",
+};
+
+const char *metrics_stage_names[STAGE_MAX] = {
+	"capture",
+	"queue",
+	"forward",
+	"request",
+	"server",
+	"answer",
+};
+
+const char *metrics_hook_names[HOOK_MAX] = {
+	"client_request",
+	"send_to_server",
+	"server_answer",
+	"send_to_client",
+};
+
+const char *metrics_class_names[QCLASS_MAX] = {
+	"bound",
+	"request",
+	"discover",
+};
+
+static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+#define QUANTILES_NUM	(sizeof(quantiles) / sizeof(quantiles[0]))
+
+static uint64_t
+sum(const struct metrics_shm *m, size_t offset)
+{
+	uint64_t n = 0;
+	unsigned i;
+
+	for (i = 0; i < m->threads_num; i++)
+		n += *(const uint64_t *)((const char *)METRICS_THREAD(m, i) + offset);
+	return n;
+}
+
+#define SUM(m, field)	sum(m, offsetof(struct metrics_thread, field))
+
+/* Merge a histogram at offset of all threads blocks */
+static void
+hist_merge(const struct metrics_shm *m, size_t offset, struct metrics_hist *h)
+{
+	const struct metrics_hist *t;
+	unsigned i, j;
+
+	bzero(h, sizeof(*h));
+	for (i = 0; i < m->threads_num; i++) {
+		t = (const struct metrics_hist *)((const char *)METRICS_THREAD(m, i) + offset);
+		if (t->count == 0)
+			continue;
+		h->count += t->count;
+		h->sum += t->sum;
+		if (h->max < t->max)
+			h->max = t->max;
+		for (j = 0; j < HIST_BUCKETS; j++)
+			h->buckets[j] += t->buckets[j];
+	}
+}
+
+static void
+stage_hist(const struct metrics_shm *m, int stage, struct metrics_hist *h)
+{
+	hist_merge(m, offsetof(struct metrics_thread, latency) +
+		stage * sizeof(struct metrics_hist), h);
+}
+
+static void
+hook_hist(const struct metrics_shm *m, int plugin, int hook, struct metrics_hist *h)
+{
+	hist_merge(m, offsetof(struct metrics_thread, hooks) +
+		(plugin * HOOK_MAX + hook) * sizeof(struct metrics_hist), h);
+}
+
+static void
+class_hist(const struct metrics_shm *m, int qclass, struct metrics_hist *h)
+{
+	hist_merge(m, offsetof(struct metrics_thread, queue_wait) +
+		qclass * sizeof(struct metrics_hist), h);
+}
+
+/* A value (ns) at quantile q. It's a middle of a bucket, not above max. */
+uint64_t
+hist_quantile(const struct metrics_hist *h, double q)
+{
+	uint64_t rank, n = 0, v;
+	unsigned i;
+
+	if (h->count == 0)
+		return 0;
+	rank = q * h->count;
+	if (rank == 0)
+		rank = 1;
+	for (i = 0; i < HIST_BUCKETS - 1; i++) {
+		n += h->buckets[i];
+		if (n >= rank)
+			break;
+	}
+	if (i == HIST_BUCKETS - 1)
+		return h->max;
+	v = (hist_bucket_value(i) + hist_bucket_value(i + 1) - 1) / 2;
+	return v < h->max ? v : h->max;
+}
+
+static void
+print_summary(FILE *f, const char *name, const char *labels,
+	const struct metrics_hist *h)
+{
+	unsigned i;
+
+	for (i = 0; i < QUANTILES_NUM; i++)
+		fprintf(f, "%s{%s,quantile=\"%g\"} %.9f\n", name, labels, quantiles[i],
+			hist_quantile(h, quantiles[i]) / 1e9);
+	fprintf(f, "%s{%s,quantile=\"1\"} %.9f\n", name, labels, h->max / 1e9);
+	fprintf(f, "%s_sum{%s} %.9f\n", name, labels, h->sum / 1e9);
+	fprintf(f, "%s_count{%s} %ju\n", name, labels, (uintmax_t)h->count);
+}
+
+static void
+print_latency_line(FILE *f, const char *name, const struct metrics_hist *h)
+{
+	unsigned i;
+
+	fprintf(f, "  %-32s %12ju", name, (uintmax_t)h->count);
+	for (i = 0; i < QUANTILES_NUM; i++)
+		fprintf(f, " %10.1f", hist_quantile(h, quantiles[i]) / 1e3);
+	fprintf(f, " %10.1f\n", h->max / 1e3);
+}
+
+static void
+print_prometheus(const struct metrics_shm *m, FILE *f)
+{
+	const struct metrics_server *ms;
+	struct metrics_hist h;
+	char labels[160];
+	unsigned i, j;
+
+	fputs("# TYPE dhcprelya_requests_total counter\n", f);
+	for (i = 0; i < m->if_num; i++)
+		fprintf(f, "dhcprelya_requests_total{interface=\"%s\"} %ju\n",
+			m->if_names[i], (uintmax_t)SUM(m, if_in[i]));
+	fputs("# TYPE dhcprelya_replies_total counter\n", f);
+	for (i = 0; i < m->if_num; i++)
+		fprintf(f, "dhcprelya_replies_total{interface=\"%s\"} %ju\n",
+			m->if_names[i], (uintmax_t)SUM(m, if_out[i]));
+	fputs("# TYPE dhcprelya_queue_drops_total counter\n", f);
+	for (i = 0; i < m->if_num; i++)
+		fprintf(f, "dhcprelya_queue_drops_total{interface=\"%s\"} %ju\n",
+			m->if_names[i], (uintmax_t)SUM(m, queue_drops[i]));
+	fputs("# TYPE dhcprelya_pcap_received_total counter\n", f);
+	for (i = 0; i < m->if_num; i++)
+		fprintf(f, "dhcprelya_pcap_received_total{interface=\"%s\"} %ju\n",
+			m->if_names[i], (uintmax_t)m->pcap[i].recv);
+	fputs("# TYPE dhcprelya_pcap_dropped_total counter\n", f);
+	for (i = 0; i < m->if_num; i++)
+		fprintf(f, "dhcprelya_pcap_dropped_total{interface=\"%s\"} %ju\n",
+			m->if_names[i], (uintmax_t)m->pcap[i].drop);
+	fputs("# TYPE dhcprelya_pcap_ifdropped_total counter\n", f);
+	for (i = 0; i < m->if_num; i++)
+		fprintf(f, "dhcprelya_pcap_ifdropped_total{interface=\"%s\"} %ju\n",
+			m->if_names[i], (uintmax_t)m->pcap[i].ifdrop);
+	fputs("# TYPE dhcprelya_pcap_buffer_bytes gauge\n", f);
+	for (i = 0; i < m->if_num; i++)
+		fprintf(f, "dhcprelya_pcap_buffer_bytes{interface=\"%s\"} %ju\n",
+			m->if_names[i], (uintmax_t)m->pcap[i].buffer);
+	fputs("# TYPE dhcprelya_pcap_buffer_resizes_total counter\n", f);
+	for (i = 0; i < m->if_num; i++)
+		fprintf(f, "dhcprelya_pcap_buffer_resizes_total{interface=\"%s\"} %ju\n",
+			m->if_names[i], (uintmax_t)m->pcap[i].resizes);
+
+	fputs("# TYPE dhcprelya_server_requests_total counter\n", f);
+	for (i = 0; i < m->srv_num; i++)
+		fprintf(f, "dhcprelya_server_requests_total{server=\"%s\"} %ju\n",
+			m->srv_names[i], (uintmax_t)SUM(m, srv_out[i]));
+	fputs("# TYPE dhcprelya_server_replies_total counter\n", f);
+	for (i = 0; i < m->srv_num; i++)
+		fprintf(f, "dhcprelya_server_replies_total{server=\"%s\"} %ju\n",
+			m->srv_names[i], (uintmax_t)SUM(m, srv_in[i]));
+	fputs("# TYPE dhcprelya_server_lost_total counter\n", f);
+	for (i = 0; i < m->srv_num; i++)
+		fprintf(f, "dhcprelya_server_lost_total{server=\"%s\"} %ju\n",
+			m->srv_names[i], (uintmax_t)m->srv[i].lost);
+	fputs("# TYPE dhcprelya_server_errors_total counter\n", f);
+	for (i = 0; i < m->srv_num; i++)
+		fprintf(f, "dhcprelya_server_errors_total{server=\"%s\"} %ju\n",
+			m->srv_names[i], (uintmax_t)m->srv[i].errors);
+	fputs("# TYPE dhcprelya_server_outstanding gauge\n", f);
+	for (i = 0; i < m->srv_num; i++)
+		fprintf(f, "dhcprelya_server_outstanding{server=\"%s\"} %ju\n",
+			m->srv_names[i], (uintmax_t)m->srv[i].outstanding);
+	fputs("# TYPE dhcprelya_server_up gauge\n", f);
+	for (i = 0; i < m->srv_num; i++)
+		fprintf(f, "dhcprelya_server_up{server=\"%s\"} %u\n",
+			m->srv_names[i], m->srv[i].up);
+	fputs("# TYPE dhcprelya_server_rtt_microseconds gauge\n", f);
+	for (i = 0; i < m->srv_num; i++) {
+		ms = &m->srv[i];
+		fprintf(f, "dhcprelya_server_rtt_microseconds{server=\"%s\",stat=\"last\"} %jd\n"
+			"dhcprelya_server_rtt_microseconds{server=\"%s\",stat=\"avg\"} %jd\n"
+			"dhcprelya_server_rtt_microseconds{server=\"%s\",stat=\"max\"} %jd\n",
+			m->srv_names[i], (intmax_t)ms->rtt_last,
+			m->srv_names[i], (intmax_t)ms->rtt_avg,
+			m->srv_names[i], (intmax_t)ms->rtt_max);
+	}
+
+	fputs("# TYPE dhcprelya_drops_total counter\n", f);
+	for (i = 0; i < DROP_MAX; i++)
+		fprintf(f, "dhcprelya_drops_total{reason=\"%s\"} %ju\n",
+			metrics_drop_names[i], (uintmax_t)SUM(m, drops[i]));
+	fputs("# TYPE dhcprelya_plugin_rejects_total counter\n", f);
+	for (i = 0; i < m->plugins_num; i++)
+		fprintf(f, "dhcprelya_plugin_rejects_total{plugin=\"%s\"} %ju\n",
+			m->plugin_names[i], (uintmax_t)SUM(m, plugin_rejects[i]));
+	fprintf(f, "# TYPE dhcprelya_queue_depth gauge\ndhcprelya_queue_depth %ju\n",
+		(uintmax_t)m->queue_depth);
+	fprintf(f, "# TYPE dhcprelya_queue_depth_max gauge\ndhcprelya_queue_depth_max %ju\n",
+		(uintmax_t)m->queue_depth_max);
+	fputs("# TYPE dhcprelya_queue_class_depth gauge\n", f);
+	for (i = 0; i < QCLASS_MAX; i++)
+		fprintf(f, "dhcprelya_queue_class_depth{class=\"%s\"} %ju\n",
+			metrics_class_names[i], (uintmax_t)m->class_depth[i]);
+	fputs("# TYPE dhcprelya_queue_class_depth_max gauge\n", f);
+	for (i = 0; i < QCLASS_MAX; i++)
+		fprintf(f, "dhcprelya_queue_class_depth_max{class=\"%s\"} %ju\n",
+			metrics_class_names[i], (uintmax_t)m->class_depth_max[i]);
+	fputs("# TYPE dhcprelya_queue_requests_total counter\n", f);
+	for (i = 0; i < QCLASS_MAX; i++)
+		fprintf(f, "dhcprelya_queue_requests_total{class=\"%s\"} %ju\n",
+			metrics_class_names[i], (uintmax_t)SUM(m, queue_in[i]));
+	fprintf(f, "# TYPE dhcprelya_queue_aged_total counter\ndhcprelya_queue_aged_total %ju\n",
+		(uintmax_t)SUM(m, queue_aged));
+	fputs("# TYPE dhcprelya_queue_wait_seconds summary\n", f);
+	for (i = 0; i < QCLASS_MAX; i++) {
+		class_hist(m, i, &h);
+		snprintf(labels, sizeof(labels), "class=\"%s\"", metrics_class_names[i]);
+		print_summary(f, "dhcprelya_queue_wait_seconds", labels, &h);
+	}
+	if (m->shed_enabled) {
+		fputs("# TYPE dhcprelya_server_overloaded gauge\n", f);
+		for (i = 0; i < m->srv_num; i++)
+			fprintf(f, "dhcprelya_server_overloaded{server=\"%s\"} %u\n",
+				m->srv_names[i], m->srv[i].overloaded);
+		fputs("# TYPE dhcprelya_shed_admitted_ratio gauge\n", f);
+		for (i = 0; i < m->if_num; i++)
+			fprintf(f, "dhcprelya_shed_admitted_ratio{interface=\"%s\"} %.3f\n",
+				m->if_names[i], m->shed_admitted[i] / 1000.0);
+	}
+	if (m->capture_budget != 0)
+		fprintf(f, "# TYPE dhcprelya_capture_budget_bytes gauge\n"
+			"dhcprelya_capture_budget_bytes %ju\n"
+			"# TYPE dhcprelya_capture_used_bytes gauge\n"
+			"dhcprelya_capture_used_bytes %ju\n",
+			(uintmax_t)m->capture_budget, (uintmax_t)m->capture_used);
+	fprintf(f, "# TYPE dhcprelya_start_time_seconds gauge\ndhcprelya_start_time_seconds %jd\n",
+		(intmax_t)m->start_time);
+
+	if (m->radius.enabled) {
+		fputs("# TYPE dhcprelya_radius_acct_total counter\n", f);
+		fprintf(f, "dhcprelya_radius_acct_total{result=\"queued\"} %ju\n"
+			"dhcprelya_radius_acct_total{result=\"dropped\"} %ju\n"
+			"dhcprelya_radius_acct_total{result=\"answered\"} %ju\n"
+			"dhcprelya_radius_acct_total{result=\"failed\"} %ju\n",
+			(uintmax_t)m->radius.queued, (uintmax_t)m->radius.dropped,
+			(uintmax_t)m->radius.answered, (uintmax_t)m->radius.failed);
+		fputs("# TYPE dhcprelya_radius_acct_requests_total counter\n", f);
+		fprintf(f, "dhcprelya_radius_acct_requests_total{type=\"start\"} %ju\n"
+			"dhcprelya_radius_acct_requests_total{type=\"interim\"} %ju\n"
+			"dhcprelya_radius_acct_requests_total{type=\"stop\"} %ju\n",
+			(uintmax_t)m->radius.starts, (uintmax_t)m->radius.interims,
+			(uintmax_t)m->radius.stops);
+		fprintf(f, "# TYPE dhcprelya_radius_renewals_total counter\n"
+			"dhcprelya_radius_renewals_total %ju\n"
+			"# TYPE dhcprelya_radius_untracked_total counter\n"
+			"dhcprelya_radius_untracked_total %ju\n"
+			"# TYPE dhcprelya_radius_leases gauge\n"
+			"dhcprelya_radius_leases %ju\n",
+			(uintmax_t)m->radius.renewals, (uintmax_t)m->radius.untracked,
+			(uintmax_t)m->radius.leases);
+		fprintf(f, "# TYPE dhcprelya_radius_spool_total counter\n"
+			"dhcprelya_radius_spool_total{result=\"spooled\"} %ju\n"
+			"dhcprelya_radius_spool_total{result=\"dropped\"} %ju\n"
+			"dhcprelya_radius_spool_total{result=\"replayed\"} %ju\n"
+			"# TYPE dhcprelya_radius_spool_depth gauge\n"
+			"dhcprelya_radius_spool_depth %ju\n"
+			"# TYPE dhcprelya_radius_replay_rate gauge\n"
+			"dhcprelya_radius_replay_rate %ju\n",
+			(uintmax_t)m->radius.spooled, (uintmax_t)m->radius.spool_dropped,
+			(uintmax_t)m->radius.replayed, (uintmax_t)m->radius.spool_depth,
+			(uintmax_t)m->radius.replay_rate);
+		fprintf(f, "# TYPE dhcprelya_radius_queue_depth gauge\n"
+			"dhcprelya_radius_queue_depth %ju\n"
+			"# TYPE dhcprelya_radius_queue_depth_max gauge\n"
+			"dhcprelya_radius_queue_depth_max %ju\n"
+			"# TYPE dhcprelya_radius_in_flight gauge\n"
+			"dhcprelya_radius_in_flight %ju\n",
+			(uintmax_t)m->radius.queue_depth,
+			(uintmax_t)m->radius.queue_depth_max,
+			(uintmax_t)m->radius.in_flight);
+		fputs("# TYPE dhcprelya_radius_latency_seconds summary\n", f);
+		print_summary(f, "dhcprelya_radius_latency_seconds", "request=\"accounting\"",
+			&m->radius.latency);
+		if (m->radius.auth_enabled) {
+			fputs("# TYPE dhcprelya_radius_auth_cache_total counter\n", f);
+			fprintf(f, "dhcprelya_radius_auth_cache_total{result=\"hit\"} %ju\n"
+				"dhcprelya_radius_auth_cache_total{result=\"miss\"} %ju\n"
+				"dhcprelya_radius_auth_cache_total{result=\"coalesced\"} %ju\n"
+				"dhcprelya_radius_auth_cache_total{result=\"dropped\"} %ju\n",
+				(uintmax_t)m->radius.auth_hits, (uintmax_t)m->radius.auth_misses,
+				(uintmax_t)m->radius.auth_coalesced,
+				(uintmax_t)m->radius.auth_dropped);
+			fputs("# TYPE dhcprelya_radius_auth_total counter\n", f);
+			fprintf(f, "dhcprelya_radius_auth_total{result=\"accept\"} %ju\n"
+				"dhcprelya_radius_auth_total{result=\"reject\"} %ju\n"
+				"dhcprelya_radius_auth_total{result=\"failed\"} %ju\n",
+				(uintmax_t)m->radius.auth_accepted,
+				(uintmax_t)m->radius.auth_rejected,
+				(uintmax_t)m->radius.auth_failed);
+			print_summary(f, "dhcprelya_radius_latency_seconds",
+				"request=\"authorization\"", &m->radius.auth_latency);
+		}
+	}
+
+	fputs("# TYPE dhcprelya_latency_seconds summary\n", f);
+	for (i = 0; i < STAGE_MAX; i++) {
+		stage_hist(m, i, &h);
+		snprintf(labels, sizeof(labels), "stage=\"%s\"", metrics_stage_names[i]);
+		print_summary(f, "dhcprelya_latency_seconds", labels, &h);
+	}
+	fputs("# TYPE dhcprelya_plugin_latency_seconds summary\n", f);
+	for (i = 0; i < m->plugins_num; i++)
+		for (j = 0; j < HOOK_MAX; j++) {
+			hook_hist(m, i, j, &h);
+			if (h.count == 0)
+				continue;
+			snprintf(labels, sizeof(labels), "plugin=\"%s\",hook=\"%s\"",
+				m->plugin_names[i], metrics_hook_names[j]);
+			print_summary(f, "dhcprelya_plugin_latency_seconds", labels, &h);
+		}
+}
+
+static void
+print_text(const struct metrics_shm *m, FILE *f)
+{
+	const struct metrics_server *ms;
+	struct metrics_hist h;
+	char name[METRICS_NAME_LEN + 20];
+	unsigned i, j;
+
+	fprintf(f, "%-16s %12s %12s %12s %12s %12s %10s\n", "Interface", "Requests",
+		"Replies", "Queue drop", "Pcap recv", "Pcap drop", "Buffer");
+	for (i = 0; i < m->if_num; i++) {
+		if (m->pcap[i].buffer != 0)
+			snprintf(name, sizeof(name), "%juK", (uintmax_t)m->pcap[i].buffer / 1024);
+		else
+			strlcpy(name, "default", sizeof(name));
+		fprintf(f, "%-16s %12ju %12ju %12ju %12ju %12ju %10s\n", m->if_names[i],
+			(uintmax_t)SUM(m, if_in[i]), (uintmax_t)SUM(m, if_out[i]),
+			(uintmax_t)SUM(m, queue_drops[i]), (uintmax_t)m->pcap[i].recv,
+			(uintmax_t)(m->pcap[i].drop + m->pcap[i].ifdrop), name);
+	}
+
+	fprintf(f, "\n%-21s %3s %12s %12s %10s %10s %10s %10s %10s\n", "Server", "Up",
+		"Requests", "Replies", "Waiting", "Lost", "Errors", "RTT avg", "RTT max");
+	for (i = 0; i < m->srv_num; i++) {
+		ms = &m->srv[i];
+		fprintf(f, "%-21s %3s %12ju %12ju %10ju %10ju %10ju %8jdus %8jdus\n",
+			m->srv_names[i], ms->up ? "yes" : "no",
+			(uintmax_t)SUM(m, srv_out[i]), (uintmax_t)SUM(m, srv_in[i]),
+			(uintmax_t)ms->outstanding, (uintmax_t)ms->lost, (uintmax_t)ms->errors,
+			(intmax_t)ms->rtt_avg, (intmax_t)ms->rtt_max);
+	}
+
+	fputs("\nDrops:\n", f);
+	for (i = 0; i < DROP_MAX; i++)
+		fprintf(f, "  %-24s %12ju\n", metrics_drop_names[i],
+			(uintmax_t)SUM(m, drops[i]));
+	if (m->plugins_num > 0)
+		fputs("\nPlugin rejects:\n", f);
+	for (i = 0; i < m->plugins_num; i++)
+		fprintf(f, "  %-24s %12ju\n", m->plugin_names[i],
+			(uintmax_t)SUM(m, plugin_rejects[i]));
+	fprintf(f, "\nQueue depth: %ju (max %ju), aged %ju\n", (uintmax_t)m->queue_depth,
+		(uintmax_t)m->queue_depth_max, (uintmax_t)SUM(m, queue_aged));
+	for (i = 0; i < QCLASS_MAX; i++)
+		fprintf(f, "  %-10s depth %ju (max %ju), queued %ju\n",
+			metrics_class_names[i], (uintmax_t)m->class_depth[i],
+			(uintmax_t)m->class_depth_max[i], (uintmax_t)SUM(m, queue_in[i]));
+	if (m->shed_enabled) {
+		for (i = 0; i < m->srv_num; i++)
+			if (m->srv[i].overloaded)
+				fprintf(f, "Server %s is overloaded\n", m->srv_names[i]);
+		for (i = 0; i < m->if_num; i++)
+			if (m->shed_admitted[i] < 1000)
+				fprintf(f, "Shedding on %s: %.1f%% of new DISCOVERs admitted\n",
+					m->if_names[i], m->shed_admitted[i] / 10.0);
+	}
+	if (m->capture_budget != 0)
+		fprintf(f, "Capture buffers: %juK of %juK budget\n",
+			(uintmax_t)m->capture_used / 1024, (uintmax_t)m->capture_budget / 1024);
+	if (m->radius.enabled)
+		fprintf(f, "\nRADIUS accounting: queued %ju, dropped %ju, answered %ju, "
+			"failed %ju\n  in flight %ju, queue depth %ju (max %ju)\n"
+			"  start %ju, interim %ju, stop %ju, renewals %ju, untracked %ju, "
+			"leases %ju\n  spooled %ju, spool dropped %ju, replayed %ju, "
+			"spool depth %ju, replay rate %ju/s\n",
+			(uintmax_t)m->radius.queued, (uintmax_t)m->radius.dropped,
+			(uintmax_t)m->radius.answered, (uintmax_t)m->radius.failed,
+			(uintmax_t)m->radius.in_flight, (uintmax_t)m->radius.queue_depth,
+			(uintmax_t)m->radius.queue_depth_max, (uintmax_t)m->radius.starts,
+			(uintmax_t)m->radius.interims, (uintmax_t)m->radius.stops,
+			(uintmax_t)m->radius.renewals, (uintmax_t)m->radius.untracked,
+			(uintmax_t)m->radius.leases,
+			(uintmax_t)m->radius.spooled, (uintmax_t)m->radius.spool_dropped,
+			(uintmax_t)m->radius.replayed, (uintmax_t)m->radius.spool_depth,
+			(uintmax_t)m->radius.replay_rate);
+	if (m->radius.auth_enabled)
+		fprintf(f, "RADIUS authorization: hits %ju, misses %ju, coalesced %ju, "
+			"dropped %ju\n  accepted %ju, rejected %ju, failed %ju\n",
+			(uintmax_t)m->radius.auth_hits, (uintmax_t)m->radius.auth_misses,
+			(uintmax_t)m->radius.auth_coalesced, (uintmax_t)m->radius.auth_dropped,
+			(uintmax_t)m->radius.auth_accepted, (uintmax_t)m->radius.auth_rejected,
+			(uintmax_t)m->radius.auth_failed);
+
+	fprintf(f, "\nLatency (us):\n  %-32s %12s %10s %10s %10s %10s %10s\n", "",
+		"Count", "p50", "p90", "p99", "p99.9", "Max");
+	for (i = 0; i < STAGE_MAX; i++) {
+		stage_hist(m, i, &h);
+		print_latency_line(f, metrics_stage_names[i], &h);
+	}
+	for (i = 0; i < QCLASS_MAX; i++) {
+		class_hist(m, i, &h);
+		if (h.count == 0)
+			continue;
+		snprintf(name, sizeof(name), "queue/%s", metrics_class_names[i]);
+		print_latency_line(f, name, &h);
+	}
+	for (i = 0; i < m->plugins_num; i++)
+		for (j = 0; j < HOOK_MAX; j++) {
+			hook_hist(m, i, j, &h);
+			if (h.count == 0)
+				continue;
+			snprintf(name, sizeof(name), "%s/%s", m->plugin_names[i],
+				metrics_hook_names[j]);
+			print_latency_line(f, name, &h);
+		}
+	if (m->radius.enabled)
+		print_latency_line(f, "radius/accounting", &m->radius.latency);
+	if (m->radius.auth_enabled)
+		print_latency_line(f, "radius/authorization", &m->radius.auth_latency);
+}
+
+void
+metrics_print(const struct metrics_shm *m, FILE *f, int prometheus)
+{
+	if (prometheus)
+		print_prometheus(m, f);
+	else
+		print_text(m, f);
+}
@@ -25,14 +25,28 @@
  * SUCH DAMAGE. */
 
 #include <stdlib.h>
+#include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <machine/atomic.h>
 
 #include "dhcprelya.h"
 
-static char rid[255];
+/* Trusted circuits are Circuit IDs and Remote IDs from trusted_circuits
+ * and trusted_circuits_file. They are looked up in an idset (a hash set),
+ * so a list of any length costs the same per packet. A reloader thread
+ * checks the file every trusted_reload_interval seconds and builds a new
+ * set if it's changed. The set pointer is swapped at once and the previous
+ * set is freed on a next reload, when no lookup can use it any more. */
+
+static char rid[256];
 static int rid_len, drop_untrusted = 1, never_strip_answer = 0, always_strip_answer = 0;
 
+/* trusted_circuits values, kept to rebuild the set */
 STAILQ_HEAD(thead, trusted_circuits) trusted_head;
 struct trusted_circuits {
 	uint8_t *id;
@@ -41,15 +55,255 @@ struct trusted_circuits {
 	 STAILQ_ENTRY(trusted_circuits) next;
 };
 
+static struct idset *trusted, *trusted_old;
+static char *trusted_file;
+static struct stat trusted_st;
+static int trusted_bloom = 0;
+static unsigned trusted_reload_interval = 10;
+
+static pthread_once_t reloader_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t reload_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reload_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t reloader_tid;
+static int reloader_running = 0, reloader_stop = 0;
+
+void option82_plugin_destroy(void);
+
 static int link_selection_map[IF_MAX];
 static int only_for[IF_MAX];
 
+/* Option 82 of an interface as it's appended to a packet: a code, a length
+ * and sub-options. It's the same for every request, so it's built once. */
+struct agent_option {
+	ip_addr_t ip;		/* Link Selection address it's built for */
+	int len;		/* 0 - not built yet, -1 - too long */
+	uint8_t data[2 + 255];
+};
+static struct agent_option agent_options[IF_MAX];
+
+static int
+hex_value(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	c = tolower((unsigned char)c);
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+/* A quoted string or a hexadecimal (0xNNNN) value into buf of 255 bytes.
+ * Any other word is taken as is if bare is set. Returns a length or -1. */
+static int
+parse_id(const char *str, uint8_t *buf, int bare)
+{
+	size_t len = strlen(str), i;
+	int hi, lo;
+
+	if (len >= 2 && str[0] == '"' && str[len - 1] == '"') {
+		len -= 2;
+		if (len > 255)
+			return -1;
+		memcpy(buf, str + 1, len);
+		return len;
+	}
+	if (strncasecmp(str, "0x", 2) == 0) {
+		str += 2;
+		len -= 2;
+		if (len == 0 || len % 2 != 0 || len / 2 > 255)
+			return -1;
+		for (i = 0; i < len / 2; i++) {
+			if ((hi = hex_value(str[2 * i])) == -1 ||
+			    (lo = hex_value(str[2 * i + 1])) == -1)
+				return -1;
+			buf[i] = hi << 4 | lo;
+		}
+		return len / 2;
+	}
+	if (!bare || len == 0 || len > 255 || *str == '"')
+		return -1;
+	memcpy(buf, str, len);
+	return len;
+}
+
+/* Add values of a file to a set: one a line, # starts a comment line.
+ * st is the file the values are read from. */
+static int
+load_file(struct idset *set, const char *path, struct stat *st)
+{
+	FILE *f;
+	char line[1024], *p, *e;
+	uint8_t id[255];
+	int len, n = 0;
+
+	if ((f = fopen(path, "r")) == NULL) {
+		logd(LOG_ERR, "option82_plugin: can't open %s: %s", path, strerror(errno));
+		return 0;
+	}
+	fstat(fileno(f), st);
+	while (fgets(line, sizeof(line), f) != NULL) {
+		n++;
+		p = line + strspn(line, " \t");
+		for (e = p + strlen(p); e > p && isspace((unsigned char)e[-1]); e--)
+			e[-1] = '\0';
+		if (*p == '\0' || *p == '#')
+			continue;
+		if ((len = parse_id(p, id, 1)) == -1) {
+			logd(LOG_WARNING, "option82_plugin: %s:%d: value syntax error. Ignoring.",
+				path, n);
+			continue;
+		}
+		if (idset_add(set, id, len) == -1) {
+			logd(LOG_ERR, "option82_plugin: malloc error");
+			fclose(f);
+			return 0;
+		}
+	}
+	fclose(f);
+	return 1;
+}
+
+/* A set of trusted_circuits and file values. NULL on error. */
+static struct idset *
+build_set(struct stat *st)
+{
+	struct trusted_circuits *tc_entry;
+	struct idset *set;
+
+	if ((set = idset_new(idset_count(trusted), trusted_bloom)) == NULL) {
+		logd(LOG_ERR, "option82_plugin: malloc error");
+		return NULL;
+	}
+	STAILQ_FOREACH(tc_entry, &trusted_head, next)
+		if (idset_add(set, tc_entry->id, tc_entry->len) == -1) {
+			logd(LOG_ERR, "option82_plugin: malloc error");
+			idset_free(set);
+			return NULL;
+		}
+	if (trusted_file != NULL && !load_file(set, trusted_file, st)) {
+		idset_free(set);
+		return NULL;
+	}
+	return set;
+}
+
+static void
+install_set(struct idset *set)
+{
+	idset_free(trusted_old);
+	trusted_old = trusted;
+	atomic_store_rel_ptr((volatile uintptr_t *)&trusted, (uintptr_t)set);
+}
+
+/* Build a new set when the file is replaced or changed */
+static void *
+reloader(void *arg)
+{
+	struct timespec ts;
+	struct stat st;
+	struct idset *set;
+
+	pthread_mutex_lock(&reload_lock);
+	while (!reloader_stop) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += trusted_reload_interval;
+		pthread_cond_timedwait(&reload_cond, &reload_lock, &ts);
+		if (reloader_stop || stat(trusted_file, &st) == -1)
+			continue;
+		if (st.st_ino == trusted_st.st_ino && st.st_size == trusted_st.st_size &&
+		    st.st_mtim.tv_sec == trusted_st.st_mtim.tv_sec &&
+		    st.st_mtim.tv_nsec == trusted_st.st_mtim.tv_nsec)
+			continue;
+		if ((set = build_set(&st)) == NULL) {
+			/* Try again when it's changed next time */
+			logd(LOG_ERR, "option82_plugin: %s is not reloaded", trusted_file);
+			trusted_st = st;
+			continue;
+		}
+		trusted_st = st;
+		install_set(set);
+		logd(LOG_NOTICE, "option82_plugin: %u trusted circuits loaded from %s",
+			idset_count(set), trusted_file);
+	}
+	pthread_mutex_unlock(&reload_lock);
+	return NULL;
+}
+
+static void
+start_reloader(void)
+{
+	if (trusted_file == NULL || trusted_reload_interval == 0)
+		return;
+	if (pthread_create(&reloader_tid, NULL, reloader, NULL) != 0) {
+		logd(LOG_ERR, "option82_plugin: can't create a reloader thread");
+		return;
+	}
+	reloader_running = 1;
+	/* dhcprelya -r exits without plugins destroy() */
+	atexit(option82_plugin_destroy);
+}
+
+static void
+build_agent_option(const struct interface *intf)
+{
+	struct agent_option *a = &agent_options[intf->idx];
+	int intf_name_len, len;
+	uint8_t *p;
+
+	intf_name_len = strlen(intf->name);
+	len = 2 + intf_name_len + 2 + rid_len;
+	if (link_selection_map[intf->idx])
+		len += 2 + sizeof(ip_addr_t);
+	a->ip = intf->ip;
+	if (len > 255) {
+		logd(LOG_ERR, "option82_plugin: option 82 for %s is too long. It's not added.",
+			intf->name);
+		a->len = -1;
+		return;
+	}
+
+	p = a->data;
+	*p++ = 82;
+	*p++ = len;
+	*p++ = 1;
+	*p++ = intf_name_len;
+	memcpy(p, intf->name, intf_name_len);
+	p += intf_name_len;
+	*p++ = 2;
+	*p++ = rid_len;
+	memcpy(p, rid, rid_len);
+	p += rid_len;
+	if (link_selection_map[intf->idx]) {
+		*p++ = 5;
+		*p++ = sizeof(ip_addr_t);
+		memcpy(p, &intf->ip, sizeof(ip_addr_t));
+		p += sizeof(ip_addr_t);
+	}
+	a->len = p - a->data;
+}
+
+/* Is a Circuit ID or a Remote ID of the packet trusted */
+static int
+is_trusted(struct dhcp_packet *dhcp)
+{
+	struct idset *set;
+	uint8_t *p;
+
+	set = (struct idset *)atomic_load_acq_ptr((volatile uintptr_t *)&trusted);
+	if ((p = find_suboption(dhcp, 82, 1)) != NULL && idset_contains(set, p + 2, p[1]))
+		return 1;
+	if ((p = find_suboption(dhcp, 82, 2)) != NULL && idset_contains(set, p + 2, p[1]))
+		return 1;
+	return 0;
+}
+
 int
 option82_plugin_init(plugin_options_head_t *options_head)
 {
 	struct plugin_options *opts, *opts_tmp;
-	int i, n, rid_set = 0;
+	int i, n, len, rid_set = 0;
 	char *p, *p1;
+	uint8_t id[255];
 	struct trusted_circuits *tc_entry;
 	struct interface *intf;
 
@@ -72,24 +326,12 @@ option82_plugin_init(plugin_options_head_t *options_head)
 			}
 		} else if (strcasecmp(opts->option_line, "remote_id") == 0) {
 			rid_set = 1;
-			rid_len = 0;
-			/* is a string */
-			if (*p == '"') {
-				p++;
-				for (i = 0; *p != '"' && *p != '\0'; p++, i++)
-					rid[i] = *p;
-				if (*p != '"') {
-					logd(LOG_ERR, "option82_plugin: Syntex error in option value at line: %s", opts->option_line);
-					return 0;
-				}
-			} else if (strcasecmp(p, "0x") == 0) {
-				p += 2;
-				logd(LOG_ERR, "option82_plugin: hexadecimal is not supported yet at line: %s", opts->option_line);
-				return 0;
-			} else {
+			/* a quoted string or a hexadecimal */
+			if ((rid_len = parse_id(p, (uint8_t *)rid, 0)) == -1) {
 				logd(LOG_ERR, "option82_plugin: Syntex error in option value at line: %s", opts->option_line);
 				return 0;
 			}
+			rid[rid_len] = '\0';
 		} else if (strcasecmp(opts->option_line, "never_strip_answer") == 0) {
 			if ((never_strip_answer = get_bool_value(p)) == -1) {
 				logd(LOG_ERR, "option82_plugin: Syntex error in option value at line: %s", opts->option_line);
@@ -107,38 +349,43 @@ option82_plugin_init(plugin_options_head_t *options_head)
 		} else if (strcasecmp(opts->option_line, "trusted_circuits") == 0) {
 			n = 1;
 			while ((p1 = strsep(&p, " \t")) != NULL) {
-				if (*p1 == '"') {
-					p1++;
-					tc_entry = malloc(sizeof(struct trusted_circuits));
-					if (tc_entry == NULL) {
-						logd(LOG_ERR, "option82_plugin: malloc error");
-						return 0;
-					}
-					tc_entry->id = malloc(strlen(p1));
-					if (tc_entry->id == NULL) {
-						logd(LOG_ERR, "option82_plugin: malloc error");
-						return 0;
-					}
-					for (i = 0; *p1 != '\0'; i++, p1++)
-						tc_entry->id[i] = *p1;
-					i--;
-					if (tc_entry->id[i] != '"') {
-						logd(LOG_ERR, "option82_plugin: value syntax error at line %d", opts->option_line);
-						return 0;
-					}
-					tc_entry->id[i] = '\0';
-					logd(LOG_DEBUG, "trusted circuit #%d: %s", n, tc_entry->id);
-					tc_entry->len = strlen((char *)tc_entry->id);
-					STAILQ_INSERT_TAIL(&trusted_head, tc_entry, next);
-					n++;
-				} else {
-					if (strncasecmp(p1, "0x", 2) == 0)
-						logd(LOG_ERR, "option82_plugin: hexadecial is not supported yet at line: %d", opts->option_line);
-					else
-						logd(LOG_ERR, "option82_plugin: value syntax error at line %d", opts->option_line);
+				if (*p1 == '\0')
+					continue;
+				if ((len = parse_id(p1, id, 0)) == -1) {
+					logd(LOG_ERR, "option82_plugin: value syntax error at line: %s", opts->option_line);
 					return 0;
 				}
+				tc_entry = malloc(sizeof(struct trusted_circuits));
+				if (tc_entry == NULL || (tc_entry->id = malloc(len + 1)) == NULL) {
+					logd(LOG_ERR, "option82_plugin: malloc error");
+					return 0;
+				}
+				memcpy(tc_entry->id, id, len);
+				tc_entry->id[len] = '\0';
+				tc_entry->len = len;
+				logd(LOG_DEBUG, "trusted circuit #%d: %s", n, p1);
+				STAILQ_INSERT_TAIL(&trusted_head, tc_entry, next);
+				n++;
 			}
+		} else if (strcasecmp(opts->option_line, "trusted_circuits_file") == 0) {
+			free(trusted_file);
+			if ((trusted_file = strdup(p)) == NULL) {
+				logd(LOG_ERR, "option82_plugin: malloc error");
+				return 0;
+			}
+		} else if (strcasecmp(opts->option_line, "trusted_bloom") == 0) {
+			if ((trusted_bloom = get_bool_value(p)) == -1) {
+				logd(LOG_ERR, "option82_plugin: Syntex error in option value at line: %s", opts->option_line);
+				return 0;
+			}
+		} else if (strcasecmp(opts->option_line, "trusted_reload_interval") == 0) {
+			n = strtol(p, NULL, 10);
+			if (n < 0 || n > 86400) {
+				logd(LOG_ERR, "option82_plugin: trusted_reload_interval must be from 0 to 86400");
+				return 0;
+			}
+			trusted_reload_interval = n;
+			logd(LOG_DEBUG, "trusted_reload_interval set to: %u", trusted_reload_interval);
 		} else if (strcasecmp(opts->option_line, "enable_link_selection_for") == 0) {
 			while ((p1 = strsep(&p, " ,")) != NULL) {
 				if ((intf = get_interface_by_name(p1)) == NULL) {
@@ -179,58 +426,70 @@ option82_plugin_init(plugin_options_head_t *options_head)
 		rid_len = strlen(rid);
 	}
 	logd(LOG_DEBUG, "option82_plugin: Agent Remote ID: %s", rid);
+	for (i = 0; i < if_num; i++)
+		build_agent_option(ifs[i]);
+
+	if ((trusted = build_set(&trusted_st)) == NULL)
+		return 0;
+	logd(LOG_DEBUG, "option82_plugin: %u trusted circuits", idset_count(trusted));
 	return 1;
 }
 
+void
+option82_plugin_destroy()
+{
+	if (reloader_running) {
+		pthread_mutex_lock(&reload_lock);
+		reloader_stop = 1;
+		pthread_cond_signal(&reload_cond);
+		pthread_mutex_unlock(&reload_lock);
+		pthread_join(reloader_tid, NULL);
+		reloader_running = 0;
+	}
+}
+
 int
 option82_plugin_client_request(const struct interface *intf,
 			       struct dhcp_packet *dhcp, struct packet_headers *headers)
 {
-	uint8_t buf[255], *p, *opt;
-	int intf_name_len, match;
-	struct trusted_circuits *tc_entry;
+	struct agent_option *a;
+	uint8_t *opt;
+	int max_opts_len;
 
+	pthread_once(&reloader_once, start_reloader);
 	if (!only_for[intf->idx])		// Disabled in config. Ignore interface and pass the packet as is.
 		return 1;
 
-	opt = find_option(dhcp, 82);
+	/* Option 82 or the end where ours goes */
+	if ((opt = find_option_or_end(dhcp, 82)) == NULL)
+		return 1;
 	/* XXX discard if GIADDR spoofing (our address) */
-	if (*((ip_addr_t *)&dhcp->giaddr) == 0 && opt != NULL) {
+	if (*((ip_addr_t *)&dhcp->giaddr) == 0 && *opt == 82) {
 		logd(LOG_ERR, "option82_plugin: got a packet from an agent but GIADDR == 0. Dropped.");
 		return 0;
 	}
 	/* if we already have option82, check for trusted circuits. we'll not
 	 * add own option82 if it's already there. */
-	if (opt) {
-		match = 0;
-		STAILQ_FOREACH(tc_entry, &trusted_head, next) {
-			if (tc_entry->len == rid_len && memcmp(tc_entry->id, rid, rid_len) == 0)
-				match = 1;
-		}
-		if (!match) {
+	if (*opt == 82) {
+		if (!is_trusted(dhcp)) {
 			logd(LOG_DEBUG, "option82_plugin: got a packet with option82 but from unknown circuit. Dropped.");
 			return 0;
 		}
 	} else {
-		intf_name_len = strlen(intf->name);
-
-		/* insert option 82 */
-		p = buf;
-		*p++ = 1;
-		*p++ = intf_name_len;
-		memcpy(p, intf->name, intf_name_len);
-		p += intf_name_len;
-		*p++ = 2;
-		*p++ = rid_len;
-		memcpy(p, rid, rid_len);
-		p += rid_len;
-		if (link_selection_map[intf->idx]) {
-			*p++ = 5;
-			*p++ = sizeof(ip_addr_t);
-			memcpy(p, &intf->ip, sizeof(ip_addr_t));
-			p += sizeof(ip_addr_t);
+		a = &agent_options[intf->idx];
+		if (a->len == 0 || (link_selection_map[intf->idx] && a->ip != intf->ip))
+			build_agent_option(intf);
+		if (a->len == -1)
+			return 1;
+		/* append option 82 in place of the end mark (the limit is as in insert_option()) */
+		max_opts_len = max_packet_size - ETHER_HDR_LEN - DHCP_UDP_OVERHEAD -
+			DHCP_FIXED_NON_UDP - DHCP_COOKIE_LEN;
+		if (opt - (uint8_t *)dhcp + 1 + a->len > max_opts_len) {
+			logd(LOG_ERR, "Can't add option 82 without packet oversizing. Passed without changes.");
+			return 1;
 		}
-		insert_option(dhcp, 82, p - buf, buf, INSERT_OPTION_NORMAL);
+		memcpy(opt, a->data, a->len);
+		opt[a->len] = 255;
 	}
 
 	return 1;
@@ -243,8 +502,8 @@ option82_plugin_send_to_client(const struct sockaddr_in *server,
 {
 	uint8_t *p;
 	int rlen, match, need_strip = 0;
-	struct trusted_circuits *tc_entry;
 
+	pthread_once(&reloader_once, start_reloader);
 	if (!only_for[intf->idx])		// Disabled in config. Ignore interface and pass the packet as is.
 		return 1;
 
@@ -266,12 +525,7 @@ option82_plugin_send_to_client(const struct sockaddr_in *server,
 
 	/* it's not our. check for trusted */
 	if (!match) {
-		match = 0;
-		STAILQ_FOREACH(tc_entry, &trusted_head, next) {
-			if (tc_entry->len == rlen && memcmp(tc_entry->id, p, rlen) == 0)
-				match = 1;
-		}
-		if (!match) {
+		if (!is_trusted(dhcp)) {
 			*(p + rlen) = '\0';
 			logd(LOG_DEBUG, "option82_plugin: an answer from untrusted circuit: %s. Ignored", p);
 			return 0;
@@ -289,7 +543,7 @@ option82_plugin_send_to_client(const struct sockaddr_in *server,
 struct plugin_data option82_plugin = {
 	"option82",
 	option82_plugin_init,
-	NULL,
+	option82_plugin_destroy,
 	option82_plugin_client_request,
 	NULL,
 	NULL,
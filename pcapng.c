@@ -0,0 +1,197 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/param.h>
+#include <sys/time.h>
+
+#include "dhcprelya.h"
+
+/* pcapng trace files.
+ *
+ * A file has a section header, an interface description block for every
+ * interface name when a first packet for it is written and an enhanced
+ * packet block per packet with a direction flag and a comment. Blocks go
+ * through a large stdio buffer, so a few packets are one write(2). Files
+ * are <prefix>-YYYYmmdd-HHMMSS-N.pcapng and are rotated by a size and by
+ * an age (a packet time). Only one thread may use it. */
+
+#define BT_SHB		0x0A0D0D0A
+#define BT_IDB		0x00000001
+#define BT_EPB		0x00000006
+#define BYTE_ORDER_MAGIC	0x1A2B3C4D
+
+#define OPT_END		0
+#define OPT_COMMENT	1
+#define OPT_SHB_USERAPPL	4
+#define OPT_IF_NAME	2
+#define OPT_EPB_FLAGS	2
+
+#define LINKTYPE_ETHERNET	1
+#define PCAPNG_IF_MAX	(IF_MAX + 1)
+#define PCAPNG_BUFSIZE	(1024 * 1024)
+
+static FILE *f;
+static char *prefix;
+static char *buf;
+static off_t size, rotate_size;
+static time_t opened, rotate_time;
+static unsigned seq;
+static char if_names[PCAPNG_IF_MAX][INTF_NAME_LEN];
+static int if_cnt;
+
+static size_t
+opt_len(size_t len)
+{
+	return 4 + roundup(len, 4);
+}
+
+static void
+put(const void *data, size_t len)
+{
+	fwrite(data, len, 1, f);
+	size += len;
+}
+
+static void
+put32(uint32_t v)
+{
+	put(&v, sizeof(v));
+}
+
+static void
+put_opt(uint16_t code, const void *data, size_t len)
+{
+	static const uint8_t zero[4];
+	uint16_t hdr[2] = {code, len};
+
+	put(hdr, sizeof(hdr));
+	put(data, len);
+	put(zero, roundup(len, 4) - len);
+}
+
+static int
+new_file(time_t now)
+{
+	char name[MAXPATHLEN], stamp[32];
+	const char *appl = "dhcprelya";
+	struct tm tm;
+	uint32_t len;
+	uint16_t version[2] = {1, 0};
+	int64_t section_len = -1;
+
+	if (f != NULL)
+		fclose(f);
+	localtime_r(&now, &tm);
+	strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+	snprintf(name, sizeof(name), "%s-%s-%u.pcapng", prefix, stamp, seq++);
+	if ((f = fopen(name, "w")) == NULL) {
+		logd(LOG_ERR, "pcapng: Can't open %s: %s", name, strerror(errno));
+		return 0;
+	}
+	setvbuf(f, buf, _IOFBF, PCAPNG_BUFSIZE);
+	size = 0;
+	opened = now;
+	if_cnt = 0;
+
+	len = 28 + opt_len(strlen(appl)) + opt_len(0);
+	put32(BT_SHB);
+	put32(len);
+	put32(BYTE_ORDER_MAGIC);
+	put(version, sizeof(version));
+	put(&section_len, sizeof(section_len));
+	put_opt(OPT_SHB_USERAPPL, appl, strlen(appl));
+	put_opt(OPT_END, NULL, 0);
+	put32(len);
+	return 1;
+}
+
+/* An interface id. A description block is written for a new one. */
+static int
+interface_id(const char *ifname)
+{
+	uint32_t len;
+	uint16_t link[2] = {LINKTYPE_ETHERNET, 0};
+	int i;
+
+	for (i = 0; i < if_cnt; i++)
+		if (strcmp(if_names[i], ifname) == 0)
+			return i;
+	if (if_cnt == PCAPNG_IF_MAX)
+		return 0;
+	strlcpy(if_names[if_cnt], ifname, INTF_NAME_LEN);
+
+	len = 20 + opt_len(strlen(ifname)) + opt_len(0);
+	put32(BT_IDB);
+	put32(len);
+	put(link, sizeof(link));
+	put32(DHCP_MTU_MAX + ETHER_HDR_LEN);	/* snaplen */
+	put_opt(OPT_IF_NAME, ifname, strlen(ifname));
+	put_opt(OPT_END, NULL, 0);
+	put32(len);
+	return if_cnt++;
+}
+
+int
+pcapng_open(const char *file_prefix, off_t max_size, time_t max_age)
+{
+	if ((prefix = strdup(file_prefix)) == NULL ||
+	    (buf = malloc(PCAPNG_BUFSIZE)) == NULL) {
+		logd(LOG_ERR, "pcapng: malloc");
+		return 0;
+	}
+	rotate_size = max_size;
+	rotate_time = max_age;
+	return new_file(time(NULL));
+}
+
+/* Write an Ethernet frame. flags: PCAPNG_IN or PCAPNG_OUT. */
+void
+pcapng_write(const char *ifname, int flags, const struct timeval *tv,
+	const uint8_t *frame, size_t frame_len, const char *comment)
+{
+	static const uint8_t zero[4];
+	uint64_t ts;
+	uint32_t len, epb_flags = flags;
+	int id;
+
+	if ((rotate_size && size >= rotate_size) ||
+	    (rotate_time && tv->tv_sec - opened >= rotate_time) || f == NULL)
+		if (!new_file(tv->tv_sec))
+			return;
+
+	id = interface_id(ifname);
+	len = 32 + roundup(frame_len, 4) + opt_len(sizeof(epb_flags)) +
+		(comment != NULL ? opt_len(strlen(comment)) : 0) + opt_len(0);
+	ts = (uint64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+	put32(BT_EPB);
+	put32(len);
+	put32(id);
+	put32(ts >> 32);
+	put32(ts);
+	put32(frame_len);
+	put32(frame_len);
+	put(frame, frame_len);
+	put(zero, roundup(frame_len, 4) - frame_len);
+	put_opt(OPT_EPB_FLAGS, &epb_flags, sizeof(epb_flags));
+	if (comment != NULL)
+		put_opt(OPT_COMMENT, comment, strlen(comment));
+	put_opt(OPT_END, NULL, 0);
+	put32(len);
+}
+
+void
+pcapng_flush(void)
+{
+	if (f != NULL)
+		fflush(f);
+}
+
+void
+pcapng_close(void)
+{
+	if (f != NULL)
+		fclose(f);
+	f = NULL;
+}
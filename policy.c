@@ -0,0 +1,485 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include "dhcprelya.h"
+
+/* Policy based routing of client requests.
+ *
+ * [policy] section lines are server groups:
+ *	group <name> = <server>...
+ * and rules:
+ *	<match>... => drop | pass | group <name>
+ * where a match is one of (a comma separated list of values means "any of"):
+ *	interface=vlan1,vlan2
+ *	type=discover,request,release,... (or a number)
+ *	vendor_class=<prefix>	(option 60)
+ *	user_class=<prefix>	(option 77)
+ *	chaddr=00:11:22		(a client MAC prefix)
+ * The first matched rule wins. If no rule matched, a request is passed to
+ * the interface servers as usual. Group servers are opened when the whole
+ * config is read, so a server of servers lines is not opened twice.
+ *
+ * Rules are compiled into a decision table. Every rule is a bit. For every
+ * match kind and every possible value there is a bitmap of rules accepting
+ * it (rules without such a match accept any value). A packet gets one
+ * bitmap per match kind and the lowest bit of their intersection is the
+ * rule. String and MAC prefixes are kept in a hash by (length, prefix),
+ * so a lookup costs one probe per distinct prefix length used in rules. */
+
+#define MATCH_IF	0
+#define MATCH_TYPE	1
+#define MATCH_VENDOR	2
+#define MATCH_USER	3
+#define MATCH_CHADDR	4
+#define MATCH_MAX	5
+
+static const char *match_names[MATCH_MAX] = {
+	"interface", "type", "vendor_class", "user_class", "chaddr"
+};
+
+static const char *msg_types[] = {
+	"", "discover", "offer", "request", "decline", "ack", "nak",
+	"release", "inform", NULL
+};
+
+struct policy_rule {
+	int line;
+	int action;
+	char *group_name;
+	int group;
+	char *match[MATCH_MAX];	/* NULL if any value accepted */
+};
+
+struct policy_group {
+	char *name;
+	char *spec;		/* servers till policy_compile() */
+	int line;
+	int srv_num;
+	int srvrs[SERVERS_MAX];
+};
+
+struct pfx_entry {
+	int len;
+	uint8_t *key;
+	uint64_t *bits;
+	struct pfx_entry *next;
+};
+
+struct pfx_index {
+	uint64_t *any;
+	int nlens;
+	uint8_t lens[256];	/* distinct prefix lengths, ascending */
+	struct pfx_entry **hash;
+	unsigned hash_mask;
+};
+
+static struct policy_rule *rules;
+static int rules_num = 0;
+static struct policy_group *groups;
+static int groups_num = 0;
+
+/* Compiled table */
+static int words;		/* uint64_t words in a bitmap */
+static uint64_t *if_bits;	/* [IF_MAX][words] */
+static uint64_t *type_bits;	/* [256][words] */
+static struct pfx_index pfx[MATCH_MAX];
+static uint64_t *acc, *tmp;	/* lookup buffers, the main thread only */
+
+static int
+find_group(const char *name)
+{
+	int i;
+
+	for (i = 0; i < groups_num; i++)
+		if (strcmp(groups[i].name, name) == 0)
+			return i;
+	return -1;
+}
+
+static char *
+strip(char *s)
+{
+	char *e;
+
+	while (isspace(*s))
+		s++;
+	e = s + strlen(s);
+	while (e > s && isspace(e[-1]))
+		*--e = '\0';
+	return s;
+}
+
+/* Parse a line of [policy] section. Returns 0 on error. */
+int
+policy_parse_line(char *buf, int line)
+{
+	struct policy_rule *r;
+	struct policy_group *g;
+	char *p, *action, *tok;
+	int i;
+
+	buf = strip(buf);
+	if (strncasecmp(buf, "group", 5) == 0 && isspace(buf[5])) {
+		if ((p = strchr(buf, '=')) == NULL) {
+			logd(LOG_ERR, "policy: group syntax error. Line: %d", line);
+			return 0;
+		}
+		*p++ = '\0';
+		groups = realloc(groups, (groups_num + 1) * sizeof(struct policy_group));
+		if (groups == NULL)
+			process_error(EX_MEM, "malloc");
+		g = &groups[groups_num];
+		bzero(g, sizeof(struct policy_group));
+		g->name = strdup(strip(buf + 5));
+		if (g->name == NULL)
+			process_error(EX_MEM, "malloc");
+		if (find_group(g->name) != -1) {
+			logd(LOG_ERR, "policy: group %s is already defined. Line: %d", g->name, line);
+			free(g->name);
+			return 0;
+		}
+		if ((g->spec = strdup(p)) == NULL)
+			process_error(EX_MEM, "malloc");
+		g->line = line;
+		groups_num++;
+		return 1;
+	}
+
+	if ((p = strstr(buf, "=>")) == NULL) {
+		logd(LOG_ERR, "policy: rule must have an action (=>). Line: %d", line);
+		return 0;
+	}
+	*p = '\0';
+	action = strip(p + 2);
+
+	rules = realloc(rules, (rules_num + 1) * sizeof(struct policy_rule));
+	if (rules == NULL)
+		process_error(EX_MEM, "malloc");
+	r = &rules[rules_num];
+	bzero(r, sizeof(struct policy_rule));
+	r->line = line;
+	r->group = -1;
+
+	if (strcasecmp(action, "drop") == 0)
+		r->action = POLICY_DROP;
+	else if (strcasecmp(action, "pass") == 0)
+		r->action = POLICY_PASS;
+	else if (strncasecmp(action, "group", 5) == 0 && isspace(action[5])) {
+		r->action = POLICY_GROUP;
+		r->group_name = strdup(strip(action + 5));
+		if (r->group_name == NULL)
+			process_error(EX_MEM, "malloc");
+	} else {
+		logd(LOG_ERR, "policy: unknown action %s. Line: %d", action, line);
+		return 0;
+	}
+
+	p = buf;
+	while ((tok = strsep(&p, " \t")) != NULL) {
+		if (*tok == '\0')
+			continue;
+		if ((action = strchr(tok, '=')) == NULL) {
+			logd(LOG_ERR, "policy: match syntax error: %s. Line: %d", tok, line);
+			return 0;
+		}
+		*action++ = '\0';
+		for (i = 0; i < MATCH_MAX; i++)
+			if (strcasecmp(tok, match_names[i]) == 0)
+				break;
+		if (i == MATCH_MAX || *action == '\0') {
+			logd(LOG_ERR, "policy: unknown match %s. Line: %d", tok, line);
+			return 0;
+		}
+		if (r->match[i] != NULL) {
+			logd(LOG_ERR, "policy: duplicate match %s. Line: %d", tok, line);
+			return 0;
+		}
+		if ((r->match[i] = strdup(action)) == NULL)
+			process_error(EX_MEM, "malloc");
+	}
+	rules_num++;
+	return 1;
+}
+
+static inline void
+set_bit(uint64_t *bits, int n)
+{
+	bits[n / 64] |= 1ULL << (n % 64);
+}
+
+static inline unsigned
+pfx_hash(const uint8_t *key, int len)
+{
+	return fnv1a(FNV1A_BASIS, key, len) ^ len;
+}
+
+static struct pfx_entry *
+pfx_find(const struct pfx_index *idx, const uint8_t *key, int len)
+{
+	struct pfx_entry *e;
+
+	for (e = idx->hash[pfx_hash(key, len) & idx->hash_mask]; e != NULL; e = e->next)
+		if (e->len == len && memcmp(e->key, key, len) == 0)
+			return e;
+	return NULL;
+}
+
+static void
+pfx_add(struct pfx_index *idx, const uint8_t *key, int len, int rule)
+{
+	struct pfx_entry *e;
+	unsigned h;
+	int i;
+
+	if ((e = pfx_find(idx, key, len)) == NULL) {
+		e = malloc(sizeof(struct pfx_entry));
+		if (e == NULL || (e->key = malloc(len)) == NULL ||
+		    (e->bits = calloc(words, sizeof(uint64_t))) == NULL)
+			process_error(EX_MEM, "malloc");
+		e->len = len;
+		memcpy(e->key, key, len);
+		h = pfx_hash(key, len) & idx->hash_mask;
+		e->next = idx->hash[h];
+		idx->hash[h] = e;
+
+		/* Keep distinct lengths sorted */
+		for (i = 0; i < idx->nlens && idx->lens[i] < len; i++)
+			;
+		if (i == idx->nlens || idx->lens[i] != len) {
+			memmove(&idx->lens[i + 1], &idx->lens[i], idx->nlens - i);
+			idx->lens[i] = len;
+			idx->nlens++;
+		}
+	}
+	set_bit(e->bits, rule);
+}
+
+/* Parse "00:11:22" into bytes. Returns a length or 0. */
+static int
+parse_mac_prefix(const char *s, uint8_t *buf)
+{
+	char *end;
+	long v;
+	int n = 0;
+
+	while (*s != '\0' && n < 16) {
+		v = strtol(s, &end, 16);
+		if (end == s || v < 0 || v > 255 || (*end != ':' && *end != '\0'))
+			return 0;
+		buf[n++] = v;
+		s = *end == ':' ? end + 1 : end;
+	}
+	return *s == '\0' ? n : 0;
+}
+
+static int
+parse_msg_type(const char *s)
+{
+	char *end;
+	long v;
+	int i;
+
+	for (i = 1; msg_types[i] != NULL; i++)
+		if (strcasecmp(s, msg_types[i]) == 0)
+			return i;
+	v = strtol(s, &end, 10);
+	if (end == s || *end != '\0' || v < 1 || v > 255)
+		return -1;
+	return v;
+}
+
+/* Open servers of a group. add_server() finds one opened already. */
+static int
+open_group(struct policy_group *g)
+{
+	char *p, *tok;
+	int srv;
+
+	p = g->spec;
+	while ((tok = strsep(&p, " \t")) != NULL) {
+		if (*tok == '\0')
+			continue;
+		if ((srv = add_server(tok)) == -1) {
+			logd(LOG_WARNING, "policy: can't open server %s. Ignored.", tok);
+			continue;
+		}
+		g->srvrs[g->srv_num++] = srv;
+	}
+	free(g->spec);
+	g->spec = NULL;
+	if (g->srv_num == 0) {
+		logd(LOG_ERR, "policy: no servers in group %s. Line: %d", g->name, g->line);
+		return 0;
+	}
+	return 1;
+}
+
+/* Build a decision table. Should be called after all interfaces and
+ * servers opened. */
+int
+policy_compile(void)
+{
+	struct policy_rule *r;
+	struct interface *intf;
+	uint8_t key[16];
+	char *list, *v, *p;
+	int i, j, m, n, t, len, values;
+	unsigned hsize;
+
+	for (i = 0; i < groups_num; i++)
+		if (!open_group(&groups[i]))
+			return 0;
+	if (rules_num == 0)
+		return 1;
+
+	words = (rules_num + 63) / 64;
+	if_bits = calloc(IF_MAX * words, sizeof(uint64_t));
+	type_bits = calloc(256 * words, sizeof(uint64_t));
+	acc = calloc(words, sizeof(uint64_t));
+	tmp = calloc(words, sizeof(uint64_t));
+	if (if_bits == NULL || type_bits == NULL || acc == NULL || tmp == NULL)
+		process_error(EX_MEM, "malloc");
+
+	for (m = MATCH_VENDOR; m < MATCH_MAX; m++) {
+		values = 0;
+		for (i = 0; i < rules_num; i++)
+			if (rules[i].match[m] != NULL)
+				for (p = rules[i].match[m], values++; *p != '\0'; p++)
+					if (*p == ',')
+						values++;
+		for (hsize = 16; hsize < values * 2; hsize <<= 1)
+			;
+		pfx[m].any = calloc(words, sizeof(uint64_t));
+		pfx[m].hash = calloc(hsize, sizeof(struct pfx_entry *));
+		if (pfx[m].any == NULL || pfx[m].hash == NULL)
+			process_error(EX_MEM, "malloc");
+		pfx[m].hash_mask = hsize - 1;
+	}
+
+	for (i = 0; i < rules_num; i++) {
+		r = &rules[i];
+		if (r->action == POLICY_GROUP &&
+		    (r->group = find_group(r->group_name)) == -1) {
+			logd(LOG_ERR, "policy: unknown group %s. Line: %d", r->group_name, r->line);
+			return 0;
+		}
+
+		if (r->match[MATCH_IF] == NULL) {
+			for (j = 0; j < IF_MAX; j++)
+				set_bit(if_bits + j * words, i);
+		} else {
+			n = 0;
+			list = r->match[MATCH_IF];
+			while ((v = strsep(&list, ",")) != NULL) {
+				if ((intf = get_interface_by_name(v)) == NULL) {
+					logd(LOG_WARNING, "policy: interface %s is not open. Ignoring. Line: %d", v, r->line);
+					continue;
+				}
+				set_bit(if_bits + intf->idx * words, i);
+				n++;
+			}
+			if (n == 0)
+				logd(LOG_WARNING, "policy: the rule never matches. Line: %d", r->line);
+		}
+
+		if (r->match[MATCH_TYPE] == NULL) {
+			for (t = 0; t < 256; t++)
+				set_bit(type_bits + t * words, i);
+		} else {
+			list = r->match[MATCH_TYPE];
+			while ((v = strsep(&list, ",")) != NULL) {
+				if ((t = parse_msg_type(v)) == -1) {
+					logd(LOG_ERR, "policy: unknown message type %s. Line: %d", v, r->line);
+					return 0;
+				}
+				set_bit(type_bits + t * words, i);
+			}
+		}
+
+		for (m = MATCH_VENDOR; m < MATCH_MAX; m++) {
+			if (r->match[m] == NULL) {
+				set_bit(pfx[m].any, i);
+				continue;
+			}
+			list = r->match[m];
+			while ((v = strsep(&list, ",")) != NULL) {
+				if (m == MATCH_CHADDR) {
+					if ((len = parse_mac_prefix(v, key)) == 0) {
+						logd(LOG_ERR, "policy: bad MAC prefix %s. Line: %d", v, r->line);
+						return 0;
+					}
+					pfx_add(&pfx[m], key, len, i);
+				} else {
+					len = strlen(v);
+					if (len == 0 || len > 255) {
+						logd(LOG_ERR, "policy: bad %s value. Line: %d", match_names[m], r->line);
+						return 0;
+					}
+					pfx_add(&pfx[m], (uint8_t *)v, len, i);
+				}
+			}
+		}
+	}
+	logd(LOG_DEBUG, "policy: %d rules and %d groups compiled", rules_num, groups_num);
+	return 1;
+}
+
+/* acc &= union of rules accepting the value */
+static void
+pfx_match(const struct pfx_index *idx, const uint8_t *data, int len)
+{
+	struct pfx_entry *e;
+	int i, w;
+
+	memcpy(tmp, idx->any, words * sizeof(uint64_t));
+	for (i = 0; i < idx->nlens && idx->lens[i] <= len; i++)
+		if ((e = pfx_find(idx, data, idx->lens[i])) != NULL)
+			for (w = 0; w < words; w++)
+				tmp[w] |= e->bits[w];
+	for (w = 0; w < words; w++)
+		acc[w] &= tmp[w];
+}
+
+/* Find a policy for a request. For POLICY_GROUP *srvrs and *srv_cnt are set
+ * to the group servers. The main thread only. */
+int
+policy_lookup(struct dhcp_packet *dhcp, int if_idx, const int **srvrs, int *srv_cnt)
+{
+	struct policy_rule *r;
+	uint8_t *opt;
+	uint64_t *t;
+	int w, type;
+
+	if (rules_num == 0)
+		return POLICY_PASS;
+
+	opt = find_option(dhcp, 53);
+	type = (opt != NULL && opt[1] > 0) ? opt[2] : 0;
+
+	t = type_bits + type * words;
+	memcpy(acc, if_bits + if_idx * words, words * sizeof(uint64_t));
+	for (w = 0; w < words; w++)
+		acc[w] &= t[w];
+
+	opt = find_option(dhcp, 60);
+	pfx_match(&pfx[MATCH_VENDOR], opt ? opt + 2 : NULL, opt ? opt[1] : 0);
+	opt = find_option(dhcp, 77);
+	pfx_match(&pfx[MATCH_USER], opt ? opt + 2 : NULL, opt ? opt[1] : 0);
+	pfx_match(&pfx[MATCH_CHADDR], dhcp->chaddr,
+		dhcp->hlen <= sizeof(dhcp->chaddr) ? dhcp->hlen : sizeof(dhcp->chaddr));
+
+	for (w = 0; w < words; w++)
+		if (acc[w] != 0)
+			break;
+	if (w == words)
+		return POLICY_PASS;
+	r = &rules[w * 64 + ffsll(acc[w]) - 1];
+	if (r->action == POLICY_GROUP) {
+		*srvrs = groups[r->group].srvrs;
+		*srv_cnt = groups[r->group].srv_num;
+	}
+	return r->action;
+}
@@ -0,0 +1,207 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include <machine/atomic.h>
+
+#include "metrics.h"
+
+/* Requests from listeners to the main thread.
+ *
+ * Every interface has its own queue, so a flooding VLAN can't take the
+ * main thread from others. Interfaces with requests are served by a deficit
+ * round robin: an interface gets weight requests in its turn (a cost of
+ * a request is one, they all take about the same time to forward).
+ *
+ * A queue of an interface is split into priority classes by a message type,
+ * so a storm of DISCOVERs (a mass reboot, a loop on a switch port) doesn't
+ * delay clients which already have a lease or an offer:
+ * QCLASS_BOUND: RENEWING and REBINDING REQUESTs (ciaddr is set), DECLINE,
+ * RELEASE and INFORM;
+ * QCLASS_REQUEST: SELECTING and INIT-REBOOT REQUESTs;
+ * QCLASS_DISCOVER: DISCOVERs, BOOTP and anything else.
+ * In its turn an interface gives the oldest request of the highest non
+ * empty class.
+ *
+ * Strict priority may keep new clients waiting while bound ones are busy.
+ * With queue_aging a request with the secs field (a time since a client
+ * started trying) of queue_aging or more goes one class up, so clients
+ * retrying for long are not starved by a flow of new ones.
+ *
+ * Entries are not malloc()ed per request. An interface has a pool of
+ * queue_limit entries, it's the limit of its queue too: a request is
+ * dropped (tail drop) if all of them are queued or being forwarded.
+ * Pool pages are touched when an entry is used first time. The listener
+ * takes entries and the main thread returns them through a single producer,
+ * single consumer ring, so it's done without the queue lock. */
+
+unsigned int queue_size = 0;	/* all interfaces and classes */
+unsigned queue_aging = 0, queue_limit = 256;
+
+struct if_queue {
+	STAILQ_HEAD(, queue) heads[QCLASS_MAX];
+	unsigned depth, weight, deficit;
+	TAILQ_ENTRY(if_queue) active;
+	/* The pool. Entries of pool[] after pool_used were never taken. */
+	struct queue *pool;
+	unsigned pool_used;		/* the listener */
+	struct queue *spare;		/* the listener, returned by queue_cancel() */
+	struct queue **ring;		/* returned by the main thread */
+	volatile uint32_t ring_head;	/* the main thread */
+	uint32_t ring_tail;		/* the listener */
+} __aligned(CACHE_LINE_SIZE);
+
+static struct if_queue *if_queues;
+static unsigned ring_mask;
+static TAILQ_HEAD(, if_queue) active = TAILQ_HEAD_INITIALIZER(active);
+static unsigned q_depth[QCLASS_MAX];
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+/* Interfaces and their weights are known */
+int
+queue_init(void)
+{
+	struct if_queue *iq;
+	unsigned n;
+	int i, j;
+
+	if (if_num == 0)
+		return 1;
+	/* Ring counters are free running, a power of 2 size keeps slots right
+	 * when they wrap */
+	for (n = 1; n < queue_limit; n <<= 1)
+		;
+	ring_mask = n - 1;
+	if ((if_queues = calloc(if_num, sizeof(struct if_queue))) == NULL)
+		return 0;
+	for (i = 0; i < if_num; i++) {
+		iq = &if_queues[i];
+		for (j = 0; j < QCLASS_MAX; j++)
+			STAILQ_INIT(&iq->heads[j]);
+		iq->weight = ifs[i]->weight;
+		iq->pool = malloc(queue_limit * sizeof(struct queue));
+		iq->ring = malloc((ring_mask + 1) * sizeof(struct queue *));
+		if (iq->pool == NULL || iq->ring == NULL)
+			return 0;
+	}
+	return 1;
+}
+
+/* A free entry for a request from intf or NULL if the queue is full.
+ * The interface listener only. */
+struct queue *
+queue_alloc(const struct interface *intf)
+{
+	struct if_queue *iq = &if_queues[intf->idx];
+	struct queue *q;
+
+	if ((q = iq->spare) != NULL)
+		iq->spare = NULL;
+	else if (iq->ring_tail != atomic_load_acq_32(&iq->ring_head))
+		q = iq->ring[iq->ring_tail++ & ring_mask];
+	else if (iq->pool_used < queue_limit)
+		q = &iq->pool[iq->pool_used++];
+	else
+		return NULL;
+	q->if_idx = intf->idx;
+	return q;
+}
+
+/* Give back an entry not queued. The listener only. */
+void
+queue_cancel(struct queue *q)
+{
+	if_queues[q->if_idx].spare = q;
+}
+
+/* Give back a forwarded entry. The main thread only. */
+void
+queue_free(struct queue *q)
+{
+	struct if_queue *iq = &if_queues[q->if_idx];
+
+	iq->ring[iq->ring_head & ring_mask] = q;
+	atomic_store_rel_32(&iq->ring_head, iq->ring_head + 1);
+}
+
+/* A priority class of a request. Called by listeners. */
+int
+queue_class(struct dhcp_packet *dhcp)
+{
+	uint8_t *opt;
+	int qclass;
+
+	opt = find_option(dhcp, 53);
+	switch ((opt != NULL && opt[0] == 53 && opt[1] > 0) ? opt[2] : 0) {
+	case 3:		/* DHCPREQUEST */
+		qclass = dhcp->ciaddr.s_addr != 0 ? QCLASS_BOUND : QCLASS_REQUEST;
+		break;
+	case 4:		/* DHCPDECLINE */
+	case 7:		/* DHCPRELEASE */
+	case 8:		/* DHCPINFORM */
+		qclass = QCLASS_BOUND;
+		break;
+	default:
+		qclass = QCLASS_DISCOVER;
+	}
+	if (queue_aging && qclass != QCLASS_BOUND && ntohs(dhcp->secs) >= queue_aging) {
+		METRIC_INC(queue_aged);
+		qclass--;
+	}
+	return qclass;
+}
+
+void
+queue_put(struct queue *q)
+{
+	struct if_queue *iq = &if_queues[q->if_idx];
+
+	/* Not in queue_class(), a request may be dropped after it */
+	METRIC_INC(queue_in[q->qclass]);
+	pthread_mutex_lock(&queue_lock);
+	STAILQ_INSERT_TAIL(&iq->heads[q->qclass], q, entries);
+	if (iq->depth++ == 0)
+		TAILQ_INSERT_TAIL(&active, iq, active);
+	q_depth[q->qclass]++;
+	queue_size++;
+	pthread_cond_signal(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+}
+
+/* Wait for a request. The main thread only. */
+struct queue *
+queue_get(void)
+{
+	struct if_queue *iq;
+	struct queue *q;
+	int i;
+
+	pthread_mutex_lock(&queue_lock);
+	while (queue_size == 0)
+		pthread_cond_wait(&queue_cond, &queue_lock);
+	iq = TAILQ_FIRST(&active);
+	if (iq->deficit == 0)
+		iq->deficit = iq->weight;
+	for (i = 0; STAILQ_EMPTY(&iq->heads[i]); i++)
+		;
+	q = STAILQ_FIRST(&iq->heads[i]);
+	STAILQ_REMOVE_HEAD(&iq->heads[i], entries);
+	q_depth[i]--;
+	queue_size--;
+	iq->deficit--;
+	/* An empty queue loses the rest of its turn */
+	if (--iq->depth == 0 || iq->deficit == 0) {
+		TAILQ_REMOVE(&active, iq, active);
+		if (iq->depth != 0)
+			TAILQ_INSERT_TAIL(&active, iq, active);
+		iq->deficit = 0;
+	}
+	pthread_mutex_unlock(&queue_lock);
+	return q;
+}
+
+/* A number of requests of a class waiting. It's a gauge, so no lock. */
+unsigned
+queue_depth(int qclass)
+{
+	return q_depth[qclass];
+}
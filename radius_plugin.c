@@ -24,88 +24,767 @@
  * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
  * SUCH DAMAGE. */
 
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <poll.h>
 #include <pthread.h>
 #include <sys/types.h>
+#include <sys/queue.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <arpa/inet.h>
+#include <machine/atomic.h>
 #include <radlib.h>
 #include "dhcprelya.h"
+#include "metrics.h"
+
+/* RADIUS accounting of DHCP leases.
+ *
+ * A lease cache keyed by chaddr keeps an address, a lease time (option 51)
+ * and an expiration time of every binding seen in a DHCPACK. Start is sent
+ * for a new binding or a new address only, a renewal just moves the
+ * expiration. Stop is sent for a DHCPRELEASE and when a lease expires,
+ * Interim-Update every interim_interval seconds if it's set. Both are
+ * driven by a timer wheel turned once a second by a lease timer thread.
+ * Acct-Session-Id is a session start time and a MAC. If the cache is full
+ * a binding is accounted with a bare Start as before (untracked).
+ *
+ * A hook copies an address and a MAC into a bounded queue and returns.
+ * A fixed pool of workers (started on a first ACK, after daemon(3)) takes
+ * jobs from it. Every worker keeps up to max_inflight requests in flight:
+ * a libradius handle per request, started with rad_init_send_request()
+ * and driven by poll(2) and rad_continue_send_request(). Every handle has
+ * its own socket, so identifiers of concurrent requests never clash, and
+ * libradius does retries, timeouts and dead servers. A full queue drops a
+ * job and counts it. Counters, depths and a queued -> answered latency
+ * are in metrics (radius section).
+ *
+ * With spool_file a failed request or one not fitting into the queue is
+ * appended to a durable spool (spool.c) instead. Since then all new
+ * requests go to the spool too, workers don't wait for dead servers.
+ * A replayer thread sends spooled requests one by one, at most
+ * replay_rate a second, with Acct-Delay-Time. A record leaves the spool
+ * only when it's answered. The first answer sends new requests to the
+ * queue again while the rest of the spool is drained.
+ *
+ * With auth=yes DISCOVER and REQUEST are authorized by a MAC with
+ * Access-Request. Results are kept in a cache keyed by chaddr and an
+ * interface: a 4-way set associative table with a lock per a group of
+ * sets, entries live auth_accept_ttl, auth_reject_ttl or auth_fail_ttl
+ * seconds. A listener thread never waits for RADIUS: on a miss it marks
+ * an entry pending, puts a job into an authorization queue (taken by
+ * workers before accounting) and returns auth_pending verdict at once.
+ * Other packets of a client with a pending entry don't make new requests
+ * (coalescing). A client retransmits and gets a cached verdict. */
+
+#define ACCT_POLL_MS	10	/* look for new jobs while requests are in flight */
+#define LEASE_WHEEL_SIZE	4096
+#define AUTH_WAYS	4
+#define AUTH_LOCKS	256
+
+enum { AUTH_EMPTY, AUTH_PENDING, AUTH_ACCEPT, AUTH_REJECT, AUTH_FAILED };
+
+struct acct_job {
+	struct in_addr yiaddr;
+	uint8_t chaddr[ETHER_ADDR_LEN];
+	int status;			/* RAD_START, RAD_UPDATE or RAD_STOP */
+	int cause;			/* Acct-Terminate-Cause of Stop */
+	uint32_t session;		/* a session start time, 0 - no session */
+	uint32_t session_time;
+	uint32_t time;			/* wall clock of an event */
+	struct timespec queued;
+};
+
+struct auth_job {
+	uint8_t chaddr[ETHER_ADDR_LEN];
+	int if_idx;
+	const char *ifname;
+	struct timespec queued;
+};
+
+struct auth_entry {
+	uint8_t chaddr[ETHER_ADDR_LEN];
+	uint8_t state;
+	int if_idx;
+	time_t expires;			/* monotonic */
+};
+
+struct lease {
+	uint8_t chaddr[ETHER_ADDR_LEN];
+	struct in_addr ip;
+	uint32_t lease_time;
+	uint32_t session;		/* wall clock start time */
+	time_t started, expires;	/* monotonic */
+	time_t interim;			/* next Interim-Update */
+	struct tw_timer timer;		/* at min(expires, interim) */
+	LIST_ENTRY(lease) entries;	/* a hash chain or a free list */
+};
+LIST_HEAD(lease_list, lease);
+
+struct acct_slot {
+	struct rad_handle *rh;		/* accounting */
+	struct rad_handle *auth_rh;	/* authorization if enabled */
+	struct rad_handle *cur;		/* of a request in flight */
+	int fd;				/* -1 if the slot is free */
+	struct timespec deadline;
+	struct acct_job job;
+	struct auth_job auth;		/* if cur is auth_rh */
+};
+
+struct acct_worker {
+	pthread_t tid;
+	struct acct_slot *slots;
+	unsigned busy;
+};
 
-static struct rad_handle *rh;
 static char **only_for;
 static unsigned only_for_num = 0;
 static struct in_addr bind_addr;
-static pthread_mutex_t mtx;
 
-void *
-send_acct(void *packet)
+static int rad_servers_num = 0, rad_secrets_num = 0;
+static char **rad_servers = NULL, **rad_secrets = NULL;
+static int timeout = 5, tries = 3, dead_time = 60;
+static unsigned workers_num = 2, max_inflight = 32, queue_size = 1024;
+static unsigned lease_cache_size = 65536, interim_interval = 0;
+static unsigned default_lease_time = 86400;
+static char *spool_file = NULL;
+static unsigned spool_size = 65536, replay_rate = 100;
+static int accounting = 1, auth = 0, auth_on_fail = 1, auth_on_pending = 0;
+static unsigned auth_cache_size = 65536, auth_accept_ttl = 3600;
+static unsigned auth_reject_ttl = 300, auth_fail_ttl = 30;
+static char *auth_password = NULL;
+
+static struct lease *leases;
+static struct lease_list *lease_hash, lease_free;
+static unsigned lease_mask;
+static struct timer_wheel wheel;
+static int timer_running = 0, timer_stop = 0;
+static pthread_t timer_tid;
+static pthread_mutex_t cache_lock;
+static pthread_cond_t cache_cond;
+
+static struct auth_entry *auth_cache;
+static unsigned auth_mask;
+static pthread_mutex_t auth_locks[AUTH_LOCKS];
+
+static struct acct_job *queue;
+static unsigned q_head, q_tail, q_len;
+static struct auth_job *auth_queue;
+static unsigned aq_head, aq_tail, aq_len;
+static struct acct_worker *workers;
+static int workers_running = 0, stop = 0;
+static struct metrics_radius stats, *mr = &stats;
+static pthread_mutex_t queue_lock;
+static pthread_cond_t queue_cond;
+static pthread_once_t workers_once = PTHREAD_ONCE_INIT;
+
+static struct spool *spool;
+static volatile int spooling = 0;	/* servers are down, spool everything */
+static int replayer_running = 0, replay_stop = 0;
+static pthread_t replayer_tid;
+static pthread_mutex_t replay_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t replay_cond = PTHREAD_COND_INITIALIZER;
+
+void radius_plugin_destroy(void);
+
+/* An accounting or an authorization handle with all servers added */
+static struct rad_handle *
+new_handle(int for_auth)
 {
-	struct dhcp_packet *dhcp = (struct dhcp_packet *)packet;
-	char buf[100];
+	struct rad_handle *rh;
+	int i;
 
-	/* Ignore all packets w/o an assigned IP address */
-	if (dhcp->yiaddr.s_addr == 0) {
-		free(packet);
+	if ((rh = for_auth ? rad_auth_open() : rad_acct_open()) == NULL) {
+		logd(LOG_ERR, "radius_plugin: can't intialize libradius");
 		return NULL;
 	}
-	pthread_mutex_lock(&mtx);
+	for (i = 0; i < rad_servers_num; i++)
+		if (rad_add_server_ex(rh, rad_servers[i], 0,
+				rad_secrets_num == 1 ? rad_secrets[0] : rad_secrets[i],
+				timeout, tries, dead_time, &bind_addr) == -1) {
+			logd(LOG_ERR, "radius_plugin: rad_add_server_ex(%s) error", rad_servers[i]);
+			rad_close(rh);
+			return NULL;
+		}
+	return rh;
+}
+
+static int
+build_request(struct rad_handle *rh, const struct acct_job *job)
+{
+	const uint8_t *m = job->chaddr;
+	char buf[100];
+
 	if (rad_create_request(rh, RAD_ACCOUNTING_REQUEST) == -1) {
 		logd(LOG_ERR, "radius_plugin: rad_create_request()");
-		goto end;
+		return 0;
 	}
-	if (rad_put_int(rh, RAD_ACCT_STATUS_TYPE, RAD_START) == -1) {
+	if (rad_put_int(rh, RAD_ACCT_STATUS_TYPE, job->status) == -1) {
 		logd(LOG_ERR, "radius_plugin: rad_put_int(RAD_ACCT_STATUS_TYPE) error");
-		goto end;
+		return 0;
+	}
+	if (job->session != 0) {
+		snprintf(buf, sizeof(buf), "%08x-%02x%02x%02x%02x%02x%02x",
+			job->session, m[0], m[1], m[2], m[3], m[4], m[5]);
+		if (rad_put_string(rh, RAD_ACCT_SESSION_ID, buf) == -1) {
+			logd(LOG_ERR, "radius_plugin: rad_put_string(RAD_ACCT_SESSION_ID)");
+			return 0;
+		}
+	}
+	if (job->status != RAD_START &&
+	    rad_put_int(rh, RAD_ACCT_SESSION_TIME, job->session_time) == -1) {
+		logd(LOG_ERR, "radius_plugin: rad_put_int(RAD_ACCT_SESSION_TIME)");
+		return 0;
+	}
+	if (job->status == RAD_STOP &&
+	    rad_put_int(rh, RAD_ACCT_TERMINATE_CAUSE, job->cause) == -1) {
+		logd(LOG_ERR, "radius_plugin: rad_put_int(RAD_ACCT_TERMINATE_CAUSE)");
+		return 0;
+	}
+	if (time(NULL) > job->time &&
+	    rad_put_int(rh, RAD_ACCT_DELAY_TIME, time(NULL) - job->time) == -1) {
+		logd(LOG_ERR, "radius_plugin: rad_put_int(RAD_ACCT_DELAY_TIME)");
+		return 0;
 	}
 	if (rad_put_string(rh, RAD_USER_NAME,
-		ether_ntoa_r((struct ether_addr*)dhcp->chaddr, buf)) == -1) {
+		ether_ntoa_r((const struct ether_addr *)job->chaddr, buf)) == -1) {
 		logd(LOG_ERR, "radius_plugin: rad_put_string()");
-		goto end;
+		return 0;
 	}
 	if (rad_put_string(rh, RAD_CALLING_STATION_ID,
-		ether_ntoa_r((struct ether_addr*)dhcp->chaddr, buf)) == -1) {
+		ether_ntoa_r((const struct ether_addr *)job->chaddr, buf)) == -1) {
 		logd(LOG_ERR, "radius_plugin: rad_put_string()");
-		goto end;
+		return 0;
 	}
-	if (rad_put_addr(rh, RAD_FRAMED_IP_ADDRESS, dhcp->yiaddr) == -1) {
+	if (rad_put_addr(rh, RAD_FRAMED_IP_ADDRESS, job->yiaddr) == -1) {
 		logd(LOG_ERR, "radius_plugin: rad_put_addr()");
-		goto end;
+		return 0;
 	}
-	if (rad_put_int(rh, RAD_NAS_PORT, dhcp->yiaddr.s_addr) == -1) {
+	if (rad_put_int(rh, RAD_NAS_PORT, job->yiaddr.s_addr) == -1) {
 		logd(LOG_ERR, "radius_plugin: rad_put_int(port)");
-		goto end;
+		return 0;
 	}
 	if (rad_put_addr(rh, RAD_NAS_IP_ADDRESS, bind_addr) == -1) {
 		logd(LOG_ERR, "radius_plugin: rad_put_addr()");
-		goto end;
+		return 0;
 	}
-	if (rad_send_request(rh) == -1)
-		logd(LOG_ERR, "rad_send_request(): %s", rad_strerror(rh));
+	return 1;
+}
+
+static int
+build_auth_request(struct rad_handle *rh, const struct auth_job *job)
+{
+	char buf[100];
+
+	ether_ntoa_r((const struct ether_addr *)job->chaddr, buf);
+	if (rad_create_request(rh, RAD_ACCESS_REQUEST) == -1) {
+		logd(LOG_ERR, "radius_plugin: rad_create_request()");
+		return 0;
+	}
+	if (rad_put_string(rh, RAD_USER_NAME, buf) == -1 ||
+	    rad_put_string(rh, RAD_USER_PASSWORD,
+		auth_password != NULL ? auth_password : buf) == -1 ||
+	    rad_put_string(rh, RAD_CALLING_STATION_ID, buf) == -1) {
+		logd(LOG_ERR, "radius_plugin: rad_put_string()");
+		return 0;
+	}
+	if (rad_put_string(rh, RAD_NAS_PORT_ID, job->ifname) == -1) {
+		logd(LOG_ERR, "radius_plugin: rad_put_string(RAD_NAS_PORT_ID)");
+		return 0;
+	}
+	if (rad_put_addr(rh, RAD_NAS_IP_ADDRESS, bind_addr) == -1) {
+		logd(LOG_ERR, "radius_plugin: rad_put_addr()");
+		return 0;
+	}
+	return 1;
+}
+
+static void
+set_deadline(struct acct_slot *slot, const struct timeval *tv)
+{
+	clock_gettime(CLOCK_MONOTONIC, &slot->deadline);
+	slot->deadline.tv_sec += tv->tv_sec;
+	slot->deadline.tv_nsec += tv->tv_usec * 1000;
+	if (slot->deadline.tv_nsec >= 1000000000) {
+		slot->deadline.tv_sec++;
+		slot->deadline.tv_nsec -= 1000000000;
+	}
+}
+
+/* Append a job to the spool. Under the queue lock. */
+static int
+spool_job(const struct acct_job *job)
+{
+	if (!spool_append(spool, job)) {
+		mr->spool_dropped++;
+		return 0;
+	}
+	mr->spooled++;
+	mr->spool_depth = spool_depth(spool);
+	if (!spooling)
+		spooling = 1;
+	pthread_cond_signal(&replay_cond);
+	return 1;
+}
+
+static inline unsigned
+auth_set(const uint8_t *chaddr, int if_idx)
+{
+	return ((chaddr_hash(chaddr) ^ if_idx) * FNV1A_PRIME) & auth_mask;
+}
+
+/* An entry of a client or a victim to reuse: an empty one or the oldest.
+ * Under a set lock. */
+static struct auth_entry *
+auth_find(struct auth_entry *set, const uint8_t *chaddr, int if_idx, int *found)
+{
+	struct auth_entry *e, *victim = NULL;
+	int i;
+
+	for (i = 0; i < AUTH_WAYS; i++) {
+		e = &set[i];
+		if (e->state != AUTH_EMPTY && e->if_idx == if_idx &&
+		    memcmp(e->chaddr, chaddr, ETHER_ADDR_LEN) == 0) {
+			*found = 1;
+			return e;
+		}
+		if (victim == NULL || (victim->state != AUTH_EMPTY &&
+		    (e->state == AUTH_EMPTY || e->expires < victim->expires)))
+			victim = e;
+	}
+	*found = 0;
+	return victim;
+}
+
+/* Remember a result of a request */
+static void
+auth_store(const struct auth_job *job, int state)
+{
+	struct auth_entry *e;
+	struct timespec now;
+	unsigned set;
+	int found;
+
+	clock_gettime(CLOCK_MONOTONIC_FAST, &now);
+	set = auth_set(job->chaddr, job->if_idx);
+	pthread_mutex_lock(&auth_locks[set % AUTH_LOCKS]);
+	e = auth_find(&auth_cache[set * AUTH_WAYS], job->chaddr, job->if_idx, &found);
+	memcpy(e->chaddr, job->chaddr, ETHER_ADDR_LEN);
+	e->if_idx = job->if_idx;
+	e->state = state;
+	e->expires = now.tv_sec + (state == AUTH_ACCEPT ? auth_accept_ttl :
+		(state == AUTH_REJECT ? auth_reject_ttl : auth_fail_ttl));
+	pthread_mutex_unlock(&auth_locks[set % AUTH_LOCKS]);
+}
+
+/* A request of a slot is answered (rc > 0) or failed (rc == -1) */
+static void
+finish(struct acct_worker *w, struct acct_slot *slot, int rc)
+{
+	struct timespec now;
+
+	if (rc == -1)
+		logd(LOG_ERR, "rad_send_request(): %s", rad_strerror(slot->cur));
 	else
 		logd(LOG_DEBUG, "OK");
-end:
-	pthread_mutex_unlock(&mtx);
-	free(packet);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	slot->fd = -1;
+	w->busy--;
+	if (slot->cur == slot->auth_rh) {
+		auth_store(&slot->auth, rc == RAD_ACCESS_ACCEPT ? AUTH_ACCEPT :
+			(rc == RAD_ACCESS_REJECT ? AUTH_REJECT : AUTH_FAILED));
+		pthread_mutex_lock(&queue_lock);
+		if (rc == RAD_ACCESS_ACCEPT)
+			mr->auth_accepted++;
+		else if (rc == RAD_ACCESS_REJECT)
+			mr->auth_rejected++;
+		else
+			mr->auth_failed++;
+		if (rc != -1)
+			latency_add(&mr->auth_latency, &slot->auth.queued, &now);
+		mr->in_flight--;
+		pthread_mutex_unlock(&queue_lock);
+		return;
+	}
+	pthread_mutex_lock(&queue_lock);
+	if (rc == -1) {
+		mr->failed++;
+		if (spool != NULL)
+			spool_job(&slot->job);
+	} else {
+		mr->answered++;
+		latency_add(&mr->latency, &slot->job.queued, &now);
+	}
+	mr->in_flight--;
+	pthread_mutex_unlock(&queue_lock);
+}
+
+static void
+start(struct acct_worker *w, struct acct_slot *slot, const struct acct_job *job)
+{
+	struct timeval tv;
+	int rc;
+
+	w->busy++;
+	slot->job = *job;
+	slot->cur = slot->rh;
+	if (!build_request(slot->rh, job)) {
+		finish(w, slot, -1);
+		return;
+	}
+	if ((rc = rad_init_send_request(slot->rh, &slot->fd, &tv)) != 0)
+		finish(w, slot, rc);
+	else
+		set_deadline(slot, &tv);
+}
+
+static void
+start_auth(struct acct_worker *w, struct acct_slot *slot, const struct auth_job *job)
+{
+	struct timeval tv;
+	int rc;
+
+	w->busy++;
+	slot->auth = *job;
+	slot->cur = slot->auth_rh;
+	if (!build_auth_request(slot->auth_rh, job)) {
+		finish(w, slot, -1);
+		return;
+	}
+	if ((rc = rad_init_send_request(slot->auth_rh, &slot->fd, &tv)) != 0)
+		finish(w, slot, rc);
+	else
+		set_deadline(slot, &tv);
+}
+
+/* Put a job into the queue or the spool. A full queue drops it. */
+static void
+enqueue(const struct acct_job *job)
+{
+	struct acct_job *q, rec;
+
+	pthread_mutex_lock(&queue_lock);
+	if (job->status == RAD_START)
+		mr->starts++;
+	else if (job->status == RAD_UPDATE)
+		mr->interims++;
+	else
+		mr->stops++;
+	if (spool != NULL && (spooling || q_len == queue_size)) {
+		rec = *job;
+		rec.time = time(NULL);
+		if (!spool_job(&rec)) {
+			pthread_mutex_unlock(&queue_lock);
+			logd(LOG_WARNING, "radius_plugin: spool is full, accounting dropped");
+			return;
+		}
+		pthread_mutex_unlock(&queue_lock);
+		return;
+	}
+	if (q_len == queue_size) {
+		mr->dropped++;
+		pthread_mutex_unlock(&queue_lock);
+		logd(LOG_WARNING, "radius_plugin: queue is full, accounting dropped");
+		return;
+	}
+	q = &queue[q_head];
+	*q = *job;
+	q->time = time(NULL);
+	clock_gettime(CLOCK_MONOTONIC, &q->queued);
+	q_head = (q_head + 1) % queue_size;
+	q_len++;
+	mr->queued++;
+	mr->queue_depth = q_len;
+	if (mr->queue_depth_max < q_len)
+		mr->queue_depth_max = q_len;
+	pthread_cond_signal(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+}
+
+static inline unsigned
+lease_bucket(const uint8_t *chaddr)
+{
+	return chaddr_hash(chaddr) & lease_mask;
+}
+
+/* Lease cache functions below are called under the cache lock */
+static struct lease *
+lease_find(const uint8_t *chaddr)
+{
+	struct lease *l;
+
+	LIST_FOREACH(l, &lease_hash[lease_bucket(chaddr)], entries)
+		if (memcmp(l->chaddr, chaddr, ETHER_ADDR_LEN) == 0)
+			return l;
 	return NULL;
 }
 
+static void
+lease_job(struct acct_job *job, const struct lease *l, int status, int cause,
+	time_t now)
+{
+	job->yiaddr = l->ip;
+	memcpy(job->chaddr, l->chaddr, ETHER_ADDR_LEN);
+	job->status = status;
+	job->cause = cause;
+	job->session = l->session;
+	job->session_time = now - l->started;
+}
+
+static void
+lease_arm(struct lease *l)
+{
+	time_t next = l->expires;
+
+	if (interim_interval != 0 && l->interim < next)
+		next = l->interim;
+	tw_add(&wheel, &l->timer, next);
+}
+
+/* Send Stop and forget a lease */
+static void
+lease_stop(struct lease *l, int cause, time_t now)
+{
+	struct acct_job job;
+
+	lease_job(&job, l, RAD_STOP, cause, now);
+	enqueue(&job);
+	tw_del(&wheel, &l->timer);
+	LIST_REMOVE(l, entries);
+	LIST_INSERT_HEAD(&lease_free, l, entries);
+	mr->leases--;
+}
+
+/* A lease is expired or it's time for Interim-Update */
+static void
+lease_expire(struct tw_timer *t, void *arg)
+{
+	struct lease *l;
+	struct acct_job job;
+	time_t now = *(time_t *)arg;
+
+	l = (struct lease *)((char *)t - offsetof(struct lease, timer));
+	if (now >= l->expires) {
+		lease_stop(l, RAD_TERM_SESSION_TIMEOUT, now);
+		return;
+	}
+	lease_job(&job, l, RAD_UPDATE, 0, now);
+	enqueue(&job);
+	l->interim = now + interim_interval;
+	lease_arm(l);
+}
+
+static void *
+lease_timer(void *arg)
+{
+	struct timespec now, ts;
+	time_t sec;
+
+	pthread_mutex_lock(&cache_lock);
+	while (!timer_stop) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		sec = now.tv_sec;
+		tw_advance(&wheel, sec, lease_expire, &sec);
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec++;
+		pthread_cond_timedwait(&cache_cond, &cache_lock, &ts);
+	}
+	pthread_mutex_unlock(&cache_lock);
+	return NULL;
+}
+
+/* Send spooled requests, at most replay_rate a second */
+static void *
+replayer(void *arg)
+{
+	struct rad_handle *rh = NULL;
+	struct acct_job job;
+	struct timespec ts;
+	unsigned sent;
+
+	pthread_mutex_lock(&replay_lock);
+	while (!replay_stop) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec++;
+		pthread_cond_timedwait(&replay_cond, &replay_lock, &ts);
+		pthread_mutex_unlock(&replay_lock);
+
+		spool_sync(spool);
+		for (sent = 0; sent < replay_rate && !replay_stop &&
+		    spool_peek(spool, &job); ) {
+			if (rh == NULL && (rh = new_handle(0)) == NULL)
+				break;
+			/* A record we can't build is just dropped */
+			if (build_request(rh, &job) && rad_send_request(rh) == -1) {
+				logd(LOG_ERR, "radius_plugin: replay: %s", rad_strerror(rh));
+				break;
+			}
+			spool_consume(spool);
+			sent++;
+			/* Servers are back */
+			if (spooling)
+				spooling = 0;
+		}
+
+		pthread_mutex_lock(&queue_lock);
+		mr->replayed += sent;
+		mr->replay_rate = sent;
+		mr->spool_depth = spool_depth(spool);
+		pthread_mutex_unlock(&queue_lock);
+		pthread_mutex_lock(&replay_lock);
+	}
+	pthread_mutex_unlock(&replay_lock);
+	if (rh != NULL)
+		rad_close(rh);
+	return NULL;
+}
+
+static void *
+worker(void *arg)
+{
+	struct acct_worker *w = arg;
+	struct acct_job jobs[max_inflight];
+	struct auth_job auth_jobs[max_inflight];
+	struct pollfd pfd[max_inflight];
+	unsigned idx[max_inflight];
+	struct timespec now;
+	struct timeval tv;
+	int64_t wait, left;
+	unsigned i, n, taken, auth_taken;
+	int rc;
+
+	for (;;) {
+		/* Wait for a job only if nothing is in flight */
+		pthread_mutex_lock(&queue_lock);
+		while (q_len == 0 && aq_len == 0 && w->busy == 0 && !stop)
+			pthread_cond_wait(&queue_cond, &queue_lock);
+		if (stop && q_len == 0 && aq_len == 0 && w->busy == 0) {
+			pthread_mutex_unlock(&queue_lock);
+			break;
+		}
+		/* Clients wait for authorization, take it first */
+		for (auth_taken = 0; aq_len > 0 && w->busy + auth_taken < max_inflight;
+		    auth_taken++) {
+			auth_jobs[auth_taken] = auth_queue[aq_tail];
+			aq_tail = (aq_tail + 1) % queue_size;
+			aq_len--;
+		}
+		for (taken = 0; q_len > 0 && w->busy + auth_taken + taken < max_inflight;
+		    taken++) {
+			jobs[taken] = queue[q_tail];
+			q_tail = (q_tail + 1) % queue_size;
+			q_len--;
+		}
+		mr->queue_depth = q_len;
+		mr->in_flight += auth_taken + taken;
+		pthread_mutex_unlock(&queue_lock);
+
+		for (i = 0, n = 0; n < auth_taken; i++)
+			if (w->slots[i].fd == -1)
+				start_auth(w, &w->slots[i], &auth_jobs[n++]);
+		for (i = 0, n = 0; n < taken; i++)
+			if (w->slots[i].fd == -1)
+				start(w, &w->slots[i], &jobs[n++]);
+		if (w->busy == 0)
+			continue;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		wait = ACCT_POLL_MS;
+		for (i = 0, n = 0; i < max_inflight; i++) {
+			if (w->slots[i].fd == -1)
+				continue;
+			left = (timespec_ns(&w->slots[i].deadline) - timespec_ns(&now)) / 1000000;
+			if (left < wait)
+				wait = left > 0 ? left : 0;
+			pfd[n].fd = w->slots[i].fd;
+			pfd[n].events = POLLIN;
+			idx[n++] = i;
+		}
+		if (poll(pfd, n, wait) == -1 && errno != EINTR) {
+			logd(LOG_ERR, "radius_plugin: poll: %s", strerror(errno));
+			continue;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		for (i = 0; i < n; i++) {
+			struct acct_slot *slot = &w->slots[idx[i]];
+
+			if (pfd[i].revents == 0 &&
+			    timespec_ns(&slot->deadline) > timespec_ns(&now))
+				continue;
+			/* An answer or a timeout (resend or a next server) */
+			rc = rad_continue_send_request(slot->cur, pfd[i].revents != 0,
+				&slot->fd, &tv);
+			if (rc != 0)
+				finish(w, slot, rc);
+			else
+				set_deadline(slot, &tv);
+		}
+	}
+	return NULL;
+}
+
+static void
+start_workers(void)
+{
+	struct acct_worker *w;
+	unsigned i, j;
+
+	if (metrics != NULL)
+		mr = &metrics->radius;
+	mr->enabled = 1;
+	mr->auth_enabled = auth;
+	if ((workers = calloc(workers_num, sizeof(struct acct_worker))) == NULL) {
+		logd(LOG_ERR, "radius_plugin: malloc error");
+		return;
+	}
+	for (i = 0; i < workers_num; i++) {
+		w = &workers[i];
+		if ((w->slots = calloc(max_inflight, sizeof(struct acct_slot))) == NULL) {
+			logd(LOG_ERR, "radius_plugin: malloc error");
+			return;
+		}
+		for (j = 0; j < max_inflight; j++) {
+			if ((w->slots[j].rh = new_handle(0)) == NULL)
+				return;
+			if (auth && (w->slots[j].auth_rh = new_handle(1)) == NULL)
+				return;
+			w->slots[j].fd = -1;
+		}
+		if (pthread_create(&w->tid, NULL, worker, w) != 0) {
+			logd(LOG_ERR, "radius_plugin: can't create a worker thread");
+			return;
+		}
+		workers_running++;
+	}
+	if (spool != NULL) {
+		if (pthread_create(&replayer_tid, NULL, replayer, NULL) != 0)
+			logd(LOG_ERR, "radius_plugin: can't create a replayer thread");
+		else
+			replayer_running = 1;
+	}
+	if (leases != NULL) {
+		if (pthread_create(&timer_tid, NULL, lease_timer, NULL) != 0)
+			logd(LOG_ERR, "radius_plugin: can't create a lease timer thread");
+		else
+			timer_running = 1;
+	}
+	/* dhcprelya -r exits without plugins destroy() */
+	atexit(radius_plugin_destroy);
+}
+
 int
 radius_plugin_init(plugin_options_head_t *options_head)
 {
 	struct plugin_options *opts, *opts_tmp;
+	struct rad_handle *rh;
+	struct timespec now;
 	char *p, *p1;
-	int i, n = 0, timeout = 5, tries = 3, dead_time = 60;
-	int servers_num = 0, secrets_num = 0;
-	char **servers = NULL, **secrets = NULL;
+	int i, n = 0, verdict;
 
-	if ((rh = rad_acct_open()) == NULL) {
-		logd(LOG_ERR, "radius_plugin: can't intialize libradius");
-		return 0;
-	}
 	SLIST_FOREACH_SAFE(opts, options_head, next, opts_tmp) {
 		if ((p = strchr(opts->option_line, '=')) == NULL) {
 			logd(LOG_ERR, "radius_plugin: syntax error at line: %s", opts->option_line);
@@ -114,44 +793,44 @@ radius_plugin_init(plugin_options_head_t *options_head)
 		*p = '\0';
 		p++;
 		if (strcasecmp(opts->option_line, "servers") == 0) {
-			servers_num = 0;
+			rad_servers_num = 0;
 			for (i = 0; i < strlen(p); i++)
 				if (p[i] == ' ' || p[i] == '\t')
 					n++;
-			servers = malloc(sizeof(char *) * (n + 1));
-			if (servers == NULL) {
+			rad_servers = malloc(sizeof(char *) * (n + 1));
+			if (rad_servers == NULL) {
 				logd(LOG_ERR, "radius_plugin: malloc error");
 				return 0;
 			}
 			while ((p1 = strsep(&p, " \t")) != NULL) {
-				servers[servers_num] = malloc(strlen(p1) + 1);
-				if (servers[servers_num] == NULL) {
+				rad_servers[rad_servers_num] = malloc(strlen(p1) + 1);
+				if (rad_servers[rad_servers_num] == NULL) {
 					logd(LOG_ERR, "radius_plugin: malloc error");
 					return 0;
 				}
 				logd(LOG_DEBUG, "Server: %s", p1);
-				strcpy(servers[servers_num], p1);
-				servers_num++;
+				strcpy(rad_servers[rad_servers_num], p1);
+				rad_servers_num++;
 			}
 		} else if (strcasecmp(opts->option_line, "secret") == 0) {
-			secrets_num = 0;
+			rad_secrets_num = 0;
 			for (i = 0; i < strlen(p); i++)
 				if (p[i] == ' ' || p[i] == '\t')
 					n++;
-			secrets = malloc(sizeof(char *) * (n + 1));
-			if (secrets == NULL) {
+			rad_secrets = malloc(sizeof(char *) * (n + 1));
+			if (rad_secrets == NULL) {
 				logd(LOG_ERR, "radius_plugin: malloc error");
 				return 0;
 			}
 			while ((p1 = strsep(&p, " \t")) != NULL) {
-				secrets[secrets_num] = malloc(strlen(p1) + 1);
-				if (secrets[secrets_num] == NULL) {
+				rad_secrets[rad_secrets_num] = malloc(strlen(p1) + 1);
+				if (rad_secrets[rad_secrets_num] == NULL) {
 					logd(LOG_ERR, "radius_plugin: malloc error");
 					return 0;
 				}
 				logd(LOG_DEBUG, "secret: %s", p1);
-				strcpy(secrets[secrets_num], p1);
-				secrets_num++;
+				strcpy(rad_secrets[rad_secrets_num], p1);
+				rad_secrets_num++;
 			}
 		} else if (strcasecmp(opts->option_line, "timeout") == 0) {
 			timeout = strtol(p, NULL, 10);
@@ -174,6 +853,117 @@ radius_plugin_init(plugin_options_head_t *options_head)
 				return 0;
 			}
 			logd(LOG_DEBUG, "dead_time set to: %d", dead_time);
+		} else if (strcasecmp(opts->option_line, "workers") == 0) {
+			workers_num = strtol(p, NULL, 10);
+			if (workers_num < 1 || workers_num > 64) {
+				logd(LOG_ERR, "radius_plugin: workers error");
+				return 0;
+			}
+			logd(LOG_DEBUG, "workers set to: %u", workers_num);
+		} else if (strcasecmp(opts->option_line, "max_inflight") == 0) {
+			max_inflight = strtol(p, NULL, 10);
+			if (max_inflight < 1 || max_inflight > 256) {
+				logd(LOG_ERR, "radius_plugin: max_inflight error");
+				return 0;
+			}
+			logd(LOG_DEBUG, "max_inflight set to: %u", max_inflight);
+		} else if (strcasecmp(opts->option_line, "queue_size") == 0) {
+			queue_size = strtol(p, NULL, 10);
+			if (queue_size < 16) {
+				logd(LOG_ERR, "radius_plugin: queue_size error");
+				return 0;
+			}
+			logd(LOG_DEBUG, "queue_size set to: %u", queue_size);
+		} else if (strcasecmp(opts->option_line, "lease_cache_size") == 0) {
+			lease_cache_size = strtol(p, NULL, 10);
+			if (lease_cache_size > 16 * 1024 * 1024) {
+				logd(LOG_ERR, "radius_plugin: lease_cache_size error");
+				return 0;
+			}
+			logd(LOG_DEBUG, "lease_cache_size set to: %u", lease_cache_size);
+		} else if (strcasecmp(opts->option_line, "interim_interval") == 0) {
+			interim_interval = strtol(p, NULL, 10);
+			if (interim_interval != 0 && interim_interval < 60) {
+				logd(LOG_ERR, "radius_plugin: interim_interval error");
+				return 0;
+			}
+			logd(LOG_DEBUG, "interim_interval set to: %u", interim_interval);
+		} else if (strcasecmp(opts->option_line, "default_lease_time") == 0) {
+			default_lease_time = strtol(p, NULL, 10);
+			if (default_lease_time < 1) {
+				logd(LOG_ERR, "radius_plugin: default_lease_time error");
+				return 0;
+			}
+			logd(LOG_DEBUG, "default_lease_time set to: %u", default_lease_time);
+		} else if (strcasecmp(opts->option_line, "accounting") == 0) {
+			if ((accounting = get_bool_value(p)) == -1) {
+				logd(LOG_ERR, "radius_plugin: accounting error");
+				return 0;
+			}
+			logd(LOG_DEBUG, "accounting set to: %d", accounting);
+		} else if (strcasecmp(opts->option_line, "auth") == 0) {
+			if ((auth = get_bool_value(p)) == -1) {
+				logd(LOG_ERR, "radius_plugin: auth error");
+				return 0;
+			}
+			logd(LOG_DEBUG, "auth set to: %d", auth);
+		} else if (strcasecmp(opts->option_line, "auth_password") == 0) {
+			if ((auth_password = strdup(p)) == NULL) {
+				logd(LOG_ERR, "radius_plugin: malloc error");
+				return 0;
+			}
+		} else if (strcasecmp(opts->option_line, "auth_cache_size") == 0) {
+			auth_cache_size = strtol(p, NULL, 10);
+			if (auth_cache_size < AUTH_WAYS || auth_cache_size > 16 * 1024 * 1024) {
+				logd(LOG_ERR, "radius_plugin: auth_cache_size error");
+				return 0;
+			}
+			logd(LOG_DEBUG, "auth_cache_size set to: %u", auth_cache_size);
+		} else if (strcasecmp(opts->option_line, "auth_accept_ttl") == 0) {
+			auth_accept_ttl = strtol(p, NULL, 10);
+			logd(LOG_DEBUG, "auth_accept_ttl set to: %u", auth_accept_ttl);
+		} else if (strcasecmp(opts->option_line, "auth_reject_ttl") == 0) {
+			auth_reject_ttl = strtol(p, NULL, 10);
+			logd(LOG_DEBUG, "auth_reject_ttl set to: %u", auth_reject_ttl);
+		} else if (strcasecmp(opts->option_line, "auth_fail_ttl") == 0) {
+			auth_fail_ttl = strtol(p, NULL, 10);
+			logd(LOG_DEBUG, "auth_fail_ttl set to: %u", auth_fail_ttl);
+		} else if (strcasecmp(opts->option_line, "auth_on_fail") == 0 ||
+		    strcasecmp(opts->option_line, "auth_on_pending") == 0) {
+			if (strcasecmp(p, "pass") == 0)
+				verdict = 1;
+			else if (strcasecmp(p, "drop") == 0)
+				verdict = 0;
+			else {
+				logd(LOG_ERR, "radius_plugin: %s must be pass or drop",
+					opts->option_line);
+				return 0;
+			}
+			if (strcasecmp(opts->option_line, "auth_on_fail") == 0)
+				auth_on_fail = verdict;
+			else
+				auth_on_pending = verdict;
+			logd(LOG_DEBUG, "%s set to: %s", opts->option_line, p);
+		} else if (strcasecmp(opts->option_line, "spool_file") == 0) {
+			if ((spool_file = strdup(p)) == NULL) {
+				logd(LOG_ERR, "radius_plugin: malloc error");
+				return 0;
+			}
+			logd(LOG_DEBUG, "spool_file set to: %s", spool_file);
+		} else if (strcasecmp(opts->option_line, "spool_size") == 0) {
+			spool_size = strtol(p, NULL, 10);
+			if (spool_size < 16) {
+				logd(LOG_ERR, "radius_plugin: spool_size error");
+				return 0;
+			}
+			logd(LOG_DEBUG, "spool_size set to: %u", spool_size);
+		} else if (strcasecmp(opts->option_line, "replay_rate") == 0) {
+			replay_rate = strtol(p, NULL, 10);
+			if (replay_rate < 1) {
+				logd(LOG_ERR, "radius_plugin: replay_rate error");
+				return 0;
+			}
+			logd(LOG_DEBUG, "replay_rate set to: %u", replay_rate);
 		} else if (strcasecmp(opts->option_line, "bind_to") == 0) {
 			/* Bind to an IP or an interface */
 			if (inet_pton(AF_INET, p, &bind_addr.s_addr) != 1)
@@ -209,36 +999,208 @@ radius_plugin_init(plugin_options_head_t *options_head)
 		free(opts);
 	}
 
-	if (servers_num == 0) {
+	if (rad_servers_num == 0) {
 		logd(LOG_ERR, "radius_plugin: at least one server must be defined");
 		return 0;
 	}
-	if (secrets_num == 0) {
+	if (rad_secrets_num == 0) {
 		logd(LOG_ERR, "radius_plugin: at least one secret must be defined");
 		return 0;
 	}
-	if (secrets_num > 1 && secrets_num != servers_num) {
+	if (rad_secrets_num > 1 && rad_secrets_num != rad_servers_num) {
 		logd(LOG_ERR, "radius_plugin: number of secrets must be one or the same as servers number");
 		return 0;
 	}
-	for (i = 0; i < servers_num; i++)
-		if (rad_add_server_ex(rh, servers[i], 0, secrets_num == 1 ? secrets[0] : secrets[i],
-				timeout, tries, dead_time, &bind_addr) == -1) {
-			logd(LOG_ERR, "radius_plugin: rad_add_server_ex(%s) error", servers[i]);
-			return 0;
-		}
+	/* Check servers now, workers make own handles later */
+	if ((rh = new_handle(0)) == NULL)
+		return 0;
+	rad_close(rh);
 	for (i = 0; i < only_for_num; i++)
 		logd(LOG_DEBUG, "only_for: %s", only_for[i]);
 
-	pthread_mutex_init(&mtx, NULL);
+	if ((queue = calloc(queue_size, sizeof(struct acct_job))) == NULL) {
+		logd(LOG_ERR, "radius_plugin: malloc error");
+		return 0;
+	}
+	pthread_mutex_init(&queue_lock, NULL);
+	pthread_cond_init(&queue_cond, NULL);
+	if (spool_file != NULL &&
+	    (spool = spool_open(spool_file, sizeof(struct acct_job), spool_size)) == NULL)
+		return 0;
+
+	if (auth) {
+		for (auth_mask = 1; auth_mask * AUTH_WAYS < auth_cache_size; auth_mask <<= 1)
+			;
+		auth_cache = calloc(auth_mask * AUTH_WAYS, sizeof(struct auth_entry));
+		auth_queue = calloc(queue_size, sizeof(struct auth_job));
+		if (auth_cache == NULL || auth_queue == NULL) {
+			logd(LOG_ERR, "radius_plugin: malloc error");
+			return 0;
+		}
+		auth_mask--;
+		for (i = 0; i < AUTH_LOCKS; i++)
+			pthread_mutex_init(&auth_locks[i], NULL);
+		logd(LOG_DEBUG, "radius_plugin: authorization cache: %u entries",
+			(auth_mask + 1) * AUTH_WAYS);
+	}
+
+	if (lease_cache_size == 0)
+		return 1;
+	for (lease_mask = 1; lease_mask < lease_cache_size; lease_mask <<= 1)
+		;
+	leases = calloc(lease_cache_size, sizeof(struct lease));
+	lease_hash = calloc(lease_mask, sizeof(struct lease_list));
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (leases == NULL || lease_hash == NULL ||
+	    !tw_init(&wheel, LEASE_WHEEL_SIZE, now.tv_sec)) {
+		logd(LOG_ERR, "radius_plugin: malloc error");
+		return 0;
+	}
+	for (i = 0; i < lease_mask; i++)
+		LIST_INIT(&lease_hash[i]);
+	lease_mask--;
+	LIST_INIT(&lease_free);
+	for (i = 0; i < lease_cache_size; i++)
+		LIST_INSERT_HEAD(&lease_free, &leases[i], entries);
+	pthread_mutex_init(&cache_lock, NULL);
+	pthread_cond_init(&cache_cond, NULL);
+	logd(LOG_DEBUG, "radius_plugin: lease cache: %u entries", lease_cache_size);
 	return 1;
 }
 
+/* Send queued and in flight requests and stop workers. Open sessions are
+ * not stopped: leases are still valid and a next renewal starts them
+ * again. */
 void
 radius_plugin_destroy()
 {
-	pthread_mutex_destroy(&mtx);
-	rad_close(rh);
+	unsigned i, j;
+
+	if (replayer_running) {
+		pthread_mutex_lock(&replay_lock);
+		replay_stop = 1;
+		pthread_cond_signal(&replay_cond);
+		pthread_mutex_unlock(&replay_lock);
+		pthread_join(replayer_tid, NULL);
+		replayer_running = 0;
+	}
+	if (timer_running) {
+		pthread_mutex_lock(&cache_lock);
+		timer_stop = 1;
+		pthread_cond_signal(&cache_cond);
+		pthread_mutex_unlock(&cache_lock);
+		pthread_join(timer_tid, NULL);
+		timer_running = 0;
+	}
+	if (workers_running != 0) {
+		pthread_mutex_lock(&queue_lock);
+		stop = 1;
+		pthread_cond_broadcast(&queue_cond);
+		pthread_mutex_unlock(&queue_lock);
+		for (i = 0; i < workers_running; i++) {
+			pthread_join(workers[i].tid, NULL);
+			for (j = 0; j < max_inflight; j++) {
+				rad_close(workers[i].slots[j].rh);
+				if (workers[i].slots[j].auth_rh != NULL)
+					rad_close(workers[i].slots[j].auth_rh);
+			}
+		}
+		workers_running = 0;
+	}
+	/* Requests failed on the way out are kept for a next run */
+	if (spool != NULL) {
+		spool_close(spool);
+		spool = NULL;
+	}
+}
+
+/* A verdict for a client from the cache. Starts a lookup if there's no
+ * fresh one. Never waits for RADIUS. */
+static int
+authorize(const struct interface *intf, const uint8_t *chaddr)
+{
+	struct auth_entry *e;
+	struct auth_job *job, drop;
+	struct timespec now;
+	unsigned set;
+	int found, state;
+
+	clock_gettime(CLOCK_MONOTONIC_FAST, &now);
+	set = auth_set(chaddr, intf->idx);
+	pthread_mutex_lock(&auth_locks[set % AUTH_LOCKS]);
+	e = auth_find(&auth_cache[set * AUTH_WAYS], chaddr, intf->idx, &found);
+	if (found && e->expires > now.tv_sec) {
+		state = e->state;
+		pthread_mutex_unlock(&auth_locks[set % AUTH_LOCKS]);
+		if (state == AUTH_PENDING) {
+			atomic_add_64(&mr->auth_coalesced, 1);
+			return auth_on_pending;
+		}
+		atomic_add_64(&mr->auth_hits, 1);
+		return state == AUTH_ACCEPT || (state == AUTH_FAILED && auth_on_fail);
+	}
+	/* A pending entry lives until libradius gives up on all servers */
+	memcpy(e->chaddr, chaddr, ETHER_ADDR_LEN);
+	e->if_idx = intf->idx;
+	e->state = AUTH_PENDING;
+	e->expires = now.tv_sec + timeout * tries * rad_servers_num + 1;
+	pthread_mutex_unlock(&auth_locks[set % AUTH_LOCKS]);
+	atomic_add_64(&mr->auth_misses, 1);
+
+	pthread_mutex_lock(&queue_lock);
+	if (aq_len == queue_size) {
+		mr->auth_dropped++;
+		pthread_mutex_unlock(&queue_lock);
+		/* Let a next packet try again */
+		memcpy(drop.chaddr, chaddr, ETHER_ADDR_LEN);
+		drop.if_idx = intf->idx;
+		auth_store(&drop, AUTH_EMPTY);
+		logd(LOG_WARNING, "radius_plugin: authorization queue is full");
+		return auth_on_pending;
+	}
+	job = &auth_queue[aq_head];
+	memcpy(job->chaddr, chaddr, ETHER_ADDR_LEN);
+	job->if_idx = intf->idx;
+	job->ifname = intf->name;
+	clock_gettime(CLOCK_MONOTONIC, &job->queued);
+	aq_head = (aq_head + 1) % queue_size;
+	aq_len++;
+	pthread_cond_signal(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+	return auth_on_pending;
+}
+
+/* Authorize DISCOVER and REQUEST, stop a session of a released lease */
+int
+radius_plugin_client_request(const struct interface *intf,
+				struct dhcp_packet *dhcp, struct packet_headers *headers)
+{
+	struct timespec now;
+	struct lease *l;
+	uint8_t *b;
+	int i;
+
+	b = find_option(dhcp, 53);
+	if (!b)
+		return 1;
+	if (auth && (b[2] == 1 || b[2] == 3)) {
+		for (i = 0; i < only_for_num; i++)
+			if (strcmp(only_for[i], intf->name) == 0)
+				break;
+		if (only_for_num != 0 && i == only_for_num)
+			return 1;
+		pthread_once(&workers_once, start_workers);
+		return authorize(intf, dhcp->chaddr);
+	}
+	if (leases == NULL || b[2] != 7)
+		return 1;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	pthread_mutex_lock(&cache_lock);
+	if ((l = lease_find(dhcp->chaddr)) != NULL &&
+	    l->ip.s_addr == dhcp->ciaddr.s_addr)
+		lease_stop(l, RAD_TERM_USER_REQUEST, now.tv_sec);
+	pthread_mutex_unlock(&cache_lock);
+	return 1;
 }
 
 int
@@ -246,32 +1208,87 @@ radius_plugin_send_to_client(const struct sockaddr_in *server,
 				const struct interface *intf,
 				struct dhcp_packet *dhcp, struct packet_headers *headers)
 {
-	pthread_t tid;
+	static uint32_t last_session;
+	struct acct_job job;
+	struct timespec now;
+	struct lease *l;
+	uint32_t lease_time;
 	int i;
 	uint8_t *b;
-	size_t dhcp_len;
 
+	if (!accounting)
+		return 1;
 	b = find_option(dhcp, 53);
 	/* If it's not DHCPACK. Just pass the packet. */
 	if (!b || b[2] != 5)
 		return 1;
+	/* Ignore all packets w/o an assigned IP address */
+	if (dhcp->yiaddr.s_addr == 0)
+		return 1;
 
 	/* Look for interfaces we should do radius request */
 	for (i = 0; i < only_for_num; i++)
 		if (strcmp(only_for[i], intf->name) == 0)
 			break;
 
-	if (only_for_num == 0 || i < only_for_num) {
-		dhcp_len = get_dhcp_len(dhcp);
-		b = malloc(dhcp_len);
-		if (b == NULL) {
-			logd(LOG_ERR, "radius_plugin: malloc error");
-			return 0;
+	if (only_for_num != 0 && i == only_for_num)
+		return 1;
+
+	pthread_once(&workers_once, start_workers);
+	bzero(&job, sizeof(job));
+	job.yiaddr = dhcp->yiaddr;
+	memcpy(job.chaddr, dhcp->chaddr, ETHER_ADDR_LEN);
+	job.status = RAD_START;
+	if (leases == NULL) {
+		enqueue(&job);
+		return 1;
+	}
+
+	b = find_option(dhcp, 51);
+	if (b != NULL && b[1] == 4)
+		lease_time = ((uint32_t)b[2] << 24) + (b[3] << 16) + (b[4] << 8) + b[5];
+	else
+		lease_time = default_lease_time;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	pthread_mutex_lock(&cache_lock);
+	if ((l = lease_find(dhcp->chaddr)) != NULL) {
+		if (l->ip.s_addr == dhcp->yiaddr.s_addr) {
+			/* A renewal */
+			l->lease_time = lease_time;
+			l->expires = now.tv_sec + lease_time;
+			lease_arm(l);
+			mr->renewals++;
+			pthread_mutex_unlock(&cache_lock);
+			return 1;
 		}
-		memcpy(b, dhcp, dhcp_len);
-		pthread_create(&tid, NULL, send_acct, b);
-		pthread_detach(tid);
+		/* The client got another address */
+		lease_stop(l, RAD_TERM_LOST_SERVICE, now.tv_sec);
+	}
+	if ((l = LIST_FIRST(&lease_free)) == NULL) {
+		mr->untracked++;
+		pthread_mutex_unlock(&cache_lock);
+		enqueue(&job);
+		return 1;
 	}
+	LIST_REMOVE(l, entries);
+	memcpy(l->chaddr, dhcp->chaddr, ETHER_ADDR_LEN);
+	l->ip = dhcp->yiaddr;
+	l->lease_time = lease_time;
+	/* A start time, but unique for sessions started in the same second */
+	l->session = time(NULL);
+	if (l->session <= last_session)
+		l->session = last_session + 1;
+	last_session = l->session;
+	l->started = now.tv_sec;
+	l->expires = now.tv_sec + lease_time;
+	l->interim = now.tv_sec + interim_interval;
+	LIST_INSERT_HEAD(&lease_hash[lease_bucket(l->chaddr)], l, entries);
+	lease_arm(l);
+	mr->leases++;
+	job.session = l->session;
+	enqueue(&job);
+	pthread_mutex_unlock(&cache_lock);
 	return 1;
 }
 
@@ -279,7 +1296,7 @@ struct plugin_data radius_plugin = {
 	"radius",
 	radius_plugin_init,
 	radius_plugin_destroy,
-	NULL,
+	radius_plugin_client_request,
 	NULL,
 	NULL,
 	radius_plugin_send_to_client
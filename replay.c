@@ -0,0 +1,317 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pcap.h>
+
+#include "dhcprelya.h"
+#include "metrics.h"
+
+/* Offline replay.
+ *
+ * Client frames are read from pcap files (-r interface:file) and server
+ * answers from a pcap file (-R file) instead of interfaces and sockets.
+ * Interfaces are not opened, their addresses are set by bind_ip. All
+ * packets are loaded into memory first and then run in timestamp order
+ * through the same code as live ones in the main thread: client_packet(),
+ * process_queue() and server_packet(). Packets to servers and clients are
+ * written to <prefix>-servers.pcap and <prefix>-clients.pcap (-w prefix)
+ * with input timestamps, so the same input gives the same output. -L
+ * repeats the input to get stable numbers and profiles. */
+
+extern int bootps_port;
+
+int replay_mode = 0;
+unsigned replay_passes = 1;
+char *replay_server_file = NULL, *replay_output = NULL;
+
+struct replay_packet {
+	int if_idx;		/* -1 for a server answer */
+	unsigned seq;		/* keeps files order for equal timestamps */
+	struct pcap_pkthdr hdr;
+	struct sockaddr_in from;	/* a server answer source */
+	size_t len;
+	u_char *data;		/* a frame or a server answer UDP payload */
+};
+
+static struct {
+	char *iname;
+	char *file;
+} inputs[IF_MAX];
+static int inputs_num;
+
+static struct replay_packet *packets;
+static size_t packets_num, packets_size;
+static pcap_dumper_t *to_servers, *to_clients;
+static struct timeval now_ts;	/* the current input packet time */
+
+/* -r interface:file */
+int
+replay_add_input(const char *spec)
+{
+	char *p;
+
+	if (inputs_num >= IF_MAX || (p = strchr(spec, ':')) == NULL ||
+	    p == spec || p[1] == '\0')
+		return 0;
+	inputs[inputs_num].iname = strndup(spec, p - spec);
+	inputs[inputs_num].file = strdup(p + 1);
+	if (inputs[inputs_num].iname == NULL || inputs[inputs_num].file == NULL)
+		process_error(EX_MEM, "malloc");
+	inputs_num++;
+	return 1;
+}
+
+static struct replay_packet *
+new_packet(int if_idx, const struct pcap_pkthdr *hdr, const u_char *data, size_t len)
+{
+	struct replay_packet *p;
+
+	if (packets_num == packets_size) {
+		packets_size = packets_size ? packets_size * 2 : 1024;
+		packets = realloc(packets, packets_size * sizeof(struct replay_packet));
+		if (packets == NULL)
+			process_error(EX_MEM, "malloc");
+	}
+	p = &packets[packets_num];
+	p->if_idx = if_idx;
+	p->seq = packets_num++;
+	p->hdr = *hdr;
+	p->len = len;
+	if ((p->data = malloc(len)) == NULL)
+		process_error(EX_MEM, "malloc");
+	memcpy(p->data, data, len);
+	return p;
+}
+
+static pcap_t *
+open_input(const char *file, const char *filter)
+{
+	char errbuf[PCAP_ERRBUF_SIZE];
+	struct bpf_program fp;
+	pcap_t *cap;
+
+	if ((cap = pcap_open_offline(file, errbuf)) == NULL) {
+		logd(LOG_ERR, "replay: %s", errbuf);
+		return NULL;
+	}
+	if (pcap_datalink(cap) != DLT_EN10MB) {
+		logd(LOG_ERR, "replay: %s is not an Ethernet capture", file);
+		pcap_close(cap);
+		return NULL;
+	}
+	if (filter == NULL)
+		return cap;
+	if (pcap_compile(cap, &fp, filter, 0, 0) < 0 || pcap_setfilter(cap, &fp) < 0) {
+		logd(LOG_ERR, "replay: filter for %s: %s", file, pcap_geterr(cap));
+		pcap_close(cap);
+		return NULL;
+	}
+	pcap_freecode(&fp);
+	return cap;
+}
+
+static int
+load_client_file(const char *iname, const char *file)
+{
+	struct interface *intf;
+	struct pcap_pkthdr *hdr;
+	const u_char *data;
+	pcap_t *cap;
+	int n;
+
+	if ((intf = get_interface_by_name((char *)iname)) == NULL) {
+		logd(LOG_ERR, "replay: interface %s is not configured", iname);
+		return 0;
+	}
+	/* The same filter as a live capture has */
+	if ((cap = open_input(file, NULL)) == NULL)
+		return 0;
+	if (!capture_filter(cap, intf)) {
+		pcap_close(cap);
+		return 0;
+	}
+	while ((n = pcap_next_ex(cap, &hdr, &data)) == 1)
+		new_packet(intf->idx, hdr, data, hdr->caplen);
+	pcap_close(cap);
+	return n == -2;
+}
+
+/* Keep UDP payloads of server answers */
+static int
+load_server_file(const char *file)
+{
+	struct replay_packet *p;
+	struct pcap_pkthdr *hdr;
+	const struct ip *ip;
+	const struct udphdr *udp;
+	const u_char *data;
+	pcap_t *cap;
+	size_t off, len;
+	int n;
+
+	if ((cap = open_input(file, "ip and udp and dst port bootps")) == NULL)
+		return 0;
+	while ((n = pcap_next_ex(cap, &hdr, &data)) == 1) {
+		if (hdr->caplen < ETHER_HDR_LEN + sizeof(struct ip))
+			continue;
+		ip = (const struct ip *)(data + ETHER_HDR_LEN);
+		off = ETHER_HDR_LEN + ip->ip_hl * 4;
+		if (hdr->caplen < off + sizeof(struct udphdr))
+			continue;
+		udp = (const struct udphdr *)(data + off);
+		off += sizeof(struct udphdr);
+		len = MIN(ntohs(udp->uh_ulen) - sizeof(struct udphdr), hdr->caplen - off);
+		len = MIN(len, sizeof(struct dhcp_packet));
+		p = new_packet(-1, hdr, data + off, len);
+		bzero(&p->from, sizeof(p->from));
+		p->from.sin_family = AF_INET;
+		p->from.sin_addr = ip->ip_src;
+		p->from.sin_port = udp->uh_sport;
+	}
+	pcap_close(cap);
+	return n == -2;
+}
+
+static int
+packet_cmp(const void *a, const void *b)
+{
+	const struct replay_packet *pa = a, *pb = b;
+
+	if (timercmp(&pa->hdr.ts, &pb->hdr.ts, <))
+		return -1;
+	if (timercmp(&pa->hdr.ts, &pb->hdr.ts, >))
+		return 1;
+	return pa->seq < pb->seq ? -1 : 1;
+}
+
+static pcap_dumper_t *
+open_output(pcap_t *dead, const char *suffix)
+{
+	char file[MAXPATHLEN];
+	pcap_dumper_t *d;
+
+	snprintf(file, sizeof(file), "%s-%s.pcap", replay_output, suffix);
+	if ((d = pcap_dump_open(dead, file)) == NULL)
+		logd(LOG_ERR, "replay: %s", pcap_geterr(dead));
+	return d;
+}
+
+static void
+dump(pcap_dumper_t *d, const uint8_t *frame, size_t len)
+{
+	struct pcap_pkthdr hdr;
+
+	hdr.ts = now_ts;
+	hdr.caplen = hdr.len = len;
+	pcap_dump((u_char *)d, &hdr, frame);
+}
+
+/* Instead of sendto() */
+ssize_t
+replay_to_server(const struct interface *intf, const struct sockaddr_in *server,
+	const struct dhcp_packet *dhcp, size_t len)
+{
+	uint8_t frame[sizeof(struct packet_headers) + sizeof(struct dhcp_packet)];
+	struct packet_headers *h = (struct packet_headers *)frame;
+
+	if (to_servers == NULL)
+		return len;
+	bzero(h, sizeof(*h));
+	memcpy(h->eh.ether_shost, intf->mac, ETHER_ADDR_LEN);
+	h->eh.ether_type = htons(ETHERTYPE_IP);
+	h->ip.ip_v = IPVERSION;
+	h->ip.ip_hl = 5;
+	h->ip.ip_len = htons(DHCP_UDP_OVERHEAD + len);
+	h->ip.ip_ttl = 64;
+	h->ip.ip_p = IPPROTO_UDP;
+	h->ip.ip_src.s_addr = intf->ip;
+	h->ip.ip_dst = server->sin_addr;
+	h->ip.ip_sum = htons(ip_checksum((const char *)&h->ip, sizeof(struct ip)));
+	h->udp.uh_sport = bootps_port;
+	h->udp.uh_dport = server->sin_port;
+	h->udp.uh_ulen = htons(sizeof(struct udphdr) + len);
+	memcpy(frame + sizeof(struct packet_headers), dhcp, len);
+	h->udp.uh_sum = htons(udp_checksum((const char *)frame));
+	dump(to_servers, frame, sizeof(struct packet_headers) + len);
+	return len;
+}
+
+/* Instead of a BPF write */
+ssize_t
+replay_to_client(const struct interface *intf, const uint8_t *packet, size_t len)
+{
+	if (to_clients != NULL)
+		dump(to_clients, packet, len);
+	return len;
+}
+
+int
+replay_run(void)
+{
+	struct replay_packet *p;
+	struct dhcp_packet dhcp;
+	struct timespec start, end;
+	struct queue *q;
+	pcap_t *dead = NULL;
+	uint64_t from_clients = 0, from_servers = 0;
+	double elapsed;
+	unsigned pass;
+	size_t i;
+	int j;
+
+	for (j = 0; j < inputs_num; j++)
+		if (!load_client_file(inputs[j].iname, inputs[j].file))
+			return EX_NOHOST;
+	if (replay_server_file != NULL && !load_server_file(replay_server_file))
+		return EX_NOHOST;
+	if (packets_num == 0) {
+		logd(LOG_ERR, "replay: no packets to replay");
+		return EX_NOHOST;
+	}
+	qsort(packets, packets_num, sizeof(struct replay_packet), packet_cmp);
+	for (i = 0; i < packets_num; i++)
+		if (packets[i].if_idx >= 0)
+			from_clients++;
+		else
+			from_servers++;
+
+	if (replay_output != NULL) {
+		dead = pcap_open_dead(DLT_EN10MB, DHCP_MTU_MAX + ETHER_HDR_LEN);
+		to_servers = open_output(dead, "servers");
+		to_clients = open_output(dead, "clients");
+		if (to_servers == NULL || to_clients == NULL)
+			return EX_RES;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (pass = 0; pass < replay_passes; pass++)
+		for (i = 0; i < packets_num; i++) {
+			p = &packets[i];
+			now_ts = p->hdr.ts;
+			if (p->if_idx >= 0) {
+				METRIC_INC(if_in[p->if_idx]);
+				if ((q = client_packet(ifs[p->if_idx], &p->hdr, p->data)) != NULL)
+					process_queue(q);
+			} else {
+				memcpy(&dhcp, p->data, p->len);
+				bzero((char *)&dhcp + p->len, sizeof(dhcp) - p->len);
+				server_packet(&p->from, &dhcp, p->len);
+			}
+		}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	elapsed = (timespec_ns(&end) - timespec_ns(&start)) / 1e9;
+
+	if (dead != NULL) {
+		pcap_dump_close(to_servers);
+		pcap_dump_close(to_clients);
+		pcap_close(dead);
+	}
+
+	printf("Replayed %ju packets (%ju from clients, %ju from servers) x %u in %.3f s: %.0f packets/s\n\n",
+		(uintmax_t)packets_num, (uintmax_t)from_clients, (uintmax_t)from_servers,
+		replay_passes, elapsed, packets_num * replay_passes / elapsed);
+	metrics_update();
+	metrics_print(metrics, stdout, 0);
+	return EX_OK;
+}
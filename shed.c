@@ -0,0 +1,139 @@
+#include <stdlib.h>
+#include <machine/atomic.h>
+
+#include "metrics.h"
+
+/* Admission control (load shedding) by servers responsiveness.
+ *
+ * When servers slow down, forwarding at a full client rate only makes it
+ * worse: clients retransmit, servers get more work and clients time out
+ * anyway. With shed=yes the main thread checks servers every SHED_INTERVAL
+ * ms. A server is overloaded if its average answer time is over
+ * shed_latency or more than shed_outstanding requests wait for its
+ * answers. Down servers (server_down_after) are left to fan-out.
+ *
+ * An interface with an overloaded server sheds the least valuable requests
+ * first: retransmitted DISCOVERs still waiting for an answer are
+ * dropped at once, new DISCOVERs (the discover queue class) are dropped
+ * with a probability. An admitted part of DISCOVERs is cut by a quarter
+ * every interval while a server is overloaded and grows by SHED_RECOVER
+ * when it's not (AIMD), so it recovers gradually and doesn't swing. At
+ * least SHED_ADMIT_MIN of new clients are admitted. REQUESTs, renewals and
+ * releases are never shed, they finish work servers already did.
+ *
+ * Listeners decide before plugins by a per-interface ratio written by the
+ * main thread. The normal path is one load. */
+
+#define SHED_INTERVAL	100	/* ms */
+#define SHED_ALL	1000	/* ratios are per-mille */
+#define SHED_ADMIT_MIN	50
+#define SHED_RECOVER	25	/* per interval, 4 s from SHED_ADMIT_MIN */
+
+int shed_enabled = 0;
+unsigned shed_latency = 2000, shed_outstanding = 1000;
+
+static volatile uint32_t shed_ratio[IF_MAX];	/* of new DISCOVERs dropped */
+static uint64_t overloaded;			/* a bit per server */
+static struct timespec last_tick;
+
+static __thread uint32_t rnd_state;
+
+static inline uint32_t
+rnd(void)
+{
+	/* xorshift32, a thread has its own sequence */
+	if (rnd_state == 0)
+		rnd_state = (uintptr_t)&rnd_state | 1;
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 17;
+	rnd_state ^= rnd_state << 5;
+	return rnd_state;
+}
+
+/* Check servers and update shed ratios. The main thread. */
+void
+shed_tick(const struct timespec *now)
+{
+	struct dhcp_server *srv;
+	uint64_t over = 0;
+	int64_t steps;
+	uint32_t ratio, admit;
+	int i, j;
+
+	steps = (timespec_ns(now) - timespec_ns(&last_tick)) / (SHED_INTERVAL * 1000000LL);
+	if (steps <= 0)
+		return;
+	last_tick = *now;
+
+	for (i = 0; i < srv_num; i++) {
+		srv = servers[i];
+		if (atomic_load_acq_32(&srv->timeouts) >= server_down_after)
+			continue;
+		if (srv->rtt_avg > shed_latency * 1000L ||
+		    server_outstanding(i) > shed_outstanding)
+			over |= 1ULL << i;
+	}
+	overloaded = over;
+
+	for (i = 0; i < if_num; i++) {
+		for (j = 0; j < ifs[i]->srv_num; j++)
+			if (over & (1ULL << ifs[i]->srvrs[j]))
+				break;
+		ratio = shed_ratio[i];
+		if (j < ifs[i]->srv_num) {
+			/* One cut for an interval, idle ones don't count */
+			admit = (SHED_ALL - ratio) * 3 / 4;
+			if (admit < SHED_ADMIT_MIN)
+				admit = SHED_ADMIT_MIN;
+			if (ratio == 0)
+				logd(LOG_WARNING, "Servers of %s are overloaded. Shedding requests.",
+					ifs[i]->name);
+			ratio = SHED_ALL - admit;
+		} else if (ratio != 0) {
+			ratio = (int64_t)ratio > steps * SHED_RECOVER ? ratio - steps * SHED_RECOVER : 0;
+			if (ratio == 0)
+				logd(LOG_WARNING, "Servers of %s are back to normal. Shedding stopped.",
+					ifs[i]->name);
+		}
+		atomic_store_rel_32(&shed_ratio[i], ratio);
+	}
+}
+
+/* Returns 0 if a request should be dropped. Listeners. */
+int
+shed_admit(const struct interface *intf, struct dhcp_packet *dhcp, int qclass)
+{
+	struct xid_entry xe;
+	struct timespec now;
+	uint32_t ratio;
+
+	ratio = atomic_load_acq_32(&shed_ratio[intf->idx]);
+	if (ratio == 0 || qclass != QCLASS_DISCOVER)
+		return 1;
+	/* A retransmission of a DISCOVER servers didn't answer yet. Only
+	 * DISCOVERs: a REQUEST has the xid of its DISCOVER, it's not
+	 * a retransmission if another server made an offer. */
+	clock_gettime(CLOCK_MONOTONIC_FAST, &now);
+	if (xid_table_lookup(dhcp, &xe, &now) && (xe.srv_mask & ~xe.replied) != 0) {
+		METRIC_DROP(DROP_SHED_RETRANSMIT);
+		return 0;
+	}
+	if (rnd() % SHED_ALL < ratio) {
+		METRIC_DROP(DROP_SHED_DISCOVER);
+		return 0;
+	}
+	return 1;
+}
+
+/* A part of new DISCOVERs an interface admits, per-mille */
+unsigned
+shed_admitted(int if_idx)
+{
+	return SHED_ALL - shed_ratio[if_idx];
+}
+
+int
+shed_server_overloaded(int srv_idx)
+{
+	return (overloaded >> srv_idx) & 1;
+}
@@ -0,0 +1,229 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <machine/atomic.h>
+
+#include "dhcprelya.h"
+
+/* A durable queue of fixed size records in a memory mapped file.
+ *
+ * The file is a header page and a ring of slots. A record gets a sequence
+ * number and goes to the slot seq % slots. Its checksum is written last,
+ * so a record torn by a crash is just not valid. The header keeps the
+ * sequence of the oldest record not consumed yet. It's moved only after a
+ * record is consumed, so a record is delivered at least once. On open all
+ * slots are scanned for valid records not older than that. A full spool
+ * refuses new records. Dirty pages are flushed by spool_sync(). */
+
+#define SPOOL_MAGIC	0x53504f4f	/* SPOO */
+#define SPOOL_HDR_SIZE	4096
+
+struct spool_hdr {
+	uint32_t magic;
+	uint32_t rec_size;
+	uint64_t slots;
+	uint64_t read_seq;
+};
+
+struct spool_slot {
+	uint64_t seq;
+	uint32_t sum;
+	uint32_t pad;
+	uint8_t data[];
+};
+
+struct spool {
+	char *map;
+	size_t map_size, slot_size;
+	unsigned rec_size;
+	uint64_t slots, read_seq, write_seq;
+	struct spool_hdr *hdr;
+	int dirty;
+	pthread_mutex_t lock;
+};
+
+static uint32_t
+slot_sum(const struct spool_slot *s, unsigned len)
+{
+	/* FNV-1a of a sequence and data */
+	return fnv1a(fnv1a(FNV1A_BASIS, &s->seq, sizeof(s->seq)), s->data, len);
+}
+
+static inline struct spool_slot *
+slot_of(struct spool *sp, uint64_t seq)
+{
+	return (struct spool_slot *)(sp->map + SPOOL_HDR_SIZE +
+		(seq % sp->slots) * sp->slot_size);
+}
+
+static inline int
+slot_valid(struct spool *sp, uint64_t seq)
+{
+	struct spool_slot *s = slot_of(sp, seq);
+
+	return s->seq == seq && s->sum == slot_sum(s, sp->rec_size);
+}
+
+/* Open or create a spool of slots records of rec_size bytes. Records of a
+ * spool with another geometry are dropped. */
+struct spool *
+spool_open(const char *path, unsigned rec_size, uint64_t slots)
+{
+	struct spool *sp;
+	struct spool_slot *s;
+	struct stat st;
+	uint64_t i;
+	int fd;
+
+	if ((sp = calloc(1, sizeof(struct spool))) == NULL) {
+		logd(LOG_ERR, "spool: malloc error");
+		return NULL;
+	}
+	sp->rec_size = rec_size;
+	sp->slots = slots;
+	sp->slot_size = roundup(sizeof(struct spool_slot) + rec_size, 8);
+	sp->map_size = SPOOL_HDR_SIZE + slots * sp->slot_size;
+
+	if ((fd = open(path, O_RDWR | O_CREAT, 0600)) == -1) {
+		logd(LOG_ERR, "spool: can't open %s: %s", path, strerror(errno));
+		free(sp);
+		return NULL;
+	}
+	if (fstat(fd, &st) == -1 || (st.st_size != sp->map_size &&
+	    ftruncate(fd, sp->map_size) == -1)) {
+		logd(LOG_ERR, "spool: can't resize %s: %s", path, strerror(errno));
+		close(fd);
+		free(sp);
+		return NULL;
+	}
+	sp->map = mmap(NULL, sp->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (sp->map == MAP_FAILED) {
+		logd(LOG_ERR, "spool: mmap: %s", strerror(errno));
+		free(sp);
+		return NULL;
+	}
+	sp->hdr = (struct spool_hdr *)sp->map;
+
+	if (sp->hdr->magic != SPOOL_MAGIC || sp->hdr->rec_size != rec_size ||
+	    sp->hdr->slots != slots) {
+		if (sp->hdr->magic == SPOOL_MAGIC)
+			logd(LOG_WARNING, "spool: %s has another format, records dropped",
+				path);
+		memset(sp->map, 0, sp->map_size);
+		sp->hdr->rec_size = rec_size;
+		sp->hdr->slots = slots;
+		sp->hdr->read_seq = 1;
+		sp->hdr->magic = SPOOL_MAGIC;
+	}
+
+	/* The newest valid record not consumed yet */
+	sp->read_seq = sp->write_seq = sp->hdr->read_seq;
+	for (i = 0; i < slots; i++) {
+		s = (struct spool_slot *)(sp->map + SPOOL_HDR_SIZE + i * sp->slot_size);
+		if (s->seq >= sp->write_seq && s->seq < sp->read_seq + slots &&
+		    s->seq % slots == i && s->sum == slot_sum(s, rec_size))
+			sp->write_seq = s->seq + 1;
+	}
+	pthread_mutex_init(&sp->lock, NULL);
+	sp->dirty = 1;
+	if (sp->write_seq != sp->read_seq)
+		logd(LOG_NOTICE, "spool: %s: %ju records recovered", path,
+			(uintmax_t)(sp->write_seq - sp->read_seq));
+	return sp;
+}
+
+/* Returns 0 if the spool is full */
+int
+spool_append(struct spool *sp, const void *rec)
+{
+	struct spool_slot *s;
+
+	pthread_mutex_lock(&sp->lock);
+	if (sp->write_seq - sp->read_seq == sp->slots) {
+		pthread_mutex_unlock(&sp->lock);
+		return 0;
+	}
+	s = slot_of(sp, sp->write_seq);
+	s->seq = sp->write_seq;
+	memcpy(s->data, rec, sp->rec_size);
+	atomic_thread_fence_rel();
+	s->sum = slot_sum(s, sp->rec_size);
+	sp->write_seq++;
+	sp->dirty = 1;
+	pthread_mutex_unlock(&sp->lock);
+	return 1;
+}
+
+/* Copy the oldest record. Returns 0 if the spool is empty. Torn records
+ * are skipped. */
+int
+spool_peek(struct spool *sp, void *rec)
+{
+	pthread_mutex_lock(&sp->lock);
+	for (; sp->read_seq != sp->write_seq; sp->read_seq++)
+		if (slot_valid(sp, sp->read_seq)) {
+			memcpy(rec, slot_of(sp, sp->read_seq)->data, sp->rec_size);
+			pthread_mutex_unlock(&sp->lock);
+			return 1;
+		}
+	if (sp->hdr->read_seq != sp->read_seq) {
+		sp->hdr->read_seq = sp->read_seq;
+		sp->dirty = 1;
+	}
+	pthread_mutex_unlock(&sp->lock);
+	return 0;
+}
+
+/* The oldest record is delivered */
+void
+spool_consume(struct spool *sp)
+{
+	pthread_mutex_lock(&sp->lock);
+	if (sp->read_seq != sp->write_seq) {
+		sp->read_seq++;
+		sp->hdr->read_seq = sp->read_seq;
+		sp->dirty = 1;
+	}
+	pthread_mutex_unlock(&sp->lock);
+}
+
+uint64_t
+spool_depth(struct spool *sp)
+{
+	uint64_t n;
+
+	pthread_mutex_lock(&sp->lock);
+	n = sp->write_seq - sp->read_seq;
+	pthread_mutex_unlock(&sp->lock);
+	return n;
+}
+
+/* Write dirty pages to a disk */
+void
+spool_sync(struct spool *sp)
+{
+	int dirty;
+
+	pthread_mutex_lock(&sp->lock);
+	dirty = sp->dirty;
+	sp->dirty = 0;
+	pthread_mutex_unlock(&sp->lock);
+	if (dirty && msync(sp->map, sp->map_size, MS_SYNC) == -1)
+		logd(LOG_ERR, "spool: msync: %s", strerror(errno));
+}
+
+void
+spool_close(struct spool *sp)
+{
+	spool_sync(sp);
+	munmap(sp->map, sp->map_size);
+	pthread_mutex_destroy(&sp->lock);
+	free(sp);
+}
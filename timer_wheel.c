@@ -0,0 +1,102 @@
+#include <stdlib.h>
+
+#include "dhcprelya.h"
+
+/* A hashed timer wheel with one second resolution. A timer lives in the
+ * bucket (expires % size) and is fired when the wheel passes that bucket
+ * and the expiration time is reached. Timers more than size seconds ahead
+ * just stay in their bucket for one or more extra rounds.
+ * The wheel is not thread safe, a caller must serialize an access. */
+
+int
+tw_init(struct timer_wheel *tw, unsigned size, time_t now)
+{
+	unsigned i;
+
+	/* Round the size up to a power of 2 to use a mask instead of % */
+	for (tw->size = 1; tw->size < size; tw->size <<= 1)
+		;
+	tw->buckets = malloc(tw->size * sizeof(struct tw_bucket));
+	if (tw->buckets == NULL)
+		return 0;
+	for (i = 0; i < tw->size; i++)
+		TAILQ_INIT(&tw->buckets[i]);
+	tw->now = now;
+	tw->count = 0;
+	return 1;
+}
+
+void
+tw_destroy(struct timer_wheel *tw)
+{
+	free(tw->buckets);
+	tw->buckets = NULL;
+	tw->count = 0;
+}
+
+void
+tw_add(struct timer_wheel *tw, struct tw_timer *t, time_t expires)
+{
+	if (t->armed)
+		tw_del(tw, t);
+	/* Never put a timer into the past, it'll be missed for a whole round */
+	if (expires <= tw->now)
+		expires = tw->now + 1;
+	t->expires = expires;
+	t->armed = 1;
+	TAILQ_INSERT_TAIL(&tw->buckets[expires & (tw->size - 1)], t, entries);
+	tw->count++;
+}
+
+void
+tw_del(struct timer_wheel *tw, struct tw_timer *t)
+{
+	if (!t->armed)
+		return;
+	TAILQ_REMOVE(&tw->buckets[t->expires & (tw->size - 1)], t, entries);
+	t->armed = 0;
+	tw->count--;
+}
+
+/* Move the wheel to 'now' and call fn() for every expired timer.
+ * A timer is disarmed before fn() is called, so fn() may re-add it.
+ * Returns a number of fired timers. */
+int
+tw_advance(struct timer_wheel *tw, time_t now,
+	void (*fn)(struct tw_timer *t, void *arg), void *arg)
+{
+	struct tw_bucket *bucket, fired;
+	struct tw_timer *t, *t_tmp;
+	time_t tick;
+	int n = 0;
+
+	if (now <= tw->now)
+		return 0;
+	/* We were idle for more than a round. Every bucket will be checked
+	 * once anyway. */
+	tick = tw->now + 1;
+	if (now - tw->now > tw->size)
+		tick = now - tw->size + 1;
+
+	TAILQ_INIT(&fired);
+	for (; tick <= now; tick++) {
+		bucket = &tw->buckets[tick & (tw->size - 1)];
+		TAILQ_FOREACH_SAFE(t, bucket, entries, t_tmp) {
+			if (t->expires > now)
+				continue;
+			TAILQ_REMOVE(bucket, t, entries);
+			TAILQ_INSERT_TAIL(&fired, t, entries);
+		}
+	}
+	tw->now = now;
+
+	/* Call handlers after the wheel is consistent */
+	while ((t = TAILQ_FIRST(&fired)) != NULL) {
+		TAILQ_REMOVE(&fired, t, entries);
+		t->armed = 0;
+		tw->count--;
+		n++;
+		fn(t, arg);
+	}
+	return n;
+}
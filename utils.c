@@ -26,13 +26,9 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <stdarg.h>
 #include <string.h>
-#include <syslog.h>
 #include "dhcprelya.h"
 
-extern unsigned debug;
-
 char *
 print_xid(uint32_t ip, char *buf)
 {
@@ -46,34 +42,16 @@ print_xid(uint32_t ip, char *buf)
 	return buf;
 }
 
-/* Print a log message */
-void
-logd(int log_level, char *fmt,...)
-{
-	va_list ap;
-	char buf[1024];
-
-	va_start(ap, fmt);
-
-	vsprintf(buf, fmt, ap);
-	if (debug)
-		printf("%s\n", buf);
-	else if (log_level != LOG_DEBUG)
-		syslog(LOG_ERR, "%s", buf);
-
-	va_end(ap);
-}
-
 /* Rerurn 1(true) for strings "yes", "on", "1" or 0(false) for strings "no",
  * "off", "0" and -1 for an error. All strings is case insensitive. */
 int
 get_bool_value(const char *str)
 {
 	if (strcasecmp(str, "yes") == 0 || strcasecmp(str, "on") == 0 ||
-	    strcmp(str, "1"))
+	    strcmp(str, "1") == 0)
 		return 1;
 	else if (strcasecmp(str, "no") == 0 || strcasecmp(str, "off") == 0 ||
-		 strcmp(str, "0"))
+		 strcmp(str, "0") == 0)
 		return 0;
 	else
 		return -1;
@@ -0,0 +1,241 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <machine/atomic.h>
+
+#include "dhcprelya.h"
+
+/* Forwarded requests table.
+ *
+ * The main thread (process_queue()) is the only writer. The server answers
+ * thread only reads it. So we need no locks: every entry is protected by a
+ * generation counter (seqlock). A writer makes it odd before an update and
+ * even after. A reader retries if it saw an odd value or the value was
+ * changed while it copied the entry.
+ *
+ * Entries are expired by a timer wheel. The wheel belongs to the writer.
+ *
+ * Every server has a number of requests waiting for its answer (sent, not
+ * answered and not expired). The writer adds them and takes unanswered ones
+ * away when an entry is expired or reused, the answers thread takes away
+ * answered ones. The writer sets all replied bits at once when it takes
+ * them, so a server is taken away by one of the threads only. */
+
+#define XID_PROBES	4	/* Linear probing window */
+#define XID_READ_TRIES	4
+
+static struct xid_entry *table;
+static unsigned table_mask;
+static unsigned timeout;
+static struct timer_wheel wheel;
+static void (*expire_cb) (const struct xid_entry *entry);
+
+static inline unsigned
+xid_hash(uint32_t xid, const uint8_t *chaddr)
+{
+	uint32_t h;
+
+	h = xid * 2654435761U;
+	h ^= ((uint32_t)chaddr[2] << 24 | chaddr[3] << 16 | chaddr[4] << 8 | chaddr[5]);
+	h ^= h >> 15;
+	return h & table_mask;
+}
+
+/* Add n to outstanding requests of servers in mask */
+static void
+outstanding_add(uint64_t mask, int n)
+{
+	int i;
+
+	for (i = 0; mask != 0 && i < srv_num; i++, mask >>= 1)
+		if (mask & 1)
+			atomic_add_32(&servers[i]->outstanding, n);
+}
+
+static inline void
+write_begin(struct xid_entry *e)
+{
+	atomic_store_rel_32(&e->gen, e->gen + 1);
+	atomic_thread_fence_rel();
+}
+
+static inline void
+write_end(struct xid_entry *e)
+{
+	atomic_store_rel_32(&e->gen, e->gen + 1);
+}
+
+static void
+xid_expire(struct tw_timer *t, void *arg)
+{
+	struct xid_entry *e;
+
+	e = (struct xid_entry *)((char *)t - offsetof(struct xid_entry, timer));
+	if (expire_cb)
+		expire_cb(e);
+	/* All bits set, a late answer doesn't take its server away again */
+	outstanding_add(e->srv_mask & ~atomic_swap_64(&e->replied, ~0ULL), -1);
+	write_begin(e);
+	e->used = 0;
+	write_end(e);
+}
+
+int
+xid_table_init(unsigned size, unsigned entry_timeout)
+{
+	struct timespec now;
+	unsigned n;
+
+	for (n = 1; n < size; n <<= 1)
+		;
+	table = calloc(n, sizeof(struct xid_entry));
+	if (table == NULL)
+		return 0;
+	table_mask = n - 1;
+	timeout = entry_timeout;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (!tw_init(&wheel, timeout + 1, now.tv_sec)) {
+		free(table);
+		table = NULL;
+		return 0;
+	}
+	logd(LOG_DEBUG, "Transaction table: %u entries, timeout %u sec", n, timeout);
+	return 1;
+}
+
+/* Set a function called when an entry is expired or evicted.
+ * It's called in the writer thread context. */
+void
+xid_table_set_expire_cb(void (*cb) (const struct xid_entry *entry))
+{
+	expire_cb = cb;
+}
+
+/* Expire old entries. The writer thread only. */
+void
+xid_table_tick(const struct timespec *now)
+{
+	tw_advance(&wheel, now->tv_sec, xid_expire, NULL);
+}
+
+/* Remember a request was sent. The writer thread only. */
+void
+xid_table_insert(const struct dhcp_packet *dhcp, int if_idx,
+	uint64_t srv_mask, const struct timespec *now)
+{
+	struct xid_entry *e, *victim = NULL;
+	unsigned i, h;
+
+	xid_table_tick(now);
+
+	h = xid_hash(dhcp->xid, dhcp->chaddr);
+	for (i = 0; i < XID_PROBES; i++) {
+		e = &table[(h + i) & table_mask];
+		if (!e->used) {
+			if (victim == NULL || victim->used)
+				victim = e;
+			continue;
+		}
+		/* A retransmission. Update the entry. */
+		if (e->xid == dhcp->xid &&
+		    memcmp(e->chaddr, dhcp->chaddr, ETH_ADDR_LEN) == 0) {
+			victim = e;
+			break;
+		}
+		/* Otherwise the oldest one is a candidate for eviction */
+		if (victim == NULL ||
+		    (victim->used && e->timer.expires < victim->timer.expires))
+			victim = e;
+	}
+	/* The table is full around here. Evict the oldest one. */
+	if (victim->used && expire_cb && (victim->xid != dhcp->xid ||
+	    memcmp(victim->chaddr, dhcp->chaddr, ETH_ADDR_LEN) != 0))
+		expire_cb(victim);
+	if (victim->used)
+		outstanding_add(victim->srv_mask & ~atomic_swap_64(&victim->replied, ~0ULL), -1);
+
+	write_begin(victim);
+	victim->used = 1;
+	victim->xid = dhcp->xid;
+	memcpy(victim->chaddr, dhcp->chaddr, ETH_ADDR_LEN);
+	victim->if_idx = if_idx;
+	victim->srv_mask = srv_mask;
+	victim->replied = 0;
+	victim->sent = *now;
+	write_end(victim);
+	outstanding_add(srv_mask, 1);
+
+	tw_add(&wheel, &victim->timer, now->tv_sec + timeout);
+}
+
+/* Look for a request by a server answer. Returns 1 and a copy of the entry
+ * if found and not expired yet. Any thread. */
+int
+xid_table_lookup(const struct dhcp_packet *dhcp, struct xid_entry *found,
+	const struct timespec *now)
+{
+	struct xid_entry *e;
+	uint32_t gen;
+	unsigned i, h, try;
+
+	h = xid_hash(dhcp->xid, dhcp->chaddr);
+	for (i = 0; i < XID_PROBES; i++) {
+		e = &table[(h + i) & table_mask];
+		for (try = 0; try < XID_READ_TRIES; try++) {
+			gen = atomic_load_acq_32(&e->gen);
+			if (gen & 1)
+				continue;
+			found->used = e->used;
+			found->xid = e->xid;
+			memcpy(found->chaddr, e->chaddr, ETH_ADDR_LEN);
+			found->if_idx = e->if_idx;
+			found->srv_mask = e->srv_mask;
+			found->replied = e->replied;
+			found->sent = e->sent;
+			atomic_thread_fence_acq();
+			if (gen == e->gen)
+				break;
+		}
+		if (try == XID_READ_TRIES)
+			continue;
+		if (found->used && found->xid == dhcp->xid &&
+		    memcmp(found->chaddr, dhcp->chaddr, ETH_ADDR_LEN) == 0)
+			/* The writer may be idle and did not expire it */
+			return now->tv_sec - found->sent.tv_sec <= timeout;
+	}
+	return 0;
+}
+
+/* Mark a request as answered by a server. The server answers thread. */
+void
+xid_table_answered(const struct dhcp_packet *dhcp, int srv_idx)
+{
+	struct xid_entry *e;
+	unsigned i, h;
+
+	h = xid_hash(dhcp->xid, dhcp->chaddr);
+	for (i = 0; i < XID_PROBES; i++) {
+		e = &table[(h + i) & table_mask];
+		if (atomic_load_acq_32(&e->gen) & 1)
+			continue;
+		if (e->used && e->xid == dhcp->xid &&
+		    memcmp(e->chaddr, dhcp->chaddr, ETH_ADDR_LEN) == 0) {
+			if (!atomic_testandset_64(&e->replied, srv_idx) &&
+			    (e->srv_mask & (1ULL << srv_idx)))
+				atomic_subtract_32(&servers[srv_idx]->outstanding, 1);
+			return;
+		}
+	}
+}
+
+/* Requests sent to a server and not answered or expired yet. It's kept by
+ * two threads without a lock, so it may be a bit off for a moment. */
+unsigned
+server_outstanding(int srv_idx)
+{
+	int32_t n;
+
+	n = atomic_load_acq_32(&servers[srv_idx]->outstanding);
+	return n > 0 ? n : 0;
+}